@@ -9,13 +9,23 @@
  * instead it uses array of pointers to store the expressions
  * and evaluate them in order of operations.
  *
- * compile: gcc analysis.c -o analysis -lm -Wall -Wextra
+ * compile: gcc analysis.c -o analysis -lm -pthread -Wall -Wextra
 */
 
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #define EVALABLE void*
 
@@ -29,8 +39,64 @@
 #define INIT_CHAIN_ARGS 4
 #endif
 
+/* In order to change the number of values that are evaluated together
+ * by the batch evaluation change the value of EVAL_BATCH_SIZE.
+ * i.e.
+ * gcc -DEVAL_BATCH_SIZE=512 analysis.c -o analysis -lm -Wall -Wextra
+*/
+#ifndef EVAL_BATCH_SIZE
+#define EVAL_BATCH_SIZE 256
+#endif
+
+/* In order to change the precision of the calculations define USE_DOUBLE
+ * or USE_FLOAT, the default precision is long double.
+ * i.e.
+ * gcc -DUSE_DOUBLE -O2 -mavx2 -mfma analysis.c -o analysis -lm -Wall -Wextra
+ * this will use double precision and, since AVX2 and FMA are enabled, the
+ * vectorized sin/cos/exp/log kernels for the batch evaluation.
+ *
+ * LDOUBLE_SCN and LDOUBLE_PRI are the scanf and printf conversions for
+ * ldouble_t. i.e. printf("%" LDOUBLE_PRI "\n", value);
+ * LDOUBLE_EXACT with LDOUBLE_DIGITS digits prints a value so that it is
+ * read back the same. i.e. printf("%.*" LDOUBLE_EXACT, LDOUBLE_DIGITS, value);
+ * STR_TO_LDOUBLE is the strtod() of ldouble_t.
+*/
+#if defined(USE_FLOAT)
+typedef float ldouble_t;
+#define LDOUBLE_SCN "f"
+#define LDOUBLE_PRI "f"
+#define LDOUBLE_EXACT "g"
+#define LDOUBLE_DIGITS 9
+#define STR_TO_LDOUBLE strtof
+#elif defined(USE_DOUBLE)
+typedef double ldouble_t;
+#define LDOUBLE_SCN "lf"
+#define LDOUBLE_PRI "f"
+#define LDOUBLE_EXACT "g"
+#define LDOUBLE_DIGITS 17
+#define STR_TO_LDOUBLE strtod
+#else
 typedef long double ldouble_t;
+#define LDOUBLE_SCN "Lf"
+#define LDOUBLE_PRI "Lf"
+#define LDOUBLE_EXACT "Lg"
+#define LDOUBLE_DIGITS 21
+#define STR_TO_LDOUBLE strtold
+#endif
+
+#if defined(USE_DOUBLE) && defined(__AVX2__) && defined(__FMA__)
+#define USE_AVX2_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(USE_DOUBLE) && defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT)
+#define USE_JIT
+#include <sys/mman.h>
+#endif
+
 #define ABS(x) ((x) < 0 ? -(x) : (x))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
 
 ldouble_t evaluate(EVALABLE *e, ldouble_t value);
 #define EVALTYPE(x) ((EvalAble *)x)->type
@@ -52,6 +118,8 @@ typedef enum _EvalAbleType {
     EXPONENTIAL,
     TRIGONOMETRIC,
     INVERSE_TRIGONOMETRIC,
+    SHARED,
+    POLYNOMIAL,
 } EvalAbleType;
 
 /* Struct Prototypes */
@@ -65,6 +133,8 @@ typedef struct _Trigonometric Trigonometric;
 typedef enum _TrigonometricType TrigonometricType;
 typedef struct _InverseTrigonometric InverseTrigonometric;
 typedef enum _InverseTrigonometricType InverseTrigonometricType;
+typedef struct _Shared Shared;
+typedef struct _Polynomial Polynomial;
 
 typedef struct _EvalAble {
     EvalAbleType type;
@@ -75,8 +145,15 @@ typedef struct _Constant {
     ldouble_t value;
 } Constant;
 
+/*
+ * index is the place of the value of the variable in the values that the
+ * expression is evaluated with, x is always 0. name is the letter that the
+ * variable is written with.
+*/
 typedef struct _Variable {
     EvalAbleType type;
+    int index;
+    char name;
 } Variable;
 
 typedef struct _SumChain {
@@ -95,8 +172,24 @@ typedef struct _MulChain {
     int *isDivided;
 } MulChain;
 
+/*
+ * How an Exponential is evaluated, it is found from the base and the
+ * exponent whenever they change. x^(3) is x*x*x with repeated squaring,
+ * x^(-1) is 1/x, x^(0.5) is sqrt(x) and e^(x) is exp(x), anything else
+ * is pow().
+*/
+typedef enum _PowerType {
+    GENERAL_POWER,
+    INTEGER_POWER,
+    RECIPROCAL,
+    SQUARE_ROOT,
+    NATURAL_EXPONENTIAL,
+} PowerType;
+
 typedef struct _Exponential {
     EvalAbleType type;
+    PowerType powerType;
+    int integerExponent;
     EVALABLE *base;
     EVALABLE *exponent;
 } Exponential;
@@ -110,9 +203,15 @@ typedef enum _TrigonometricType {
     COT,
 } TrigonometricType;
 
+/*
+ * sincosSlot is -1, or the first of the two slots that keep sin(arg) and
+ * cos(arg) when the node is fused with the other trigonometric functions
+ * of the same argument, see fuseTrigonometric().
+*/
 typedef struct _Trigonometric {
     EvalAbleType type;
     TrigonometricType trigType;
+    int sincosSlot;
     EVALABLE *arg;
 } Trigonometric;
 
@@ -137,6 +236,32 @@ typedef struct _Logarithm {
     EVALABLE *value;
 } Logarithm;
 
+/*
+ * A subexpression that appears more than once in an expression. All the
+ * places it appears point to the same Shared node, the node is destroyed
+ * when the last of them is destroyed. The slot is used to keep the value
+ * of the subexpression while evaluating, see shareSubexpressions().
+*/
+typedef struct _Shared {
+    EvalAbleType type;
+    int slot;
+    int references;
+    EVALABLE *expr;
+} Shared;
+
+/*
+ * A polynomial in x that is evaluated with Horner's method. Without centers
+ * it is a_0 + a_1 x + ... + a_n x^n, with centers it is the Newton form
+ * a_0 + a_1 (x - c_0) + ... + a_n (x - c_0) ... (x - c_(n-1)) that is
+ * evaluated as a_0 + (x - c_0)(a_1 + (x - c_1)(a_2 + ...)).
+*/
+typedef struct _Polynomial {
+    EvalAbleType type;
+    int degree;
+    ldouble_t *coefficients;
+    ldouble_t *centers;
+} Polynomial;
+
 /*
  * Each EvalAble struct has a type field that is used to determine the type of the expression
  * The type field is used to determine the type of the expression and to cast the expression
@@ -150,7 +275,7 @@ typedef struct _Logarithm {
 */
 
 /* SumChain prototypes */
-Variable *createVariable();
+Variable *createVariable(int index, char name);
 void destroyVariable(Variable *v);
 ldouble_t evaluateVariable(Variable *v, ldouble_t value);
 void printVariable(Variable *v);
@@ -167,6 +292,26 @@ void destroyExponential(Exponential *e);
 ldouble_t evaluateExponential(Exponential *e, ldouble_t value);
 void printExponential(Exponential *e);
 
+/*
+ * Find how the Exponential is evaluated, must be called again when the
+ * base or the exponent is changed
+ *
+ * Parameters:
+ * - e: The expression
+*/
+void classifyExponential(Exponential *e);
+
+/*
+ * base^exponent with repeated squaring
+ *
+ * Parameters:
+ * - base: The base
+ * - exponent: The exponent
+ * Returns:
+ * - base^exponent
+*/
+ldouble_t integerPower(ldouble_t base, int exponent);
+
 /* Logarithm prototypes */
 Logarithm *createLogarithm(EVALABLE *base, EVALABLE *value);
 void destroyLogarithm(Logarithm *l);
@@ -199,6 +344,29 @@ void destroyInverseTrigonometric(InverseTrigonometric *it);
 ldouble_t evaluateInverseTrigonometric(InverseTrigonometric *it, ldouble_t value);
 void printInverseTrigonometric(InverseTrigonometric *it);
 
+/* Shared prototypes */
+Shared *createShared(EVALABLE *expr, int slot);
+void destroyShared(Shared *sh);
+ldouble_t evaluateShared(Shared *sh, ldouble_t value);
+void printShared(Shared *sh);
+
+/* Polynomial prototypes */
+Polynomial *createPolynomial(int degree, const ldouble_t *coefficients, const ldouble_t *centers);
+void destroyPolynomial(Polynomial *p);
+ldouble_t evaluatePolynomial(Polynomial *p, ldouble_t value);
+void printPolynomial(Polynomial *p);
+
+/*
+ * Get the number of slots needed to evaluate the shared subexpressions of
+ * the expression
+ *
+ * Parameters:
+ * - e: The expression
+ * Returns:
+ * - 1 + the biggest slot of the Shared nodes in the expression, 0 if there is none
+*/
+int sharedSlotCount(EVALABLE *e);
+
 /* 
  * Evaluate the expression with the given value
  *
@@ -210,6 +378,20 @@ void printInverseTrigonometric(InverseTrigonometric *it);
 */
 ldouble_t evaluate(EVALABLE *e, ldouble_t value);
 
+/*
+ * Evaluate the expression with the given values of its variables
+ * evaluate() gives NAN for the variables other than x.
+ *
+ * Parameters:
+ * - e: The expression to be evaluated
+ * - value: The value of x
+ * - values: The values of the variables, values[i] for the variable with
+ *   index i, values[0] is not used
+ * Returns:
+ * - The result of the expression
+*/
+ldouble_t evaluateVariables(EVALABLE *e, ldouble_t value, const ldouble_t *values);
+
 /* 
  * Destroy the expression and free the memory
  *
@@ -226,41 +408,524 @@ void destroy(EVALABLE *e);
 */
 void print(EVALABLE *e);
 
-Variable *createVariable()
+/* Expression arena implementation */
+
+/*
+ * Parsing and optimizing a function creates and destroys a lot of small
+ * nodes. Instead of a malloc for each of them the nodes can be allocated
+ * from an arena, a list of big blocks that are filled one after another
+ * and released all together.
+ *
+ * The constructors allocate from the current arena that is set with
+ * useArena(), if there is no current arena they use malloc. Destroying a
+ * node that is in the current arena does nothing, its memory is released
+ * when the arena is destroyed. Each thread has its own current arena, so
+ * the threads can create expressions at the same time.
+*/
+
+/* In order to change the size of the first block of an arena change the
+ * value of ARENA_BLOCK_SIZE, each new block is twice as big as the previous.
+*/
+#ifndef ARENA_BLOCK_SIZE
+#define ARENA_BLOCK_SIZE 4096
+#endif
+
+#define ARENA_ALIGN 16
+
+typedef struct _ArenaBlock {
+    struct _ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char *data;
+} ArenaBlock;
+
+typedef struct _Arena {
+    ArenaBlock *head;
+    size_t nextSize;
+} Arena;
+
+/* The arena that the constructors of the thread allocate from, NULL for malloc */
+_Thread_local Arena *exprArena = NULL;
+
+/*
+ * Create an empty arena
+ *
+ * Returns:
+ * - The created arena
+*/
+Arena *createArena();
+
+/*
+ * Destroy the arena and free all the memory allocated from it
+ *
+ * Parameters:
+ * - a: The arena to be destroyed, can be NULL
+*/
+void destroyArena(Arena *a);
+
+/*
+ * Allocate memory from the arena
+ *
+ * Parameters:
+ * - a: The arena
+ * - size: The number of bytes
+ * Returns:
+ * - The allocated memory, aligned to ARENA_ALIGN bytes
+*/
+void *arenaAlloc(Arena *a, size_t size);
+
+/*
+ * Check if the memory is allocated from the arena
+ *
+ * Parameters:
+ * - a: The arena
+ * - p: The memory
+ * Returns:
+ * - 1 if p is in one of the blocks of the arena, 0 otherwise
+*/
+int arenaOwns(Arena *a, void *p);
+
+/*
+ * Set the arena that the expressions of the calling thread are allocated from
+ *
+ * Parameters:
+ * - a: The new arena, NULL to use malloc
+ * Returns:
+ * - The previous arena
+*/
+Arena *useArena(Arena *a);
+
+/* Allocation functions used by the EvalAble constructors and destructors */
+void *allocExpr(size_t size);
+void *reallocExpr(void *p, size_t oldSize, size_t newSize);
+void freeExpr(void *p);
+
+Arena *createArena()
+{
+    Arena *a;
+    a = (Arena *)malloc(sizeof(Arena));
+    a->head = NULL;
+    a->nextSize = ARENA_BLOCK_SIZE;
+    return a;
+}
+
+void destroyArena(Arena *a)
+{
+    ArenaBlock *block;
+    if (a == NULL)
+    {
+        return;
+    }
+    while (a->head != NULL)
+    {
+        block = a->head;
+        a->head = block->next;
+        free(block);
+    }
+    free(a);
+}
+
+void *arenaAlloc(Arena *a, size_t size)
+{
+    ArenaBlock *block = a->head;
+    void *p;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (block == NULL || block->used + size > block->size)
+    {
+        size_t blockSize = a->nextSize;
+        while (blockSize < size)
+        {
+            blockSize *= 2;
+        }
+        /* the block header and its data are allocated together */
+        block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + blockSize + ARENA_ALIGN);
+        block->data = (char *)(((size_t)(block + 1) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1));
+        block->size = blockSize;
+        block->used = 0;
+        block->next = a->head;
+        a->head = block;
+        a->nextSize = blockSize * 2;
+    }
+    p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+int arenaOwns(Arena *a, void *p)
+{
+    ArenaBlock *block;
+    for (block = a->head; block != NULL; block = block->next)
+    {
+        if ((char *)p >= block->data && (char *)p < block->data + block->size)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+Arena *useArena(Arena *a)
+{
+    Arena *previous = exprArena;
+    exprArena = a;
+    return previous;
+}
+
+void *allocExpr(size_t size)
+{
+    if (exprArena != NULL)
+    {
+        return arenaAlloc(exprArena, size);
+    }
+    return malloc(size);
+}
+
+void *reallocExpr(void *p, size_t oldSize, size_t newSize)
+{
+    void *result;
+    if (exprArena == NULL || !arenaOwns(exprArena, p))
+    {
+        return realloc(p, newSize);
+    }
+    result = arenaAlloc(exprArena, newSize);
+    memcpy(result, p, oldSize);
+    return result;
+}
+
+void freeExpr(void *p)
+{
+    if (exprArena != NULL && arenaOwns(exprArena, p))
+    {
+        return;
+    }
+    free(p);
+}
+
+/* Thread pool implementation */
+
+/*
+ * The matrix routines and the integrators split their work into ranges
+ * of independent items (rows, columns, tiles, subintervals) and run the
+ * ranges on a pool of threads with parallelFor(). The calling thread works
+ * too, so a pool of N threads has N - 1 worker threads.
+ *
+ * The number of threads is read from the ANALYSIS_THREADS environment
+ * variable, if it is not set the number of online processors is used.
+ * setThreadCount() changes it at run time.
+ *
+ * A parallelFor() that is called from inside a task, or while another
+ * thread is using the pool, runs on the calling thread only.
+*/
+
+/* In order to change the minimum amount of work (about the number of
+ * multiply-adds) that is worth giving to a thread change PARALLEL_MIN_WORK.
+*/
+#ifndef PARALLEL_MIN_WORK
+#define PARALLEL_MIN_WORK 32768
+#endif
+
+typedef void (*ParallelTask)(void *context, int begin, int end);
+
+typedef struct _ThreadPool {
+    int threadCount;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_mutex_t submitLock;
+    pthread_cond_t workReady;
+    pthread_cond_t workDone;
+    ParallelTask task;
+    void *context;
+    int count;
+    int grain;
+    int next;
+    int active;
+    int generation;
+    int shutdown;
+} ThreadPool;
+
+ThreadPool *threadPool = NULL;
+int threadCount = 0;
+pthread_mutex_t threadPoolLock = PTHREAD_MUTEX_INITIALIZER;
+_Thread_local int insideParallel = 0;
+
+/*
+ * Set the number of threads used by parallelFor()
+ *
+ * Parameters:
+ * - count: The number of threads, 1 to run everything on the calling thread
+*/
+void setThreadCount(int count);
+
+/*
+ * Get the number of threads used by parallelFor()
+ *
+ * Returns:
+ * - The number of threads
+*/
+int getThreadCount();
+
+/*
+ * Run task(context, begin, end) for the ranges of [0, count) on the pool
+ *
+ * The ranges are grain items long (the last one can be shorter) and are
+ * given to the threads in any order, the task must not depend on the
+ * order. Returns after all the ranges are done.
+ *
+ * Parameters:
+ * - count: The number of items
+ * - grain: The number of items in each range
+ * - task: The function that processes a range of items
+ * - context: The pointer passed to the task
+*/
+void parallelFor(int count, int grain, ParallelTask task, void *context);
+
+/*
+ * Number of items per range so that each range has about PARALLEL_MIN_WORK
+ * work and there are a few ranges for each thread
+ *
+ * Parameters:
+ * - count: The number of items
+ * - workPerItem: The work for one item
+ * Returns:
+ * - The grain for parallelFor()
+*/
+int parallelGrain(int count, double workPerItem);
+
+void runParallelRanges(ThreadPool *pool)
+{
+    int begin;
+    insideParallel = 1;
+    while ((begin = __atomic_fetch_add(&pool->next, pool->grain, __ATOMIC_RELAXED)) < pool->count)
+    {
+        pool->task(pool->context, begin, MIN(begin + pool->grain, pool->count));
+    }
+    insideParallel = 0;
+}
+
+void *threadPoolWorker(void *arg)
+{
+    ThreadPool *pool = (ThreadPool *)arg;
+    int generation = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (!pool->shutdown && pool->generation == generation)
+        {
+            pthread_cond_wait(&pool->workReady, &pool->lock);
+        }
+        if (pool->shutdown)
+        {
+            break;
+        }
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        runParallelRanges(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->active--;
+        if (pool->active == 0)
+        {
+            pthread_cond_signal(&pool->workDone);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+ThreadPool *createThreadPool(int count)
+{
+    ThreadPool *pool;
+    int i;
+    pool = (ThreadPool *)malloc(sizeof(ThreadPool));
+    pool->threadCount = count;
+    pool->threads = (pthread_t *)malloc(count * sizeof(pthread_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->submitLock, NULL);
+    pthread_cond_init(&pool->workReady, NULL);
+    pthread_cond_init(&pool->workDone, NULL);
+    pool->task = NULL;
+    pool->context = NULL;
+    pool->count = 0;
+    pool->grain = 1;
+    pool->next = 0;
+    pool->active = 0;
+    pool->generation = 0;
+    pool->shutdown = 0;
+    for (i = 1; i < count; i++)
+    {
+        pthread_create(&pool->threads[i], NULL, threadPoolWorker, pool);
+    }
+    return pool;
+}
+
+void destroyThreadPool(ThreadPool *pool)
+{
+    int i;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->workReady);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 1; i < pool->threadCount; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->submitLock);
+    pthread_cond_destroy(&pool->workReady);
+    pthread_cond_destroy(&pool->workDone);
+    free(pool->threads);
+    free(pool);
+}
+
+int getThreadCount()
+{
+    pthread_mutex_lock(&threadPoolLock);
+    if (threadCount <= 0)
+    {
+        char *env = getenv("ANALYSIS_THREADS");
+        threadCount = env != NULL ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (threadCount <= 0)
+        {
+            threadCount = 1;
+        }
+    }
+    pthread_mutex_unlock(&threadPoolLock);
+    return threadCount;
+}
+
+void setThreadCount(int count)
+{
+    pthread_mutex_lock(&threadPoolLock);
+    if (threadPool != NULL)
+    {
+        destroyThreadPool(threadPool);
+        threadPool = NULL;
+    }
+    threadCount = count > 0 ? count : 1;
+    pthread_mutex_unlock(&threadPoolLock);
+}
+
+int parallelGrain(int count, double workPerItem)
+{
+    int threads = getThreadCount();
+    int grain = (int)(PARALLEL_MIN_WORK / (workPerItem > 1 ? workPerItem : 1));
+    /* a few ranges for each thread to balance the load */
+    int balanced = count / (4 * threads);
+    if (grain < balanced)
+    {
+        grain = balanced;
+    }
+    return grain > 0 ? grain : 1;
+}
+
+void parallelFor(int count, int grain, ParallelTask task, void *context)
+{
+    ThreadPool *pool;
+    if (count <= 0)
+    {
+        return;
+    }
+    if (grain < 1)
+    {
+        grain = 1;
+    }
+    if (insideParallel || count <= grain || getThreadCount() == 1)
+    {
+        task(context, 0, count);
+        return;
+    }
+
+    pthread_mutex_lock(&threadPoolLock);
+    if (threadPool == NULL)
+    {
+        threadPool = createThreadPool(threadCount);
+    }
+    pool = threadPool;
+    if (pthread_mutex_trylock(&pool->submitLock) != 0)
+    {
+        /* the pool is busy with another thread's work */
+        pthread_mutex_unlock(&threadPoolLock);
+        task(context, 0, count);
+        return;
+    }
+    pthread_mutex_unlock(&threadPoolLock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->context = context;
+    pool->count = count;
+    pool->grain = grain;
+    pool->next = 0;
+    pool->active = pool->threadCount - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->workReady);
+    pthread_mutex_unlock(&pool->lock);
+
+    runParallelRanges(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0)
+    {
+        pthread_cond_wait(&pool->workDone, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->submitLock);
+}
+
+/*
+ * The values of the variables other than x for the expression that is being
+ * evaluated, evaluateVariables() and evaluateBatchVariables() set it for the
+ * thread that is evaluating, so the node functions do not need an extra
+ * parameter. NULL when they are not given.
+*/
+_Thread_local const ldouble_t *variableValues = NULL;
+
+/* The value of the variable with the index, x is value and the others are in values, NAN if they are not given */
+ldouble_t variableValue(int index, ldouble_t value, const ldouble_t *values)
+{
+    if (index == 0)
+    {
+        return value;
+    }
+    return values != NULL ? values[index] : NAN;
+}
+
+Variable *createVariable(int index, char name)
 {
     Variable *v;
-    v = (Variable *)malloc(sizeof(Variable));
+    v = (Variable *)allocExpr(sizeof(Variable));
     v->type = VARIABLE;
+    v->index = index;
+    v->name = name;
     return v;
 }
 
 void destroyVariable(Variable *v)
 {
-    free(v);
+    freeExpr(v);
 }
 
 ldouble_t evaluateVariable(Variable *v, ldouble_t value)
 {
-    UNUSED(v);
-    return value;
+    return variableValue(v->index, value, variableValues);
 }
 
 void printVariable(Variable *v)
 {
-    UNUSED(v);
-    printf("x");
+    printf("%c", v->name);
 }
 
 MulChain *createMulChain()
 {
     MulChain *m; 
     int i;
-    m = (MulChain *)malloc(sizeof(MulChain));
+    m = (MulChain *)allocExpr(sizeof(MulChain));
     m->type = MUL_CHAIN;
     m->argCount = 0;
     m->maxArgs = INIT_CHAIN_ARGS;
-    m->args = (EVALABLE **)calloc(m->maxArgs, sizeof(EVALABLE *));
-    m->isDivided = (int *)calloc(m->maxArgs, sizeof(int));
+    m->args = (EVALABLE **)allocExpr(m->maxArgs * sizeof(EVALABLE *));
+    m->isDivided = (int *)allocExpr(m->maxArgs * sizeof(int));
     for (i = 0; i < m->maxArgs; i++)
     {
         m->args[i] = NULL;
@@ -273,9 +938,9 @@ void addMulChainArg(MulChain *m, EVALABLE *arg, int isDivided)
 {
     if (m->argCount >= m->maxArgs)
     {
+        m->args = (EVALABLE **)reallocExpr(m->args, m->maxArgs * sizeof(EVALABLE *), 2 * m->maxArgs * sizeof(EVALABLE *));
+        m->isDivided = (int *)reallocExpr(m->isDivided, m->maxArgs * sizeof(int), 2 * m->maxArgs * sizeof(int));
         m->maxArgs *= 2;
-        m->args = (EVALABLE **)realloc(m->args, m->maxArgs * sizeof(EVALABLE *));
-        m->isDivided = (int *)realloc(m->isDivided, m->maxArgs * sizeof(int));
     }
     m->args[m->argCount] = arg;
     m->isDivided[m->argCount] = isDivided;
@@ -289,9 +954,9 @@ void destroyMulChain(MulChain *m)
     {
         destroy(m->args[i]);
     }
-    free(m->args);
-    free(m->isDivided);
-    free(m);
+    freeExpr(m->args);
+    freeExpr(m->isDivided);
+    freeExpr(m);
 }
 
 ldouble_t evaluateMulChain(MulChain *m, ldouble_t value)
@@ -313,6 +978,10 @@ ldouble_t evaluateMulChain(MulChain *m, ldouble_t value)
 void printMulChain(MulChain *m)
 {
     int i;
+    if (m->argCount > 0 && m->isDivided[0] == 1)
+    {
+        printf("1/");
+    }
     for (i = 0; i < m->argCount && m->args[i] != NULL; i++)
     {
         print(m->args[i]);
@@ -331,7 +1000,7 @@ void printMulChain(MulChain *m)
 Constant *createConstant(ldouble_t value)
 {
     Constant *c;
-    c = (Constant *)malloc(sizeof(Constant)); 
+    c = (Constant *)allocExpr(sizeof(Constant));
     c->type = CONSTANT;
     c->value = value;
     return c;
@@ -339,7 +1008,7 @@ Constant *createConstant(ldouble_t value)
 
 void destroyConstant(Constant *c)
 {
-    free(c);
+    freeExpr(c);
 }
 
 ldouble_t evaluateConstant(Constant *c, ldouble_t value)
@@ -350,13 +1019,13 @@ ldouble_t evaluateConstant(Constant *c, ldouble_t value)
 
 void printConstant(Constant *c)
 {
-    printf("%Lf", c->value);
+    printf("%" LDOUBLE_PRI, c->value);
 }
 
 Exponential *createExponential(EVALABLE *base, EVALABLE *exponent)
 {
     Exponential *e;
-    e = (Exponential *)malloc(sizeof(Exponential));
+    e = (Exponential *)allocExpr(sizeof(Exponential));
     e->type = EXPONENTIAL;
     if (base == NULL)
     {
@@ -368,19 +1037,84 @@ Exponential *createExponential(EVALABLE *base, EVALABLE *exponent)
         exponent = (EVALABLE *)createConstant(1);
     }
     e->exponent = exponent;
+    classifyExponential(e);
     return e;
 }
 
-void destroyExponential(Exponential *e)
-{
+/* In order to change the biggest integer exponent that is evaluated with
+ * repeated squaring instead of pow() change the value of INTEGER_POWER_MAX.
+ * Bigger exponents multiply the rounding error of every squaring, so they are
+ * left to pow().
+ * i.e. gcc -DINTEGER_POWER_MAX=16 analysis.c -o analysis -lm -pthread
+*/
+#ifndef INTEGER_POWER_MAX
+#define INTEGER_POWER_MAX 32
+#endif
+
+void classifyExponential(Exponential *e)
+{
+    ldouble_t exponent;
+    e->powerType = GENERAL_POWER;
+    e->integerExponent = 0;
+    if (EVALTYPE(e->base) == CONSTANT && ((Constant *)e->base)->value == (ldouble_t)M_E)
+    {
+        e->powerType = NATURAL_EXPONENTIAL;
+        return;
+    }
+    if (EVALTYPE(e->exponent) != CONSTANT)
+        return;
+    exponent = ((Constant *)e->exponent)->value;
+    if (exponent == 0.5)
+    {
+        e->powerType = SQUARE_ROOT;
+    } else if (exponent == -1)
+    {
+        e->powerType = RECIPROCAL;
+    } else if (exponent == (int)exponent && exponent >= -INTEGER_POWER_MAX && exponent <= INTEGER_POWER_MAX)
+    {
+        e->powerType = INTEGER_POWER;
+        e->integerExponent = (int)exponent;
+    }
+}
+
+ldouble_t integerPower(ldouble_t base, int exponent)
+{
+    ldouble_t result = 1;
+    int n = exponent < 0 ? -exponent : exponent;
+    while (n > 0)
+    {
+        if (n & 1)
+        {
+            result *= base;
+        }
+        base *= base;
+        n >>= 1;
+    }
+    return exponent < 0 ? 1 / result : result;
+}
+
+void destroyExponential(Exponential *e)
+{
     destroy(e->base);
     destroy(e->exponent);
-    free(e);
+    freeExpr(e);
 }
 
 ldouble_t evaluateExponential(Exponential *e, ldouble_t value)
 {
-    return pow(evaluate(e->base, value), evaluate(e->exponent, value));
+    switch (e->powerType)
+    {
+        case INTEGER_POWER:
+            return integerPower(evaluate(e->base, value), e->integerExponent);
+        case RECIPROCAL:
+            return 1 / evaluate(e->base, value);
+        case SQUARE_ROOT:
+            return sqrt(evaluate(e->base, value));
+        case NATURAL_EXPONENTIAL:
+            return exp(evaluate(e->exponent, value));
+        default:
+            return pow(evaluate(e->base, value), evaluate(e->exponent, value));
+    }
 }
 
 void printExponential(Exponential *e)
@@ -394,7 +1128,7 @@ void printExponential(Exponential *e)
 Trigonometric *createTrigonometric(TrigonometricType type, EVALABLE *arg)
 {
     Trigonometric *t;
-    t = (Trigonometric *)malloc(sizeof(Trigonometric));
+    t = (Trigonometric *)allocExpr(sizeof(Trigonometric));
     t->type = TRIGONOMETRIC;
     if (arg == NULL)
     {
@@ -402,13 +1136,14 @@ Trigonometric *createTrigonometric(TrigonometricType type, EVALABLE *arg)
     }
     t->arg = arg;
     t->trigType = type;
+    t->sincosSlot = -1;
     return t;
 }
 
 void destroyTrigonometric(Trigonometric *t)
 {
     destroy(t->arg);
-    free(t);
+    freeExpr(t);
 }
 
 ldouble_t evaluateTrigonometric(Trigonometric *t, ldouble_t value)
@@ -432,6 +1167,39 @@ ldouble_t evaluateTrigonometric(Trigonometric *t, ldouble_t value)
     }
 }
 
+/*
+ * sin(v) and cos(v), gcc turns the two calls into one sincos() call when
+ * optimizing
+*/
+void sinCos(ldouble_t v, ldouble_t *s, ldouble_t *c)
+{
+    double x = v;
+    *s = sin(x);
+    *c = cos(x);
+}
+
+/* The function of the fused group from sin and cos, taken in double like evaluateTrigonometric() */
+ldouble_t fusedTrigonometric(TrigonometricType type, ldouble_t s, ldouble_t c)
+{
+    switch (type)
+    {
+        case SIN:
+            return s;
+        case COS:
+            return c;
+        case TAN:
+            return (double)s / (double)c;
+        case CSC:
+            return 1 / (double)s;
+        case SEC:
+            return 1 / (double)c;
+        case COT:
+            return (double)c / (double)s;
+        default:
+            return 0;
+    }
+}
+
 void printTrigonometric(Trigonometric *t)
 {
     switch (t->trigType)
@@ -462,7 +1230,7 @@ void printTrigonometric(Trigonometric *t)
 InverseTrigonometric *createInverseTrigonometric(InverseTrigonometricType type, EVALABLE *arg)
 {
     InverseTrigonometric *it;
-    it = (InverseTrigonometric *)malloc(sizeof(InverseTrigonometric));
+    it = (InverseTrigonometric *)allocExpr(sizeof(InverseTrigonometric));
     it->type = INVERSE_TRIGONOMETRIC;
     if (arg == NULL)
     {
@@ -476,7 +1244,7 @@ InverseTrigonometric *createInverseTrigonometric(InverseTrigonometricType type,
 void destroyInverseTrigonometric(InverseTrigonometric *it)
 {
     destroy(it->arg);
-    free(it);
+    freeExpr(it);
 }
 
 ldouble_t evaluateInverseTrigonometric(InverseTrigonometric *it, ldouble_t value)
@@ -531,7 +1299,7 @@ void printInverseTrigonometric(InverseTrigonometric *it)
 Logarithm *createLogarithm(EVALABLE *base, EVALABLE *value)
 {
     Logarithm *l;
-    l = (Logarithm *)malloc(sizeof(Logarithm));
+    l = (Logarithm *)allocExpr(sizeof(Logarithm));
     l->type = LOGARITHM;
     if (base == NULL)
     {
@@ -550,7 +1318,7 @@ void destroyLogarithm(Logarithm *l)
 {
     destroy(l->base);
     destroy(l->value);
-    free(l);
+    freeExpr(l);
 }
 
 ldouble_t evaluateLogarithm(Logarithm *l, ldouble_t value)
@@ -567,19 +1335,217 @@ void printLogarithm(Logarithm *l)
     printf(")");
 }
 
+Shared *createShared(EVALABLE *expr, int slot)
+{
+    Shared *sh;
+    sh = (Shared *)allocExpr(sizeof(Shared));
+    sh->type = SHARED;
+    sh->slot = slot;
+    sh->references = 1;
+    sh->expr = expr;
+    return sh;
+}
+
+void destroyShared(Shared *sh)
+{
+    sh->references--;
+    if (sh->references > 0)
+    {
+        return;
+    }
+    destroy(sh->expr);
+    freeExpr(sh);
+}
+
+/*
+ * The values of the Shared nodes in the current evaluate() call. The
+ * outermost evaluate() call starts a new generation, a slot holds the
+ * value of this call when its stamp is the current generation, so the
+ * slots are never cleared and the buffers are kept for the next calls.
+*/
+typedef struct _EvaluationSlots {
+    int depth;
+    unsigned long generation;
+    int slotCount;
+    ldouble_t *values;
+    unsigned long *stamps;
+} EvaluationSlots;
+
+_Thread_local EvaluationSlots evaluationSlots = {0, 0, 0, NULL, NULL};
+
+ldouble_t evaluateShared(Shared *sh, ldouble_t value)
+{
+    EvaluationSlots *slots = &evaluationSlots;
+    ldouble_t result;
+    if (sh->slot < slots->slotCount && slots->stamps[sh->slot] == slots->generation)
+    {
+        return slots->values[sh->slot];
+    }
+    result = evaluate(sh->expr, value);
+    if (sh->slot >= slots->slotCount)
+    {
+        int count = MAX(sh->slot + 1, 2 * slots->slotCount);
+        slots->values = (ldouble_t *)realloc(slots->values, count * sizeof(ldouble_t));
+        slots->stamps = (unsigned long *)realloc(slots->stamps, count * sizeof(unsigned long));
+        memset(slots->stamps + slots->slotCount, 0, (count - slots->slotCount) * sizeof(unsigned long));
+        slots->slotCount = count;
+    }
+    slots->values[sh->slot] = result;
+    slots->stamps[sh->slot] = slots->generation;
+    return result;
+}
+
+void printShared(Shared *sh)
+{
+    print(sh->expr);
+}
+
+Polynomial *createPolynomial(int degree, const ldouble_t *coefficients, const ldouble_t *centers)
+{
+    Polynomial *p;
+    p = (Polynomial *)allocExpr(sizeof(Polynomial));
+    p->type = POLYNOMIAL;
+    p->degree = degree;
+    p->coefficients = (ldouble_t *)allocExpr((degree + 1) * sizeof(ldouble_t));
+    memcpy(p->coefficients, coefficients, (degree + 1) * sizeof(ldouble_t));
+    p->centers = NULL;
+    if (centers != NULL)
+    {
+        p->centers = (ldouble_t *)allocExpr((degree + 1) * sizeof(ldouble_t));
+        memcpy(p->centers, centers, degree * sizeof(ldouble_t));
+    }
+    return p;
+}
+
+void destroyPolynomial(Polynomial *p)
+{
+    freeExpr(p->coefficients);
+    if (p->centers != NULL)
+    {
+        freeExpr(p->centers);
+    }
+    freeExpr(p);
+}
+
+/* Horner's method, centers is NULL for a_0 + a_1 x + ... + a_n x^n */
+ldouble_t evaluateHorner(int degree, const ldouble_t *coefficients, const ldouble_t *centers, ldouble_t value)
+{
+    ldouble_t result = coefficients[degree];
+    int i;
+    if (centers == NULL)
+    {
+        for (i = degree - 1; i >= 0; i--)
+        {
+            result = result * value + coefficients[i];
+        }
+        return result;
+    }
+    for (i = degree - 1; i >= 0; i--)
+    {
+        result = result * (value - centers[i]) + coefficients[i];
+    }
+    return result;
+}
+
+ldouble_t evaluatePolynomial(Polynomial *p, ldouble_t value)
+{
+    return evaluateHorner(p->degree, p->coefficients, p->centers, value);
+}
+
+/* Write the coefficients of a_0 + a_1 x + ... + a_n x^n, the Newton form is multiplied out */
+void expandPolynomial(Polynomial *p, ldouble_t *coefficients)
+{
+    int i, j;
+    if (p->centers == NULL)
+    {
+        memcpy(coefficients, p->coefficients, (p->degree + 1) * sizeof(ldouble_t));
+        return;
+    }
+    /* r = r * (x - c_i) + a_i from the innermost parentheses out */
+    for (j = 0; j <= p->degree; j++)
+    {
+        coefficients[j] = 0;
+    }
+    coefficients[0] = p->coefficients[p->degree];
+    for (i = p->degree - 1; i >= 0; i--)
+    {
+        for (j = p->degree - i; j > 0; j--)
+        {
+            coefficients[j] = coefficients[j - 1] - p->centers[i] * coefficients[j];
+        }
+        coefficients[0] = p->coefficients[i] - p->centers[i] * coefficients[0];
+    }
+}
+
+void printPolynomial(Polynomial *p)
+{
+    int i, j;
+    printf("(");
+    if (p->centers != NULL)
+    {
+        /* the same as the SumChain of MulChains it replaces */
+        printf("%" LDOUBLE_PRI, p->coefficients[0]);
+        for (i = 1; i <= p->degree; i++)
+        {
+            printf("+");
+            for (j = 0; j < i; j++)
+            {
+                printf("(x-%" LDOUBLE_PRI ")*", p->centers[j]);
+            }
+            printf("%" LDOUBLE_PRI, p->coefficients[i]);
+        }
+        printf(")");
+        return;
+    }
+    j = 0;
+    for (i = p->degree; i >= 0; i--)
+    {
+        ldouble_t coefficient = p->coefficients[i];
+        if (coefficient == 0 && !(i == 0 && j == 0))
+            continue;
+        if (coefficient < 0)
+        {
+            printf("-");
+            coefficient = -coefficient;
+        } else if (j > 0)
+        {
+            printf("+");
+        }
+        j++;
+        if (i == 0)
+        {
+            printf("%" LDOUBLE_PRI, coefficient);
+            continue;
+        }
+        if (i == 1)
+        {
+            printf("x");
+        } else
+        {
+            printf("x^(%" LDOUBLE_PRI ")", (ldouble_t)i);
+        }
+        if (coefficient != 1)
+        {
+            printf("*%" LDOUBLE_PRI, coefficient);
+        }
+    }
+    printf(")");
+}
+
 SumChain *createSumChain()
 {
     SumChain *f;
     int i;
-    f = (SumChain *)malloc(sizeof(SumChain));
+    f = (SumChain *)allocExpr(sizeof(SumChain));
     f->type = SUM_CHAIN;
     f->maxArgs = INIT_CHAIN_ARGS;
     f->argCount = 0;
-    f->args = (EVALABLE **)calloc(f->maxArgs, sizeof(EVALABLE *));
-    f->isPositive = (int *)calloc(f->maxArgs, sizeof(int));
+    f->args = (EVALABLE **)allocExpr(f->maxArgs * sizeof(EVALABLE *));
+    f->isPositive = (int *)allocExpr(f->maxArgs * sizeof(int));
     for (i = 0; i < f->maxArgs; i++)
     {
         f->args[i] = NULL;
+        f->isPositive[i] = 0;
     }
     return f;
 }
@@ -588,9 +1554,9 @@ void addSumChainArg(SumChain *f, EVALABLE *arg, int isPositive)
 {
     if (f->argCount >= f->maxArgs)
     {
+        f->args = (EVALABLE **)reallocExpr(f->args, f->maxArgs * sizeof(EVALABLE *), 2 * f->maxArgs * sizeof(EVALABLE *));
+        f->isPositive = (int *)reallocExpr(f->isPositive, f->maxArgs * sizeof(int), 2 * f->maxArgs * sizeof(int));
         f->maxArgs *= 2;
-        f->args = (EVALABLE **)realloc(f->args, f->maxArgs * sizeof(EVALABLE *));
-        f->isPositive = (int *)realloc(f->isPositive, f->maxArgs * sizeof(int));
     }
     f->args[f->argCount] = arg;
     f->isPositive[f->argCount] = isPositive;
@@ -604,9 +1570,9 @@ void destroySumChain(SumChain *f)
     {
         destroy(f->args[i]);
     }
-    free(f->args);
-    free(f->isPositive);
-    free(f);
+    freeExpr(f->args);
+    freeExpr(f->isPositive);
+    freeExpr(f);
 }
 
 ldouble_t evaluateSumChain(SumChain *f, ldouble_t value)
@@ -658,7 +1624,7 @@ EVALABLE *copyEvalable(EVALABLE *e)
         case CONSTANT:
             return (EVALABLE *)createConstant(((Constant *)e)->value);
         case VARIABLE:
-            return (EVALABLE *)createVariable();
+            return (EVALABLE *)createVariable(((Variable *)e)->index, ((Variable *)e)->name);
         case EXPONENTIAL:
             return (EVALABLE *)createExponential(
                 copyEvalable(((Exponential *)e)->base),
@@ -699,6 +1665,16 @@ EVALABLE *copyEvalable(EVALABLE *e)
             }
             return (EVALABLE *)m;
         }
+        case SHARED:
+            /* a copy of a shared subexpression is one more reference to it */
+            ((Shared *)e)->references++;
+            return e;
+        case POLYNOMIAL:
+            return (EVALABLE *)createPolynomial(
+                ((Polynomial *)e)->degree,
+                ((Polynomial *)e)->coefficients,
+                ((Polynomial *)e)->centers
+            );
         default:
             return NULL;
     }
@@ -732,10 +1708,30 @@ void destroy(EVALABLE *e)
         case MUL_CHAIN:
             destroyMulChain((MulChain *)e);
             break;
+        case SHARED:
+            destroyShared((Shared *)e);
+            break;
+        case POLYNOMIAL:
+            destroyPolynomial((Polynomial *)e);
+            break;
     }
 }
 
+ldouble_t evaluateNode(EVALABLE *e, ldouble_t value);
+
 ldouble_t evaluate(EVALABLE *e, ldouble_t value)
+{
+    ldouble_t result;
+    if (evaluationSlots.depth++ == 0)
+    {
+        evaluationSlots.generation++;
+    }
+    result = evaluateNode(e, value);
+    evaluationSlots.depth--;
+    return result;
+}
+
+ldouble_t evaluateNode(EVALABLE *e, ldouble_t value)
 {
     switch (EVALTYPE(e))
     {
@@ -755,11 +1751,25 @@ ldouble_t evaluate(EVALABLE *e, ldouble_t value)
             return evaluateSumChain((SumChain *)e, value);
         case MUL_CHAIN:
             return evaluateMulChain((MulChain *)e, value);
+        case SHARED:
+            return evaluateShared((Shared *)e, value);
+        case POLYNOMIAL:
+            return evaluatePolynomial((Polynomial *)e, value);
         default:
             return 0;
     }
 }
 
+ldouble_t evaluateVariables(EVALABLE *e, ldouble_t value, const ldouble_t *values)
+{
+    const ldouble_t *previous = variableValues;
+    ldouble_t result;
+    variableValues = values;
+    result = evaluate(e, value);
+    variableValues = previous;
+    return result;
+}
+
 void print(EVALABLE *e)
 {
     switch (EVALTYPE(e))
@@ -788,6 +1798,12 @@ void print(EVALABLE *e)
         case MUL_CHAIN:
             printMulChain((MulChain *)e);
             break;
+        case SHARED:
+            printShared((Shared *)e);
+            break;
+        case POLYNOMIAL:
+            printPolynomial((Polynomial *)e);
+            break;
     }
 }
 
@@ -819,1825 +1835,9416 @@ void printType(EVALABLE *e)
         case MUL_CHAIN:
             printf("Mul Chain\n");
             break;
+        case SHARED:
+            printf("Shared\n");
+            break;
+        case POLYNOMIAL:
+            printf("Polynomial\n");
+            break;
     }
 }
 
-/* Optimize functions */ 
-EVALABLE *optimize(EVALABLE *e);
-EVALABLE *optimizeSumChain(SumChain *f);
-EVALABLE *optimizeMulChain(MulChain *m);
-EVALABLE *optimizeExponential(Exponential *e);
-EVALABLE *optimizeTrigonometric(Trigonometric *t);
-EVALABLE *optimizeInverseTrigonometric(InverseTrigonometric *it);
-EVALABLE *optimizeLogarithm(Logarithm *l);
+/* Vector math kernels */
 
-/* 
- * Optimize functions for each type of expression
- *
- * The optimization functions are responsible for simplifying the expression
- * by evaluating the constants and optimizing the expressions that can be
- * simplified.
- *
- * Also the optimization functions are responsible for freeing the memory and
- * creating a new expression that is optimized if necessary.
+/*
+ * Elementwise math functions used by the batch evaluation. y may be the
+ * same array as x.
  *
- * Parameters:
- * - e: The expression to be optimized
- *   The expression can be any type of expression
- * Returns:
- * - The optimized expression
+ * With USE_AVX2_KERNELS the functions work on 4 doubles at once with
+ * polynomial approximations (Cephes), the results are within a few ulps
+ * of the libm functions. Values the approximations do not cover (very big
+ * arguments, nan, inf, zero or negative logarithms, results that under or
+ * overflow) are recomputed with libm. Without USE_AVX2_KERNELS these are
+ * plain libm loops and give exactly the same results as evaluate().
 */
-EVALABLE *optimize(EVALABLE *e)
+void vectorSin(const ldouble_t *x, ldouble_t *y, int n);
+void vectorCos(const ldouble_t *x, ldouble_t *y, int n);
+void vectorTan(const ldouble_t *x, ldouble_t *y, int n);
+void vectorSinCos(const ldouble_t *x, ldouble_t *s, ldouble_t *c, int n);
+void vectorExp(const ldouble_t *x, ldouble_t *y, int n);
+void vectorLog(const ldouble_t *x, ldouble_t *y, int n);
+
+#ifdef USE_AVX2_KERNELS
+
+static inline __m256d polevl256(__m256d x, const double *coef, int n)
 {
-    switch (EVALTYPE(e))
+    __m256d result = _mm256_set1_pd(coef[0]);
+    int i;
+    for (i = 1; i <= n; i++)
     {
-        case CONSTANT:
-        case VARIABLE:
-            return e;
-        case EXPONENTIAL:
-            return optimizeExponential((Exponential *)e);
-        case TRIGONOMETRIC:
-            return optimizeTrigonometric((Trigonometric *)e);
-        case INVERSE_TRIGONOMETRIC:
-            return optimizeInverseTrigonometric((InverseTrigonometric *)e);
-        case LOGARITHM:
-            return optimizeLogarithm((Logarithm *)e);
-        case MUL_CHAIN:
-            return optimizeMulChain((MulChain *)e);
-        case SUM_CHAIN:
-            return optimizeSumChain((SumChain *)e);
-        default:
-            return NULL;
+        result = _mm256_fmadd_pd(result, x, _mm256_set1_pd(coef[i]));
     }
+    return result;
 }
 
-EVALABLE *optimizeSumChain(SumChain *f)
+/* Returns the lanes of x that are outside of [-limit, limit] or nan */
+static inline int outOfRange256(__m256d x, double limit)
 {
-    int i;
-    for (i = 0; i < f->argCount; i++)
-    {
-        f->args[i] = optimize(f->args[i]);
-    }
-    ldouble_t constantSum = 0;
-    SumChain *optimized = createSumChain();
-    for (i = 0; i < f->argCount; i++)
+    __m256d ax = _mm256_andnot_pd(_mm256_set1_pd(-0.0), x);
+    return _mm256_movemask_pd(_mm256_cmp_pd(ax, _mm256_set1_pd(limit), _CMP_NLE_UQ));
+}
+
+static void sinCos256(__m256d x, __m256d *s, __m256d *c)
+{
+    static const double sincof[] = {
+        1.58962301576546568060E-10, -2.50507477628578072866E-8,
+        2.75573136213857245213E-6, -1.98412698295895385996E-4,
+        8.33333333332211858878E-3, -1.66666666666666307295E-1,
+    };
+    static const double coscof[] = {
+        -1.13585365213876817300E-11, 2.08757008419747316778E-9,
+        -2.75573141792967388112E-7, 2.48015872888517045348E-5,
+        -1.38888888888730564116E-3, 4.16666666666665929218E-2,
+    };
+    const __m256d signMask = _mm256_set1_pd(-0.0);
+    __m256d ax = _mm256_andnot_pd(signMask, x);
+    __m256d xSign = _mm256_and_pd(signMask, x);
+    __m128i j32;
+    __m256i j;
+    __m256d y, z, zz, ps, pc, swap, sinSign, cosSign;
+
+    /* octant of the argument, rounded up to an even octant */
+    j32 = _mm256_cvttpd_epi32(_mm256_mul_pd(ax, _mm256_set1_pd(4 / M_PI)));
+    j32 = _mm_and_si128(_mm_add_epi32(j32, _mm_set1_epi32(1)), _mm_set1_epi32(~1));
+    y = _mm256_cvtepi32_pd(j32);
+    j = _mm256_cvtepi32_epi64(j32);
+
+    /* extended precision modular arithmetic */
+    z = _mm256_fnmadd_pd(y, _mm256_set1_pd(7.85398125648498535156E-1), ax);
+    z = _mm256_fnmadd_pd(y, _mm256_set1_pd(3.77489470793079817668E-8), z);
+    z = _mm256_fnmadd_pd(y, _mm256_set1_pd(2.69515142907905952645E-15), z);
+    zz = _mm256_mul_pd(z, z);
+
+    ps = _mm256_fmadd_pd(_mm256_mul_pd(z, zz), polevl256(zz, sincof, 5), z);
+    pc = _mm256_fmadd_pd(_mm256_mul_pd(zz, zz), polevl256(zz, coscof, 5),
+                         _mm256_fnmadd_pd(_mm256_set1_pd(0.5), zz, _mm256_set1_pd(1)));
+
+    swap = _mm256_castsi256_pd(_mm256_cmpeq_epi64(
+        _mm256_and_si256(j, _mm256_set1_epi64x(2)), _mm256_set1_epi64x(2)));
+    sinSign = _mm256_castsi256_pd(_mm256_slli_epi64(
+        _mm256_and_si256(j, _mm256_set1_epi64x(4)), 61));
+    cosSign = _mm256_castsi256_pd(_mm256_slli_epi64(
+        _mm256_and_si256(_mm256_xor_si256(j, _mm256_slli_epi64(j, 1)), _mm256_set1_epi64x(4)), 61));
+
+    *s = _mm256_xor_pd(_mm256_blendv_pd(ps, pc, swap), _mm256_xor_pd(sinSign, xSign));
+    *c = _mm256_xor_pd(_mm256_blendv_pd(pc, ps, swap), cosSign);
+}
+
+static __m256d exp256(__m256d x)
+{
+    static const double P[] = {
+        1.26177193074810590878E-4, 3.02994407707441961300E-2,
+        9.99999999999999999910E-1,
+    };
+    static const double Q[] = {
+        3.00198505138664455042E-6, 2.52448340349684104192E-3,
+        2.27265548208155028766E-1, 2.00000000000000000009E0,
+    };
+    __m256d n, r, rr, px, qx;
+    __m256i scale;
+
+    n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(M_LOG2E)),
+                        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    r = _mm256_fnmadd_pd(n, _mm256_set1_pd(6.93145751953125E-1), x);
+    r = _mm256_fnmadd_pd(n, _mm256_set1_pd(1.42860682030941723212E-6), r);
+
+    /* e^r = 1 + 2r P(r^2) / (Q(r^2) - r P(r^2)) */
+    rr = _mm256_mul_pd(r, r);
+    px = _mm256_mul_pd(r, polevl256(rr, P, 2));
+    qx = polevl256(rr, Q, 3);
+    r = _mm256_div_pd(px, _mm256_sub_pd(qx, px));
+    r = _mm256_fmadd_pd(_mm256_set1_pd(2), r, _mm256_set1_pd(1));
+
+    /* multiply by 2^n */
+    scale = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n));
+    scale = _mm256_slli_epi64(_mm256_add_epi64(scale, _mm256_set1_epi64x(1023)), 52);
+    return _mm256_mul_pd(r, _mm256_castsi256_pd(scale));
+}
+
+static __m256d log256(__m256d x)
+{
+    static const double P[] = {
+        1.01875663804580931796E-4, 4.97494994976747001425E-1,
+        4.70579119878881725854E0, 1.44989225341610930846E1,
+        1.79368678507819816313E1, 7.70838733755885391666E0,
+    };
+    static const double Q[] = {
+        1.0, 1.12873587189167450590E1, 4.52279145837532221105E1,
+        8.29875266912776603211E1, 7.11544750618563894466E1,
+        2.31251620126765340583E1,
+    };
+    const __m256i mantissaMask = _mm256_set1_epi64x(0x000fffffffffffffLL);
+    const __m256d two52 = _mm256_set1_pd(4503599627370496.0);
+    __m256i bits = _mm256_castpd_si256(x);
+    __m256d e, m, small, z, y;
+
+    /* x = m * 2^e, 0.5 <= m < 1 */
+    e = _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), _mm256_castpd_si256(two52)));
+    e = _mm256_sub_pd(_mm256_sub_pd(e, two52), _mm256_set1_pd(1022));
+    m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, mantissaMask),
+                                            _mm256_set1_epi64x(0x3fe0000000000000LL)));
+
+    /* if m < sqrt(1/2) use 2m - 1 and e - 1, otherwise m - 1 */
+    small = _mm256_cmp_pd(m, _mm256_set1_pd(M_SQRT1_2), _CMP_LT_OQ);
+    e = _mm256_sub_pd(e, _mm256_and_pd(small, _mm256_set1_pd(1)));
+    m = _mm256_sub_pd(_mm256_add_pd(m, _mm256_and_pd(small, m)), _mm256_set1_pd(1));
+
+    z = _mm256_mul_pd(m, m);
+    y = _mm256_div_pd(_mm256_mul_pd(z, polevl256(m, P, 5)), polevl256(m, Q, 5));
+    y = _mm256_mul_pd(m, y);
+    y = _mm256_fnmadd_pd(e, _mm256_set1_pd(2.121944400546905827679E-4), y);
+    y = _mm256_fnmadd_pd(_mm256_set1_pd(0.5), z, y);
+    z = _mm256_add_pd(m, y);
+    return _mm256_fmadd_pd(e, _mm256_set1_pd(0.693359375), z);
+}
+
+void vectorSinCos(const ldouble_t *x, ldouble_t *s, ldouble_t *c, int n)
+{
+    int i, k;
+    for (i = 0; i + 4 <= n; i += 4)
     {
-        if (EVALTYPE(f->args[i]) == CONSTANT)
+        __m256d v = _mm256_loadu_pd(x + i);
+        __m256d vs, vc;
+        int fix = outOfRange256(v, 1.0e8);
+        sinCos256(v, &vs, &vc);
+        _mm256_storeu_pd(s + i, vs);
+        _mm256_storeu_pd(c + i, vc);
+        for (k = 0; fix != 0; k++, fix >>= 1)
         {
-            if (f->isPositive[i] == 1)
-            {
-                constantSum += ((Constant *)f->args[i])->value;
-            } else
+            if (fix & 1)
             {
-                constantSum -= ((Constant *)f->args[i])->value;
+                s[i + k] = sin(v[k]);
+                c[i + k] = cos(v[k]);
             }
-        } else
-        {
-            EVALABLE *arg = copyEvalable(f->args[i]);
-            addSumChainArg(optimized, arg, f->isPositive[i]);
         }
     }
-    if (optimized->argCount == 0)
+    for (; i < n; i++)
     {
-        destroySumChain(optimized);
-        destroySumChain(f);
-        return (EVALABLE *)createConstant(constantSum);
+        ldouble_t v = x[i];
+        s[i] = sin(v);
+        c[i] = cos(v);
     }
-    if (constantSum != 0)
+}
+
+void vectorSin(const ldouble_t *x, ldouble_t *y, int n)
+{
+    int i, k;
+    for (i = 0; i + 4 <= n; i += 4)
     {
-        addSumChainArg(optimized, (EVALABLE *)createConstant(constantSum), 1);
+        __m256d v = _mm256_loadu_pd(x + i);
+        __m256d vs, vc;
+        int fix = outOfRange256(v, 1.0e8);
+        sinCos256(v, &vs, &vc);
+        _mm256_storeu_pd(y + i, vs);
+        for (k = 0; fix != 0; k++, fix >>= 1)
+        {
+            if (fix & 1)
+                y[i + k] = sin(v[k]);
+        }
+    }
+    for (; i < n; i++)
+    {
+        y[i] = sin(x[i]);
     }
-    destroySumChain(f);
-    return (EVALABLE *)optimized;
 }
 
-EVALABLE *optimizeMulChain(MulChain *m)
+void vectorCos(const ldouble_t *x, ldouble_t *y, int n)
 {
-    int i;
-    ldouble_t constantMul = 1;
-    MulChain *optimized;
-    for (i = 0; i < m->argCount; i++)
+    int i, k;
+    for (i = 0; i + 4 <= n; i += 4)
     {
-        m->args[i] = optimize(m->args[i]);
+        __m256d v = _mm256_loadu_pd(x + i);
+        __m256d vs, vc;
+        int fix = outOfRange256(v, 1.0e8);
+        sinCos256(v, &vs, &vc);
+        _mm256_storeu_pd(y + i, vc);
+        for (k = 0; fix != 0; k++, fix >>= 1)
+        {
+            if (fix & 1)
+                y[i + k] = cos(v[k]);
+        }
     }
-    optimized = createMulChain();
-    for (i = 0; i < m->argCount; i++)
+    for (; i < n; i++)
     {
-        if (EVALTYPE(m->args[i]) == CONSTANT)
-        {
-            if (m->isDivided[i] == 1)
-            {
-                constantMul /= ((Constant *)m->args[i])->value;
-            } else
-            {
-                constantMul *= ((Constant *)m->args[i])->value;
-            }
-        } else
+        y[i] = cos(x[i]);
+    }
+}
+
+void vectorTan(const ldouble_t *x, ldouble_t *y, int n)
+{
+    int i, k;
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        __m256d v = _mm256_loadu_pd(x + i);
+        __m256d vs, vc;
+        int fix = outOfRange256(v, 1.0e8);
+        sinCos256(v, &vs, &vc);
+        _mm256_storeu_pd(y + i, _mm256_div_pd(vs, vc));
+        for (k = 0; fix != 0; k++, fix >>= 1)
         {
-            EVALABLE *arg = copyEvalable(m->args[i]);
-            addMulChainArg(optimized, arg, m->isDivided[i]);
+            if (fix & 1)
+                y[i + k] = tan(v[k]);
         }
     }
-    if (optimized->argCount == 0)
+    for (; i < n; i++)
     {
-        destroyMulChain(optimized);
-        destroyMulChain(m);
-        return (EVALABLE *)createConstant(constantMul);
+        y[i] = tan(x[i]);
     }
-    if (constantMul != 1)
+}
+
+void vectorExp(const ldouble_t *x, ldouble_t *y, int n)
+{
+    int i, k;
+    for (i = 0; i + 4 <= n; i += 4)
     {
-        addMulChainArg(optimized, (EVALABLE *)createConstant(constantMul), 0);
+        __m256d v = _mm256_loadu_pd(x + i);
+        int fix = outOfRange256(v, 708.0);
+        _mm256_storeu_pd(y + i, exp256(v));
+        for (k = 0; fix != 0; k++, fix >>= 1)
+        {
+            if (fix & 1)
+                y[i + k] = exp(v[k]);
+        }
+    }
+    for (; i < n; i++)
+    {
+        y[i] = exp(x[i]);
     }
-    destroyMulChain(m);
-    return (EVALABLE *)optimized;
 }
 
-EVALABLE *optimizeExponential(Exponential *e)
+void vectorLog(const ldouble_t *x, ldouble_t *y, int n)
 {
-    e->base = optimize(e->base);
-    e->exponent = optimize(e->exponent);
-    if (EVALTYPE(e->base) != CONSTANT || EVALTYPE(e->exponent) != CONSTANT)
-        return (EVALABLE *)e;
+    int i, k;
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        __m256d v = _mm256_loadu_pd(x + i);
+        /* zero, negative, denormal, inf and nan values go to libm */
+        int fix = _mm256_movemask_pd(_mm256_cmp_pd(v, _mm256_set1_pd(2.2250738585072014e-308), _CMP_NGE_UQ)) |
+                  _mm256_movemask_pd(_mm256_cmp_pd(v, _mm256_set1_pd(1.7976931348623157e308), _CMP_NLE_UQ));
+        _mm256_storeu_pd(y + i, log256(v));
+        for (k = 0; fix != 0; k++, fix >>= 1)
+        {
+            if (fix & 1)
+                y[i + k] = log(v[k]);
+        }
+    }
+    for (; i < n; i++)
+    {
+        y[i] = log(x[i]);
+    }
+}
 
-    ldouble_t base = ((Constant *)e->base)->value;
-    ldouble_t exponent = ((Constant *)e->exponent)->value;
-    destroyExponential(e);
-    return (EVALABLE *)createConstant(pow(base, exponent));
+#else
+
+void vectorSinCos(const ldouble_t *x, ldouble_t *s, ldouble_t *c, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        ldouble_t v = x[i];
+        s[i] = sin(v);
+        c[i] = cos(v);
+    }
 }
 
-EVALABLE *optimizeLogarithm(Logarithm *l)
+void vectorSin(const ldouble_t *x, ldouble_t *y, int n)
 {
-    l->base = optimize(l->base);
-    l->value = optimize(l->value);
-    if (EVALTYPE(l->base) != CONSTANT || EVALTYPE(l->value) != CONSTANT)
-        return (EVALABLE *)l;
+    int i;
+    for (i = 0; i < n; i++)
+        y[i] = sin(x[i]);
+}
 
-    ldouble_t base = ((Constant *)l->base)->value;
-    ldouble_t value = ((Constant *)l->value)->value;
-    destroyLogarithm(l);
-    return (EVALABLE *)createConstant(log(value) / log(base));
+void vectorCos(const ldouble_t *x, ldouble_t *y, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        y[i] = cos(x[i]);
 }
 
-EVALABLE *optimizeTrigonometric(Trigonometric *t)
+void vectorTan(const ldouble_t *x, ldouble_t *y, int n)
 {
-    t->arg = optimize(t->arg);
-    if (EVALTYPE(t->arg) != CONSTANT)
-        return (EVALABLE *)t;
+    int i;
+    for (i = 0; i < n; i++)
+        y[i] = tan(x[i]);
+}
 
-    ldouble_t val = ((Constant *)t->arg)->value;
-    ldouble_t result = 0;
+void vectorExp(const ldouble_t *x, ldouble_t *y, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        y[i] = exp(x[i]);
+}
+
+void vectorLog(const ldouble_t *x, ldouble_t *y, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        y[i] = log(x[i]);
+}
+
+#endif
+
+/* Batch evaluation */
+
+/*
+ * The batch evaluation functions evaluate an expression for a block of
+ * values at once. Each node is visited once per block instead of once per
+ * value, and the work of each node is a plain loop over the block.
+ *
+ * The node functions take at most EVAL_BATCH_SIZE values, the temporary
+ * results of the child nodes are kept on the stack.
+ * The results are the same as calling evaluate() for each value.
+*/
+void evaluateBlock(EVALABLE *e, const ldouble_t *x, ldouble_t *y, int n);
+void evaluateConstantBatch(Constant *c, const ldouble_t *x, ldouble_t *y, int n);
+void evaluateVariableBatch(Variable *v, const ldouble_t *x, ldouble_t *y, int n);
+void evaluateSumChainBatch(SumChain *f, const ldouble_t *x, ldouble_t *y, int n);
+void evaluateMulChainBatch(MulChain *m, const ldouble_t *x, ldouble_t *y, int n);
+void evaluateExponentialBatch(Exponential *e, const ldouble_t *x, ldouble_t *y, int n);
+void evaluateLogarithmBatch(Logarithm *l, const ldouble_t *x, ldouble_t *y, int n);
+void evaluateTrigonometricBatch(Trigonometric *t, const ldouble_t *x, ldouble_t *y, int n);
+void evaluateInverseTrigonometricBatch(InverseTrigonometric *it, const ldouble_t *x, ldouble_t *y, int n);
+void evaluateSharedBatch(Shared *sh, const ldouble_t *x, ldouble_t *y, int n);
+void evaluatePolynomialBatch(Polynomial *p, const ldouble_t *x, ldouble_t *y, int n);
+
+/*
+ * The values of the shared subexpressions for the current block, each
+ * shared subexpression is evaluated once per block. evaluateBatch()
+ * starts a new generation for each block, a slot holds the values of the
+ * block when its stamp is the current generation. The buffers belong to
+ * the thread and are kept for the next calls, a slot gets its buffer the
+ * first time it is used and the buffer does not move after that.
+*/
+typedef struct _BatchSlots {
+    unsigned long generation;
+    int slotCount;
+    ldouble_t **values;
+    unsigned long *stamps;
+} BatchSlots;
+
+_Thread_local BatchSlots batchSlots = {0, 0, NULL, NULL};
+
+/* The buffer of the slot, it is created the first time */
+ldouble_t *batchSlot(int slot)
+{
+    int i;
+    if (slot >= batchSlots.slotCount)
+    {
+        int count = MAX(slot + 1, 2 * batchSlots.slotCount);
+        batchSlots.values = (ldouble_t **)realloc(batchSlots.values, count * sizeof(ldouble_t *));
+        batchSlots.stamps = (unsigned long *)realloc(batchSlots.stamps, count * sizeof(unsigned long));
+        for (i = batchSlots.slotCount; i < count; i++)
+        {
+            batchSlots.values[i] = NULL;
+            batchSlots.stamps[i] = 0;
+        }
+        batchSlots.slotCount = count;
+    }
+    if (batchSlots.values[slot] == NULL)
+    {
+        batchSlots.values[slot] = (ldouble_t *)malloc(EVAL_BATCH_SIZE * sizeof(ldouble_t));
+    }
+    return batchSlots.values[slot];
+}
+
+/*
+ * Evaluate the expression for each of the given values
+ *
+ * Parameters:
+ * - e: The expression to be evaluated
+ * - x: The values to be used in the expression
+ * - y: The results, y[i] = f(x[i])
+ * - n: The number of values
+*/
+void evaluateBatch(EVALABLE *e, const ldouble_t *x, ldouble_t *y, int n);
+
+/*
+ * Evaluate the expression for each of the given values of x, the other
+ * variables have the same values for all of them
+ *
+ * Parameters:
+ * - e: The expression to be evaluated
+ * - values: The values of the variables, values[0] is not used
+ * - x: The values of x
+ * - y: The results, y[i] = f(x[i])
+ * - n: The number of values
+*/
+void evaluateBatchVariables(EVALABLE *e, const ldouble_t *values, const ldouble_t *x, ldouble_t *y, int n);
+
+void evaluateConstantBatch(Constant *c, const ldouble_t *x, ldouble_t *y, int n)
+{
+    int i;
+    UNUSED(x);
+    for (i = 0; i < n; i++)
+    {
+        y[i] = c->value;
+    }
+}
+
+void evaluateVariableBatch(Variable *v, const ldouble_t *x, ldouble_t *y, int n)
+{
+    int i;
+    if (v->index == 0)
+    {
+        memcpy(y, x, n * sizeof(ldouble_t));
+        return;
+    }
+    for (i = 0; i < n; i++)
+    {
+        y[i] = variableValue(v->index, 0, variableValues);
+    }
+}
+
+void evaluateSumChainBatch(SumChain *f, const ldouble_t *x, ldouble_t *y, int n)
+{
+    ldouble_t temp[EVAL_BATCH_SIZE];
+    int i, j;
+    if (f->argCount == 0 || f->args[0] == NULL)
+    {
+        for (j = 0; j < n; j++)
+        {
+            y[j] = 0;
+        }
+        return;
+    }
+    evaluateBlock(f->args[0], x, y, n);
+    if (f->isPositive[0] != 1)
+    {
+        for (j = 0; j < n; j++)
+        {
+            y[j] = -y[j];
+        }
+    }
+    for (i = 1; i < f->argCount && f->args[i] != NULL; i++)
+    {
+        evaluateBlock(f->args[i], x, temp, n);
+        if (f->isPositive[i] == 1)
+        {
+            for (j = 0; j < n; j++)
+            {
+                y[j] += temp[j];
+            }
+        } else {
+            for (j = 0; j < n; j++)
+            {
+                y[j] -= temp[j];
+            }
+        }
+    }
+}
+
+void evaluateMulChainBatch(MulChain *m, const ldouble_t *x, ldouble_t *y, int n)
+{
+    ldouble_t temp[EVAL_BATCH_SIZE];
+    int i, j;
+    if (m->argCount == 0 || m->args[0] == NULL)
+    {
+        for (j = 0; j < n; j++)
+        {
+            y[j] = 1;
+        }
+        return;
+    }
+    evaluateBlock(m->args[0], x, y, n);
+    if (m->isDivided[0] == 1)
+    {
+        for (j = 0; j < n; j++)
+        {
+            y[j] = 1 / y[j];
+        }
+    }
+    for (i = 1; i < m->argCount && m->args[i] != NULL; i++)
+    {
+        evaluateBlock(m->args[i], x, temp, n);
+        if (m->isDivided[i] == 1)
+        {
+            for (j = 0; j < n; j++)
+            {
+                y[j] /= temp[j];
+            }
+        } else {
+            for (j = 0; j < n; j++)
+            {
+                y[j] *= temp[j];
+            }
+        }
+    }
+}
+
+void evaluateExponentialBatch(Exponential *e, const ldouble_t *x, ldouble_t *y, int n)
+{
+    ldouble_t temp[EVAL_BATCH_SIZE];
+    int j;
+    switch (e->powerType)
+    {
+        case INTEGER_POWER:
+            evaluateBlock(e->base, x, y, n);
+            for (j = 0; j < n; j++)
+            {
+                y[j] = integerPower(y[j], e->integerExponent);
+            }
+            return;
+        case RECIPROCAL:
+            evaluateBlock(e->base, x, y, n);
+            for (j = 0; j < n; j++)
+            {
+                y[j] = 1 / y[j];
+            }
+            return;
+        case SQUARE_ROOT:
+            evaluateBlock(e->base, x, y, n);
+            for (j = 0; j < n; j++)
+            {
+                y[j] = sqrt(y[j]);
+            }
+            return;
+        case NATURAL_EXPONENTIAL:
+            evaluateBlock(e->exponent, x, y, n);
+            vectorExp(y, y, n);
+            return;
+        default:
+            break;
+    }
+    evaluateBlock(e->base, x, y, n);
+    evaluateBlock(e->exponent, x, temp, n);
+    for (j = 0; j < n; j++)
+    {
+        y[j] = pow(y[j], temp[j]);
+    }
+}
+
+void evaluateLogarithmBatch(Logarithm *l, const ldouble_t *x, ldouble_t *y, int n)
+{
+    ldouble_t temp[EVAL_BATCH_SIZE];
+    int j;
+    evaluateBlock(l->value, x, y, n);
+    evaluateBlock(l->base, x, temp, n);
+    vectorLog(y, y, n);
+    vectorLog(temp, temp, n);
+    for (j = 0; j < n; j++)
+    {
+        y[j] = (double)y[j] / (double)temp[j];
+    }
+}
+
+void evaluateTrigonometricBatch(Trigonometric *t, const ldouble_t *x, ldouble_t *y, int n)
+{
+    int j;
+    if (t->sincosSlot >= 0)
+    {
+        ldouble_t *sines = batchSlot(t->sincosSlot);
+        ldouble_t *cosines = batchSlot(t->sincosSlot + 1);
+        if (batchSlots.stamps[t->sincosSlot] != batchSlots.generation)
+        {
+            evaluateBlock(t->arg, x, y, n);
+            vectorSinCos(y, sines, cosines, n);
+            batchSlots.stamps[t->sincosSlot] = batchSlots.generation;
+        }
+        for (j = 0; j < n; j++)
+        {
+            y[j] = fusedTrigonometric(t->trigType, sines[j], cosines[j]);
+        }
+        return;
+    }
+    evaluateBlock(t->arg, x, y, n);
+    /* the reciprocals are taken in double like 1 / sin(v) in evaluateTrigonometric() */
     switch (t->trigType)
     {
         case SIN:
-            result = sin(val);
+            vectorSin(y, y, n);
             break;
         case COS:
-            result = cos(val);
+            vectorCos(y, y, n);
             break;
         case TAN:
-            result = tan(val);
+            vectorTan(y, y, n);
             break;
         case CSC:
-            result = 1 / sin(val);
+            vectorSin(y, y, n);
+            for (j = 0; j < n; j++)
+                y[j] = 1 / (double)y[j];
             break;
         case SEC:
-            result = 1 / cos(val);
+            vectorCos(y, y, n);
+            for (j = 0; j < n; j++)
+                y[j] = 1 / (double)y[j];
             break;
         case COT:
-            result = 1 / tan(val);
+            vectorTan(y, y, n);
+            for (j = 0; j < n; j++)
+                y[j] = 1 / (double)y[j];
             break;
     }
-    destroyTrigonometric(t);
-    return (EVALABLE *)createConstant(result);
 }
 
-EVALABLE *optimizeInverseTrigonometric(InverseTrigonometric *it)
+void evaluateInverseTrigonometricBatch(InverseTrigonometric *it, const ldouble_t *x, ldouble_t *y, int n)
 {
-    it->arg = optimize(it->arg);
-    if (EVALTYPE(it->arg) != CONSTANT)
-        return (EVALABLE *)it;
-    
-    ldouble_t val = ((Constant *)it->arg)->value;
-    ldouble_t result = 0;
+    int j;
+    evaluateBlock(it->arg, x, y, n);
     switch (it->trigType)
     {
         case ASIN:
-            result = asin(val);
+            for (j = 0; j < n; j++)
+                y[j] = asin(y[j]);
             break;
         case ACOS:
-            result = acos(val);
+            for (j = 0; j < n; j++)
+                y[j] = acos(y[j]);
             break;
         case ATAN:
-            result = atan(val);
+            for (j = 0; j < n; j++)
+                y[j] = atan(y[j]);
             break;
         case ACSC:
-            result = asin(1 / val);
+            for (j = 0; j < n; j++)
+                y[j] = asin(1 / y[j]);
             break;
         case ASEC:
-            result = acos(1 / val);
+            for (j = 0; j < n; j++)
+                y[j] = acos(1 / y[j]);
             break;
         case ACOT:
-            result = atan(1 / val);
+            for (j = 0; j < n; j++)
+                y[j] = atan(1 / y[j]);
             break;
     }
-    destroyInverseTrigonometric(it);
-    return (EVALABLE *)createConstant(result);
 }
 
-/* Parser functions */
-
-/* 
- * Parse the expression from the input string
- *
- * The parser function is responsible for parsing the expression from the input string
- * and creating the necessary EvalAble structs to represent the expression.
- *
- * Parameters:
- * - input: The input string to be parsed
- * - e: The pointer to the EvalAble struct that will be created
- * - s: The status code
- * Returns:
- * - The position of the input string after the expression
-*/
-char *parseExpression(char *input, EVALABLE **e, StatusCode *s);
-char *parseLogarithm(char *input, EVALABLE **e, StatusCode *s);
-char *parseInsideParantheses(char *input, EVALABLE **e, StatusCode *s);
-char *parseTrigonometric(char *input, EVALABLE **e, StatusCode *s);
-char *parseInverseTrigonometric(char *input, EVALABLE **e, StatusCode *s);
-
-char *parseTrigonometric(char *input, EVALABLE **e, StatusCode *s)
+void evaluateBlock(EVALABLE *e, const ldouble_t *x, ldouble_t *y, int n)
 {
-    if (s->code != 0)
-        return input;
-    TrigonometricType type;
-    EVALABLE *arg;
-    if (strncmp(input, "sin", 3) == 0)
-        type = SIN;
-    else if (strncmp(input, "cos", 3) == 0)
-        type = COS;
-    else if (strncmp(input, "tan", 3) == 0)
-        type = TAN;
-    else if (strncmp(input, "csc", 3) == 0)
-        type = CSC;
-    else if (strncmp(input, "sec", 3) == 0)
-        type = SEC;
-    else if (strncmp(input, "cot", 3) == 0)
-        type = COT;
-    else
-        return input;
-    input += 3;
-    if (input[0] != '(')
+    switch (EVALTYPE(e))
     {
-        s->code = 2;
-        s->expected = '(';
-        s->pos = input;
-        return input;
+        case CONSTANT:
+            evaluateConstantBatch((Constant *)e, x, y, n);
+            break;
+        case VARIABLE:
+            evaluateVariableBatch((Variable *)e, x, y, n);
+            break;
+        case EXPONENTIAL:
+            evaluateExponentialBatch((Exponential *)e, x, y, n);
+            break;
+        case TRIGONOMETRIC:
+            evaluateTrigonometricBatch((Trigonometric *)e, x, y, n);
+            break;
+        case INVERSE_TRIGONOMETRIC:
+            evaluateInverseTrigonometricBatch((InverseTrigonometric *)e, x, y, n);
+            break;
+        case LOGARITHM:
+            evaluateLogarithmBatch((Logarithm *)e, x, y, n);
+            break;
+        case SUM_CHAIN:
+            evaluateSumChainBatch((SumChain *)e, x, y, n);
+            break;
+        case MUL_CHAIN:
+            evaluateMulChainBatch((MulChain *)e, x, y, n);
+            break;
+        case SHARED:
+            evaluateSharedBatch((Shared *)e, x, y, n);
+            break;
+        case POLYNOMIAL:
+            evaluatePolynomialBatch((Polynomial *)e, x, y, n);
+            break;
     }
-    input = parseInsideParantheses(input, &arg, s);
-    *e = (EVALABLE *)createTrigonometric(type, arg);
-    return input;
 }
 
-char *parseInverseTrigonometric(char *input, EVALABLE **e, StatusCode *s)
+void evaluateSharedBatch(Shared *sh, const ldouble_t *x, ldouble_t *y, int n)
 {
-    if (s->code != 0)
-        return input;
-    InverseTrigonometricType type;
-    EVALABLE *arg;
-    if (strncmp(input, "asin", 4) == 0)
-        type = ASIN;
-    else if (strncmp(input, "acos", 4) == 0)
-        type = ACOS;
-    else if (strncmp(input, "atan", 4) == 0)
-        type = ATAN;
-    else if (strncmp(input, "acsc", 4) == 0)
-        type = ACSC;
-    else if (strncmp(input, "asec", 4) == 0)
-        type = ASEC;
-    else if (strncmp(input, "acot", 4) == 0)
-        type = ACOT;
-    else
-        return input;
-    input += 4;
-    if (input[0] != '(')
+    ldouble_t *values = batchSlot(sh->slot);
+    if (batchSlots.stamps[sh->slot] != batchSlots.generation)
     {
-        s->code = 2;
-        s->expected = '(';
-        s->pos = input;
-        return input;
+        evaluateBlock(sh->expr, x, values, n);
+        batchSlots.stamps[sh->slot] = batchSlots.generation;
     }
-    input = parseInsideParantheses(input, &arg, s);
-    *e = (EVALABLE *)createInverseTrigonometric(type, arg);
-    return input;
+    memcpy(y, values, n * sizeof(ldouble_t));
 }
 
-char *parseInsideParantheses(char *input, EVALABLE **e, StatusCode *s)
+void evaluatePolynomialBatch(Polynomial *p, const ldouble_t *x, ldouble_t *y, int n)
 {
-    if (s->code != 0)
-        return input;
-    if (input[0] != '(')
+    int i, j;
+    for (j = 0; j < n; j++)
     {
-        s->code = 2;
-        s->expected = '(';
-        s->pos = input;
-        return input;
+        y[j] = p->coefficients[p->degree];
     }
-    int i = 1;
-    int paranthesesCount = 1;
-    while (paranthesesCount > 0 && input[i] != '\0')
+    for (i = p->degree - 1; i >= 0; i--)
     {
-        if (input[i] == '(')
+        ldouble_t coefficient = p->coefficients[i];
+        if (p->centers == NULL)
         {
-            paranthesesCount++;
-        }
-        else if (input[i] == ')')
+            for (j = 0; j < n; j++)
+            {
+                y[j] = y[j] * x[j] + coefficient;
+            }
+        } else
         {
-            paranthesesCount--;
+            ldouble_t center = p->centers[i];
+            for (j = 0; j < n; j++)
+            {
+                y[j] = y[j] * (x[j] - center) + coefficient;
+            }
         }
-        i++;
     }
-    if (paranthesesCount > 0)
+}
+
+void evaluateBatch(EVALABLE *e, const ldouble_t *x, ldouble_t *y, int n)
+{
+    int i;
+    for (i = 0; i < n; i += EVAL_BATCH_SIZE)
     {
-        s->code = 2;
-        s->expected = ')';
-        s->pos = input + i;
-        return input;
+        batchSlots.generation++;
+        evaluateBlock(e, x + i, y + i, MIN(EVAL_BATCH_SIZE, n - i));
     }
+}
 
-    input[i - 1] = '\0';
-    parseExpression(input + 1, e, s);
-    input += i;
-    return input;
+void evaluateBatchVariables(EVALABLE *e, const ldouble_t *values, const ldouble_t *x, ldouble_t *y, int n)
+{
+    const ldouble_t *previous = variableValues;
+    variableValues = values;
+    evaluateBatch(e, x, y, n);
+    variableValues = previous;
 }
 
-char *parseLogarithm(char *input, EVALABLE **e, StatusCode *s)
+/* Optimize functions */ 
+EVALABLE *optimize(EVALABLE *e);
+EVALABLE *optimizeSumChain(SumChain *f);
+EVALABLE *optimizeMulChain(MulChain *m);
+EVALABLE *optimizeExponential(Exponential *e);
+EVALABLE *optimizeTrigonometric(Trigonometric *t);
+EVALABLE *optimizeInverseTrigonometric(InverseTrigonometric *it);
+EVALABLE *optimizeLogarithm(Logarithm *l);
+
+/*
+ * Check if the expression is the given constant
+ *
+ * Parameters:
+ * - e: The expression
+ * - value: The constant
+ * Returns:
+ * - 1 if the expression is a Constant with the given value, 0 otherwise
+*/
+int isConstantValue(EVALABLE *e, ldouble_t value);
+
+/*
+ * Check if two expressions are the same, i.e. sin(x)+2 and sin(x)+2.
+ * The arguments of the chains are compared in order so x*2 and 2*x
+ * are not the same, after the optimization they are.
+ *
+ * Parameters:
+ * - a: The first expression
+ * - b: The second expression
+ * Returns:
+ * - 1 if the expressions are the same, 0 otherwise
+*/
+int equalEvalable(EVALABLE *a, EVALABLE *b);
+
+/* 
+ * Optimize functions for each type of expression
+ *
+ * The optimization functions are responsible for simplifying the expression
+ * by evaluating the constants and optimizing the expressions that can be
+ * simplified.
+ *
+ * Besides the constants the chains are simplified algebraically:
+ * - The nested chains are flattened, x+(y-z) is x+y-z and x*(y/z) is x*y/z
+ * - The like terms are collected, x+2*x is 3*x and x-x disappears
+ * - The powers of the same base are collected, x*x*x is x^(3) and x/x disappears
+ * - The identities are removed, x*0 is 0, x*1 is x, x+0 is x, x^(1) is x,
+ *   x^(0) is 1 and log_(x)(x) is 1
+ * The values where the original expression is undefined are not kept,
+ * i.e. x/x is 1 for x = 0 too.
+ *
+ * Also the optimization functions are responsible for freeing the memory and
+ * creating a new expression that is optimized if necessary.
+ *
+ * Parameters:
+ * - e: The expression to be optimized
+ *   The expression can be any type of expression
+ * Returns:
+ * - The optimized expression
+*/
+EVALABLE *optimize(EVALABLE *e)
 {
-    if (s->code != 0)
-        return input;
-    if (strncmp(input, "log", 3) != 0)
+    switch (EVALTYPE(e))
     {
-        return input;
+        case CONSTANT:
+        case VARIABLE:
+        case SHARED:
+        case POLYNOMIAL:
+            return e;
+        case EXPONENTIAL:
+            return optimizeExponential((Exponential *)e);
+        case TRIGONOMETRIC:
+            return optimizeTrigonometric((Trigonometric *)e);
+        case INVERSE_TRIGONOMETRIC:
+            return optimizeInverseTrigonometric((InverseTrigonometric *)e);
+        case LOGARITHM:
+            return optimizeLogarithm((Logarithm *)e);
+        case MUL_CHAIN:
+            return optimizeMulChain((MulChain *)e);
+        case SUM_CHAIN:
+            return optimizeSumChain((SumChain *)e);
+        default:
+            return NULL;
     }
-    input += 3;
-    if (input[0] != '_')
+}
+
+int isConstantValue(EVALABLE *e, ldouble_t value)
+{
+    return EVALTYPE(e) == CONSTANT && ((Constant *)e)->value == value;
+}
+
+int equalEvalable(EVALABLE *a, EVALABLE *b)
+{
+    int i;
+    while (EVALTYPE(a) == SHARED)
     {
-        s->code = 2;
-        s->expected = '_';
-        s->pos = input;
-        return input;
+        a = ((Shared *)a)->expr;
     }
-    input++;
-    EVALABLE *base;
-    EVALABLE *value;
-    input = parseInsideParantheses(input, &base, s);
-    if (input[0] != '(')
+    while (EVALTYPE(b) == SHARED)
     {
-        s->code = 2;
-        s->expected = '(';
-        s->pos = input;
-        return input;
+        b = ((Shared *)b)->expr;
+    }
+    if (a == b)
+        return 1;
+    if (EVALTYPE(a) != EVALTYPE(b))
+        return 0;
+    switch (EVALTYPE(a))
+    {
+        case CONSTANT:
+            return ((Constant *)a)->value == ((Constant *)b)->value;
+        case VARIABLE:
+            return ((Variable *)a)->index == ((Variable *)b)->index;
+        case EXPONENTIAL:
+            return equalEvalable(((Exponential *)a)->base, ((Exponential *)b)->base)
+                && equalEvalable(((Exponential *)a)->exponent, ((Exponential *)b)->exponent);
+        case LOGARITHM:
+            return equalEvalable(((Logarithm *)a)->base, ((Logarithm *)b)->base)
+                && equalEvalable(((Logarithm *)a)->value, ((Logarithm *)b)->value);
+        case TRIGONOMETRIC:
+            return ((Trigonometric *)a)->trigType == ((Trigonometric *)b)->trigType
+                && equalEvalable(((Trigonometric *)a)->arg, ((Trigonometric *)b)->arg);
+        case INVERSE_TRIGONOMETRIC:
+            return ((InverseTrigonometric *)a)->trigType == ((InverseTrigonometric *)b)->trigType
+                && equalEvalable(((InverseTrigonometric *)a)->arg, ((InverseTrigonometric *)b)->arg);
+        case SUM_CHAIN:
+        case MUL_CHAIN:
+            /* SumChain and MulChain have the same layout */
+            if (((SumChain *)a)->argCount != ((SumChain *)b)->argCount)
+                return 0;
+            for (i = 0; i < ((SumChain *)a)->argCount; i++)
+            {
+                if (((SumChain *)a)->isPositive[i] != ((SumChain *)b)->isPositive[i]
+                    || !equalEvalable(((SumChain *)a)->args[i], ((SumChain *)b)->args[i]))
+                {
+                    return 0;
+                }
+            }
+            return 1;
+        case POLYNOMIAL:
+            if (((Polynomial *)a)->degree != ((Polynomial *)b)->degree
+                || (((Polynomial *)a)->centers == NULL) != (((Polynomial *)b)->centers == NULL))
+                return 0;
+            for (i = 0; i <= ((Polynomial *)a)->degree; i++)
+            {
+                if (((Polynomial *)a)->coefficients[i] != ((Polynomial *)b)->coefficients[i])
+                    return 0;
+                if (((Polynomial *)a)->centers != NULL && i < ((Polynomial *)a)->degree
+                    && ((Polynomial *)a)->centers[i] != ((Polynomial *)b)->centers[i])
+                    return 0;
+            }
+            return 1;
+        default:
+            return 0;
     }
-    input = parseInsideParantheses(input, &value, s);
-    *e = (EVALABLE *)createLogarithm(base, value);
-    return input;
 }
 
+/* In order to change the highest degree that a sum is turned into a
+ * Polynomial with, change the value of POLYNOMIAL_MAX_DEGREE.
+ * i.e. gcc -DPOLYNOMIAL_MAX_DEGREE=16 analysis.c -o analysis -lm -pthread
+*/
+#ifndef POLYNOMIAL_MAX_DEGREE
+#define POLYNOMIAL_MAX_DEGREE 32
+#endif
+
 /*
- * Macro for checking if the argument is available
- * If the argument is available, the input is set to the previous character
- * and the current character is set to '*' to evaluate the expressions 
- * like 2x as 2*x.
+ * Find the coefficients of the expression as a polynomial in x. The
+ * products are only multiplied out when at most one of their factors has
+ * more than one term, so (x-1)^(10) is not turned into a sum that loses
+ * precision near x = 1.
  *
- * (Creating a new variable called isArgAvailable is not necessary, arg can
- * be compared to NULL to check if the argument is available. But this is 
- * more readable and less error-prone.)
+ * Parameters:
+ * - e: The expression
+ * - coefficients: POLYNOMIAL_MAX_DEGREE + 1 values, a_0 ... a_n are written
+ * Returns:
+ * - The degree, -1 if the expression is not such a polynomial
 */
-#define CHECK_ARG_AVAILABLE()              \
-    if (isArgAvailable)                    \
-    {                                      \
-        input--;                           \
-        input[0] = '*';                    \
-        continue;                          \
-    }
-
-char *parseExpression(char *input, EVALABLE **e, StatusCode *s)
+int polynomialCoefficients(EVALABLE *e, ldouble_t *coefficients)
 {
-    if (s->code != 0)
-        return input;
-    SumChain *f = createSumChain();
-    MulChain *m = createMulChain();
-    EVALABLE *arg = NULL;
-    int isPositive = 1;
-    int isDivided = 0;
-    int isArgAvailable = 0;
-    while (input[0])
+    ldouble_t term[POLYNOMIAL_MAX_DEGREE + 1];
+    ldouble_t product[POLYNOMIAL_MAX_DEGREE + 1];
+    int degree = 0, termDegree, terms, multipleTerms = 0;
+    int i, j, k;
+    for (i = 0; i <= POLYNOMIAL_MAX_DEGREE; i++)
     {
-        if (s->code != 0)
-            return input;
-        if (input[0] == ' ')
-        {
-            input++;
-        }
-        else if (strncmp(input, "log", 3) == 0)
-        {
-            CHECK_ARG_AVAILABLE();
-            input = parseLogarithm(input, &arg, s);
-            isArgAvailable = 1;
-        }
-        else if (strncmp(input, "ln", 2) == 0)
-        {
-            CHECK_ARG_AVAILABLE();
-            input += 2;
-            if (input[0] != '(')
-            {
-                s->code = 2;
-                s->expected = '(';
-                s->pos = input;
-                return input;
-            }
-            input = parseInsideParantheses(input, &arg, s);
-            arg = (EVALABLE *)createLogarithm((EVALABLE *)createConstant(M_E), arg);
-            isArgAvailable = 1;
-        }
-        else if (
-            strncmp(input, "sin", 3) == 0 || 
-            strncmp(input, "cos", 3) == 0 || 
-            strncmp(input, "tan", 3) == 0 || 
-            strncmp(input, "csc", 3) == 0 || 
-            strncmp(input, "sec", 3) == 0 || 
-            strncmp(input, "cot", 3) == 0)
-        {
-            CHECK_ARG_AVAILABLE();
-            input = parseTrigonometric(input, &arg, s);
-            isArgAvailable = 1;
-        }
-        else if (
-            strncmp(input, "asin", 4) == 0 ||
-            strncmp(input, "acos", 4) == 0 ||
-            strncmp(input, "atan", 4) == 0 ||
-            strncmp(input, "acsc", 4) == 0 ||
-            strncmp(input, "asec", 4) == 0 ||
-            strncmp(input, "acot", 4) == 0)
-        {
-            CHECK_ARG_AVAILABLE();
-            input = parseInverseTrigonometric(input, &arg, s);
-            isArgAvailable = 1;
-        }
-        else if (input[0] == '(')
+        coefficients[i] = 0;
+    }
+    switch (EVALTYPE(e))
+    {
+        case CONSTANT:
+            coefficients[0] = ((Constant *)e)->value;
+            return 0;
+        case VARIABLE:
+            /* the other variables are not constants of a polynomial of x */
+            if (((Variable *)e)->index != 0)
+                return -1;
+            coefficients[1] = 1;
+            return 1;
+        case EXPONENTIAL:
         {
-            CHECK_ARG_AVAILABLE();
-            input = parseInsideParantheses(input, &arg, s);
-            isArgAvailable = 1;
+            Exponential *power = (Exponential *)e;
+            ldouble_t exponent;
+            if (EVALTYPE(power->base) != VARIABLE || ((Variable *)power->base)->index != 0
+                || EVALTYPE(power->exponent) != CONSTANT)
+                return -1;
+            exponent = ((Constant *)power->exponent)->value;
+            if (exponent < 0 || exponent > POLYNOMIAL_MAX_DEGREE || exponent != (int)exponent)
+                return -1;
+            coefficients[(int)exponent] = 1;
+            return (int)exponent;
         }
-        else if (input[0] >= '0' && input[0] <= '9')
+        case POLYNOMIAL:
+            if (((Polynomial *)e)->centers != NULL || ((Polynomial *)e)->degree > POLYNOMIAL_MAX_DEGREE)
+                return -1;
+            expandPolynomial((Polynomial *)e, coefficients);
+            return ((Polynomial *)e)->degree;
+        case SHARED:
+            return polynomialCoefficients(((Shared *)e)->expr, coefficients);
+        case SUM_CHAIN:
         {
-            CHECK_ARG_AVAILABLE();
-            ldouble_t value = 0;
-            while (input[0] >= '0' && input[0] <= '9')
-            {
-                value = value * 10 + (input[0] - '0');
-                input++;
-            }
-            if (input[0] == '.')
+            SumChain *f = (SumChain *)e;
+            for (i = 0; i < f->argCount && f->args[i] != NULL; i++)
             {
-                input++;
-                ldouble_t decimal = 0;
-                ldouble_t divider = 10;
-                while (input[0] >= '0' && input[0] <= '9')
+                termDegree = polynomialCoefficients(f->args[i], term);
+                if (termDegree < 0)
+                    return -1;
+                for (j = 0; j <= termDegree; j++)
                 {
-                    decimal += (input[0] - '0') / divider;
-                    divider *= 10;
-                    input++;
+                    coefficients[j] += f->isPositive[i] == 1 ? term[j] : -term[j];
                 }
-                value += decimal;
+                degree = MAX(degree, termDegree);
             }
-            arg = (EVALABLE *)createConstant(value);
-            isArgAvailable = 1;
-        }
-        else if (input[0] == '^')
-        {
-            input++;
-            EVALABLE *exponent;
-            input = parseInsideParantheses(input, &exponent, s);
-            if (s->code != 0)
-                return input;
-            arg = (EVALABLE *)createExponential(arg, exponent);
-            isArgAvailable = 1;
-        }
-        else if (input[0] == 'x')
-        {
-            CHECK_ARG_AVAILABLE();
-            input++;
-            arg = (EVALABLE *)createVariable();
-            isArgAvailable = 1;
-        }
-        else if (input[0] == 'e')
-        {
-            CHECK_ARG_AVAILABLE();
-            input++;
-            arg = (EVALABLE *)createConstant(M_E);
-            isArgAvailable = 1;
-        }
-        else if (strncmp(input, "pi", 2) == 0 || (strncmp(input, "PI", 2) == 0))
-        {
-            CHECK_ARG_AVAILABLE();
-            input += 2;
-            arg = (EVALABLE *)createConstant(M_PI);
-            isArgAvailable = 1;
+            break;
         }
-        else if (input[0] == '+' || input[0] == '-')
+        case MUL_CHAIN:
         {
-            if (isArgAvailable)
+            MulChain *m = (MulChain *)e;
+            coefficients[0] = 1;
+            for (i = 0; i < m->argCount && m->args[i] != NULL; i++)
             {
-                addMulChainArg(m, arg, isDivided);
-                arg = NULL;
-                EVALABLE *val;
-                if (m->argCount == 1)
-                {
-                    val = copyEvalable(m->args[0]);
-                    destroyMulChain(m);
-                }
-                else
-                {
-                    val = (EVALABLE *)m;
-                }
-                addSumChainArg(f, val, isPositive);
-                if (input[0] == '+')
-                {
-                    isPositive = 1;
-                }
-                else if (input[0] == '-')
+                if (m->isDivided[i] == 1)
                 {
-                    isPositive = 0;
+                    if (EVALTYPE(m->args[i]) != CONSTANT)
+                        return -1;
+                    for (j = 0; j <= degree; j++)
+                    {
+                        coefficients[j] /= ((Constant *)m->args[i])->value;
+                    }
+                    continue;
                 }
-                m = createMulChain();
-                input++;
-                isArgAvailable = 0;
-            }
-            else 
-            {
-                if (input[0] == '+')
+                termDegree = polynomialCoefficients(m->args[i], term);
+                if (termDegree < 0 || degree + termDegree > POLYNOMIAL_MAX_DEGREE)
+                    return -1;
+                terms = 0;
+                for (j = 0; j <= termDegree; j++)
                 {
-                    isPositive = 1;
+                    terms += term[j] != 0;
                 }
-                else if (input[0] == '-')
+                if (terms > 1 && multipleTerms++ > 0)
+                    return -1;
+                for (j = 0; j <= degree + termDegree; j++)
                 {
-                    isPositive = 0;
+                    product[j] = 0;
                 }
-                /* make - -> -1* */ 
-                if (input[0] == '-')
+                for (j = 0; j <= degree; j++)
                 {
-                    addMulChainArg(m, (EVALABLE *)createConstant(-1), 0);
-                    isPositive = 0;
+                    for (k = 0; k <= termDegree; k++)
+                    {
+                        product[j + k] += coefficients[j] * term[k];
+                    }
                 }
-                input++;
+                degree += termDegree;
+                memcpy(coefficients, product, (degree + 1) * sizeof(ldouble_t));
             }
+            break;
         }
-        else if (input[0] == '*')
-        {
-            addMulChainArg(m, arg, isDivided);
-            arg = NULL;
-            isDivided = 0;
-            input++;
-            isArgAvailable = 0;
-        }
-        else if (input[0] == '/')
-        {
-            addMulChainArg(m, arg, isDivided);
-            arg = NULL;
-            isDivided = 1;
-            input++;
-            isArgAvailable = 0;
-        }
-        else 
-        {
-            s->code = 1;
-            s->pos = input;
-            return input;
-        }
-    }
-    if (arg != NULL)
-    {
-        addMulChainArg(m, arg, isDivided);
-    }
-    EVALABLE *val;
-    if (m->argCount == 1)
-    {
-        val = copyEvalable(m->args[0]);
-        destroyMulChain(m);
-    }
-    else
-    {
-        val = (EVALABLE *)m;
-    }
-    addSumChainArg(f, (EVALABLE *)val, isPositive);
-    EVALABLE *result;
-    if (f->argCount == 1)
-    {
-        result = copyEvalable(f->args[0]);
-        destroySumChain(f);
+        default:
+            return -1;
     }
-    else
+    while (degree > 0 && coefficients[degree] == 0)
     {
-        result = (EVALABLE *)f;
+        degree--;
     }
-
-    *e = result;
-    return input;
+    return degree;
 }
 
-
-/* Prototypes for solvers */
-ldouble_t solveBisection(EVALABLE *e, ldouble_t a, ldouble_t b, ldouble_t epsilon);
-ldouble_t solveRegulaFalsi(EVALABLE *e, ldouble_t a, ldouble_t b, ldouble_t epsilon);
-ldouble_t solveNewtonRaphson(EVALABLE *e, ldouble_t x0, ldouble_t epsilon);
-
-/* Integral function prototypes */
-ldouble_t integrateTrapez(EVALABLE *e, ldouble_t a, ldouble_t b, int n);
-ldouble_t integrateSimpson13(EVALABLE *e, ldouble_t a, ldouble_t b, int n);
-ldouble_t integrateSimpson38(EVALABLE *e, ldouble_t a, ldouble_t b, int n);
-
-
-ldouble_t solveBisection(EVALABLE *e, ldouble_t a, ldouble_t b, ldouble_t epsilon)
+/* Add a copy of the term to the chain, the constants are summed instead */
+void addSumTerm(SumChain *f, EVALABLE *term, int isPositive, ldouble_t *constantSum)
 {
-    ldouble_t fa = evaluate(e, a);
-    ldouble_t fb = evaluate(e, b);
-    ldouble_t c = 0;
-    if (fa * fb > 0)
-    {
-        return NAN;
-    }
-    while ((b - a) > epsilon)
+    if (EVALTYPE(term) == CONSTANT)
     {
-        c = (a + b) / 2;
-        ldouble_t fc = evaluate(e, c);
-        if (ABS(fc) < epsilon)
+        if (isPositive)
         {
-            return c;
-        }
-        else if (fa * fc < 0)
+            *constantSum += ((Constant *)term)->value;
+        } else
         {
-            b = c;
-            fb = fc;
-        } else {
-            a = c;
-            fa = fc;
+            *constantSum -= ((Constant *)term)->value;
         }
+        return;
     }
-    return c;
+    addSumChainArg(f, copyEvalable(term), isPositive);
 }
 
-ldouble_t solveRegulaFalsi(EVALABLE *e, ldouble_t a, ldouble_t b, ldouble_t epsilon)
+/* Add a copy of the factor to the chain, the constants are multiplied instead */
+void addMulFactor(MulChain *m, EVALABLE *factor, int isDivided, ldouble_t *constantMul)
 {
-    ldouble_t fa = evaluate(e, a);
-    ldouble_t fb = evaluate(e, b);
-    ldouble_t c = 0;
-    if (fa * fb > 0)
+    if (EVALTYPE(factor) == CONSTANT)
     {
-        return NAN;
+        if (isDivided)
+        {
+            *constantMul /= ((Constant *)factor)->value;
+        } else
+        {
+            *constantMul *= ((Constant *)factor)->value;
+        }
+        return;
     }
-    while ((b - a) > epsilon)
+    addMulChainArg(m, copyEvalable(factor), isDivided);
+}
+
+/* 3 * x * y = 3 * (x * y), returns a new x * y and sets the coefficient to 3 */
+EVALABLE *splitCoefficient(EVALABLE *term, ldouble_t *coefficient)
+{
+    MulChain *m = (MulChain *)term;
+    MulChain *rest;
+    int i, constant = -1;
+    *coefficient = 1;
+    if (EVALTYPE(term) != MUL_CHAIN)
+        return copyEvalable(term);
+    for (i = 0; i < m->argCount; i++)
     {
-        c = (a * fb - b * fa) / (fb - fa);
-        ldouble_t fc = evaluate(e, c);
-        if (ABS(fc) < epsilon)
+        if (EVALTYPE(m->args[i]) == CONSTANT && m->isDivided[i] == 0)
         {
-            return c;
+            constant = i;
         }
-        else if (fa * fc < 0)
+    }
+    if (constant == -1)
+        return copyEvalable(term);
+    *coefficient = ((Constant *)m->args[constant])->value;
+    if (m->argCount == 2 && m->isDivided[1 - constant] == 0)
+        return copyEvalable(m->args[1 - constant]);
+    rest = createMulChain();
+    for (i = 0; i < m->argCount; i++)
+    {
+        if (i != constant)
         {
-            b = c;
-            fb = fc;
-        } else {
-            a = c;
-            fa = fc;
+            addMulChainArg(rest, copyEvalable(m->args[i]), m->isDivided[i]);
         }
     }
-    return c;
+    return (EVALABLE *)rest;
 }
 
-ldouble_t solveNewtonRaphson(EVALABLE *e, ldouble_t x0, ldouble_t epsilon)
+/* coefficient * e, e is used in the result */
+EVALABLE *scaleExpression(EVALABLE *e, ldouble_t coefficient)
 {
-    ldouble_t x = x0;
-    ldouble_t fx = evaluate(e, x);
-    ldouble_t dfx = (evaluate(e, x + epsilon) - fx) / epsilon;
-    while (ABS(fx) > epsilon)
+    MulChain *m;
+    if (coefficient == 1)
+        return e;
+    if (EVALTYPE(e) == MUL_CHAIN)
     {
-        x = x - fx / dfx;
-        fx = evaluate(e, x);
-        dfx = (evaluate(e, x + epsilon) - fx) / epsilon;
+        m = (MulChain *)e;
+    } else
+    {
+        m = createMulChain();
+        addMulChainArg(m, e, 0);
     }
-    return x;
+    addMulChainArg(m, (EVALABLE *)createConstant(coefficient), 0);
+    return (EVALABLE *)m;
 }
 
-ldouble_t integrateTrapez(EVALABLE *e, ldouble_t a, ldouble_t b, int n)
+/* x^(2) is x with exponent 2, anything else is itself with exponent 1 */
+EVALABLE *splitPower(EVALABLE *factor, ldouble_t *exponent)
 {
-    ldouble_t h = (b - a) / n;
-    ldouble_t sum = 0;
-    int i;
-    for (i = 1; i < n; i++)
+    if (EVALTYPE(factor) == EXPONENTIAL && EVALTYPE(((Exponential *)factor)->exponent) == CONSTANT)
     {
-        sum += evaluate(e, a + i * h);
+        *exponent = ((Constant *)((Exponential *)factor)->exponent)->value;
+        return ((Exponential *)factor)->base;
     }
-    return h * (evaluate(e, a) + evaluate(e, b) + 2 * sum) / 2;
+    *exponent = 1;
+    return factor;
 }
 
-ldouble_t integrateSimpson13(EVALABLE *e, ldouble_t a, ldouble_t b, int n)
+EVALABLE *optimizeSumChain(SumChain *f)
 {
-    if (n % 2 != 0)
+    int i, j;
+    ldouble_t constantSum = 0;
+    SumChain *flat, *optimized;
+    EVALABLE **rests;
+    ldouble_t *coefficients;
+    int *used;
+    for (i = 0; i < f->argCount; i++)
     {
-        printf("n must be even for Simpson's 1/3 rule.\n");
-        return NAN;
+        f->args[i] = optimize(f->args[i]);
     }
-    ldouble_t h = (b - a) / n;
-    ldouble_t sum1 = 0;
-    ldouble_t sum2 = 0;
-    int i;
-    for (i = 1; i < n; i++)
+
+    /* a + (b - c) = a + b - c, the nested chains are already flat */
+    flat = createSumChain();
+    for (i = 0; i < f->argCount; i++)
     {
-        if (i % 2 == 0)
+        if (EVALTYPE(f->args[i]) == SUM_CHAIN)
         {
-            sum1 += evaluate(e, a + i * h);
+            SumChain *inner = (SumChain *)f->args[i];
+            for (j = 0; j < inner->argCount; j++)
+            {
+                addSumTerm(flat, inner->args[j], inner->isPositive[j] == f->isPositive[i], &constantSum);
+            }
         } else
         {
-            sum2 += evaluate(e, a + i * h);
+            addSumTerm(flat, f->args[i], f->isPositive[i], &constantSum);
+        }
+    }
+    destroySumChain(f);
+
+    /* 2*x + x - 3*x = 0 */
+    rests = malloc(sizeof(EVALABLE *) * (flat->argCount + 1));
+    coefficients = malloc(sizeof(ldouble_t) * (flat->argCount + 1));
+    used = calloc(flat->argCount + 1, sizeof(int));
+    for (i = 0; i < flat->argCount; i++)
+    {
+        rests[i] = splitCoefficient(flat->args[i], &coefficients[i]);
+        if (flat->isPositive[i] == 0)
+        {
+            coefficients[i] = -coefficients[i];
+        }
+    }
+    optimized = createSumChain();
+    for (i = 0; i < flat->argCount; i++)
+    {
+        ldouble_t coefficient = coefficients[i];
+        int count = 1;
+        if (used[i])
+            continue;
+        for (j = i + 1; j < flat->argCount; j++)
+        {
+            if (!used[j] && equalEvalable(rests[i], rests[j]))
+            {
+                coefficient += coefficients[j];
+                used[j] = 1;
+                count++;
+            }
+        }
+        if (count == 1)
+        {
+            addSumChainArg(optimized, copyEvalable(flat->args[i]), flat->isPositive[i]);
+        } else if (coefficient != 0)
+        {
+            EVALABLE *term = scaleExpression(copyEvalable(rests[i]), coefficient < 0 ? -coefficient : coefficient);
+            addSumChainArg(optimized, term, coefficient > 0);
+        }
+    }
+    for (i = 0; i < flat->argCount; i++)
+    {
+        destroy(rests[i]);
+    }
+    free(rests);
+    free(coefficients);
+    free(used);
+    destroySumChain(flat);
+
+    if (optimized->argCount == 0)
+    {
+        destroySumChain(optimized);
+        return (EVALABLE *)createConstant(constantSum);
+    }
+    if (constantSum != 0)
+    {
+        addSumChainArg(optimized, (EVALABLE *)createConstant(constantSum), 1);
+    }
+    if (optimized->argCount == 1 && optimized->isPositive[0] == 1)
+    {
+        EVALABLE *single = copyEvalable(optimized->args[0]);
+        destroySumChain(optimized);
+        return single;
+    }
+
+    /* x^(2) - 3*x + 2 is evaluated as (x - 3) * x + 2 */
+    if (optimized->argCount > 1)
+    {
+        ldouble_t coefficients[POLYNOMIAL_MAX_DEGREE + 1];
+        int degree = polynomialCoefficients((EVALABLE *)optimized, coefficients);
+        if (degree >= 2)
+        {
+            destroySumChain(optimized);
+            return (EVALABLE *)createPolynomial(degree, coefficients, NULL);
         }
     }
-    return (h / 3) * (evaluate(e, a) + evaluate(e, b) + 2 * sum1 + 4 * sum2);
+    return (EVALABLE *)optimized;
 }
 
-ldouble_t integrateSimpson38(EVALABLE *e, ldouble_t a, ldouble_t b, int n)
+EVALABLE *optimizeMulChain(MulChain *m)
 {
-    ldouble_t sum = 0;
-    ldouble_t h = (b - a) / n;
-    int i;
-    for (i = 0; i < n; i++)
+    int i, j;
+    ldouble_t constantMul = 1;
+    MulChain *flat, *optimized;
+    EVALABLE **bases;
+    ldouble_t *exponents;
+    int *used;
+    for (i = 0; i < m->argCount; i++)
+    {
+        m->args[i] = optimize(m->args[i]);
+    }
+
+    /* a * (b / c) = a * b / c, the nested chains are already flat */
+    flat = createMulChain();
+    for (i = 0; i < m->argCount; i++)
+    {
+        if (EVALTYPE(m->args[i]) == MUL_CHAIN)
+        {
+            MulChain *inner = (MulChain *)m->args[i];
+            for (j = 0; j < inner->argCount; j++)
+            {
+                addMulFactor(flat, inner->args[j], inner->isDivided[j] != m->isDivided[i], &constantMul);
+            }
+        } else
+        {
+            addMulFactor(flat, m->args[i], m->isDivided[i], &constantMul);
+        }
+    }
+    destroyMulChain(m);
+    if (constantMul == 0)
     {
-        b = a + h;
-        sum += (b - a) / 8 * (evaluate(e, a) + 3 * evaluate(e, (a + (b-a)/3)) + 3 * evaluate(e, (a + 2*(b-a)/3)) + evaluate(e, b));
-        a = b;
+        destroyMulChain(flat);
+        return (EVALABLE *)createConstant(0);
     }
-    return sum;
+
+    /* x * x^(2) / x = x^(2) */
+    bases = malloc(sizeof(EVALABLE *) * (flat->argCount + 1));
+    exponents = malloc(sizeof(ldouble_t) * (flat->argCount + 1));
+    used = calloc(flat->argCount + 1, sizeof(int));
+    for (i = 0; i < flat->argCount; i++)
+    {
+        bases[i] = splitPower(flat->args[i], &exponents[i]);
+        if (flat->isDivided[i] == 1)
+        {
+            exponents[i] = -exponents[i];
+        }
+    }
+    optimized = createMulChain();
+    for (i = 0; i < flat->argCount; i++)
+    {
+        ldouble_t exponent = exponents[i];
+        int count = 1;
+        if (used[i])
+            continue;
+        for (j = i + 1; j < flat->argCount; j++)
+        {
+            if (!used[j] && equalEvalable(bases[i], bases[j]))
+            {
+                exponent += exponents[j];
+                used[j] = 1;
+                count++;
+            }
+        }
+        if (count == 1)
+        {
+            addMulChainArg(optimized, copyEvalable(flat->args[i]), flat->isDivided[i]);
+        } else if (exponent == 1 || exponent == -1)
+        {
+            addMulChainArg(optimized, copyEvalable(bases[i]), exponent < 0);
+        } else if (exponent != 0)
+        {
+            EVALABLE *power = (EVALABLE *)createExponential(
+                copyEvalable(bases[i]),
+                (EVALABLE *)createConstant(exponent < 0 ? -exponent : exponent)
+            );
+            addMulChainArg(optimized, power, exponent < 0);
+        }
+    }
+    free(bases);
+    free(exponents);
+    free(used);
+    destroyMulChain(flat);
+
+    if (optimized->argCount == 0)
+    {
+        destroyMulChain(optimized);
+        return (EVALABLE *)createConstant(constantMul);
+    }
+    if (constantMul != 1)
+    {
+        addMulChainArg(optimized, (EVALABLE *)createConstant(constantMul), 0);
+    }
+    if (optimized->argCount == 1 && optimized->isDivided[0] == 0)
+    {
+        EVALABLE *single = copyEvalable(optimized->args[0]);
+        destroyMulChain(optimized);
+        return single;
+    }
+    return (EVALABLE *)optimized;
 }
 
-/* Matrix implementation */
+EVALABLE *optimizeExponential(Exponential *e)
+{
+    e->base = optimize(e->base);
+    e->exponent = optimize(e->exponent);
+    classifyExponential(e);
+    if (isConstantValue(e->exponent, 1))
+    {
+        EVALABLE *base = copyEvalable(e->base);
+        destroyExponential(e);
+        return base;
+    }
+    if (isConstantValue(e->exponent, 0) || isConstantValue(e->base, 1))
+    {
+        destroyExponential(e);
+        return (EVALABLE *)createConstant(1);
+    }
+    if (EVALTYPE(e->base) != CONSTANT || EVALTYPE(e->exponent) != CONSTANT)
+        return (EVALABLE *)e;
 
-typedef struct
+    ldouble_t base = ((Constant *)e->base)->value;
+    ldouble_t exponent = ((Constant *)e->exponent)->value;
+    destroyExponential(e);
+    return (EVALABLE *)createConstant(pow(base, exponent));
+}
+
+EVALABLE *optimizeLogarithm(Logarithm *l)
 {
-    int rows;
-    int cols;
-    ldouble_t **data;
-} Matrix;
+    l->base = optimize(l->base);
+    l->value = optimize(l->value);
+    if (EVALTYPE(l->base) != CONSTANT && equalEvalable(l->base, l->value))
+    {
+        destroyLogarithm(l);
+        return (EVALABLE *)createConstant(1);
+    }
+    if (EVALTYPE(l->base) != CONSTANT || EVALTYPE(l->value) != CONSTANT)
+        return (EVALABLE *)l;
 
-/* 
- * Create a matrix and initialize the values to 0
- *
- * Parameters:
- * - rows: The number of rows
- * - cols: The number of columns
- * Returns:
- * - The created matrix
-*/
-Matrix *createMatrix(int rows, int cols);
+    ldouble_t base = ((Constant *)l->base)->value;
+    ldouble_t value = ((Constant *)l->value)->value;
+    destroyLogarithm(l);
+    return (EVALABLE *)createConstant(log(value) / log(base));
+}
 
-/* 
- * Destroy a matrix and free the memory
- *
- * Parameters:
- * - m: The matrix to be destroyed
-*/
-void destroyMatrix(Matrix *m);
+EVALABLE *optimizeTrigonometric(Trigonometric *t)
+{
+    t->arg = optimize(t->arg);
+    if (EVALTYPE(t->arg) != CONSTANT)
+        return (EVALABLE *)t;
 
-/* 
- * Print the matrix to the console
- *
- * Parameters:
- * - m: The matrix to be printed
-*/
-void printMatrix(Matrix *m);
+    ldouble_t val = ((Constant *)t->arg)->value;
+    ldouble_t result = 0;
+    switch (t->trigType)
+    {
+        case SIN:
+            result = sin(val);
+            break;
+        case COS:
+            result = cos(val);
+            break;
+        case TAN:
+            result = tan(val);
+            break;
+        case CSC:
+            result = 1 / sin(val);
+            break;
+        case SEC:
+            result = 1 / cos(val);
+            break;
+        case COT:
+            result = 1 / tan(val);
+            break;
+    }
+    destroyTrigonometric(t);
+    return (EVALABLE *)createConstant(result);
+}
 
-/* 
- * Copy a matrix
+EVALABLE *optimizeInverseTrigonometric(InverseTrigonometric *it)
+{
+    it->arg = optimize(it->arg);
+    if (EVALTYPE(it->arg) != CONSTANT)
+        return (EVALABLE *)it;
+    
+    ldouble_t val = ((Constant *)it->arg)->value;
+    ldouble_t result = 0;
+    switch (it->trigType)
+    {
+        case ASIN:
+            result = asin(val);
+            break;
+        case ACOS:
+            result = acos(val);
+            break;
+        case ATAN:
+            result = atan(val);
+            break;
+        case ACSC:
+            result = asin(1 / val);
+            break;
+        case ASEC:
+            result = acos(1 / val);
+            break;
+        case ACOT:
+            result = atan(1 / val);
+            break;
+    }
+    destroyInverseTrigonometric(it);
+    return (EVALABLE *)createConstant(result);
+}
+
+/* Common subexpressions */
+
+/*
+ * shareSubexpressions() finds the subexpressions that appear more than
+ * once and makes all the places they appear point to one Shared node, so
+ * the tree becomes a DAG. i.e. in sin(x)^(2)+sin(x)*cos(x)+sin(x) the
+ * three sin(x) become one node.
  *
- * Parameters:
- * - m: The matrix to be copied
- * Returns:
- * - The copied matrix
+ * The nodes are numbered bottom up (hash consing), two nodes get the same
+ * number if they have the same type and the same numbers for their
+ * children, so finding a repeated subexpression is a hash table lookup.
+ * The coefficients and the centers of a Polynomial are numbered as its
+ * children, so the same polynomial is shared too.
+ *
+ * A compiled program, evaluate() and the batch evaluation keep the value
+ * of each Shared node in a slot and evaluate it once per evaluation.
+ *
+ * The Shared nodes inside a Shared node have smaller slots, so the slot
+ * count is found without going into the Shared nodes.
 */
-Matrix *copyMatrix(Matrix *m);
 
-/* 
- * Add two matrices. m1 + scalar * m2
+/*
+ * Share the repeated subexpressions of the expression
  *
  * Parameters:
- * - m1: The first matrix
- * - m2: The second matrix
- * - scalar: The scalar to multiply the second matrix
+ * - e: The expression, it is changed and must not be used after the call
  * Returns:
- * - The result of the addition
+ * - The expression with shared subexpressions
 */
-Matrix *addMatrix(Matrix *m1, Matrix *m2, ldouble_t scalar);
+EVALABLE *shareSubexpressions(EVALABLE *e);
 
-/* 
- * Multiply two matrices. m1 * m2
- *
- * Parameters:
- * - m1: The first matrix
- * - m2: The second matrix
- * Returns:
- * - The result of the multiplication
-*/
-Matrix *multiplyMatrix(Matrix *m1, Matrix *m2);
+typedef struct {
+    EvalAbleType type;
+    int subtype;
+    int childCount;
+    int firstChild;
+    ldouble_t value;
+    unsigned long hash;
+    EVALABLE **location;
+    Shared *shared;
+} ShareEntry;
+
+typedef struct {
+    ShareEntry *entries;
+    int entryCount;
+    int maxEntries;
+    int *children;
+    int childrenCount;
+    int maxChildren;
+    int *table;
+    int tableSize;
+    int nextSlot;
+} ShareContext;
+
+int sharedSlotCount(EVALABLE *e)
+{
+    int count = 0;
+    int i;
+    switch (EVALTYPE(e))
+    {
+        case SHARED:
+            return ((Shared *)e)->slot + 1;
+        case EXPONENTIAL:
+            count = sharedSlotCount(((Exponential *)e)->exponent);
+            return MAX(count, sharedSlotCount(((Exponential *)e)->base));
+        case LOGARITHM:
+            count = sharedSlotCount(((Logarithm *)e)->value);
+            return MAX(count, sharedSlotCount(((Logarithm *)e)->base));
+        case TRIGONOMETRIC:
+            if (((Trigonometric *)e)->sincosSlot >= 0)
+            {
+                count = ((Trigonometric *)e)->sincosSlot + 2;
+            }
+            return MAX(count, sharedSlotCount(((Trigonometric *)e)->arg));
+        case INVERSE_TRIGONOMETRIC:
+            return sharedSlotCount(((InverseTrigonometric *)e)->arg);
+        case SUM_CHAIN:
+        case MUL_CHAIN:
+            for (i = 0; i < ((SumChain *)e)->argCount && ((SumChain *)e)->args[i] != NULL; i++)
+            {
+                int argCount = sharedSlotCount(((SumChain *)e)->args[i]);
+                count = MAX(count, argCount);
+            }
+            return count;
+        default:
+            return 0;
+    }
+}
 
-/* 
- * Multiply a matrix with a scalar. scalar * m
- *
- * Parameters:
- * - m: The matrix
- * - scalar: The scalar
- * Returns:
- * - The result of the multiplication
-*/
-Matrix *multiplyMatrixScalar(Matrix *m, ldouble_t scalar);
+unsigned long hashShareKey(EvalAbleType type, int subtype, const int *children, int childCount, ldouble_t value)
+{
+    /* FNV-1a over the fields of the key */
+    unsigned long hash = 14695981039346656037UL;
+    double v = (double)value + 0.0;
+    unsigned char bytes[sizeof(double)];
+    int i;
+    unsigned int k;
+    hash = (hash ^ (unsigned long)type) * 1099511628211UL;
+    hash = (hash ^ (unsigned long)subtype) * 1099511628211UL;
+    for (i = 0; i < childCount; i++)
+    {
+        hash = (hash ^ (unsigned long)children[i]) * 1099511628211UL;
+    }
+    memcpy(bytes, &v, sizeof(double));
+    for (k = 0; k < sizeof(double); k++)
+    {
+        hash = (hash ^ bytes[k]) * 1099511628211UL;
+    }
+    return hash;
+}
 
-/* 
- * Transpose a matrix
- *
- * Parameters:
- * - m: The matrix
- * Returns:
- * - The transposed matrix
-*/
-Matrix *transposeMatrix(Matrix *m);
+void growShareTable(ShareContext *ctx)
+{
+    int i, j;
+    free(ctx->table);
+    ctx->tableSize *= 2;
+    ctx->table = (int *)malloc(ctx->tableSize * sizeof(int));
+    for (i = 0; i < ctx->tableSize; i++)
+    {
+        ctx->table[i] = -1;
+    }
+    for (i = 0; i < ctx->entryCount; i++)
+    {
+        j = (int)(ctx->entries[i].hash & (unsigned long)(ctx->tableSize - 1));
+        while (ctx->table[j] != -1)
+        {
+            j = (j + 1) & (ctx->tableSize - 1);
+        }
+        ctx->table[j] = i;
+    }
+}
 
-/* 
- * Inverse of a matrix
- *
- * Parameters:
- * - m: The matrix
- * Returns:
- * - The inverse of the matrix
-*/
-Matrix *inverseMatrix(Matrix *m);
+/* Find the number of the key, a new number is added if it is not found. *isNew is set to 1 for a new number */
+int findShareEntry(ShareContext *ctx, EvalAbleType type, int subtype, const int *children, int childCount,
+                   ldouble_t value, EVALABLE **location, int *isNew)
+{
+    unsigned long hash = hashShareKey(type, subtype, children, childCount, value);
+    ShareEntry *entry;
+    int j = (int)(hash & (unsigned long)(ctx->tableSize - 1));
+    while (ctx->table[j] != -1)
+    {
+        entry = &ctx->entries[ctx->table[j]];
+        if (entry->hash == hash && entry->type == type && entry->subtype == subtype &&
+            entry->childCount == childCount && entry->value == value &&
+            (childCount == 0 || memcmp(&ctx->children[entry->firstChild], children, childCount * sizeof(int)) == 0))
+        {
+            *isNew = 0;
+            return ctx->table[j];
+        }
+        j = (j + 1) & (ctx->tableSize - 1);
+    }
 
-/* 
- * Solve a linear system of equations
+    if (ctx->entryCount >= ctx->maxEntries)
+    {
+        ctx->maxEntries *= 2;
+        ctx->entries = (ShareEntry *)realloc(ctx->entries, ctx->maxEntries * sizeof(ShareEntry));
+    }
+    while (ctx->childrenCount + childCount > ctx->maxChildren)
+    {
+        ctx->maxChildren *= 2;
+        ctx->children = (int *)realloc(ctx->children, ctx->maxChildren * sizeof(int));
+    }
+    entry = &ctx->entries[ctx->entryCount];
+    entry->type = type;
+    entry->subtype = subtype;
+    entry->childCount = childCount;
+    entry->firstChild = ctx->childrenCount;
+    entry->value = value;
+    entry->hash = hash;
+    entry->location = location;
+    entry->shared = NULL;
+    if (childCount > 0)
+    {
+        memcpy(&ctx->children[ctx->childrenCount], children, childCount * sizeof(int));
+    }
+    ctx->childrenCount += childCount;
+    ctx->table[j] = ctx->entryCount++;
+    if (2 * ctx->entryCount > ctx->tableSize)
+    {
+        growShareTable(ctx);
+    }
+    *isNew = 1;
+    return ctx->entryCount - 1;
+}
+
+/* Number the node at *location and its children, a repeated node is replaced with the Shared node */
+int numberSubexpression(ShareContext *ctx, EVALABLE **location)
+{
+    EVALABLE *e = *location;
+    int fixedChildren[2] = {0, 0};
+    int *children = fixedChildren;
+    int childCount = 0;
+    int subtype = 0;
+    ldouble_t value = 0;
+    int id, isNew, i;
+    switch (EVALTYPE(e))
+    {
+        case CONSTANT:
+            value = ((Constant *)e)->value;
+            break;
+        case VARIABLE:
+            subtype = ((Variable *)e)->index;
+            break;
+        case SHARED:
+            /* shared by an earlier call, the slot identifies it */
+            subtype = ((Shared *)e)->slot;
+            break;
+        case POLYNOMIAL:
+        {
+            /* the coefficients and the centers are numbered like constants */
+            Polynomial *p = (Polynomial *)e;
+            subtype = 2 * p->degree + (p->centers != NULL);
+            children = (int *)calloc(2 * p->degree + 2, sizeof(int));
+            for (i = 0; i <= p->degree; i++)
+            {
+                children[childCount++] = findShareEntry(ctx, CONSTANT, 0, NULL, 0, p->coefficients[i], NULL, &isNew);
+            }
+            for (i = 0; p->centers != NULL && i < p->degree; i++)
+            {
+                children[childCount++] = findShareEntry(ctx, CONSTANT, 0, NULL, 0, p->centers[i], NULL, &isNew);
+            }
+            break;
+        }
+        case EXPONENTIAL:
+            children[childCount++] = numberSubexpression(ctx, &((Exponential *)e)->base);
+            children[childCount++] = numberSubexpression(ctx, &((Exponential *)e)->exponent);
+            break;
+        case LOGARITHM:
+            children[childCount++] = numberSubexpression(ctx, &((Logarithm *)e)->base);
+            children[childCount++] = numberSubexpression(ctx, &((Logarithm *)e)->value);
+            break;
+        case TRIGONOMETRIC:
+            subtype = ((Trigonometric *)e)->trigType;
+            children[childCount++] = numberSubexpression(ctx, &((Trigonometric *)e)->arg);
+            break;
+        case INVERSE_TRIGONOMETRIC:
+            subtype = ((InverseTrigonometric *)e)->trigType;
+            children[childCount++] = numberSubexpression(ctx, &((InverseTrigonometric *)e)->arg);
+            break;
+        case SUM_CHAIN:
+        case MUL_CHAIN:
+        {
+            /* the sign or the division of an argument is the lowest bit of its number */
+            SumChain *f = (SumChain *)e;
+            children = (int *)calloc(f->argCount + 1, sizeof(int));
+            for (i = 0; i < f->argCount && f->args[i] != NULL; i++)
+            {
+                children[childCount++] = 2 * numberSubexpression(ctx, &f->args[i]) + f->isPositive[i];
+            }
+            break;
+        }
+    }
+
+    id = findShareEntry(ctx, EVALTYPE(e), subtype, children, childCount, value, location, &isNew);
+    if (children != fixedChildren)
+    {
+        free(children);
+    }
+    if (isNew || EVALTYPE(e) == CONSTANT || EVALTYPE(e) == VARIABLE || EVALTYPE(e) == SHARED)
+    {
+        return id;
+    }
+
+    /* a repeated subexpression, the first place it appears becomes shared */
+    ShareEntry *entry = &ctx->entries[id];
+    if (entry->shared == NULL)
+    {
+        entry->shared = createShared(*entry->location, ctx->nextSlot++);
+        *entry->location = (EVALABLE *)entry->shared;
+    }
+    destroy(e);
+    entry->shared->references++;
+    *location = (EVALABLE *)entry->shared;
+    return id;
+}
+
+EVALABLE *shareSubexpressions(EVALABLE *e)
+{
+    ShareContext ctx;
+    int i;
+    ctx.maxEntries = 64;
+    ctx.entries = (ShareEntry *)malloc(ctx.maxEntries * sizeof(ShareEntry));
+    ctx.entryCount = 0;
+    ctx.maxChildren = 64;
+    ctx.children = (int *)malloc(ctx.maxChildren * sizeof(int));
+    ctx.childrenCount = 0;
+    ctx.tableSize = 128;
+    ctx.table = (int *)malloc(ctx.tableSize * sizeof(int));
+    for (i = 0; i < ctx.tableSize; i++)
+    {
+        ctx.table[i] = -1;
+    }
+    ctx.nextSlot = sharedSlotCount(e);
+
+    numberSubexpression(&ctx, &e);
+
+    free(ctx.entries);
+    free(ctx.children);
+    free(ctx.table);
+    return e;
+}
+
+/* Fused sine and cosine */
+
+/*
+ * sin(2x)*cos(2x) + tan(2x) computes the same argument and nearly the same
+ * transcendental three times. fuseTrigonometric() finds the trigonometric
+ * functions of the same argument and gives each group two slots, the
+ * first of them that is evaluated computes the argument once and keeps
+ * sin and cos of it with one sincos call, the others are found from
+ * those two:
+ *   tan = sin / cos, csc = 1 / sin, sec = 1 / cos, cot = cos / sin
  *
- * Parameters:
- * - A: The coefficient matrix
- * - B: The constant matrix
- * Returns:
- * - The solution matrix
+ * The compiled programs and the batch evaluation use the slots, evaluate()
+ * ignores them. tan and cot found this way can differ from tan() in the
+ * last bits.
+ *
+ * It must be called before shareSubexpressions() so that the slots of the
+ * Shared nodes are bigger than the slots of the fused functions.
 */
-Matrix *solveLinearSystem(Matrix *A, Matrix *B);
 
-/* 
- * Calculate the determinant of a matrix
+/*
+ * Fuse the trigonometric functions that have the same argument
  *
  * Parameters:
- * - m: The matrix
+ * - e: The expression, its Trigonometric nodes are changed
  * Returns:
- * - The determinant of the matrix
+ * - The expression
 */
-ldouble_t determinantMatrix(Matrix *m);
+EVALABLE *fuseTrigonometric(EVALABLE *e);
 
-/* 
- * Add a row to another row. r1 = r1 + scalar * r2
- *
- * Parameters:
- * - m: The matrix
- * - r1: The row to be added
- * - r2: The row to be added
- * - scalar: The scalar to multiply the row to be added
-*/
-void addRow(Matrix *m, int r1, int r2, ldouble_t scalar);
+typedef struct {
+    Trigonometric **nodes;
+    int count;
+    int maxNodes;
+} TrigonometricList;
 
-/* 
- * Multiply a row with a scalar. r = scalar * r
- *
- * Parameters:
- * - m: The matrix
- * - r: The row to be multiplied
- * - scalar: The scalar to multiply the row
-*/
-void multiplyRow(Matrix *m, int r, ldouble_t scalar); 
+/* Add the Trigonometric nodes of the expression to the list, Shared nodes are not entered */
+void collectTrigonometric(EVALABLE *e, TrigonometricList *list)
+{
+    int i;
+    switch (EVALTYPE(e))
+    {
+        case TRIGONOMETRIC:
+            if (list->count >= list->maxNodes)
+            {
+                list->maxNodes *= 2;
+                list->nodes = (Trigonometric **)realloc(list->nodes, list->maxNodes * sizeof(Trigonometric *));
+            }
+            list->nodes[list->count++] = (Trigonometric *)e;
+            collectTrigonometric(((Trigonometric *)e)->arg, list);
+            break;
+        case EXPONENTIAL:
+            collectTrigonometric(((Exponential *)e)->base, list);
+            collectTrigonometric(((Exponential *)e)->exponent, list);
+            break;
+        case LOGARITHM:
+            collectTrigonometric(((Logarithm *)e)->base, list);
+            collectTrigonometric(((Logarithm *)e)->value, list);
+            break;
+        case INVERSE_TRIGONOMETRIC:
+            collectTrigonometric(((InverseTrigonometric *)e)->arg, list);
+            break;
+        case SUM_CHAIN:
+        case MUL_CHAIN:
+            for (i = 0; i < ((SumChain *)e)->argCount && ((SumChain *)e)->args[i] != NULL; i++)
+            {
+                collectTrigonometric(((SumChain *)e)->args[i], list);
+            }
+            break;
+        default:
+            break;
+    }
+}
 
-/* 
- * Swap two rows. r1 <-> r2
- *
- * Parameters:
- * - m: The matrix
- * - r1: The first row
- * - r2: The second row
-*/
-void swapRows(Matrix *m, int r1, int r2); 
+EVALABLE *fuseTrigonometric(EVALABLE *e)
+{
+    TrigonometricList list;
+    int nextSlot = sharedSlotCount(e);
+    int i, j;
+    list.maxNodes = 16;
+    list.count = 0;
+    list.nodes = (Trigonometric **)malloc(list.maxNodes * sizeof(Trigonometric *));
+    collectTrigonometric(e, &list);
 
-/* 
- * Add a column to another column. c1 = c1 + scalar * c2
- *
- * Parameters:
- * - m: The matrix
- * - c1: The column to be added
- * - c2: The column to be added
- * - scalar: The scalar to multiply the column to be added
-*/
-void addColumn(Matrix *m, int c1, int c2, ldouble_t scalar);
+    for (i = 0; i < list.count; i++)
+    {
+        int differentTypes = 0;
+        if (list.nodes[i]->sincosSlot >= 0)
+            continue;
+        for (j = i + 1; j < list.count; j++)
+        {
+            if (list.nodes[j]->sincosSlot < 0 && list.nodes[j]->trigType != list.nodes[i]->trigType
+                && equalEvalable(list.nodes[i]->arg, list.nodes[j]->arg))
+            {
+                differentTypes = 1;
+                break;
+            }
+        }
+        /* the same function of the same argument is left to shareSubexpressions() */
+        if (!differentTypes)
+            continue;
+        for (j = i; j < list.count; j++)
+        {
+            if (list.nodes[j]->sincosSlot < 0 && equalEvalable(list.nodes[i]->arg, list.nodes[j]->arg))
+            {
+                list.nodes[j]->sincosSlot = nextSlot;
+            }
+        }
+        nextSlot += 2;
+    }
 
-/* 
- * Multiply a column with a scalar. c = scalar * c
- *
- * Parameters:
- * - m: The matrix
- * - c: The column to be multiplied
- * - scalar: The scalar to multiply the column
-*/
-void multiplyColumn(Matrix *m, int c, ldouble_t scalar);
+    free(list.nodes);
+    return e;
+}
 
-/* 
- * Swap two columns. c1 <-> c2
+/* Symbolic differentiation */
+
+/*
+ * differentiate() builds the derivative of an expression with the usual
+ * rules (sum, product, quotient, chain rule) and optimizes it. The
+ * expression is not changed, the parts of it that appear in the derivative
+ * are copied.
  *
- * Parameters:
- * - m: The matrix
- * - c1: The first column
- * - c2: The second column
+ * The builders below leave out the terms whose derivative is the constant
+ * 0 and the factors that are the constant 1, so that the derivative of a
+ * long chain does not become a chain of zeros.
 */
-void swapColumns(Matrix *m, int c1, int c2);
 
-/* 
- * Solve a linear system of equations using Gaussian elimination
+/*
+ * Differentiate the expression with respect to x
  *
  * Parameters:
- * - m: The augmented matrix
+ * - e: The expression
  * Returns:
- * - The solution matrix
+ * - The optimized derivative, a new expression
 */
-Matrix *gauusElimination(Matrix *m);
+EVALABLE *differentiate(EVALABLE *e);
 
-/* 
- * Solve a linear system of equations using Gauus-Seidel method
+/* The derivative of e without optimization */
+EVALABLE *differentiateNode(EVALABLE *e);
+
+/*
+ * Check if the expression depends on x
  *
  * Parameters:
- * - m: The augmented matrix
- * - x0: The initial solution matrix
- * - epsilon: The error tolerance
+ * - e: The expression
  * Returns:
- * - The solution matrix
+ * - 1 if x appears in the expression, 0 otherwise
 */
-Matrix *gauusSeidel(Matrix *m, Matrix *x0, ldouble_t epsilon);
+int dependsOnVariable(EVALABLE *e);
 
+int dependsOnVariable(EVALABLE *e)
+{
+    int i;
+    switch (EVALTYPE(e))
+    {
+        case CONSTANT:
+            return 0;
+        case VARIABLE:
+            return ((Variable *)e)->index == 0;
+        case EXPONENTIAL:
+            return dependsOnVariable(((Exponential *)e)->base) || dependsOnVariable(((Exponential *)e)->exponent);
+        case LOGARITHM:
+            return dependsOnVariable(((Logarithm *)e)->base) || dependsOnVariable(((Logarithm *)e)->value);
+        case TRIGONOMETRIC:
+            return dependsOnVariable(((Trigonometric *)e)->arg);
+        case INVERSE_TRIGONOMETRIC:
+            return dependsOnVariable(((InverseTrigonometric *)e)->arg);
+        case SHARED:
+            return dependsOnVariable(((Shared *)e)->expr);
+        case POLYNOMIAL:
+            return ((Polynomial *)e)->degree > 0;
+        case SUM_CHAIN:
+        case MUL_CHAIN:
+            /* SumChain and MulChain have the same layout */
+            for (i = 0; i < ((SumChain *)e)->argCount && ((SumChain *)e)->args[i] != NULL; i++)
+            {
+                if (dependsOnVariable(((SumChain *)e)->args[i]))
+                {
+                    return 1;
+                }
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
 
-Matrix *createMatrix(int rows, int cols)
+/* -e */
+EVALABLE *negateExpression(EVALABLE *e)
 {
-    Matrix *m;
+    SumChain *f;
+    if (EVALTYPE(e) == CONSTANT)
+    {
+        ((Constant *)e)->value = -((Constant *)e)->value;
+        return e;
+    }
+    f = createSumChain();
+    addSumChainArg(f, e, 0);
+    return (EVALABLE *)f;
+}
+
+/* outer * inner, both are used in the result */
+EVALABLE *chainRule(EVALABLE *outer, EVALABLE *inner)
+{
+    MulChain *m;
+    if (isConstantValue(inner, 1))
+    {
+        destroy(inner);
+        return outer;
+    }
+    if (isConstantValue(inner, 0))
+    {
+        destroy(outer);
+        return inner;
+    }
+    m = createMulChain();
+    addMulChainArg(m, inner, 0);
+    addMulChainArg(m, outer, 0);
+    return (EVALABLE *)m;
+}
+
+/* e^power, e is used in the result */
+EVALABLE *powerOf(EVALABLE *e, ldouble_t power)
+{
+    return (EVALABLE *)createExponential(e, (EVALABLE *)createConstant(power));
+}
+
+/* ln(e), e is used in the result */
+EVALABLE *naturalLogarithm(EVALABLE *e)
+{
+    return (EVALABLE *)createLogarithm((EVALABLE *)createConstant(M_E), e);
+}
+
+/* (f1 +- f2 +- ...)' = f1' +- f2' +- ... */
+EVALABLE *differentiateSumChain(SumChain *f)
+{
+    SumChain *result = createSumChain();
+    int i;
+    for (i = 0; i < f->argCount && f->args[i] != NULL; i++)
+    {
+        EVALABLE *d = differentiateNode(f->args[i]);
+        if (isConstantValue(d, 0))
+        {
+            destroy(d);
+            continue;
+        }
+        addSumChainArg(result, d, f->isPositive[i]);
+    }
+    if (result->argCount == 0)
+    {
+        destroySumChain(result);
+        return (EVALABLE *)createConstant(0);
+    }
+    return (EVALABLE *)result;
+}
+
+/*
+ * (f1 * f2 * ... / g1 / g2 ...)' is the sum of the terms where one factor
+ * is replaced by its derivative, (1 / g)' = -g' / g^2
+*/
+EVALABLE *differentiateMulChain(MulChain *m)
+{
+    SumChain *result = createSumChain();
     int i, j;
-    m = (Matrix *)malloc(sizeof(Matrix));
-    m->rows = rows;
-    m->cols = cols;
-    m->data = (ldouble_t **)malloc(rows * sizeof(ldouble_t *));
-    for (i = 0; i < rows; i++)
+    for (i = 0; i < m->argCount && m->args[i] != NULL; i++)
+    {
+        EVALABLE *d = differentiateNode(m->args[i]);
+        MulChain *term;
+        if (isConstantValue(d, 0))
+        {
+            destroy(d);
+            continue;
+        }
+        /* the derivative comes first, so the chain does not start with a division */
+        term = createMulChain();
+        addMulChainArg(term, d, 0);
+        for (j = 0; j < m->argCount && m->args[j] != NULL; j++)
+        {
+            if (j != i)
+            {
+                addMulChainArg(term, copyEvalable(m->args[j]), m->isDivided[j]);
+            }
+        }
+        if (m->isDivided[i] == 1)
+        {
+            addMulChainArg(term, powerOf(copyEvalable(m->args[i]), 2), 1);
+        }
+        addSumChainArg(result, (EVALABLE *)term, m->isDivided[i] == 1 ? 0 : 1);
+    }
+    if (result->argCount == 0)
+    {
+        destroySumChain(result);
+        return (EVALABLE *)createConstant(0);
+    }
+    return (EVALABLE *)result;
+}
+
+/*
+ * (u^v)' = v * u^(v - 1) * u'              if v does not depend on x
+ *        = u^v * ln(u) * v'                if u does not depend on x
+ *        = u^v * (v' * ln(u) + v * u' / u) otherwise
+*/
+EVALABLE *differentiateExponential(Exponential *e)
+{
+    int baseDepends = dependsOnVariable(e->base);
+    int exponentDepends = dependsOnVariable(e->exponent);
+    MulChain *m;
+    if (!baseDepends && !exponentDepends)
+    {
+        return (EVALABLE *)createConstant(0);
+    }
+    if (!exponentDepends)
+    {
+        SumChain *power = createSumChain();
+        addSumChainArg(power, copyEvalable(e->exponent), 1);
+        addSumChainArg(power, (EVALABLE *)createConstant(1), 0);
+        m = createMulChain();
+        addMulChainArg(m, copyEvalable(e->exponent), 0);
+        addMulChainArg(m, (EVALABLE *)createExponential(copyEvalable(e->base), (EVALABLE *)power), 0);
+        return chainRule((EVALABLE *)m, differentiateNode(e->base));
+    }
+    if (!baseDepends)
+    {
+        m = createMulChain();
+        addMulChainArg(m, copyEvalable((EVALABLE *)e), 0);
+        addMulChainArg(m, naturalLogarithm(copyEvalable(e->base)), 0);
+        return chainRule((EVALABLE *)m, differentiateNode(e->exponent));
+    }
+
+    SumChain *inner = createSumChain();
+    MulChain *exponentTerm = createMulChain();
+    MulChain *baseTerm = createMulChain();
+    addMulChainArg(exponentTerm, differentiateNode(e->exponent), 0);
+    addMulChainArg(exponentTerm, naturalLogarithm(copyEvalable(e->base)), 0);
+    addMulChainArg(baseTerm, differentiateNode(e->base), 0);
+    addMulChainArg(baseTerm, copyEvalable(e->exponent), 0);
+    addMulChainArg(baseTerm, copyEvalable(e->base), 1);
+    addSumChainArg(inner, (EVALABLE *)exponentTerm, 1);
+    addSumChainArg(inner, (EVALABLE *)baseTerm, 1);
+    m = createMulChain();
+    addMulChainArg(m, copyEvalable((EVALABLE *)e), 0);
+    addMulChainArg(m, (EVALABLE *)inner, 0);
+    return (EVALABLE *)m;
+}
+
+/*
+ * log_b(u) = ln(u) / ln(b)
+ * (log_b(u))' = u' / (u * ln(b))                                      if b does not depend on x
+ *             = (u' / u * ln(b) - ln(u) * b' / b) / ln(b)^2            otherwise
+*/
+EVALABLE *differentiateLogarithm(Logarithm *l)
+{
+    MulChain *m;
+    if (!dependsOnVariable(l->base))
+    {
+        if (!dependsOnVariable(l->value))
+        {
+            return (EVALABLE *)createConstant(0);
+        }
+        m = createMulChain();
+        addMulChainArg(m, differentiateNode(l->value), 0);
+        addMulChainArg(m, copyEvalable(l->value), 1);
+        addMulChainArg(m, naturalLogarithm(copyEvalable(l->base)), 1);
+        return (EVALABLE *)m;
+    }
+
+    SumChain *numerator = createSumChain();
+    MulChain *valueTerm = createMulChain();
+    MulChain *baseTerm = createMulChain();
+    addMulChainArg(valueTerm, differentiateNode(l->value), 0);
+    addMulChainArg(valueTerm, copyEvalable(l->value), 1);
+    addMulChainArg(valueTerm, naturalLogarithm(copyEvalable(l->base)), 0);
+    addMulChainArg(baseTerm, differentiateNode(l->base), 0);
+    addMulChainArg(baseTerm, copyEvalable(l->base), 1);
+    addMulChainArg(baseTerm, naturalLogarithm(copyEvalable(l->value)), 0);
+    addSumChainArg(numerator, (EVALABLE *)valueTerm, 1);
+    addSumChainArg(numerator, (EVALABLE *)baseTerm, 0);
+    m = createMulChain();
+    addMulChainArg(m, (EVALABLE *)numerator, 0);
+    addMulChainArg(m, powerOf(naturalLogarithm(copyEvalable(l->base)), 2), 1);
+    return (EVALABLE *)m;
+}
+
+EVALABLE *differentiateTrigonometric(Trigonometric *t)
+{
+    EVALABLE *outer;
+    MulChain *m;
+    switch (t->trigType)
+    {
+        case SIN:
+            outer = (EVALABLE *)createTrigonometric(COS, copyEvalable(t->arg));
+            break;
+        case COS:
+            outer = negateExpression((EVALABLE *)createTrigonometric(SIN, copyEvalable(t->arg)));
+            break;
+        case TAN:
+            outer = powerOf((EVALABLE *)createTrigonometric(SEC, copyEvalable(t->arg)), 2);
+            break;
+        case CSC:
+            m = createMulChain();
+            addMulChainArg(m, (EVALABLE *)createTrigonometric(CSC, copyEvalable(t->arg)), 0);
+            addMulChainArg(m, (EVALABLE *)createTrigonometric(COT, copyEvalable(t->arg)), 0);
+            outer = negateExpression((EVALABLE *)m);
+            break;
+        case SEC:
+            m = createMulChain();
+            addMulChainArg(m, (EVALABLE *)createTrigonometric(SEC, copyEvalable(t->arg)), 0);
+            addMulChainArg(m, (EVALABLE *)createTrigonometric(TAN, copyEvalable(t->arg)), 0);
+            outer = (EVALABLE *)m;
+            break;
+        case COT:
+            outer = negateExpression(powerOf((EVALABLE *)createTrigonometric(CSC, copyEvalable(t->arg)), 2));
+            break;
+        default:
+            return (EVALABLE *)createConstant(0);
+    }
+    return chainRule(outer, differentiateNode(t->arg));
+}
+
+/*
+ * asin(g)' = g' / (1 - g^2)^0.5,  acsc(g) = asin(1 / g)
+ * atan(g)' = g' / (1 + g^2),      acot(g) = atan(1 / g)
+ * The inverse functions of 1 / g are written without |g|, i.e.
+ * acsc(g)' = -g' / (g^2 * (1 - g^-2)^0.5)
+*/
+EVALABLE *differentiateInverseTrigonometric(InverseTrigonometric *it)
+{
+    SumChain *s = createSumChain();
+    MulChain *m = createMulChain();
+    int negative = 0;
+    addMulChainArg(m, differentiateNode(it->arg), 0);
+    switch (it->trigType)
+    {
+        case ASIN:
+        case ACOS:
+            addSumChainArg(s, (EVALABLE *)createConstant(1), 1);
+            addSumChainArg(s, powerOf(copyEvalable(it->arg), 2), 0);
+            addMulChainArg(m, powerOf((EVALABLE *)s, 0.5), 1);
+            negative = it->trigType == ACOS;
+            break;
+        case ATAN:
+        case ACOT:
+            addSumChainArg(s, powerOf(copyEvalable(it->arg), 2), 1);
+            addSumChainArg(s, (EVALABLE *)createConstant(1), 1);
+            addMulChainArg(m, (EVALABLE *)s, 1);
+            negative = it->trigType == ACOT;
+            break;
+        case ACSC:
+        case ASEC:
+            addSumChainArg(s, (EVALABLE *)createConstant(1), 1);
+            addSumChainArg(s, powerOf(copyEvalable(it->arg), -2), 0);
+            addMulChainArg(m, powerOf(copyEvalable(it->arg), 2), 1);
+            addMulChainArg(m, powerOf((EVALABLE *)s, 0.5), 1);
+            negative = it->trigType == ACSC;
+            break;
+    }
+    if (isConstantValue(m->args[0], 0))
+    {
+        destroyMulChain(m);
+        return (EVALABLE *)createConstant(0);
+    }
+    return negative ? negateExpression((EVALABLE *)m) : (EVALABLE *)m;
+}
+
+/* (a_0 + a_1 x + ... + a_n x^n)' = a_1 + 2 a_2 x + ... + n a_n x^(n-1) */
+EVALABLE *differentiatePolynomial(Polynomial *p)
+{
+    ldouble_t *coefficients;
+    EVALABLE *result;
+    int i;
+    if (p->degree == 0)
+    {
+        return (EVALABLE *)createConstant(0);
+    }
+    coefficients = (ldouble_t *)malloc((p->degree + 1) * sizeof(ldouble_t));
+    expandPolynomial(p, coefficients);
+    for (i = 1; i <= p->degree; i++)
+    {
+        coefficients[i - 1] = i * coefficients[i];
+    }
+    if (p->degree == 1)
+    {
+        result = (EVALABLE *)createConstant(coefficients[0]);
+    } else
+    {
+        result = (EVALABLE *)createPolynomial(p->degree - 1, coefficients, NULL);
+    }
+    free(coefficients);
+    return result;
+}
+
+EVALABLE *differentiateNode(EVALABLE *e)
+{
+    switch (EVALTYPE(e))
+    {
+        case CONSTANT:
+            return (EVALABLE *)createConstant(0);
+        case VARIABLE:
+            /* the other variables are constants for d/dx */
+            return (EVALABLE *)createConstant(((Variable *)e)->index == 0 ? 1 : 0);
+        case EXPONENTIAL:
+            return differentiateExponential((Exponential *)e);
+        case TRIGONOMETRIC:
+            return differentiateTrigonometric((Trigonometric *)e);
+        case INVERSE_TRIGONOMETRIC:
+            return differentiateInverseTrigonometric((InverseTrigonometric *)e);
+        case LOGARITHM:
+            return differentiateLogarithm((Logarithm *)e);
+        case SUM_CHAIN:
+            return differentiateSumChain((SumChain *)e);
+        case MUL_CHAIN:
+            return differentiateMulChain((MulChain *)e);
+        case SHARED:
+            return differentiateNode(((Shared *)e)->expr);
+        case POLYNOMIAL:
+            return differentiatePolynomial((Polynomial *)e);
+        default:
+            return (EVALABLE *)createConstant(0);
+    }
+}
+
+EVALABLE *differentiate(EVALABLE *e)
+{
+    return optimize(differentiateNode(e));
+}
+
+/* Bytecode program implementation */
+
+/*
+ * Walking the EvalAble tree means a switch and a few pointer jumps for
+ * every node on every call. Solvers and integrators evaluate the same
+ * tree thousands of times, so the tree is lowered once into a flat
+ * stack machine program and the program is evaluated instead.
+ *
+ * Constants are pooled in the program, each instruction either pushes a
+ * value onto the stack or pops its operands and pushes the result.
+ * i.e. (x+1)*sin(x) is compiled as:
+ *   VAR, CONST 0, ADD, VAR, SIN, MUL
+ *
+ * The first time a Shared node is compiled its value is stored in a slot
+ * with STORE (the value stays on the stack), the next times it is pushed
+ * from the slot with LOAD.
+ *
+ * An Exponential with a special powerType is one instruction on its base
+ * (POWI, RECIP, SQRT) or its exponent (EXP) instead of POW.
+ *
+ * The first fused trigonometric function of a group (see fuseTrigonometric())
+ * is SINCOS, which pops the argument and keeps its sin and cos in two
+ * slots, and then FUSED_SIN ... FUSED_COT, which push the function from
+ * the slots. The others of the group are only FUSED_SIN ... FUSED_COT.
+ *
+ * A Polynomial is one HORNER (or NEWTON for the Newton form) instruction,
+ * its argument is where the degree is in the constants, the coefficients
+ * and the centers follow it.
+*/
+
+/* In order to change the stack size that is used without allocation
+ * while evaluating a program change the value of PROGRAM_STACK_SIZE.
+ * Programs that need a deeper stack allocate it on each evaluation.
+*/
+#ifndef PROGRAM_STACK_SIZE
+#define PROGRAM_STACK_SIZE 64
+#endif
+
+typedef enum _OpCode {
+    OP_CONST,
+    OP_VAR,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_NEG,
+    OP_RECIP,
+    OP_POW,
+    OP_LOG,
+    OP_SIN,
+    OP_COS,
+    OP_TAN,
+    OP_CSC,
+    OP_SEC,
+    OP_COT,
+    OP_ASIN,
+    OP_ACOS,
+    OP_ATAN,
+    OP_ACSC,
+    OP_ASEC,
+    OP_ACOT,
+    OP_STORE,
+    OP_LOAD,
+    OP_HORNER,
+    OP_NEWTON,
+    OP_POWI,
+    OP_SQRT,
+    OP_EXP,
+    OP_SINCOS,
+    OP_FUSED_SIN,
+    OP_FUSED_COS,
+    OP_FUSED_TAN,
+    OP_FUSED_CSC,
+    OP_FUSED_SEC,
+    OP_FUSED_COT,
+} OpCode;
+
+typedef struct _Instruction {
+    OpCode op;
+    int arg;
+} Instruction;
+
+/*
+ * A program translated into machine code by compileNative(),
+ * functionVariables evaluates one value and batchVariables evaluates
+ * y[i] = f(x[i]) for n values, values holds the other variables.
+*/
+typedef struct _NativeCode {
+    double (*functionVariables)(double x, const double *values);
+    void (*batchVariables)(const double *x, double *y, size_t n, const double *values);
+    void *memory;
+    size_t size;
+} NativeCode;
+
+typedef struct _Program {
+    int codeCount;
+    int maxCode;
+    Instruction *code;
+    int constCount;
+    int maxConsts;
+    ldouble_t *consts;
+    int stackSize;
+    int slotCount;
+    /* 1 + the biggest index of the variables in the program */
+    int variableCount;
+    int *sharedSlots;
+    /* the machine code of the program, NULL if it is run by the interpreter */
+    NativeCode *native;
+} Program;
+
+/*
+ * Compile the expression into a bytecode program
+ *
+ * The expression is not modified and can be destroyed after compiling,
+ * it is best to compile an optimized expression.
+ *
+ * Parameters:
+ * - e: The expression to be compiled
+ * Returns:
+ * - The compiled program
+*/
+Program *compileProgram(EVALABLE *e);
+
+/*
+ * Destroy the program and free the memory
+ *
+ * Parameters:
+ * - p: The program to be destroyed
+*/
+void destroyProgram(Program *p);
+
+/*
+ * Evaluate the program with the given value
+ * Gives the same result as evaluate() on the compiled expression.
+ *
+ * Parameters:
+ * - p: The program to be evaluated
+ * - value: The value to be used in the program
+ * Returns:
+ * - The result of the program
+*/
+ldouble_t evaluateProgram(Program *p, ldouble_t value);
+
+/*
+ * Evaluate the program with the given values of the variables
+ * evaluateProgram() gives NAN for the variables other than x.
+ *
+ * Parameters:
+ * - p: The program to be evaluated
+ * - value: The value of x
+ * - values: The values of the variables, values[i] for the variable with
+ *   index i, values[0] is not used
+ * Returns:
+ * - The result of the program
+*/
+ldouble_t evaluateProgramVariables(Program *p, ldouble_t value, const ldouble_t *values);
+
+/*
+ * Evaluate the program for each of the given values
+ * Uses the machine code of the program when it has one.
+ *
+ * Parameters:
+ * - p: The program to be evaluated
+ * - x: The values to be used in the program
+ * - y: The results, y[i] = f(x[i])
+ * - n: The number of values
+*/
+void evaluateProgramBatch(Program *p, const ldouble_t *x, ldouble_t *y, int n);
+
+/*
+ * Evaluate the program for each of the given values of x, the other
+ * variables have the same values for all of them
+ *
+ * Parameters:
+ * - p: The program to be evaluated
+ * - values: The values of the variables, values[0] is not used
+ * - x: The values of x
+ * - y: The results, y[i] = f(x[i])
+ * - n: The number of values
+*/
+void evaluateProgramBatchVariables(Program *p, const ldouble_t *values, const ldouble_t *x, ldouble_t *y, int n);
+
+/*
+ * Translate the program into x86-64 machine code
+ * Only double precision builds on x86-64 Linux have the JIT, and it can
+ * be turned off with the ANALYSIS_JIT=0 environment variable.
+ *
+ * Parameters:
+ * - p: The program to be translated
+ * Returns:
+ * - The machine code, NULL if the program can not be translated
+*/
+NativeCode *compileNative(Program *p);
+
+/*
+ * Destroy the machine code and free the memory
+ *
+ * Parameters:
+ * - n: The machine code to be destroyed
+*/
+void destroyNative(NativeCode *n);
+
+void emitInstruction(Program *p, OpCode op, int arg, int *depth)
+{
+    if (p->codeCount >= p->maxCode)
+    {
+        p->maxCode *= 2;
+        p->code = (Instruction *)realloc(p->code, p->maxCode * sizeof(Instruction));
+    }
+    p->code[p->codeCount].op = op;
+    p->code[p->codeCount].arg = arg;
+    p->codeCount++;
+
+    /* keep track of the stack depth to know how big the stack must be */
+    switch (op)
+    {
+        case OP_CONST:
+        case OP_VAR:
+        case OP_LOAD:
+        case OP_HORNER:
+        case OP_NEWTON:
+            (*depth)++;
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_POW:
+        case OP_LOG:
+        case OP_SINCOS:
+            (*depth)--;
+            break;
+        case OP_FUSED_SIN:
+        case OP_FUSED_COS:
+        case OP_FUSED_TAN:
+        case OP_FUSED_CSC:
+        case OP_FUSED_SEC:
+        case OP_FUSED_COT:
+            (*depth)++;
+            break;
+        default:
+            break;
+    }
+    if (*depth > p->stackSize)
+    {
+        p->stackSize = *depth;
+    }
+}
+
+int addProgramConstant(Program *p, ldouble_t value)
+{
+    int i;
+    for (i = 0; i < p->constCount; i++)
+    {
+        if (p->consts[i] == value)
+        {
+            return i;
+        }
+    }
+    if (p->constCount >= p->maxConsts)
+    {
+        p->maxConsts *= 2;
+        p->consts = (ldouble_t *)realloc(p->consts, p->maxConsts * sizeof(ldouble_t));
+    }
+    p->consts[p->constCount] = value;
+    return p->constCount++;
+}
+
+/* Add the values one after another without pooling, returns the index of the first one */
+int addProgramConstants(Program *p, const ldouble_t *values, int count)
+{
+    int first = p->constCount;
+    while (p->constCount + count > p->maxConsts)
+    {
+        p->maxConsts *= 2;
+        p->consts = (ldouble_t *)realloc(p->consts, p->maxConsts * sizeof(ldouble_t));
+    }
+    memcpy(p->consts + first, values, count * sizeof(ldouble_t));
+    p->constCount += count;
+    return first;
+}
+
+void compileEvalable(Program *p, EVALABLE *e, int *depth)
+{
+    int i;
+    switch (EVALTYPE(e))
+    {
+        case CONSTANT:
+            emitInstruction(p, OP_CONST, addProgramConstant(p, ((Constant *)e)->value), depth);
+            break;
+        case VARIABLE:
+            emitInstruction(p, OP_VAR, ((Variable *)e)->index, depth);
+            if (((Variable *)e)->index >= p->variableCount)
+            {
+                p->variableCount = ((Variable *)e)->index + 1;
+            }
+            break;
+        case EXPONENTIAL:
+        {
+            Exponential *power = (Exponential *)e;
+            switch (power->powerType)
+            {
+                case INTEGER_POWER:
+                    compileEvalable(p, power->base, depth);
+                    emitInstruction(p, OP_POWI, power->integerExponent, depth);
+                    break;
+                case RECIPROCAL:
+                    compileEvalable(p, power->base, depth);
+                    emitInstruction(p, OP_RECIP, 0, depth);
+                    break;
+                case SQUARE_ROOT:
+                    compileEvalable(p, power->base, depth);
+                    emitInstruction(p, OP_SQRT, 0, depth);
+                    break;
+                case NATURAL_EXPONENTIAL:
+                    compileEvalable(p, power->exponent, depth);
+                    emitInstruction(p, OP_EXP, 0, depth);
+                    break;
+                default:
+                    compileEvalable(p, power->base, depth);
+                    compileEvalable(p, power->exponent, depth);
+                    emitInstruction(p, OP_POW, 0, depth);
+                    break;
+            }
+            break;
+        }
+        case LOGARITHM:
+            compileEvalable(p, ((Logarithm *)e)->value, depth);
+            compileEvalable(p, ((Logarithm *)e)->base, depth);
+            emitInstruction(p, OP_LOG, 0, depth);
+            break;
+        case TRIGONOMETRIC:
+        {
+            Trigonometric *t = (Trigonometric *)e;
+            if (t->sincosSlot < 0)
+            {
+                compileEvalable(p, t->arg, depth);
+                emitInstruction(p, OP_SIN + t->trigType, 0, depth);
+                break;
+            }
+            if (p->sharedSlots[t->sincosSlot] < 0)
+            {
+                compileEvalable(p, t->arg, depth);
+                p->sharedSlots[t->sincosSlot] = p->slotCount;
+                p->slotCount += 2;
+                emitInstruction(p, OP_SINCOS, p->sharedSlots[t->sincosSlot], depth);
+            }
+            emitInstruction(p, OP_FUSED_SIN + t->trigType, p->sharedSlots[t->sincosSlot], depth);
+            break;
+        }
+        case INVERSE_TRIGONOMETRIC:
+            compileEvalable(p, ((InverseTrigonometric *)e)->arg, depth);
+            emitInstruction(p, OP_ASIN + ((InverseTrigonometric *)e)->trigType, 0, depth);
+            break;
+        case SUM_CHAIN:
+        {
+            SumChain *f = (SumChain *)e;
+            if (f->argCount == 0 || f->args[0] == NULL)
+            {
+                emitInstruction(p, OP_CONST, addProgramConstant(p, 0), depth);
+                break;
+            }
+            compileEvalable(p, f->args[0], depth);
+            if (f->isPositive[0] != 1)
+            {
+                emitInstruction(p, OP_NEG, 0, depth);
+            }
+            for (i = 1; i < f->argCount && f->args[i] != NULL; i++)
+            {
+                compileEvalable(p, f->args[i], depth);
+                emitInstruction(p, f->isPositive[i] == 1 ? OP_ADD : OP_SUB, 0, depth);
+            }
+            break;
+        }
+        case MUL_CHAIN:
+        {
+            MulChain *m = (MulChain *)e;
+            if (m->argCount == 0 || m->args[0] == NULL)
+            {
+                emitInstruction(p, OP_CONST, addProgramConstant(p, 1), depth);
+                break;
+            }
+            compileEvalable(p, m->args[0], depth);
+            if (m->isDivided[0] == 1)
+            {
+                emitInstruction(p, OP_RECIP, 0, depth);
+            }
+            for (i = 1; i < m->argCount && m->args[i] != NULL; i++)
+            {
+                compileEvalable(p, m->args[i], depth);
+                emitInstruction(p, m->isDivided[i] == 1 ? OP_DIV : OP_MUL, 0, depth);
+            }
+            break;
+        }
+        case SHARED:
+        {
+            Shared *sh = (Shared *)e;
+            if (p->sharedSlots[sh->slot] >= 0)
+            {
+                emitInstruction(p, OP_LOAD, p->sharedSlots[sh->slot], depth);
+                break;
+            }
+            compileEvalable(p, sh->expr, depth);
+            p->sharedSlots[sh->slot] = p->slotCount++;
+            emitInstruction(p, OP_STORE, p->sharedSlots[sh->slot], depth);
+            break;
+        }
+        case POLYNOMIAL:
+        {
+            Polynomial *poly = (Polynomial *)e;
+            ldouble_t degree = poly->degree;
+            int first = addProgramConstants(p, &degree, 1);
+            addProgramConstants(p, poly->coefficients, poly->degree + 1);
+            if (poly->centers == NULL)
+            {
+                emitInstruction(p, OP_HORNER, first, depth);
+                break;
+            }
+            addProgramConstants(p, poly->centers, poly->degree);
+            emitInstruction(p, OP_NEWTON, first, depth);
+            break;
+        }
+    }
+}
+
+Program *compileProgram(EVALABLE *e)
+{
+    Program *p;
+    int depth = 0;
+    p = (Program *)malloc(sizeof(Program));
+    p->codeCount = 0;
+    p->maxCode = INIT_CHAIN_ARGS * 4;
+    p->code = (Instruction *)malloc(p->maxCode * sizeof(Instruction));
+    p->constCount = 0;
+    p->maxConsts = INIT_CHAIN_ARGS;
+    p->consts = (ldouble_t *)malloc(p->maxConsts * sizeof(ldouble_t));
+    p->stackSize = 0;
+    p->slotCount = 0;
+    p->variableCount = 1;
+    /* the program slot of each Shared slot, -1 until it is compiled */
+    int sharedCount = sharedSlotCount(e);
+    int i;
+    p->sharedSlots = (int *)malloc((sharedCount + 1) * sizeof(int));
+    for (i = 0; i < sharedCount; i++)
+    {
+        p->sharedSlots[i] = -1;
+    }
+    compileEvalable(p, e, &depth);
+    free(p->sharedSlots);
+    p->sharedSlots = NULL;
+    p->native = compileNative(p);
+    return p;
+}
+
+void destroyProgram(Program *p)
+{
+    if (p->native != NULL)
+    {
+        destroyNative(p->native);
+    }
+    free(p->code);
+    free(p->consts);
+    free(p);
+}
+
+ldouble_t evaluateProgram(Program *p, ldouble_t value)
+{
+    return evaluateProgramVariables(p, value, NULL);
+}
+
+ldouble_t evaluateProgramVariables(Program *p, ldouble_t value, const ldouble_t *values)
+{
+    ldouble_t stackBuffer[PROGRAM_STACK_SIZE];
+    ldouble_t slotBuffer[PROGRAM_STACK_SIZE];
+    ldouble_t *stack = stackBuffer;
+    ldouble_t *slots = slotBuffer;
+    ldouble_t result;
+    const Instruction *ip = p->code;
+    const Instruction *end = p->code + p->codeCount;
+    int sp = -1;
+
+#ifdef USE_JIT
+    if (p->native != NULL && (values != NULL || p->variableCount == 1))
+    {
+        return p->native->functionVariables(value, values);
+    }
+#endif
+    if (p->stackSize > PROGRAM_STACK_SIZE)
+    {
+        stack = (ldouble_t *)malloc(p->stackSize * sizeof(ldouble_t));
+    }
+    if (p->slotCount > PROGRAM_STACK_SIZE)
+    {
+        slots = (ldouble_t *)malloc(p->slotCount * sizeof(ldouble_t));
+    }
+    stack[0] = 0;
+
+    for (; ip < end; ip++)
+    {
+        switch (ip->op)
+        {
+            case OP_CONST:
+                stack[++sp] = p->consts[ip->arg];
+                break;
+            case OP_VAR:
+                stack[++sp] = variableValue(ip->arg, value, values);
+                break;
+            case OP_ADD:
+                sp--;
+                stack[sp] += stack[sp + 1];
+                break;
+            case OP_SUB:
+                sp--;
+                stack[sp] -= stack[sp + 1];
+                break;
+            case OP_MUL:
+                sp--;
+                stack[sp] *= stack[sp + 1];
+                break;
+            case OP_DIV:
+                sp--;
+                stack[sp] /= stack[sp + 1];
+                break;
+            case OP_NEG:
+                stack[sp] = -stack[sp];
+                break;
+            case OP_RECIP:
+                stack[sp] = 1 / stack[sp];
+                break;
+            case OP_POW:
+                sp--;
+                stack[sp] = pow(stack[sp], stack[sp + 1]);
+                break;
+            case OP_POWI:
+                stack[sp] = integerPower(stack[sp], ip->arg);
+                break;
+            case OP_SQRT:
+                stack[sp] = sqrt(stack[sp]);
+                break;
+            case OP_EXP:
+                stack[sp] = exp(stack[sp]);
+                break;
+            case OP_SINCOS:
+                sinCos(stack[sp], &slots[ip->arg], &slots[ip->arg + 1]);
+                sp--;
+                break;
+            case OP_FUSED_SIN:
+            case OP_FUSED_COS:
+            case OP_FUSED_TAN:
+            case OP_FUSED_CSC:
+            case OP_FUSED_SEC:
+            case OP_FUSED_COT:
+                stack[++sp] = fusedTrigonometric((TrigonometricType)(ip->op - OP_FUSED_SIN),
+                                                 slots[ip->arg], slots[ip->arg + 1]);
+                break;
+            case OP_LOG:
+                sp--;
+                stack[sp] = log(stack[sp]) / log(stack[sp + 1]);
+                break;
+            case OP_SIN:
+                stack[sp] = sin(stack[sp]);
+                break;
+            case OP_COS:
+                stack[sp] = cos(stack[sp]);
+                break;
+            case OP_TAN:
+                stack[sp] = tan(stack[sp]);
+                break;
+            case OP_CSC:
+                stack[sp] = 1 / sin(stack[sp]);
+                break;
+            case OP_SEC:
+                stack[sp] = 1 / cos(stack[sp]);
+                break;
+            case OP_COT:
+                stack[sp] = 1 / tan(stack[sp]);
+                break;
+            case OP_ASIN:
+                stack[sp] = asin(stack[sp]);
+                break;
+            case OP_ACOS:
+                stack[sp] = acos(stack[sp]);
+                break;
+            case OP_ATAN:
+                stack[sp] = atan(stack[sp]);
+                break;
+            case OP_ACSC:
+                stack[sp] = asin(1 / stack[sp]);
+                break;
+            case OP_ASEC:
+                stack[sp] = acos(1 / stack[sp]);
+                break;
+            case OP_ACOT:
+                stack[sp] = atan(1 / stack[sp]);
+                break;
+            case OP_STORE:
+                slots[ip->arg] = stack[sp];
+                break;
+            case OP_LOAD:
+                stack[++sp] = slots[ip->arg];
+                break;
+            case OP_HORNER:
+            case OP_NEWTON:
+            {
+                const ldouble_t *block = p->consts + ip->arg;
+                int degree = (int)block[0];
+                stack[++sp] = evaluateHorner(degree, block + 1,
+                                             ip->op == OP_NEWTON ? block + degree + 2 : NULL, value);
+                break;
+            }
+        }
+    }
+
+    result = stack[0];
+    if (stack != stackBuffer)
+    {
+        free(stack);
+    }
+    if (slots != slotBuffer)
+    {
+        free(slots);
+    }
+    return result;
+}
+
+void evaluateProgramBatch(Program *p, const ldouble_t *x, ldouble_t *y, int n)
+{
+    evaluateProgramBatchVariables(p, NULL, x, y, n);
+}
+
+void evaluateProgramBatchVariables(Program *p, const ldouble_t *values, const ldouble_t *x, ldouble_t *y, int n)
+{
+    int i;
+#ifdef USE_JIT
+    if (p->native != NULL && (values != NULL || p->variableCount == 1))
+    {
+        p->native->batchVariables(x, y, n, values);
+        return;
+    }
+#endif
+    for (i = 0; i < n; i++)
+    {
+        y[i] = evaluateProgramVariables(p, x[i], values);
+    }
+}
+
+/* Native code implementation */
+
+/*
+ * The interpreter still pays a switch for every instruction. compileNative()
+ * translates the program once more, into x86-64 SSE2 code that is written
+ * into an mmap'd page and called like a C function.
+ *
+ * The stack of the program is kept in registers, the value at depth i is
+ * in xmm i. xmm14 and xmm15 are scratch registers, so a program that
+ * needs a deeper stack than JIT_REGISTERS is left to the interpreter.
+ * The functions of libm (sin, pow, ...) are called like the interpreter
+ * calls them. A call may change any xmm register, so the values under the
+ * operand are spilled into the frame before the call and loaded back
+ * after it. POWI, SQRT, RECIP, the Polynomial and the fused trigonometric
+ * functions are computed inline with the same operations in the same order
+ * as the interpreter, so the machine code gives the same results.
+ *
+ * The memory starts with the constants (the sign mask of NEG, 1 and the
+ * constants of the program) which the code reads relative to rip, the
+ * code of f(x) and of the batch loop follow them.
+ *
+ * f(x) gets the values of the other variables in rdi, like
+ * double f(double x, const double *values).
+ *
+ * The frame of f(x) is:
+ *   [rsp]        x
+ *   [rsp + 8]    values
+ *   [rsp + 16]   the spilled registers
+ *   [rsp + 128]  the slots of STORE, LOAD and SINCOS
+*/
+
+#ifdef USE_JIT
+
+#define JIT_REGISTERS 14
+#define JIT_SCRATCH 15
+#define JIT_CONST_SIGN 0
+#define JIT_CONST_ONE 16
+#define JIT_CONST_PROGRAM 32
+#define JIT_FRAME_X 0
+#define JIT_FRAME_VALUES 8
+#define JIT_FRAME_SPILL 16
+#define JIT_FRAME_SLOTS (JIT_FRAME_SPILL + 8 * JIT_REGISTERS)
+
+#define REG_RAX 0
+#define REG_RSP 4
+#define REG_R12 12
+#define REG_R13 13
+
+typedef struct {
+    unsigned char *code;
+    int size;
+    int capacity;
+    /* where the code starts in the memory, the constants are before it */
+    int codeStart;
+} JitBuffer;
+
+void jitByte(JitBuffer *b, int byte)
+{
+    if (b->size >= b->capacity)
+    {
+        b->capacity *= 2;
+        b->code = (unsigned char *)realloc(b->code, b->capacity);
+    }
+    b->code[b->size++] = (unsigned char)byte;
+}
+
+void jitInt32(JitBuffer *b, int value)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        jitByte(b, (value >> (8 * i)) & 0xFF);
+    }
+}
+
+/* Overwrite the 4 bytes at the position, for the jumps that are emitted before their target */
+void jitPatchInt32(JitBuffer *b, int position, int value)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        b->code[position + i] = (unsigned char)((value >> (8 * i)) & 0xFF);
+    }
+}
+
+/* prefix [REX] 0F op, the prefix is F2 for the scalar double instructions and 66 for xorpd */
+void jitSseOpcode(JitBuffer *b, int prefix, int op, int reg, int rm)
+{
+    jitByte(b, prefix);
+    if (reg >= 8 || rm >= 8)
+    {
+        jitByte(b, 0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+    }
+    jitByte(b, 0x0F);
+    jitByte(b, op);
+}
+
+/* op xmm reg, xmm rm */
+void jitSse(JitBuffer *b, int prefix, int op, int reg, int rm)
+{
+    jitSseOpcode(b, prefix, op, reg, rm);
+    jitByte(b, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* op xmm reg, [base + offset] */
+void jitSseMemory(JitBuffer *b, int prefix, int op, int reg, int base, int offset)
+{
+    jitSseOpcode(b, prefix, op, reg, base);
+    jitByte(b, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == REG_RSP)
+    {
+        jitByte(b, 0x24);
+    }
+    jitInt32(b, offset);
+}
+
+/* op xmm reg, [rip + offset of the constant - end of the instruction] */
+void jitSseConstant(JitBuffer *b, int prefix, int op, int reg, int constant)
+{
+    jitSseOpcode(b, prefix, op, reg, 0);
+    jitByte(b, (reg & 7) << 3 | 5);
+    jitInt32(b, constant - (b->codeStart + b->size + 4));
+}
+
+#define SSE_LOAD 0x10
+#define SSE_STORE 0x11
+#define SSE_SQRT 0x51
+#define SSE_XOR 0x57
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5C
+#define SSE_DIV 0x5E
+
+void jitMove(JitBuffer *b, int to, int from)
+{
+    if (to != from)
+    {
+        jitSse(b, 0xF2, SSE_LOAD, to, from);
+    }
+}
+
+/* reg = 1 / reg */
+void jitReciprocal(JitBuffer *b, int reg)
+{
+    jitSseConstant(b, 0xF2, SSE_LOAD, JIT_SCRATCH, JIT_CONST_ONE);
+    jitSse(b, 0xF2, SSE_DIV, JIT_SCRATCH, reg);
+    jitMove(b, reg, JIT_SCRATCH);
+}
+
+/* Store or load xmm0 ... xmm (count - 1) */
+void jitSpill(JitBuffer *b, int count, int op)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        jitSseMemory(b, 0xF2, op, i, REG_RSP, JIT_FRAME_SPILL + 8 * i);
+    }
+}
+
+/* mov rax, function; call rax */
+void jitCall(JitBuffer *b, void (*function)(void))
+{
+    unsigned char address[sizeof(function)];
+    int i;
+    memcpy(address, &function, sizeof(function));
+    jitByte(b, 0x48);
+    jitByte(b, 0xB8);
+    for (i = 0; i < 8; i++)
+    {
+        jitByte(b, address[i]);
+    }
+    jitByte(b, 0xFF);
+    jitByte(b, 0xD0);
+}
+
+/* xmm top = function(xmm top) */
+void jitCallUnary(JitBuffer *b, double (*function)(double), int top)
+{
+    jitSpill(b, top, SSE_STORE);
+    jitMove(b, 0, top);
+    jitCall(b, (void (*)(void))function);
+    jitMove(b, top, 0);
+    jitSpill(b, top, SSE_LOAD);
+}
+
+/* lea reg, [rsp + offset], reg is rdi (7) or rsi (6) */
+void jitLoadFrameAddress(JitBuffer *b, int reg, int offset)
+{
+    jitByte(b, 0x48);
+    jitByte(b, 0x8D);
+    jitByte(b, 0x80 | reg << 3 | REG_RSP);
+    jitByte(b, 0x24);
+    jitInt32(b, offset);
+}
+
+/* xmm reg = base^n with repeated squaring like integerPower(), base is changed */
+void jitIntegerPower(JitBuffer *b, int reg, int exponent)
+{
+    int n = exponent < 0 ? -exponent : exponent;
+    int first = 1;
+    if (n == 0)
+    {
+        jitSseConstant(b, 0xF2, SSE_LOAD, reg, JIT_CONST_ONE);
+        return;
+    }
+    while (n > 0)
+    {
+        if (n & 1)
+        {
+            /* the first 1 * base is base */
+            if (first)
+            {
+                jitMove(b, JIT_SCRATCH, reg);
+                first = 0;
+            } else
+            {
+                jitSse(b, 0xF2, SSE_MUL, JIT_SCRATCH, reg);
+            }
+        }
+        n >>= 1;
+        if (n > 0)
+        {
+            jitSse(b, 0xF2, SSE_MUL, reg, reg);
+        }
+    }
+    if (exponent < 0)
+    {
+        jitSseConstant(b, 0xF2, SSE_LOAD, reg, JIT_CONST_ONE);
+        jitSse(b, 0xF2, SSE_DIV, reg, JIT_SCRATCH);
+    } else
+    {
+        jitMove(b, reg, JIT_SCRATCH);
+    }
+}
+
+/* Translate the instructions of f(x), returns 0 if an instruction can not be translated */
+int jitProgram(JitBuffer *b, Program *p, int frameSize)
+{
+    const Instruction *ip;
+    int sp = -1;
+
+    /* sub rsp, frameSize; movsd [rsp], xmm0; mov [rsp + 8], rdi */
+    jitByte(b, 0x48);
+    jitByte(b, 0x81);
+    jitByte(b, 0xEC);
+    jitInt32(b, frameSize);
+    jitSseMemory(b, 0xF2, SSE_STORE, 0, REG_RSP, JIT_FRAME_X);
+    jitByte(b, 0x48);
+    jitByte(b, 0x89);
+    jitByte(b, 0xBC);
+    jitByte(b, 0x24);
+    jitInt32(b, JIT_FRAME_VALUES);
+
+    for (ip = p->code; ip < p->code + p->codeCount; ip++)
+    {
+        int slot = JIT_FRAME_SLOTS + 8 * ip->arg;
+        switch (ip->op)
+        {
+            case OP_CONST:
+                sp++;
+                jitSseConstant(b, 0xF2, SSE_LOAD, sp, JIT_CONST_PROGRAM + 8 * ip->arg);
+                break;
+            case OP_VAR:
+                sp++;
+                if (ip->arg == 0)
+                {
+                    jitSseMemory(b, 0xF2, SSE_LOAD, sp, REG_RSP, JIT_FRAME_X);
+                    break;
+                }
+                /* mov rax, [rsp + 8]; movsd xmm sp, [rax + 8 * index] */
+                jitByte(b, 0x48);
+                jitByte(b, 0x8B);
+                jitByte(b, 0x84);
+                jitByte(b, 0x24);
+                jitInt32(b, JIT_FRAME_VALUES);
+                jitSseMemory(b, 0xF2, SSE_LOAD, sp, REG_RAX, 8 * ip->arg);
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            {
+                static const int ops[] = {SSE_ADD, SSE_SUB, SSE_MUL, SSE_DIV};
+                sp--;
+                jitSse(b, 0xF2, ops[ip->op - OP_ADD], sp, sp + 1);
+                break;
+            }
+            case OP_NEG:
+                jitSseConstant(b, 0x66, SSE_XOR, sp, JIT_CONST_SIGN);
+                break;
+            case OP_RECIP:
+                jitReciprocal(b, sp);
+                break;
+            case OP_POW:
+                sp--;
+                jitSpill(b, sp, SSE_STORE);
+                jitMove(b, 0, sp);
+                jitMove(b, 1, sp + 1);
+                jitCall(b, (void (*)(void))pow);
+                jitMove(b, sp, 0);
+                jitSpill(b, sp, SSE_LOAD);
+                break;
+            case OP_POWI:
+                jitIntegerPower(b, sp, ip->arg);
+                break;
+            case OP_SQRT:
+                jitSse(b, 0xF2, SSE_SQRT, sp, sp);
+                break;
+            case OP_EXP:
+                jitCallUnary(b, exp, sp);
+                break;
+            case OP_LOG:
+                /* log(value) / log(base), the value is spilled with the registers under it */
+                sp--;
+                jitSpill(b, sp + 1, SSE_STORE);
+                jitMove(b, 0, sp + 1);
+                jitCall(b, (void (*)(void))log);
+                jitSseMemory(b, 0xF2, SSE_STORE, 0, REG_RSP, JIT_FRAME_SPILL + 8 * (sp + 1));
+                jitSseMemory(b, 0xF2, SSE_LOAD, 0, REG_RSP, JIT_FRAME_SPILL + 8 * sp);
+                jitCall(b, (void (*)(void))log);
+                jitSseMemory(b, 0xF2, SSE_DIV, 0, REG_RSP, JIT_FRAME_SPILL + 8 * (sp + 1));
+                jitMove(b, sp, 0);
+                jitSpill(b, sp, SSE_LOAD);
+                break;
+            case OP_SIN:
+            case OP_CSC:
+                jitCallUnary(b, sin, sp);
+                break;
+            case OP_COS:
+            case OP_SEC:
+                jitCallUnary(b, cos, sp);
+                break;
+            case OP_TAN:
+            case OP_COT:
+                jitCallUnary(b, tan, sp);
+                break;
+            case OP_ASIN:
+            case OP_ACOS:
+            case OP_ATAN:
+                jitCallUnary(b, ip->op == OP_ASIN ? asin : ip->op == OP_ACOS ? acos : atan, sp);
+                break;
+            case OP_ACSC:
+            case OP_ASEC:
+            case OP_ACOT:
+                jitReciprocal(b, sp);
+                jitCallUnary(b, ip->op == OP_ACSC ? asin : ip->op == OP_ASEC ? acos : atan, sp);
+                break;
+            case OP_STORE:
+                jitSseMemory(b, 0xF2, SSE_STORE, sp, REG_RSP, slot);
+                break;
+            case OP_LOAD:
+                sp++;
+                jitSseMemory(b, 0xF2, SSE_LOAD, sp, REG_RSP, slot);
+                break;
+            case OP_HORNER:
+            case OP_NEWTON:
+            {
+                int block = JIT_CONST_PROGRAM + 8 * ip->arg;
+                int degree = (int)p->consts[ip->arg];
+                int i;
+                sp++;
+                jitSseConstant(b, 0xF2, SSE_LOAD, sp, block + 8 * (degree + 1));
+                for (i = degree - 1; i >= 0; i--)
+                {
+                    if (ip->op == OP_NEWTON)
+                    {
+                        jitSseMemory(b, 0xF2, SSE_LOAD, JIT_SCRATCH, REG_RSP, JIT_FRAME_X);
+                        jitSseConstant(b, 0xF2, SSE_SUB, JIT_SCRATCH, block + 8 * (degree + 2 + i));
+                        jitSse(b, 0xF2, SSE_MUL, sp, JIT_SCRATCH);
+                    } else
+                    {
+                        jitSseMemory(b, 0xF2, SSE_MUL, sp, REG_RSP, JIT_FRAME_X);
+                    }
+                    jitSseConstant(b, 0xF2, SSE_ADD, sp, block + 8 * (1 + i));
+                }
+                break;
+            }
+            case OP_SINCOS:
+                sp--;
+                jitSpill(b, sp + 1, SSE_STORE);
+                jitMove(b, 0, sp + 1);
+                jitLoadFrameAddress(b, 7, slot);
+                jitLoadFrameAddress(b, 6, slot + 8);
+                jitCall(b, (void (*)(void))sinCos);
+                jitSpill(b, sp + 1, SSE_LOAD);
+                break;
+            case OP_FUSED_SIN:
+            case OP_FUSED_TAN:
+                sp++;
+                jitSseMemory(b, 0xF2, SSE_LOAD, sp, REG_RSP, slot);
+                if (ip->op == OP_FUSED_TAN)
+                {
+                    jitSseMemory(b, 0xF2, SSE_DIV, sp, REG_RSP, slot + 8);
+                }
+                break;
+            case OP_FUSED_COS:
+            case OP_FUSED_COT:
+                sp++;
+                jitSseMemory(b, 0xF2, SSE_LOAD, sp, REG_RSP, slot + 8);
+                if (ip->op == OP_FUSED_COT)
+                {
+                    jitSseMemory(b, 0xF2, SSE_DIV, sp, REG_RSP, slot);
+                }
+                break;
+            case OP_FUSED_CSC:
+            case OP_FUSED_SEC:
+                sp++;
+                jitSseConstant(b, 0xF2, SSE_LOAD, sp, JIT_CONST_ONE);
+                jitSseMemory(b, 0xF2, SSE_DIV, sp, REG_RSP, ip->op == OP_FUSED_CSC ? slot : slot + 8);
+                break;
+            default:
+                return 0;
+        }
+        /* 1 / sin, 1 / cos and 1 / tan after the call */
+        if (ip->op == OP_CSC || ip->op == OP_SEC || ip->op == OP_COT)
+        {
+            jitReciprocal(b, sp);
+        }
+    }
+
+    /* the result is in xmm0; add rsp, frameSize; ret */
+    jitByte(b, 0x48);
+    jitByte(b, 0x81);
+    jitByte(b, 0xC4);
+    jitInt32(b, frameSize);
+    jitByte(b, 0xC3);
+    return 1;
+}
+
+/*
+ * The loop of the batch function, calls f(x) at the start of the code for each value
+ * It is void batch(const double *x, double *y, size_t n, const double *values).
+*/
+void jitBatchLoop(JitBuffer *b)
+{
+    int loop, exit;
+
+    /* push r12; push r13; push r14; push r15; sub rsp, 8 to align the stack for the call */
+    jitByte(b, 0x41);
+    jitByte(b, 0x54);
+    jitByte(b, 0x41);
+    jitByte(b, 0x55);
+    jitByte(b, 0x41);
+    jitByte(b, 0x56);
+    jitByte(b, 0x41);
+    jitByte(b, 0x57);
+    jitByte(b, 0x48);
+    jitByte(b, 0x83);
+    jitByte(b, 0xEC);
+    jitByte(b, 0x08);
+    /* mov r12, rdi; mov r13, rsi; mov r14, rdx; mov r15, rcx */
+    jitByte(b, 0x49);
+    jitByte(b, 0x89);
+    jitByte(b, 0xFC);
+    jitByte(b, 0x49);
+    jitByte(b, 0x89);
+    jitByte(b, 0xF5);
+    jitByte(b, 0x49);
+    jitByte(b, 0x89);
+    jitByte(b, 0xD6);
+    jitByte(b, 0x49);
+    jitByte(b, 0x89);
+    jitByte(b, 0xCF);
+
+    /* loop: test r14, r14; jz exit */
+    loop = b->size;
+    jitByte(b, 0x4D);
+    jitByte(b, 0x85);
+    jitByte(b, 0xF6);
+    jitByte(b, 0x0F);
+    jitByte(b, 0x84);
+    exit = b->size;
+    jitInt32(b, 0);
+
+    /* movsd xmm0, [r12]; mov rdi, r15; call f; movsd [r13], xmm0 */
+    jitSseMemory(b, 0xF2, SSE_LOAD, 0, REG_R12, 0);
+    jitByte(b, 0x4C);
+    jitByte(b, 0x89);
+    jitByte(b, 0xFF);
+    jitByte(b, 0xE8);
+    jitInt32(b, -(b->size + 4));
+    jitSseMemory(b, 0xF2, SSE_STORE, 0, REG_R13, 0);
+
+    /* add r12, 8; add r13, 8; dec r14; jmp loop */
+    jitByte(b, 0x49);
+    jitByte(b, 0x83);
+    jitByte(b, 0xC4);
+    jitByte(b, 0x08);
+    jitByte(b, 0x49);
+    jitByte(b, 0x83);
+    jitByte(b, 0xC5);
+    jitByte(b, 0x08);
+    jitByte(b, 0x49);
+    jitByte(b, 0xFF);
+    jitByte(b, 0xCE);
+    jitByte(b, 0xE9);
+    jitInt32(b, loop - (b->size + 4));
+
+    /* exit: add rsp, 8; pop r15; pop r14; pop r13; pop r12; ret */
+    jitPatchInt32(b, exit, b->size - (exit + 4));
+    jitByte(b, 0x48);
+    jitByte(b, 0x83);
+    jitByte(b, 0xC4);
+    jitByte(b, 0x08);
+    jitByte(b, 0x41);
+    jitByte(b, 0x5F);
+    jitByte(b, 0x41);
+    jitByte(b, 0x5E);
+    jitByte(b, 0x41);
+    jitByte(b, 0x5D);
+    jitByte(b, 0x41);
+    jitByte(b, 0x5C);
+    jitByte(b, 0xC3);
+}
+
+NativeCode *compileNative(Program *p)
+{
+    JitBuffer b;
+    NativeCode *n;
+    unsigned char *memory;
+    char *env = getenv("ANALYSIS_JIT");
+    const double sign[2] = {-0.0, -0.0};
+    const double one = 1;
+    int frameSize, batchStart;
+    size_t size;
+
+    if ((env != NULL && atoi(env) == 0) || p->stackSize > JIT_REGISTERS)
+    {
+        return NULL;
+    }
+    /* keep rsp + 8 a multiple of 16 in the frame, so the calls are aligned */
+    frameSize = JIT_FRAME_SLOTS + 8 * p->slotCount;
+    if (frameSize % 16 == 0)
+    {
+        frameSize += 8;
+    }
+
+    b.size = 0;
+    b.capacity = 64 + 16 * p->codeCount;
+    b.code = (unsigned char *)malloc(b.capacity);
+    b.codeStart = (JIT_CONST_PROGRAM + 8 * p->constCount + 15) / 16 * 16;
+    if (!jitProgram(&b, p, frameSize))
+    {
+        free(b.code);
+        return NULL;
+    }
+    while (b.size % 16 != 0)
+    {
+        /* int3 */
+        jitByte(&b, 0xCC);
+    }
+    batchStart = b.size;
+    jitBatchLoop(&b);
+
+    size = b.codeStart + b.size;
+    memory = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        free(b.code);
+        return NULL;
+    }
+    memcpy(memory + JIT_CONST_SIGN, sign, sizeof(sign));
+    memcpy(memory + JIT_CONST_ONE, &one, sizeof(one));
+    memcpy(memory + JIT_CONST_PROGRAM, p->consts, p->constCount * sizeof(double));
+    memcpy(memory + b.codeStart, b.code, b.size);
+    free(b.code);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(memory, size);
+        return NULL;
+    }
+
+    n = (NativeCode *)malloc(sizeof(NativeCode));
+    n->memory = memory;
+    n->size = size;
+    n->functionVariables = (double (*)(double, const double *))(void *)(memory + b.codeStart);
+    n->batchVariables = (void (*)(const double *, double *, size_t, const double *))(void *)(memory + b.codeStart + batchStart);
+    return n;
+}
+
+void destroyNative(NativeCode *n)
+{
+    munmap(n->memory, n->size);
+    free(n);
+}
+
+#else
+
+NativeCode *compileNative(Program *p)
+{
+    UNUSED(p);
+    return NULL;
+}
+
+void destroyNative(NativeCode *n)
+{
+    free(n);
+}
+
+#endif
+
+/* Forward mode automatic differentiation */
+
+/*
+ * A dual number carries a value and its derivative with respect to x.
+ * Evaluating an expression with dual numbers gives f(x) and f'(x) in one
+ * pass, each operation applies its derivative rule to the derivatives of
+ * its operands, i.e. (u * v)' = u' * v + u * v'.
+ *
+ * evaluateDual() walks the tree and evaluateProgramDual() runs a compiled
+ * program, both give the same values as evaluate().
+*/
+
+typedef struct _Dual {
+    ldouble_t value;
+    ldouble_t derivative;
+} Dual;
+
+/*
+ * Evaluate the expression and its derivative with the given value
+ *
+ * Parameters:
+ * - e: The expression to be evaluated
+ * - value: The value to be used in the expression
+ * Returns:
+ * - f(value) and f'(value)
+*/
+Dual evaluateDual(EVALABLE *e, ldouble_t value);
+
+/*
+ * Evaluate the program and the derivative of the compiled expression with
+ * the given value
+ *
+ * Parameters:
+ * - p: The program to be evaluated
+ * - value: The value to be used in the program
+ * Returns:
+ * - f(value) and f'(value)
+*/
+Dual evaluateProgramDual(Program *p, ldouble_t value);
+
+/*
+ * Evaluate the program and the derivative with respect to x with the given
+ * values of the variables, the other variables are constants
+ *
+ * Parameters:
+ * - p: The program to be evaluated
+ * - value: The value of x
+ * - values: The values of the variables, values[0] is not used
+ * Returns:
+ * - f(value) and f'(value)
+*/
+Dual evaluateProgramDualVariables(Program *p, ldouble_t value, const ldouble_t *values);
+
+Dual makeDual(ldouble_t value, ldouble_t derivative)
+{
+    Dual d;
+    d.value = value;
+    d.derivative = derivative;
+    return d;
+}
+
+Dual dualMultiply(Dual a, Dual b)
+{
+    return makeDual(a.value * b.value, a.derivative * b.value + a.value * b.derivative);
+}
+
+Dual dualDivide(Dual a, Dual b)
+{
+    return makeDual(a.value / b.value, (a.derivative * b.value - a.value * b.derivative) / (b.value * b.value));
+}
+
+/* u^v, the rules with a constant base or exponent avoid ln of a negative base */
+/* u^n, n * u^(n-1) * u' */
+Dual dualIntegerPower(Dual u, int n)
+{
+    ldouble_t value;
+    if (n == 0)
+    {
+        return makeDual(1, 0);
+    }
+    value = integerPower(u.value, n);
+    if (u.derivative == 0)
+    {
+        return makeDual(value, 0);
+    }
+    return makeDual(value, n * integerPower(u.value, n - 1) * u.derivative);
+}
+
+/* sqrt(u), u' / (2 * sqrt(u)) */
+Dual dualSquareRoot(Dual u)
+{
+    ldouble_t value = sqrt(u.value);
+    if (u.derivative == 0)
+    {
+        return makeDual(value, 0);
+    }
+    return makeDual(value, u.derivative / (2 * value));
+}
+
+/* e^u, e^u * u' */
+Dual dualExp(Dual u)
+{
+    ldouble_t value = exp(u.value);
+    return makeDual(value, value * u.derivative);
+}
+
+Dual dualPower(Dual u, Dual v)
+{
+    ldouble_t value = pow(u.value, v.value);
+    if (v.derivative == 0)
+    {
+        if (u.derivative == 0)
+        {
+            return makeDual(value, 0);
+        }
+        return makeDual(value, v.value * pow(u.value, v.value - 1) * u.derivative);
+    }
+    if (u.derivative == 0)
+    {
+        return makeDual(value, value * log(u.value) * v.derivative);
+    }
+    return makeDual(value, value * (v.derivative * log(u.value) + v.value * u.derivative / u.value));
+}
+
+/* log_b(v) = ln(v) / ln(b) */
+Dual dualLogarithm(Dual v, Dual b)
+{
+    ldouble_t lnv = log(v.value);
+    ldouble_t lnb = log(b.value);
+    /* the value is divided as in evaluate() to give the same result */
+    ldouble_t value = log(v.value) / log(b.value);
+    if (b.derivative == 0)
+    {
+        return makeDual(value, v.derivative / (v.value * lnb));
+    }
+    return makeDual(value, (v.derivative / v.value * lnb - lnv * b.derivative / b.value) / (lnb * lnb));
+}
+
+/* Horner's method for p(x) and p'(x), the value is the same as evaluateHorner() */
+Dual dualHorner(int degree, const ldouble_t *coefficients, const ldouble_t *centers, ldouble_t value)
+{
+    Dual result = makeDual(coefficients[degree], 0);
+    int i;
+    for (i = degree - 1; i >= 0; i--)
+    {
+        ldouble_t factor = centers == NULL ? value : value - centers[i];
+        result.derivative = result.derivative * factor + result.value;
+        result.value = result.value * factor + coefficients[i];
+    }
+    return result;
+}
+
+/* The function of a fused group from the dual sin and cos of the argument */
+Dual dualFusedTrigonometric(TrigonometricType type, Dual s, Dual c)
+{
+    ldouble_t value = fusedTrigonometric(type, s.value, c.value);
+    switch (type)
+    {
+        case SIN:
+            return s;
+        case COS:
+            return c;
+        case TAN:
+            return makeDual(value, (s.derivative * c.value - s.value * c.derivative) / (c.value * c.value));
+        case CSC:
+            return makeDual(value, -s.derivative / (s.value * s.value));
+        case SEC:
+            return makeDual(value, -c.derivative / (c.value * c.value));
+        case COT:
+            return makeDual(value, (c.derivative * s.value - c.value * s.derivative) / (s.value * s.value));
+        default:
+            return makeDual(0, 0);
+    }
+}
+
+Dual dualTrigonometric(TrigonometricType type, Dual u)
+{
+    ldouble_t value;
+    switch (type)
+    {
+        case SIN:
+            return makeDual(sin(u.value), cos(u.value) * u.derivative);
+        case COS:
+            return makeDual(cos(u.value), -sin(u.value) * u.derivative);
+        case TAN:
+            value = tan(u.value);
+            return makeDual(value, (1 + value * value) * u.derivative);
+        case CSC:
+            value = 1 / sin(u.value);
+            return makeDual(value, -value * cos(u.value) * value * u.derivative);
+        case SEC:
+            value = 1 / cos(u.value);
+            return makeDual(value, value * sin(u.value) * value * u.derivative);
+        case COT:
+            value = 1 / tan(u.value);
+            return makeDual(value, -(1 + value * value) * u.derivative);
+        default:
+            return makeDual(0, 0);
+    }
+}
+
+/* acsc(u) = asin(1 / u), asec(u) = acos(1 / u), acot(u) = atan(1 / u) */
+Dual dualInverseTrigonometric(InverseTrigonometricType type, Dual u)
+{
+    ldouble_t u2 = u.value * u.value;
+    switch (type)
+    {
+        case ASIN:
+            return makeDual(asin(u.value), u.derivative / sqrt(1 - u2));
+        case ACOS:
+            return makeDual(acos(u.value), -u.derivative / sqrt(1 - u2));
+        case ATAN:
+            return makeDual(atan(u.value), u.derivative / (1 + u2));
+        case ACSC:
+            return makeDual(asin(1 / u.value), -u.derivative / (u2 * sqrt(1 - 1 / u2)));
+        case ASEC:
+            return makeDual(acos(1 / u.value), u.derivative / (u2 * sqrt(1 - 1 / u2)));
+        case ACOT:
+            return makeDual(atan(1 / u.value), -u.derivative / (1 + u2));
+        default:
+            return makeDual(0, 0);
+    }
+}
+
+Dual evaluateDual(EVALABLE *e, ldouble_t value)
+{
+    Dual result, arg;
+    int i;
+    switch (EVALTYPE(e))
+    {
+        case CONSTANT:
+            return makeDual(((Constant *)e)->value, 0);
+        case VARIABLE:
+            return makeDual(variableValue(((Variable *)e)->index, value, variableValues),
+                            ((Variable *)e)->index == 0 ? 1 : 0);
+        case EXPONENTIAL:
+        {
+            Exponential *power = (Exponential *)e;
+            switch (power->powerType)
+            {
+                case INTEGER_POWER:
+                    return dualIntegerPower(evaluateDual(power->base, value), power->integerExponent);
+                case RECIPROCAL:
+                    return dualDivide(makeDual(1, 0), evaluateDual(power->base, value));
+                case SQUARE_ROOT:
+                    return dualSquareRoot(evaluateDual(power->base, value));
+                case NATURAL_EXPONENTIAL:
+                    return dualExp(evaluateDual(power->exponent, value));
+                default:
+                    return dualPower(evaluateDual(power->base, value), evaluateDual(power->exponent, value));
+            }
+        }
+        case LOGARITHM:
+            return dualLogarithm(evaluateDual(((Logarithm *)e)->value, value),
+                                 evaluateDual(((Logarithm *)e)->base, value));
+        case TRIGONOMETRIC:
+            return dualTrigonometric(((Trigonometric *)e)->trigType,
+                                     evaluateDual(((Trigonometric *)e)->arg, value));
+        case INVERSE_TRIGONOMETRIC:
+            return dualInverseTrigonometric(((InverseTrigonometric *)e)->trigType,
+                                            evaluateDual(((InverseTrigonometric *)e)->arg, value));
+        case SUM_CHAIN:
+        {
+            SumChain *f = (SumChain *)e;
+            result = makeDual(0, 0);
+            for (i = 0; i < f->argCount && f->args[i] != NULL; i++)
+            {
+                arg = evaluateDual(f->args[i], value);
+                if (f->isPositive[i] == 1)
+                {
+                    result.value += arg.value;
+                    result.derivative += arg.derivative;
+                } else {
+                    result.value -= arg.value;
+                    result.derivative -= arg.derivative;
+                }
+            }
+            return result;
+        }
+        case MUL_CHAIN:
+        {
+            MulChain *m = (MulChain *)e;
+            result = makeDual(1, 0);
+            for (i = 0; i < m->argCount && m->args[i] != NULL; i++)
+            {
+                arg = evaluateDual(m->args[i], value);
+                if (m->isDivided[i] == 1)
+                {
+                    result = dualDivide(result, arg);
+                } else {
+                    result = dualMultiply(result, arg);
+                }
+            }
+            return result;
+        }
+        case SHARED:
+            return evaluateDual(((Shared *)e)->expr, value);
+        case POLYNOMIAL:
+            return dualHorner(((Polynomial *)e)->degree, ((Polynomial *)e)->coefficients,
+                              ((Polynomial *)e)->centers, value);
+        default:
+            return makeDual(0, 0);
+    }
+}
+
+Dual evaluateProgramDual(Program *p, ldouble_t value)
+{
+    return evaluateProgramDualVariables(p, value, NULL);
+}
+
+Dual evaluateProgramDualVariables(Program *p, ldouble_t value, const ldouble_t *values)
+{
+    Dual stackBuffer[PROGRAM_STACK_SIZE];
+    Dual slotBuffer[PROGRAM_STACK_SIZE];
+    Dual *stack = stackBuffer;
+    Dual *slots = slotBuffer;
+    Dual result;
+    const Instruction *ip = p->code;
+    const Instruction *end = p->code + p->codeCount;
+    int sp = -1;
+
+    if (p->stackSize > PROGRAM_STACK_SIZE)
+    {
+        stack = (Dual *)malloc(p->stackSize * sizeof(Dual));
+    }
+    if (p->slotCount > PROGRAM_STACK_SIZE)
+    {
+        slots = (Dual *)malloc(p->slotCount * sizeof(Dual));
+    }
+    stack[0] = makeDual(0, 0);
+
+    for (; ip < end; ip++)
+    {
+        switch (ip->op)
+        {
+            case OP_CONST:
+                stack[++sp] = makeDual(p->consts[ip->arg], 0);
+                break;
+            case OP_VAR:
+                stack[++sp] = makeDual(variableValue(ip->arg, value, values), ip->arg == 0 ? 1 : 0);
+                break;
+            case OP_ADD:
+                sp--;
+                stack[sp].value += stack[sp + 1].value;
+                stack[sp].derivative += stack[sp + 1].derivative;
+                break;
+            case OP_SUB:
+                sp--;
+                stack[sp].value -= stack[sp + 1].value;
+                stack[sp].derivative -= stack[sp + 1].derivative;
+                break;
+            case OP_MUL:
+                sp--;
+                stack[sp] = dualMultiply(stack[sp], stack[sp + 1]);
+                break;
+            case OP_DIV:
+                sp--;
+                stack[sp] = dualDivide(stack[sp], stack[sp + 1]);
+                break;
+            case OP_NEG:
+                stack[sp] = makeDual(-stack[sp].value, -stack[sp].derivative);
+                break;
+            case OP_RECIP:
+                stack[sp] = dualDivide(makeDual(1, 0), stack[sp]);
+                break;
+            case OP_POW:
+                sp--;
+                stack[sp] = dualPower(stack[sp], stack[sp + 1]);
+                break;
+            case OP_POWI:
+                stack[sp] = dualIntegerPower(stack[sp], ip->arg);
+                break;
+            case OP_SQRT:
+                stack[sp] = dualSquareRoot(stack[sp]);
+                break;
+            case OP_EXP:
+                stack[sp] = dualExp(stack[sp]);
+                break;
+            case OP_SINCOS:
+            {
+                ldouble_t s, c;
+                sinCos(stack[sp].value, &s, &c);
+                slots[ip->arg] = makeDual(s, c * stack[sp].derivative);
+                slots[ip->arg + 1] = makeDual(c, -s * stack[sp].derivative);
+                sp--;
+                break;
+            }
+            case OP_FUSED_SIN:
+            case OP_FUSED_COS:
+            case OP_FUSED_TAN:
+            case OP_FUSED_CSC:
+            case OP_FUSED_SEC:
+            case OP_FUSED_COT:
+                stack[++sp] = dualFusedTrigonometric((TrigonometricType)(ip->op - OP_FUSED_SIN),
+                                                     slots[ip->arg], slots[ip->arg + 1]);
+                break;
+            case OP_LOG:
+                sp--;
+                stack[sp] = dualLogarithm(stack[sp], stack[sp + 1]);
+                break;
+            case OP_SIN:
+            case OP_COS:
+            case OP_TAN:
+            case OP_CSC:
+            case OP_SEC:
+            case OP_COT:
+                stack[sp] = dualTrigonometric((TrigonometricType)(ip->op - OP_SIN), stack[sp]);
+                break;
+            case OP_ASIN:
+            case OP_ACOS:
+            case OP_ATAN:
+            case OP_ACSC:
+            case OP_ASEC:
+            case OP_ACOT:
+                stack[sp] = dualInverseTrigonometric((InverseTrigonometricType)(ip->op - OP_ASIN), stack[sp]);
+                break;
+            case OP_STORE:
+                slots[ip->arg] = stack[sp];
+                break;
+            case OP_LOAD:
+                stack[++sp] = slots[ip->arg];
+                break;
+            case OP_HORNER:
+            case OP_NEWTON:
+            {
+                const ldouble_t *block = p->consts + ip->arg;
+                int degree = (int)block[0];
+                stack[++sp] = dualHorner(degree, block + 1,
+                                         ip->op == OP_NEWTON ? block + degree + 2 : NULL, value);
+                break;
+            }
+        }
+    }
+
+    result = stack[0];
+    if (stack != stackBuffer)
+    {
+        free(stack);
+    }
+    if (slots != slotBuffer)
+    {
+        free(slots);
+    }
+    return result;
+}
+
+/* Variable table implementation */
+
+/*
+ * The parser reads x as the variable with index 0. The other letters are
+ * variables only while a variable table is set with useVariables(), a
+ * letter that is not in the table is added with the next index. So the
+ * names are resolved once while parsing, and the expression is evaluated
+ * with an array of values where values[index] is the value of a variable.
+ *
+ * e and the function names are read as before, i.e. "ab" is a*b and
+ * "tan(s)" is tan(s), but "asin(x)" is the inverse sine, not a*sin(x).
+*/
+
+/* In order to change the number of variables that a table can have
+ * change the value of VARIABLE_MAX.
+*/
+#ifndef VARIABLE_MAX
+#define VARIABLE_MAX 26
+#endif
+
+typedef struct _VariableTable {
+    int count;
+    char names[VARIABLE_MAX];
+} VariableTable;
+
+/* The table that the parser of the thread resolves the variables with, NULL for only x */
+_Thread_local VariableTable *variableTable = NULL;
+
+/*
+ * Create a variable table that has only x
+ *
+ * Returns:
+ * - The created table
+*/
+VariableTable *createVariableTable();
+
+/*
+ * Destroy the variable table and free the memory
+ *
+ * Parameters:
+ * - t: The table to be destroyed
+*/
+void destroyVariableTable(VariableTable *t);
+
+/*
+ * Find the index of the variable
+ *
+ * Parameters:
+ * - t: The table
+ * - name: The letter of the variable
+ * Returns:
+ * - The index of the variable, -1 if it is not in the table
+*/
+int findVariable(VariableTable *t, char name);
+
+/*
+ * Add the variable to the table if it is not in it
+ *
+ * Parameters:
+ * - t: The table
+ * - name: The letter of the variable, a lowercase letter other than e
+ * Returns:
+ * - The index of the variable, -1 if the name is not valid or the table is full
+*/
+int addVariable(VariableTable *t, char name);
+
+/*
+ * Set the table that the parser of the calling thread resolves the variables with
+ *
+ * Parameters:
+ * - t: The new table, NULL to read only x
+ * Returns:
+ * - The previous table
+*/
+VariableTable *useVariables(VariableTable *t);
+
+VariableTable *createVariableTable()
+{
+    VariableTable *t = (VariableTable *)malloc(sizeof(VariableTable));
+    t->count = 1;
+    t->names[0] = 'x';
+    return t;
+}
+
+void destroyVariableTable(VariableTable *t)
+{
+    free(t);
+}
+
+int findVariable(VariableTable *t, char name)
+{
+    int i;
+    for (i = 0; i < t->count; i++)
+    {
+        if (t->names[i] == name)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int addVariable(VariableTable *t, char name)
+{
+    int index = findVariable(t, name);
+    if (index >= 0)
+    {
+        return index;
+    }
+    if (name < 'a' || name > 'z' || name == 'e' || t->count >= VARIABLE_MAX)
+    {
+        return -1;
+    }
+    t->names[t->count] = name;
+    return t->count++;
+}
+
+VariableTable *useVariables(VariableTable *t)
+{
+    VariableTable *previous = variableTable;
+    variableTable = t;
+    return previous;
+}
+
+/* Parser functions */
+
+/* 
+ * Parse the expression from the input string
+ *
+ * The parser function is responsible for parsing the expression from the input string
+ * and creating the necessary EvalAble structs to represent the expression.
+ *
+ * Parameters:
+ * - input: The input string to be parsed
+ * - e: The pointer to the EvalAble struct that will be created
+ * - s: The status code
+ * Returns:
+ * - The position of the input string after the expression
+*/
+char *parseExpression(char *input, EVALABLE **e, StatusCode *s);
+char *parseLogarithm(char *input, EVALABLE **e, StatusCode *s);
+char *parseInsideParantheses(char *input, EVALABLE **e, StatusCode *s);
+char *parseTrigonometric(char *input, EVALABLE **e, StatusCode *s);
+char *parseInverseTrigonometric(char *input, EVALABLE **e, StatusCode *s);
+
+char *parseTrigonometric(char *input, EVALABLE **e, StatusCode *s)
+{
+    if (s->code != 0)
+        return input;
+    TrigonometricType type;
+    EVALABLE *arg;
+    if (strncmp(input, "sin", 3) == 0)
+        type = SIN;
+    else if (strncmp(input, "cos", 3) == 0)
+        type = COS;
+    else if (strncmp(input, "tan", 3) == 0)
+        type = TAN;
+    else if (strncmp(input, "csc", 3) == 0)
+        type = CSC;
+    else if (strncmp(input, "sec", 3) == 0)
+        type = SEC;
+    else if (strncmp(input, "cot", 3) == 0)
+        type = COT;
+    else
+        return input;
+    input += 3;
+    if (input[0] != '(')
+    {
+        s->code = 2;
+        s->expected = '(';
+        s->pos = input;
+        return input;
+    }
+    input = parseInsideParantheses(input, &arg, s);
+    if (s->code != 0)
+        return input;
+    *e = (EVALABLE *)createTrigonometric(type, arg);
+    return input;
+}
+
+char *parseInverseTrigonometric(char *input, EVALABLE **e, StatusCode *s)
+{
+    if (s->code != 0)
+        return input;
+    InverseTrigonometricType type;
+    EVALABLE *arg;
+    if (strncmp(input, "asin", 4) == 0)
+        type = ASIN;
+    else if (strncmp(input, "acos", 4) == 0)
+        type = ACOS;
+    else if (strncmp(input, "atan", 4) == 0)
+        type = ATAN;
+    else if (strncmp(input, "acsc", 4) == 0)
+        type = ACSC;
+    else if (strncmp(input, "asec", 4) == 0)
+        type = ASEC;
+    else if (strncmp(input, "acot", 4) == 0)
+        type = ACOT;
+    else
+        return input;
+    input += 4;
+    if (input[0] != '(')
+    {
+        s->code = 2;
+        s->expected = '(';
+        s->pos = input;
+        return input;
+    }
+    input = parseInsideParantheses(input, &arg, s);
+    if (s->code != 0)
+        return input;
+    *e = (EVALABLE *)createInverseTrigonometric(type, arg);
+    return input;
+}
+
+char *parseInsideParantheses(char *input, EVALABLE **e, StatusCode *s)
+{
+    if (s->code != 0)
+        return input;
+    if (input[0] != '(')
+    {
+        s->code = 2;
+        s->expected = '(';
+        s->pos = input;
+        return input;
+    }
+    int i = 1;
+    int paranthesesCount = 1;
+    while (paranthesesCount > 0 && input[i] != '\0')
+    {
+        if (input[i] == '(')
+        {
+            paranthesesCount++;
+        }
+        else if (input[i] == ')')
+        {
+            paranthesesCount--;
+        }
+        i++;
+    }
+    if (paranthesesCount > 0)
+    {
+        s->code = 2;
+        s->expected = ')';
+        s->pos = input + i;
+        return input;
+    }
+
+    input[i - 1] = '\0';
+    parseExpression(input + 1, e, s);
+    input += i;
+    return input;
+}
+
+char *parseLogarithm(char *input, EVALABLE **e, StatusCode *s)
+{
+    if (s->code != 0)
+        return input;
+    if (strncmp(input, "log", 3) != 0)
+    {
+        return input;
+    }
+    input += 3;
+    if (input[0] != '_')
+    {
+        s->code = 2;
+        s->expected = '_';
+        s->pos = input;
+        return input;
+    }
+    input++;
+    EVALABLE *base;
+    EVALABLE *value;
+    input = parseInsideParantheses(input, &base, s);
+    if (s->code != 0)
+        return input;
+    if (input[0] != '(')
+    {
+        s->code = 2;
+        s->expected = '(';
+        s->pos = input;
+        return input;
+    }
+    input = parseInsideParantheses(input, &value, s);
+    if (s->code != 0)
+        return input;
+    *e = (EVALABLE *)createLogarithm(base, value);
+    return input;
+}
+
+/*
+ * Macro for checking if the argument is available
+ * If the argument is available, the input is set to the previous character
+ * and the current character is set to '*' to evaluate the expressions 
+ * like 2x as 2*x.
+ *
+ * (Creating a new variable called isArgAvailable is not necessary, arg can
+ * be compared to NULL to check if the argument is available. But this is 
+ * more readable and less error-prone.)
+*/
+#define CHECK_ARG_AVAILABLE()              \
+    if (isArgAvailable)                    \
+    {                                      \
+        input--;                           \
+        input[0] = '*';                    \
+        continue;                          \
+    }
+
+char *parseExpression(char *input, EVALABLE **e, StatusCode *s)
+{
+    if (s->code != 0)
+        return input;
+    SumChain *f = createSumChain();
+    MulChain *m = createMulChain();
+    EVALABLE *arg = NULL;
+    int isPositive = 1;
+    int isDivided = 0;
+    int isArgAvailable = 0;
+    while (input[0])
+    {
+        if (s->code != 0)
+            return input;
+        if (input[0] == ' ')
+        {
+            input++;
+        }
+        else if (strncmp(input, "log", 3) == 0)
+        {
+            CHECK_ARG_AVAILABLE();
+            input = parseLogarithm(input, &arg, s);
+            isArgAvailable = 1;
+        }
+        else if (strncmp(input, "ln", 2) == 0)
+        {
+            CHECK_ARG_AVAILABLE();
+            input += 2;
+            if (input[0] != '(')
+            {
+                s->code = 2;
+                s->expected = '(';
+                s->pos = input;
+                return input;
+            }
+            input = parseInsideParantheses(input, &arg, s);
+            if (s->code != 0)
+                return input;
+            arg = (EVALABLE *)createLogarithm((EVALABLE *)createConstant(M_E), arg);
+            isArgAvailable = 1;
+        }
+        else if (
+            strncmp(input, "sin", 3) == 0 || 
+            strncmp(input, "cos", 3) == 0 || 
+            strncmp(input, "tan", 3) == 0 || 
+            strncmp(input, "csc", 3) == 0 || 
+            strncmp(input, "sec", 3) == 0 || 
+            strncmp(input, "cot", 3) == 0)
+        {
+            CHECK_ARG_AVAILABLE();
+            input = parseTrigonometric(input, &arg, s);
+            isArgAvailable = 1;
+        }
+        else if (
+            strncmp(input, "asin", 4) == 0 ||
+            strncmp(input, "acos", 4) == 0 ||
+            strncmp(input, "atan", 4) == 0 ||
+            strncmp(input, "acsc", 4) == 0 ||
+            strncmp(input, "asec", 4) == 0 ||
+            strncmp(input, "acot", 4) == 0)
+        {
+            CHECK_ARG_AVAILABLE();
+            input = parseInverseTrigonometric(input, &arg, s);
+            isArgAvailable = 1;
+        }
+        else if (input[0] == '(')
+        {
+            CHECK_ARG_AVAILABLE();
+            input = parseInsideParantheses(input, &arg, s);
+            isArgAvailable = 1;
+        }
+        else if (input[0] >= '0' && input[0] <= '9')
+        {
+            CHECK_ARG_AVAILABLE();
+            ldouble_t value = 0;
+            while (input[0] >= '0' && input[0] <= '9')
+            {
+                value = value * 10 + (input[0] - '0');
+                input++;
+            }
+            if (input[0] == '.')
+            {
+                input++;
+                ldouble_t decimal = 0;
+                ldouble_t divider = 10;
+                while (input[0] >= '0' && input[0] <= '9')
+                {
+                    decimal += (input[0] - '0') / divider;
+                    divider *= 10;
+                    input++;
+                }
+                value += decimal;
+            }
+            arg = (EVALABLE *)createConstant(value);
+            isArgAvailable = 1;
+        }
+        else if (input[0] == '^')
+        {
+            if (!isArgAvailable)
+            {
+                s->code = 1;
+                s->pos = input;
+                return input;
+            }
+            input++;
+            EVALABLE *exponent;
+            input = parseInsideParantheses(input, &exponent, s);
+            if (s->code != 0)
+                return input;
+            arg = (EVALABLE *)createExponential(arg, exponent);
+            isArgAvailable = 1;
+        }
+        else if (input[0] == 'x')
+        {
+            CHECK_ARG_AVAILABLE();
+            input++;
+            arg = (EVALABLE *)createVariable(0, 'x');
+            isArgAvailable = 1;
+        }
+        else if (input[0] == 'e')
+        {
+            CHECK_ARG_AVAILABLE();
+            input++;
+            arg = (EVALABLE *)createConstant(M_E);
+            isArgAvailable = 1;
+        }
+        else if (strncmp(input, "pi", 2) == 0 || (strncmp(input, "PI", 2) == 0))
+        {
+            CHECK_ARG_AVAILABLE();
+            input += 2;
+            arg = (EVALABLE *)createConstant(M_PI);
+            isArgAvailable = 1;
+        }
+        else if (variableTable != NULL && input[0] >= 'a' && input[0] <= 'z')
+        {
+            CHECK_ARG_AVAILABLE();
+            int index = addVariable(variableTable, input[0]);
+            if (index < 0)
+            {
+                s->code = 1;
+                s->pos = input;
+                return input;
+            }
+            arg = (EVALABLE *)createVariable(index, input[0]);
+            input++;
+            isArgAvailable = 1;
+        }
+        else if (input[0] == '+' || input[0] == '-')
+        {
+            if (isArgAvailable)
+            {
+                addMulChainArg(m, arg, isDivided);
+                arg = NULL;
+                EVALABLE *val;
+                if (m->argCount == 1)
+                {
+                    val = copyEvalable(m->args[0]);
+                    destroyMulChain(m);
+                }
+                else
+                {
+                    val = (EVALABLE *)m;
+                }
+                addSumChainArg(f, val, isPositive);
+                if (input[0] == '+')
+                {
+                    isPositive = 1;
+                }
+                else if (input[0] == '-')
+                {
+                    isPositive = 0;
+                }
+                m = createMulChain();
+                input++;
+                isArgAvailable = 0;
+            }
+            else 
+            {
+                if (input[0] == '+')
+                {
+                    isPositive = 1;
+                }
+                else if (input[0] == '-')
+                {
+                    isPositive = 0;
+                }
+                /* make - -> -1* */ 
+                if (input[0] == '-')
+                {
+                    addMulChainArg(m, (EVALABLE *)createConstant(-1), 0);
+                    isPositive = 0;
+                }
+                input++;
+            }
+        }
+        else if ((input[0] == '*' || input[0] == '/') && !isArgAvailable)
+        {
+            /* there is nothing to multiply or divide, i.e. *x or x**2 */
+            s->code = 1;
+            s->pos = input;
+            return input;
+        }
+        else if (input[0] == '*')
+        {
+            addMulChainArg(m, arg, isDivided);
+            arg = NULL;
+            isDivided = 0;
+            input++;
+            isArgAvailable = 0;
+        }
+        else if (input[0] == '/')
+        {
+            addMulChainArg(m, arg, isDivided);
+            arg = NULL;
+            isDivided = 1;
+            input++;
+            isArgAvailable = 0;
+        }
+        else 
+        {
+            s->code = 1;
+            s->pos = input;
+            return input;
+        }
+    }
+    if (arg != NULL)
+    {
+        addMulChainArg(m, arg, isDivided);
+    }
+    EVALABLE *val;
+    if (m->argCount == 1)
+    {
+        val = copyEvalable(m->args[0]);
+        destroyMulChain(m);
+    }
+    else
+    {
+        val = (EVALABLE *)m;
+    }
+    addSumChainArg(f, (EVALABLE *)val, isPositive);
+    EVALABLE *result;
+    if (f->argCount == 1)
+    {
+        result = copyEvalable(f->args[0]);
+        destroySumChain(f);
+    }
+    else
+    {
+        result = (EVALABLE *)f;
+    }
+
+    *e = result;
+    return input;
+}
+
+
+/* Prototypes for solvers */
+ldouble_t solveBisection(EVALABLE *e, ldouble_t a, ldouble_t b, ldouble_t epsilon);
+ldouble_t solveRegulaFalsi(EVALABLE *e, ldouble_t a, ldouble_t b, ldouble_t epsilon);
+ldouble_t solveNewtonRaphson(EVALABLE *e, ldouble_t x0, ldouble_t epsilon);
+
+/* Integral function prototypes */
+ldouble_t integrateTrapez(EVALABLE *e, ldouble_t a, ldouble_t b, int n);
+ldouble_t integrateSimpson13(EVALABLE *e, ldouble_t a, ldouble_t b, int n);
+ldouble_t integrateSimpson38(EVALABLE *e, ldouble_t a, ldouble_t b, int n);
+
+/*
+ * Integrate with adaptive Simpson's rule, the intervals are halved until
+ * Simpson's rule on the halves agrees with the whole interval
+ *
+ * Parameters:
+ * - e: The function
+ * - a, b: The interval
+ * - tolerance: The wanted absolute error
+ * - evaluations: Set to the number of function evaluations, can be NULL
+ * Returns:
+ * - The integral
+*/
+ldouble_t integrateAdaptiveSimpson(EVALABLE *e, ldouble_t a, ldouble_t b, ldouble_t tolerance, int *evaluations);
+
+/*
+ * Integrate with adaptive 7-15 point Gauss-Kronrod rule, the interval with
+ * the biggest error estimate is halved until the total estimate is below
+ * the tolerance
+ *
+ * Parameters:
+ * - e: The function
+ * - a, b: The interval
+ * - tolerance: The wanted absolute error
+ * - evaluations: Set to the number of function evaluations, can be NULL
+ * Returns:
+ * - The integral
+*/
+ldouble_t integrateGaussKronrod(EVALABLE *e, ldouble_t a, ldouble_t b, ldouble_t tolerance, int *evaluations);
+
+/*
+ * Integrate with Romberg's method, the trapezoid rule with 1, 2, 4, ...
+ * subintervals is extrapolated with Richardson extrapolation until two
+ * diagonal elements of the table agree
+ *
+ * Parameters:
+ * - e: The function
+ * - a, b: The interval
+ * - tolerance: The wanted absolute error
+ * - evaluations: Set to the number of function evaluations, can be NULL
+ * Returns:
+ * - The integral
+*/
+ldouble_t integrateRomberg(EVALABLE *e, ldouble_t a, ldouble_t b, ldouble_t tolerance, int *evaluations);
+
+/*
+ * Integrate with the composite Gauss-Legendre rule, each of the n
+ * subintervals is integrated with the order point Gauss-Legendre rule
+ *
+ * Parameters:
+ * - e: The function
+ * - a, b: The interval
+ * - order: The number of points in each subinterval (1 to GAUSS_LEGENDRE_MAX_ORDER)
+ * - n: The number of subintervals, 1 for the plain Gauss-Legendre rule
+ * Returns:
+ * - The integral, NAN if the order is not supported
+*/
+ldouble_t integrateGaussLegendre(EVALABLE *e, ldouble_t a, ldouble_t b, int order, int n);
+
+/*
+ * The solvers and the integrators above compile the function into a program
+ * each time they are called. The ...Program versions take the program that
+ * is compiled from e, and the values of the variables other than x (values[i]
+ * for the variable with index i, NULL if there are none), so the same
+ * compiled function can be solved or integrated many times. e is used when
+ * the vector math kernels evaluate the points instead of the program.
+*/
+ldouble_t solveBisectionProgram(Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b, ldouble_t epsilon);
+ldouble_t solveRegulaFalsiProgram(Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b, ldouble_t epsilon);
+ldouble_t solveNewtonRaphsonProgram(Program *p, const ldouble_t *values, ldouble_t x0, ldouble_t epsilon);
+ldouble_t integrateTrapezProgram(EVALABLE *e, Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b, int n);
+ldouble_t integrateSimpson13Program(EVALABLE *e, Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b, int n);
+ldouble_t integrateSimpson38Program(EVALABLE *e, Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b, int n);
+ldouble_t integrateAdaptiveSimpsonProgram(Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b,
+                                          ldouble_t tolerance, int *evaluations);
+ldouble_t integrateGaussKronrodProgram(EVALABLE *e, Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b,
+                                       ldouble_t tolerance, int *evaluations);
+ldouble_t integrateRombergProgram(EVALABLE *e, Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b,
+                                  ldouble_t tolerance, int *evaluations);
+ldouble_t integrateGaussLegendreProgram(EVALABLE *e, Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b,
+                                        int order, int n);
+
+/*
+ * The solvers stop after SOLVER_MAX_ITERATIONS steps and return NAN, a
+ * tolerance below the precision of the root or a Newton-Raphson iteration
+ * that never converges (i.e. x^(2)+1) would loop forever otherwise.
+ * In order to change the number of steps change SOLVER_MAX_ITERATIONS.
+ * i.e. gcc -DSOLVER_MAX_ITERATIONS=100000 analysis.c -o analysis -lm -pthread
+*/
+#ifndef SOLVER_MAX_ITERATIONS
+#define SOLVER_MAX_ITERATIONS 10000
+#endif
+
+ldouble_t solveBisection(EVALABLE *e, ldouble_t a, ldouble_t b, ldouble_t epsilon)
+{
+    Program *p = compileProgram(e);
+    ldouble_t result = solveBisectionProgram(p, NULL, a, b, epsilon);
+    destroyProgram(p);
+    return result;
+}
+
+ldouble_t solveBisectionProgram(Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b, ldouble_t epsilon)
+{
+    ldouble_t fa = evaluateProgramVariables(p, a, values);
+    ldouble_t fb = evaluateProgramVariables(p, b, values);
+    ldouble_t c = 0;
+    int iterations = 0;
+    if (fa * fb > 0)
+    {
+        return NAN;
+    }
+    while ((b - a) > epsilon)
+    {
+        if (++iterations > SOLVER_MAX_ITERATIONS)
+        {
+            return NAN;
+        }
+        c = (a + b) / 2;
+        ldouble_t fc = evaluateProgramVariables(p, c, values);
+        if (ABS(fc) < epsilon)
+        {
+            break;
+        }
+        else if (fa * fc < 0)
+        {
+            b = c;
+            fb = fc;
+        } else {
+            a = c;
+            fa = fc;
+        }
+    }
+    return c;
+}
+
+ldouble_t solveRegulaFalsi(EVALABLE *e, ldouble_t a, ldouble_t b, ldouble_t epsilon)
+{
+    Program *p = compileProgram(e);
+    ldouble_t result = solveRegulaFalsiProgram(p, NULL, a, b, epsilon);
+    destroyProgram(p);
+    return result;
+}
+
+ldouble_t solveRegulaFalsiProgram(Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b, ldouble_t epsilon)
+{
+    ldouble_t fa = evaluateProgramVariables(p, a, values);
+    ldouble_t fb = evaluateProgramVariables(p, b, values);
+    ldouble_t c = 0;
+    int iterations = 0;
+    if (fa * fb > 0)
+    {
+        return NAN;
+    }
+    while ((b - a) > epsilon)
+    {
+        if (++iterations > SOLVER_MAX_ITERATIONS)
+        {
+            return NAN;
+        }
+        c = (a * fb - b * fa) / (fb - fa);
+        ldouble_t fc = evaluateProgramVariables(p, c, values);
+        if (ABS(fc) < epsilon)
+        {
+            break;
+        }
+        else if (fa * fc < 0)
+        {
+            b = c;
+            fb = fc;
+        } else {
+            a = c;
+            fa = fc;
+        }
+    }
+    return c;
+}
+
+ldouble_t solveNewtonRaphson(EVALABLE *e, ldouble_t x0, ldouble_t epsilon)
+{
+    Program *p = compileProgram(e);
+    ldouble_t result = solveNewtonRaphsonProgram(p, NULL, x0, epsilon);
+    destroyProgram(p);
+    return result;
+}
+
+ldouble_t solveNewtonRaphsonProgram(Program *p, const ldouble_t *values, ldouble_t x0, ldouble_t epsilon)
+{
+    /* f(x) and the exact f'(x) are evaluated together in one pass */
+    ldouble_t x = x0;
+    Dual fx = evaluateProgramDualVariables(p, x, values);
+    int iterations = 0;
+    while (ABS(fx.value) > epsilon)
+    {
+        if (++iterations > SOLVER_MAX_ITERATIONS)
+        {
+            return NAN;
+        }
+        x = x - fx.value / fx.derivative;
+        fx = evaluateProgramDualVariables(p, x, values);
+    }
+    return isfinite(fx.value) ? x : NAN;
+}
+
+/*
+ * The integrators generate their sample points in blocks of EVAL_BATCH_SIZE
+ * and evaluate each block with evaluateIntegrand(). The points and the order
+ * of the sums are the same as evaluating them one by one.
+ *
+ * The points are split into chunks of INTEGRATION_CHUNK points that are
+ * summed on the thread pool, each chunk has its own partial sum and the
+ * partial sums are added in the order of the chunks. The chunks do not
+ * depend on the number of threads, so neither does the result. When n is
+ * at most INTEGRATION_CHUNK there is one chunk and the result is the same
+ * as a single loop over the points.
+ *
+ * In order to change the number of points in a chunk change
+ * INTEGRATION_CHUNK, it must be a multiple of 3.
+ * i.e. gcc -DINTEGRATION_CHUNK=262143 ...
+*/
+#ifndef INTEGRATION_CHUNK
+#define INTEGRATION_CHUNK 65532
+#endif
+
+typedef struct {
+    EVALABLE *e;
+    Program *p;
+    const ldouble_t *values;
+    ldouble_t a;
+    ldouble_t h;
+    int n;
+    ldouble_t *sums;
+    ldouble_t *sums2;
+} IntegrationContext;
+
+/*
+ * Evaluate y[i] = f(x[i]) with the machine code of the program compiled from
+ * the expression, or with evaluateBatch() when the program has none. The
+ * vector math kernels are faster than calling libm from the machine code,
+ * so evaluateBatch() is always used when they are built. values are the
+ * values of the other variables, NULL if there are none.
+*/
+void evaluateIntegrand(EVALABLE *e, Program *p, const ldouble_t *values, const ldouble_t *x, ldouble_t *y, int n)
+{
+#if defined(USE_JIT) && !defined(USE_AVX2_KERNELS)
+    if (p->native != NULL && (values != NULL || p->variableCount == 1))
+    {
+        p->native->batchVariables(x, y, n, values);
+        return;
+    }
+#else
+    UNUSED(p);
+#endif
+    evaluateBatchVariables(e, values, x, y, n);
+}
+
+/* The number of chunks of the points, written so that it does not overflow when points is near INT_MAX */
+int integrationChunks(int points)
+{
+    return points > 0 ? (points - 1) / INTEGRATION_CHUNK + 1 : 0;
+}
+
+/* Sums the inner points 1 + [chunk * INTEGRATION_CHUNK, ...) of the chunks [begin, end) */
+void integrateTrapezChunks(void *context, int begin, int end)
+{
+    IntegrationContext *ctx = (IntegrationContext *)context;
+    ldouble_t xs[EVAL_BATCH_SIZE];
+    ldouble_t ys[EVAL_BATCH_SIZE];
+    int chunk, i, j, count, last;
+    for (chunk = begin; chunk < end; chunk++)
+    {
+        ldouble_t sum = 0;
+        i = 1 + chunk * INTEGRATION_CHUNK;
+        last = i + MIN(INTEGRATION_CHUNK, ctx->n - i);
+        for (; i < last; i += count)
+        {
+            count = MIN(EVAL_BATCH_SIZE, last - i);
+            for (j = 0; j < count; j++)
+            {
+                xs[j] = ctx->a + (i + j) * ctx->h;
+            }
+            evaluateIntegrand(ctx->e, ctx->p, ctx->values, xs, ys, count);
+            for (j = 0; j < count; j++)
+            {
+                sum += ys[j];
+            }
+        }
+        ctx->sums[chunk] = sum;
+    }
+}
+
+ldouble_t integrateTrapez(EVALABLE *e, ldouble_t a, ldouble_t b, int n)
+{
+    Program *p = compileProgram(e);
+    ldouble_t result = integrateTrapezProgram(e, p, NULL, a, b, n);
+    destroyProgram(p);
+    return result;
+}
+
+ldouble_t integrateTrapezProgram(EVALABLE *e, Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b, int n)
+{
+    IntegrationContext ctx;
+    ldouble_t xs[2];
+    ldouble_t ys[2];
+    ldouble_t sum = 0;
+    int chunks = integrationChunks(n - 1);
+    int i;
+    ctx.e = e;
+    ctx.p = p;
+    ctx.values = values;
+    ctx.a = a;
+    ctx.h = (b - a) / n;
+    ctx.n = n;
+    ctx.sums = (ldouble_t *)malloc((chunks + 1) * sizeof(ldouble_t));
+    parallelFor(chunks, parallelGrain(chunks, INTEGRATION_CHUNK), integrateTrapezChunks, &ctx);
+    for (i = 0; i < chunks; i++)
+    {
+        sum += ctx.sums[i];
+    }
+    free(ctx.sums);
+
+    xs[0] = a;
+    xs[1] = b;
+    evaluateIntegrand(e, p, values, xs, ys, 2);
+    return ctx.h * (ys[0] + ys[1] + 2 * sum) / 2;
+}
+
+/* Sums the even and the odd inner points of the chunks [begin, end) separately */
+void integrateSimpson13Chunks(void *context, int begin, int end)
+{
+    IntegrationContext *ctx = (IntegrationContext *)context;
+    ldouble_t xs[EVAL_BATCH_SIZE];
+    ldouble_t ys[EVAL_BATCH_SIZE];
+    int chunk, i, j, count, last;
+    for (chunk = begin; chunk < end; chunk++)
+    {
+        ldouble_t sum1 = 0;
+        ldouble_t sum2 = 0;
+        i = 1 + chunk * INTEGRATION_CHUNK;
+        last = i + MIN(INTEGRATION_CHUNK, ctx->n - i);
+        for (; i < last; i += count)
+        {
+            count = MIN(EVAL_BATCH_SIZE, last - i);
+            for (j = 0; j < count; j++)
+            {
+                xs[j] = ctx->a + (i + j) * ctx->h;
+            }
+            evaluateIntegrand(ctx->e, ctx->p, ctx->values, xs, ys, count);
+            for (j = 0; j < count; j++)
+            {
+                if ((i + j) % 2 == 0)
+                {
+                    sum1 += ys[j];
+                } else
+                {
+                    sum2 += ys[j];
+                }
+            }
+        }
+        ctx->sums[chunk] = sum1;
+        ctx->sums2[chunk] = sum2;
+    }
+}
+
+ldouble_t integrateSimpson13(EVALABLE *e, ldouble_t a, ldouble_t b, int n)
+{
+    Program *p = compileProgram(e);
+    ldouble_t result = integrateSimpson13Program(e, p, NULL, a, b, n);
+    destroyProgram(p);
+    return result;
+}
+
+ldouble_t integrateSimpson13Program(EVALABLE *e, Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b, int n)
+{
+    if (n % 2 != 0)
+    {
+        printf("n must be even for Simpson's 1/3 rule.\n");
+        return NAN;
+    }
+    IntegrationContext ctx;
+    ldouble_t xs[2];
+    ldouble_t ys[2];
+    ldouble_t sum1 = 0;
+    ldouble_t sum2 = 0;
+    int chunks = integrationChunks(n - 1);
+    int i;
+    ctx.e = e;
+    ctx.p = p;
+    ctx.values = values;
+    ctx.a = a;
+    ctx.h = (b - a) / n;
+    ctx.n = n;
+    ctx.sums = (ldouble_t *)malloc((chunks + 1) * sizeof(ldouble_t));
+    ctx.sums2 = (ldouble_t *)malloc((chunks + 1) * sizeof(ldouble_t));
+    parallelFor(chunks, parallelGrain(chunks, INTEGRATION_CHUNK), integrateSimpson13Chunks, &ctx);
+    for (i = 0; i < chunks; i++)
+    {
+        sum1 += ctx.sums[i];
+        sum2 += ctx.sums2[i];
+    }
+    free(ctx.sums);
+    free(ctx.sums2);
+
+    xs[0] = a;
+    xs[1] = b;
+    evaluateIntegrand(e, p, values, xs, ys, 2);
+    return (ctx.h / 3) * (ys[0] + ys[1] + 2 * sum1 + 4 * sum2);
+}
+
+/* Sums the subintervals [chunk * INTEGRATION_CHUNK / 3, ...) of the chunks [begin, end) */
+void integrateSimpson38Chunks(void *context, int begin, int end)
+{
+    /* each subinterval needs its two inner points and its right end, the
+     * left end is the right end of the previous subinterval */
+    IntegrationContext *ctx = (IntegrationContext *)context;
+    ldouble_t xs[EVAL_BATCH_SIZE];
+    ldouble_t ys[EVAL_BATCH_SIZE];
+    ldouble_t h = ctx->h;
+    int chunk, i, j, count, last;
+    for (chunk = begin; chunk < end; chunk++)
+    {
+        ldouble_t sum = 0;
+        ldouble_t a, b, fa;
+        i = chunk * (INTEGRATION_CHUNK / 3);
+        last = i + MIN(INTEGRATION_CHUNK / 3, ctx->n - i);
+        a = chunk == 0 ? ctx->a : ctx->a + i * h;
+        xs[0] = a;
+        evaluateIntegrand(ctx->e, ctx->p, ctx->values, xs, ys, 1);
+        fa = ys[0];
+        for (; i < last; i += count)
+        {
+            count = MIN(EVAL_BATCH_SIZE / 3, last - i);
+            ldouble_t left = a;
+            for (j = 0; j < count; j++)
+            {
+                b = left + h;
+                xs[3 * j] = left + (b - left) / 3;
+                xs[3 * j + 1] = left + 2 * (b - left) / 3;
+                xs[3 * j + 2] = b;
+                left = b;
+            }
+            evaluateIntegrand(ctx->e, ctx->p, ctx->values, xs, ys, 3 * count);
+            for (j = 0; j < count; j++)
+            {
+                b = a + h;
+                sum += (b - a) / 8 * (fa + 3 * ys[3 * j] + 3 * ys[3 * j + 1] + ys[3 * j + 2]);
+                fa = ys[3 * j + 2];
+                a = b;
+            }
+        }
+        ctx->sums[chunk] = sum;
+    }
+}
+
+ldouble_t integrateSimpson38(EVALABLE *e, ldouble_t a, ldouble_t b, int n)
+{
+    Program *p = compileProgram(e);
+    ldouble_t result = integrateSimpson38Program(e, p, NULL, a, b, n);
+    destroyProgram(p);
+    return result;
+}
+
+ldouble_t integrateSimpson38Program(EVALABLE *e, Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b, int n)
+{
+    IntegrationContext ctx;
+    ldouble_t sum = 0;
+    int chunks = n > 0 ? (n - 1) / (INTEGRATION_CHUNK / 3) + 1 : 0;
+    int i;
+    ctx.e = e;
+    ctx.p = p;
+    ctx.values = values;
+    ctx.a = a;
+    ctx.h = (b - a) / n;
+    ctx.n = n;
+    ctx.sums = (ldouble_t *)malloc((chunks + 1) * sizeof(ldouble_t));
+    parallelFor(chunks, parallelGrain(chunks, INTEGRATION_CHUNK), integrateSimpson38Chunks, &ctx);
+    for (i = 0; i < chunks; i++)
+    {
+        sum += ctx.sums[i];
+    }
+    free(ctx.sums);
+    return sum;
+}
+
+/*
+ * The adaptive integrators spend their evaluations where the function is
+ * hard to integrate. Adaptive Simpson passes the values at the ends and
+ * the middle of an interval to its halves, so each step evaluates only
+ * the two new quarter points. Gauss-Kronrod evaluates the 15 points of an
+ * interval with one evaluateIntegrand() call.
+ *
+ * A function value that is not finite makes the estimates NaN, so both of
+ * them return NaN instead of subdividing to their limits.
+ *
+ * In order to change the limits of the subdivision change
+ * ADAPTIVE_MAX_DEPTH (the number of times an interval can be halved in
+ * adaptive Simpson), ADAPTIVE_MAX_EVALUATIONS (the number of evaluations
+ * after which adaptive Simpson stops halving) and ADAPTIVE_MAX_INTERVALS
+ * (the number of intervals in Gauss-Kronrod).
+ * i.e. gcc -DADAPTIVE_MAX_INTERVALS=10000 ...
+*/
+#ifndef ADAPTIVE_MAX_DEPTH
+#define ADAPTIVE_MAX_DEPTH 50
+#endif
+#ifndef ADAPTIVE_MAX_EVALUATIONS
+#define ADAPTIVE_MAX_EVALUATIONS 200000
+#endif
+#ifndef ADAPTIVE_MAX_INTERVALS
+#define ADAPTIVE_MAX_INTERVALS 2000
+#endif
+
+typedef struct {
+    Program *p;
+    const ldouble_t *values;
+    int evaluations;
+} AdaptiveContext;
+
+ldouble_t adaptiveSimpsonStep(AdaptiveContext *ctx, ldouble_t a, ldouble_t b, ldouble_t fa, ldouble_t fm,
+                              ldouble_t fb, ldouble_t whole, ldouble_t tolerance, int depth)
+{
+    ldouble_t m = (a + b) / 2;
+    ldouble_t lm = (a + m) / 2;
+    ldouble_t rm = (m + b) / 2;
+    ldouble_t flm = evaluateProgramVariables(ctx->p, lm, ctx->values);
+    ldouble_t frm = evaluateProgramVariables(ctx->p, rm, ctx->values);
+    ldouble_t left = (m - a) / 6 * (fa + 4 * flm + fm);
+    ldouble_t right = (b - m) / 6 * (fm + 4 * frm + fb);
+    ldouble_t delta = left + right - whole;
+    ctx->evaluations += 2;
+    if (!isfinite(delta))
+    {
+        return NAN;
+    }
+    /* the error of left + right is about delta / 15 */
+    if (depth <= 0 || ABS(delta) <= 15 * tolerance || lm <= a || rm >= b ||
+        ctx->evaluations >= ADAPTIVE_MAX_EVALUATIONS)
+    {
+        return left + right + delta / 15;
+    }
+    return adaptiveSimpsonStep(ctx, a, m, fa, flm, fm, left, tolerance / 2, depth - 1) +
+           adaptiveSimpsonStep(ctx, m, b, fm, frm, fb, right, tolerance / 2, depth - 1);
+}
+
+ldouble_t integrateAdaptiveSimpson(EVALABLE *e, ldouble_t a, ldouble_t b, ldouble_t tolerance, int *evaluations)
+{
+    Program *p = compileProgram(e);
+    ldouble_t result = integrateAdaptiveSimpsonProgram(p, NULL, a, b, tolerance, evaluations);
+    destroyProgram(p);
+    return result;
+}
+
+ldouble_t integrateAdaptiveSimpsonProgram(Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b,
+                                          ldouble_t tolerance, int *evaluations)
+{
+    AdaptiveContext ctx;
+    ldouble_t fa, fm, fb, result;
+    ctx.p = p;
+    ctx.values = values;
+    fa = evaluateProgramVariables(p, a, values);
+    fm = evaluateProgramVariables(p, (a + b) / 2, values);
+    fb = evaluateProgramVariables(p, b, values);
+    ctx.evaluations = 3;
+    result = (b - a) / 6 * (fa + 4 * fm + fb);
+    if (isfinite(result))
+    {
+        result = adaptiveSimpsonStep(&ctx, a, b, fa, fm, fb, result, ABS(tolerance), ADAPTIVE_MAX_DEPTH);
+    }
+    else
+    {
+        result = NAN;
+    }
+    if (evaluations != NULL)
+    {
+        *evaluations = ctx.evaluations;
+    }
+    return result;
+}
+
+/* Nodes of the 15 point Kronrod rule on [-1, 1], the odd ones are the nodes of the 7 point Gauss rule */
+const ldouble_t kronrodNodes[8] = {
+    0.991455371120812639206854697526329L, 0.949107912342758524526189684047851L,
+    0.864864423359769072789712788640926L, 0.741531185599394439863864773280788L,
+    0.586087235467691130294144845693013L, 0.405845151377397166906606412076961L,
+    0.207784955007898467600689403773245L, 0.000000000000000000000000000000000L};
+const ldouble_t kronrodWeights[8] = {
+    0.022935322010529224963732008058970L, 0.063092092629978553290700663189204L,
+    0.104790010322250183839876322541518L, 0.140653259715525918745189590510238L,
+    0.169004726639267902826583426598550L, 0.190350578064785409913256402421014L,
+    0.204432940075298892414161999234649L, 0.209482141084727828012999174891714L};
+const ldouble_t gaussWeights[4] = {
+    0.129484966168869693270611432679082L, 0.279705391489276667901467771423780L,
+    0.381830050505118944950369775488975L, 0.417959183673469387755102040816327L};
+
+typedef struct {
+    ldouble_t a;
+    ldouble_t b;
+    ldouble_t result;
+    ldouble_t error;
+} QuadratureInterval;
+
+/* Integrate [interval->a, interval->b] with the 15 point Kronrod rule, the error is the difference to the 7 point Gauss rule */
+void gaussKronrodInterval(EVALABLE *e, Program *p, const ldouble_t *values, QuadratureInterval *interval)
+{
+    ldouble_t xs[15];
+    ldouble_t ys[15];
+    ldouble_t center = (interval->a + interval->b) / 2;
+    ldouble_t half = (interval->b - interval->a) / 2;
+    ldouble_t kronrod, gauss;
+    int i;
+    for (i = 0; i < 7; i++)
+    {
+        xs[2 * i] = center - half * kronrodNodes[i];
+        xs[2 * i + 1] = center + half * kronrodNodes[i];
+    }
+    xs[14] = center;
+    evaluateIntegrand(e, p, values, xs, ys, 15);
+
+    kronrod = kronrodWeights[7] * ys[14];
+    gauss = gaussWeights[3] * ys[14];
+    for (i = 0; i < 7; i++)
+    {
+        kronrod += kronrodWeights[i] * (ys[2 * i] + ys[2 * i + 1]);
+        if (i % 2 == 1)
+        {
+            gauss += gaussWeights[i / 2] * (ys[2 * i] + ys[2 * i + 1]);
+        }
+    }
+    interval->result = kronrod * half;
+    interval->error = ABS((kronrod - gauss) * half);
+}
+
+ldouble_t integrateGaussKronrod(EVALABLE *e, ldouble_t a, ldouble_t b, ldouble_t tolerance, int *evaluations)
+{
+    Program *p = compileProgram(e);
+    ldouble_t result = integrateGaussKronrodProgram(e, p, NULL, a, b, tolerance, evaluations);
+    destroyProgram(p);
+    return result;
+}
+
+ldouble_t integrateGaussKronrodProgram(EVALABLE *e, Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b,
+                                       ldouble_t tolerance, int *evaluations)
+{
+    QuadratureInterval *intervals;
+    ldouble_t result, error;
+    int count, worst, i;
+    intervals = (QuadratureInterval *)malloc(ADAPTIVE_MAX_INTERVALS * sizeof(QuadratureInterval));
+    intervals[0].a = a;
+    intervals[0].b = b;
+    gaussKronrodInterval(e, p, values, &intervals[0]);
+    count = 1;
+    result = intervals[0].result;
+    error = intervals[0].error;
+
+    while (error > ABS(tolerance) && count < ADAPTIVE_MAX_INTERVALS)
+    {
+        worst = 0;
+        for (i = 1; i < count; i++)
+        {
+            if (intervals[i].error > intervals[worst].error)
+            {
+                worst = i;
+            }
+        }
+        ldouble_t m = (intervals[worst].a + intervals[worst].b) / 2;
+        if (m <= intervals[worst].a || m >= intervals[worst].b)
+        {
+            break;
+        }
+        intervals[count].a = m;
+        intervals[count].b = intervals[worst].b;
+        intervals[worst].b = m;
+        gaussKronrodInterval(e, p, values, &intervals[worst]);
+        gaussKronrodInterval(e, p, values, &intervals[count]);
+        count++;
+
+        /* sum again instead of updating, so the rounding errors do not add up */
+        result = 0;
+        error = 0;
+        for (i = 0; i < count; i++)
+        {
+            result += intervals[i].result;
+            error += intervals[i].error;
+        }
+    }
+
+    free(intervals);
+    if (evaluations != NULL)
+    {
+        *evaluations = 15 * (2 * count - 1);
+    }
+    return result;
+}
+
+/*
+ * Romberg's method halves the step of the trapezoid rule at each level.
+ * The trapezoid sum of the previous level is reused, a level evaluates
+ * only the new midpoints. The midpoints are evaluated in blocks of
+ * EVAL_BATCH_SIZE.
+ *
+ * In order to change the number of levels (the last level has
+ * 2^(ROMBERG_MAX_LEVELS - 1) subintervals) change ROMBERG_MAX_LEVELS.
+ * The result is not accepted before ROMBERG_MIN_LEVELS levels, so that
+ * the first few samples can not agree by chance. A trapezoid sum that is
+ * not finite stops the method, the result is NaN.
+ * i.e. gcc -DROMBERG_MAX_LEVELS=20 ...
+*/
+#ifndef ROMBERG_MAX_LEVELS
+#define ROMBERG_MAX_LEVELS 25
+#endif
+#ifndef ROMBERG_MIN_LEVELS
+#define ROMBERG_MIN_LEVELS 4
+#endif
+
+ldouble_t integrateRomberg(EVALABLE *e, ldouble_t a, ldouble_t b, ldouble_t tolerance, int *evaluations)
+{
+    Program *p = compileProgram(e);
+    ldouble_t result = integrateRombergProgram(e, p, NULL, a, b, tolerance, evaluations);
+    destroyProgram(p);
+    return result;
+}
+
+ldouble_t integrateRombergProgram(EVALABLE *e, Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b,
+                                  ldouble_t tolerance, int *evaluations)
+{
+    ldouble_t previous[ROMBERG_MAX_LEVELS];
+    ldouble_t current[ROMBERG_MAX_LEVELS];
+    ldouble_t xs[EVAL_BATCH_SIZE];
+    ldouble_t ys[EVAL_BATCH_SIZE];
+    ldouble_t h = b - a;
+    ldouble_t result;
+    int count = 2;
+    int level, i, j, k, points, block;
+
+    xs[0] = a;
+    xs[1] = b;
+    evaluateIntegrand(e, p, values, xs, ys, 2);
+    previous[0] = h * (ys[0] + ys[1]) / 2;
+    result = previous[0];
+
+    for (level = 1; level < ROMBERG_MAX_LEVELS && isfinite(result); level++)
+    {
+        /* T(h / 2) = T(h) / 2 + h / 2 * (sum of the midpoints) */
+        ldouble_t sum = 0;
+        points = 1 << (level - 1);
+        for (i = 0; i < points; i += block)
+        {
+            block = MIN(EVAL_BATCH_SIZE, points - i);
+            for (j = 0; j < block; j++)
+            {
+                xs[j] = a + (2 * (i + j) + 1) * (h / 2);
+            }
+            evaluateIntegrand(e, p, values, xs, ys, block);
+            for (j = 0; j < block; j++)
+            {
+                sum += ys[j];
+            }
+        }
+        count += points;
+        h /= 2;
+        current[0] = previous[0] / 2 + h * sum;
+
+        /* Richardson extrapolation, R(level, k) removes the h^(2k) error term */
+        ldouble_t factor = 1;
+        for (k = 1; k <= level; k++)
+        {
+            factor *= 4;
+            current[k] = current[k - 1] + (current[k - 1] - previous[k - 1]) / (factor - 1);
+        }
+
+        result = current[level];
+        if (level >= ROMBERG_MIN_LEVELS && ABS(current[level] - previous[level - 1]) <= ABS(tolerance))
+        {
+            break;
+        }
+        memcpy(previous, current, (level + 1) * sizeof(ldouble_t));
+    }
+
+    if (evaluations != NULL)
+    {
+        *evaluations = count;
+    }
+    return isfinite(result) ? result : NAN;
+}
+
+/*
+ * The nodes of the order point Gauss-Legendre rule are the roots of the
+ * Legendre polynomial P_order, they are found with Newton's method starting
+ * from an approximation. The nodes and weights of an order are computed
+ * the first time the order is used and are kept until the program ends.
+ *
+ * In order to change the biggest supported order change
+ * GAUSS_LEGENDRE_MAX_ORDER.
+ * i.e. gcc -DGAUSS_LEGENDRE_MAX_ORDER=256 ...
+*/
+#ifndef GAUSS_LEGENDRE_MAX_ORDER
+#define GAUSS_LEGENDRE_MAX_ORDER 128
+#endif
+
+typedef struct {
+    ldouble_t *nodes;
+    ldouble_t *weights;
+} GaussLegendreRule;
+
+GaussLegendreRule gaussLegendreRules[GAUSS_LEGENDRE_MAX_ORDER + 1];
+pthread_mutex_t gaussLegendreLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Get the nodes and weights of the order point Gauss-Legendre rule on [-1, 1]
+ *
+ * Parameters:
+ * - order: The number of points
+ * Returns:
+ * - The rule, NULL if the order is not supported
+*/
+GaussLegendreRule *getGaussLegendreRule(int order)
+{
+    GaussLegendreRule *rule;
+    int i, j, iteration;
+    if (order < 1 || order > GAUSS_LEGENDRE_MAX_ORDER)
+    {
+        return NULL;
+    }
+    rule = &gaussLegendreRules[order];
+    pthread_mutex_lock(&gaussLegendreLock);
+    if (rule->nodes == NULL)
+    {
+        ldouble_t *nodes = (ldouble_t *)malloc(order * sizeof(ldouble_t));
+        ldouble_t *weights = (ldouble_t *)malloc(order * sizeof(ldouble_t));
+        /* the rule is symmetric, find the positive roots and mirror them */
+        for (i = 0; i < (order + 1) / 2; i++)
+        {
+            ldouble_t x = cos(M_PI * (i + 0.75) / (order + 0.5));
+            ldouble_t p0, p1, dp, dx;
+            for (iteration = 0; iteration < 100; iteration++)
+            {
+                /* P_j(x) = ((2j - 1) x P_(j-1)(x) - (j - 1) P_(j-2)(x)) / j */
+                p0 = 1;
+                p1 = 0;
+                for (j = 1; j <= order; j++)
+                {
+                    ldouble_t p2 = p1;
+                    p1 = p0;
+                    p0 = ((2 * j - 1) * x * p1 - (j - 1) * p2) / j;
+                }
+                dp = order * (x * p0 - p1) / (x * x - 1);
+                dx = p0 / dp;
+                x -= dx;
+                if (x - dx == x)
+                {
+                    break;
+                }
+            }
+            /* the derivative at the root */
+            p0 = 1;
+            p1 = 0;
+            for (j = 1; j <= order; j++)
+            {
+                ldouble_t p2 = p1;
+                p1 = p0;
+                p0 = ((2 * j - 1) * x * p1 - (j - 1) * p2) / j;
+            }
+            dp = order * (x * p0 - p1) / (x * x - 1);
+            nodes[i] = -x;
+            nodes[order - 1 - i] = x;
+            weights[i] = 2 / ((1 - x * x) * dp * dp);
+            weights[order - 1 - i] = weights[i];
+        }
+        if (order % 2 == 1)
+        {
+            nodes[order / 2] = 0;
+        }
+        rule->weights = weights;
+        rule->nodes = nodes;
+    }
+    pthread_mutex_unlock(&gaussLegendreLock);
+    return rule;
+}
+
+ldouble_t integrateGaussLegendre(EVALABLE *e, ldouble_t a, ldouble_t b, int order, int n)
+{
+    Program *p = compileProgram(e);
+    ldouble_t result = integrateGaussLegendreProgram(e, p, NULL, a, b, order, n);
+    destroyProgram(p);
+    return result;
+}
+
+ldouble_t integrateGaussLegendreProgram(EVALABLE *e, Program *p, const ldouble_t *values, ldouble_t a, ldouble_t b,
+                                        int order, int n)
+{
+    GaussLegendreRule *rule;
+    if (n < 1)
+    {
+        printf("The number of subintervals must be positive.\n");
+        return NAN;
+    }
+    rule = getGaussLegendreRule(order);
+    if (rule == NULL)
+    {
+        printf("The order must be between 1 and %d.\n", GAUSS_LEGENDRE_MAX_ORDER);
+        return NAN;
+    }
+    ldouble_t xs[EVAL_BATCH_SIZE];
+    ldouble_t ys[EVAL_BATCH_SIZE];
+    ldouble_t h = (b - a) / n;
+    ldouble_t sum = 0;
+    long long total = (long long)order * n;
+    long long i;
+    int j, count;
+    /* point i is node i % order of subinterval i / order */
+    for (i = 0; i < total; i += count)
+    {
+        count = (int)MIN((long long)EVAL_BATCH_SIZE, total - i);
+        for (j = 0; j < count; j++)
+        {
+            long long k = i + j;
+            ldouble_t left = a + (k / order) * h;
+            xs[j] = left + h / 2 * (1 + rule->nodes[k % order]);
+        }
+        evaluateIntegrand(e, p, values, xs, ys, count);
+        for (j = 0; j < count; j++)
+        {
+            sum += rule->weights[(i + j) % order] * ys[j];
+        }
+    }
+    return h / 2 * sum;
+}
+
+/* Parameter sweep */
+
+/*
+ * A sweep runs one solver or integrator for each point of a grid of
+ * parameters, i.e. the root of x^(2) - a for a = 1, 2, ..., 1000. The
+ * letters other than x are the parameters (see the variable table), the
+ * function is parsed, optimized and compiled once and each point runs the
+ * same program with its own values of the parameters.
+ *
+ * The points are independent, they are run on the thread pool and each
+ * result has its own place, so the results do not depend on the number of
+ * threads. When there are fewer points than threads they are run one after
+ * another, so the integrators can use the threads instead.
+ *
+ * With fold the parameters of each point are replaced by constants and
+ * the function is optimized and compiled again. It costs a compile for
+ * each point, it pays off when the parameters make a part of the function
+ * constant, i.e. a^(2) * sin(b) * x becomes one constant times x.
+*/
+
+typedef enum _Method {
+    METHOD_BISECTION,
+    METHOD_REGULA_FALSI,
+    METHOD_NEWTON_RAPHSON,
+    METHOD_TRAPEZ,
+    METHOD_SIMPSON13,
+    METHOD_SIMPSON38,
+    METHOD_ADAPTIVE_SIMPSON,
+    METHOD_GAUSS_KRONROD,
+    METHOD_ROMBERG,
+    METHOD_GAUSS_LEGENDRE,
+} Method;
+
+#define METHOD_COUNT 10
+
+const char *methodTitles[METHOD_COUNT] = {
+    "Bisection", "Regula Falsi", "Newton-Raphson", "Trapez rule", "Simpson's 1/3 rule",
+    "Simpson's 3/8 rule", "Adaptive Simpson's rule", "Adaptive Gauss-Kronrod rule", "Romberg's method",
+    "Gauss-Legendre rule"};
+
+/* The names of the methods in the batch files */
+const char *methodNames[METHOD_COUNT] = {
+    "bisection", "regula-falsi", "newton-raphson", "trapez", "simpson13", "simpson38",
+    "adaptive-simpson", "gauss-kronrod", "romberg", "gauss-legendre"};
+
+/*
+ * a and b are the interval, a is the initial guess of Newton-Raphson.
+ * tolerance is the error tolerance of the solvers and the adaptive
+ * integrators, n is the number of subintervals of the other integrators
+ * and order is the number of points of Gauss-Legendre.
+*/
+typedef struct _MethodSettings {
+    Method method;
+    ldouble_t a;
+    ldouble_t b;
+    ldouble_t tolerance;
+    int n;
+    int order;
+} MethodSettings;
+
+/*
+ * A list of points, each point has a value for each parameter. The values
+ * of point i are points[i * parameterCount ...], in the order of indices.
+*/
+typedef struct _SweepGrid {
+    int parameterCount;
+    int indices[VARIABLE_MAX];
+    int pointCount;
+    int maxPoints;
+    ldouble_t *points;
+} SweepGrid;
+
+/*
+ * Find the method with the name
+ *
+ * Parameters:
+ * - name: The name of the method in methodNames
+ * Returns:
+ * - The method, -1 if there is no method with the name
+*/
+int findMethod(const char *name);
+
+/*
+ * The integrators that take n can evaluate at most METHOD_MAX_POINTS
+ * points, n times the order for Gauss-Legendre, so a job of the batch mode,
+ * the sweep or the server can not run for hours.
+ * In order to change the limit change the value of METHOD_MAX_POINTS.
+ * i.e. gcc -DMETHOD_MAX_POINTS=1000000000 analysis.c -o analysis -lm -pthread
+*/
+#ifndef METHOD_MAX_POINTS
+#define METHOD_MAX_POINTS (1 << 26)
+#endif
+
+/*
+ * Check if the settings can be used with the method
+ *
+ * Parameters:
+ * - m: The settings
+ * Returns:
+ * - What is wrong with the settings, NULL if they can be used
+*/
+const char *methodSettingsError(MethodSettings *m);
+
+/*
+ * Check if the method uses the tolerance and gives the number of evaluations
+ *
+ * Parameters:
+ * - method: The method
+ * Returns:
+ * - 1 for the adaptive integrators, 0 otherwise
+*/
+int isAdaptiveMethod(Method method);
+
+/*
+ * Run the method on a compiled function
+ *
+ * Parameters:
+ * - e: The function
+ * - p: The program compiled from e
+ * - values: The values of the variables other than x, NULL if there are none
+ * - m: The method and its settings
+ * - evaluations: Set to the number of function evaluations of the adaptive
+ *   integrators, 0 for the other methods, can be NULL
+ * Returns:
+ * - The root or the integral
+*/
+ldouble_t runMethod(EVALABLE *e, Program *p, const ldouble_t *values, MethodSettings *m, int *evaluations);
+
+/*
+ * Copy the expression with some of the variables replaced by constants
+ *
+ * The Shared nodes are copied as separate subexpressions and the
+ * trigonometric functions are not fused, so the copy can be optimized
+ * again and does not share any node with e.
+ *
+ * Parameters:
+ * - e: The expression
+ * - values: The values of the variables, values[i] for the variable with index i
+ * - count: The variables with the indices 1 to count - 1 are replaced
+ * Returns:
+ * - The new expression
+*/
+EVALABLE *substituteVariables(EVALABLE *e, const ldouble_t *values, int count);
+
+/*
+ * Create a grid without points
+ *
+ * Parameters:
+ * - parameterCount: The number of parameters
+ * - indices: The variable index of each parameter
+ * Returns:
+ * - The created grid
+*/
+SweepGrid *createSweepGrid(int parameterCount, const int *indices);
+
+/*
+ * Create the grid of all the combinations of the values of the parameters,
+ * the last parameter changes fastest
+ *
+ * Parameters:
+ * - parameterCount: The number of parameters
+ * - indices: The variable index of each parameter
+ * - axes: The values of each parameter
+ * - counts: The number of values of each parameter
+ * Returns:
+ * - The created grid
+*/
+SweepGrid *createCartesianGrid(int parameterCount, const int *indices, ldouble_t *const *axes, const int *counts);
+
+/*
+ * Add a point to the end of the grid
+ *
+ * Parameters:
+ * - g: The grid
+ * - point: The value of each parameter
+*/
+void addSweepPoint(SweepGrid *g, const ldouble_t *point);
+
+/*
+ * Destroy the grid and free the memory
+ *
+ * Parameters:
+ * - g: The grid to be destroyed
+*/
+void destroySweepGrid(SweepGrid *g);
+
+/*
+ * Run the method for each point of the grid
+ *
+ * Parameters:
+ * - e: The optimized function
+ * - variableCount: The number of variables of the function, with x
+ * - g: The grid, the variables that are not in it are NAN
+ * - m: The method and its settings
+ * - fold: 1 to optimize the function again for each point with the
+ *   parameters as constants, 0 to compile it once
+ * - results: Set to the result of each point
+ * - evaluations: Set to the number of function evaluations of each point, can be NULL
+ * Returns:
+ * - 0 on success, 1 if the settings can not be used with the method
+*/
+int sweep(EVALABLE *e, int variableCount, SweepGrid *g, MethodSettings *m, int fold,
+          ldouble_t *results, int *evaluations);
+
+/*
+ * Print the grid and the results as a table, a row for each point
+ *
+ * Parameters:
+ * - t: The variable table of the function
+ * - g: The grid
+ * - m: The method
+ * - results: The result of each point
+ * - evaluations: The number of function evaluations of each point, can be NULL
+*/
+void printSweep(VariableTable *t, SweepGrid *g, MethodSettings *m, ldouble_t *results, int *evaluations);
+
+int findMethod(const char *name)
+{
+    int i;
+    for (i = 0; i < METHOD_COUNT; i++)
+    {
+        if (strcmp(methodNames[i], name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *methodSettingsError(MethodSettings *m)
+{
+    switch (m->method)
+    {
+        case METHOD_BISECTION:
+        case METHOD_REGULA_FALSI:
+        case METHOD_NEWTON_RAPHSON:
+        case METHOD_ADAPTIVE_SIMPSON:
+        case METHOD_GAUSS_KRONROD:
+        case METHOD_ROMBERG:
+            return m->tolerance > 0 ? NULL : "The tolerance must be positive.";
+        case METHOD_TRAPEZ:
+        case METHOD_SIMPSON38:
+            if (m->n < 1)
+            {
+                return "n must be positive.";
+            }
+            return m->n > METHOD_MAX_POINTS ? "n is too big." : NULL;
+        case METHOD_SIMPSON13:
+            if (m->n < 1 || m->n % 2 != 0)
+            {
+                return "n must be even for Simpson's 1/3 rule.";
+            }
+            return m->n > METHOD_MAX_POINTS ? "n is too big." : NULL;
+        case METHOD_GAUSS_LEGENDRE:
+            if (m->order < 1 || m->order > GAUSS_LEGENDRE_MAX_ORDER)
+            {
+                return "The order is not supported.";
+            }
+            if (m->n < 1)
+            {
+                return "n must be positive.";
+            }
+            return (long long)m->n * m->order > METHOD_MAX_POINTS ? "n is too big." : NULL;
+        default:
+            return "Invalid method.";
+    }
+}
+
+int isAdaptiveMethod(Method method)
+{
+    return method == METHOD_ADAPTIVE_SIMPSON || method == METHOD_GAUSS_KRONROD || method == METHOD_ROMBERG;
+}
+
+ldouble_t runMethod(EVALABLE *e, Program *p, const ldouble_t *values, MethodSettings *m, int *evaluations)
+{
+    if (evaluations != NULL)
+    {
+        *evaluations = 0;
+    }
+    switch (m->method)
+    {
+        case METHOD_BISECTION:
+            return solveBisectionProgram(p, values, m->a, m->b, m->tolerance);
+        case METHOD_REGULA_FALSI:
+            return solveRegulaFalsiProgram(p, values, m->a, m->b, m->tolerance);
+        case METHOD_NEWTON_RAPHSON:
+            return solveNewtonRaphsonProgram(p, values, m->a, m->tolerance);
+        case METHOD_TRAPEZ:
+            return integrateTrapezProgram(e, p, values, m->a, m->b, m->n);
+        case METHOD_SIMPSON13:
+            return integrateSimpson13Program(e, p, values, m->a, m->b, m->n);
+        case METHOD_SIMPSON38:
+            return integrateSimpson38Program(e, p, values, m->a, m->b, m->n);
+        case METHOD_ADAPTIVE_SIMPSON:
+            return integrateAdaptiveSimpsonProgram(p, values, m->a, m->b, m->tolerance, evaluations);
+        case METHOD_GAUSS_KRONROD:
+            return integrateGaussKronrodProgram(e, p, values, m->a, m->b, m->tolerance, evaluations);
+        case METHOD_ROMBERG:
+            return integrateRombergProgram(e, p, values, m->a, m->b, m->tolerance, evaluations);
+        case METHOD_GAUSS_LEGENDRE:
+            return integrateGaussLegendreProgram(e, p, values, m->a, m->b, m->order, m->n);
+        default:
+            return NAN;
+    }
+}
+
+EVALABLE *substituteVariables(EVALABLE *e, const ldouble_t *values, int count)
+{
+    switch (EVALTYPE(e))
+    {
+        case VARIABLE:
+        {
+            Variable *v = (Variable *)e;
+            if (v->index > 0 && v->index < count)
+            {
+                return (EVALABLE *)createConstant(values[v->index]);
+            }
+            return (EVALABLE *)createVariable(v->index, v->name);
+        }
+        case EXPONENTIAL:
+            return (EVALABLE *)createExponential(
+                substituteVariables(((Exponential *)e)->base, values, count),
+                substituteVariables(((Exponential *)e)->exponent, values, count)
+            );
+        case TRIGONOMETRIC:
+            return (EVALABLE *)createTrigonometric(
+                ((Trigonometric *)e)->trigType,
+                substituteVariables(((Trigonometric *)e)->arg, values, count)
+            );
+        case INVERSE_TRIGONOMETRIC:
+            return (EVALABLE *)createInverseTrigonometric(
+                ((InverseTrigonometric *)e)->trigType,
+                substituteVariables(((InverseTrigonometric *)e)->arg, values, count)
+            );
+        case LOGARITHM:
+            return (EVALABLE *)createLogarithm(
+                substituteVariables(((Logarithm *)e)->base, values, count),
+                substituteVariables(((Logarithm *)e)->value, values, count)
+            );
+        case SUM_CHAIN:
+        {
+            SumChain *f = createSumChain();
+            int i;
+            for (i = 0; i < ((SumChain *)e)->argCount; i++)
+            {
+                addSumChainArg(f, substituteVariables(((SumChain *)e)->args[i], values, count),
+                               ((SumChain *)e)->isPositive[i]);
+            }
+            return (EVALABLE *)f;
+        }
+        case MUL_CHAIN:
+        {
+            MulChain *m = createMulChain();
+            int i;
+            for (i = 0; i < ((MulChain *)e)->argCount; i++)
+            {
+                addMulChainArg(m, substituteVariables(((MulChain *)e)->args[i], values, count),
+                               ((MulChain *)e)->isDivided[i]);
+            }
+            return (EVALABLE *)m;
+        }
+        case SHARED:
+            return substituteVariables(((Shared *)e)->expr, values, count);
+        default:
+            return copyEvalable(e);
+    }
+}
+
+SweepGrid *createSweepGrid(int parameterCount, const int *indices)
+{
+    SweepGrid *g = (SweepGrid *)malloc(sizeof(SweepGrid));
+    g->parameterCount = parameterCount;
+    memcpy(g->indices, indices, parameterCount * sizeof(int));
+    g->pointCount = 0;
+    g->maxPoints = 16;
+    g->points = (ldouble_t *)malloc((size_t)g->maxPoints * parameterCount * sizeof(ldouble_t));
+    return g;
+}
+
+SweepGrid *createCartesianGrid(int parameterCount, const int *indices, ldouble_t *const *axes, const int *counts)
+{
+    SweepGrid *g = createSweepGrid(parameterCount, indices);
+    ldouble_t point[VARIABLE_MAX] = {0};
+    int position[VARIABLE_MAX];
+    int i;
+    for (i = 0; i < parameterCount; i++)
+    {
+        if (counts[i] < 1)
+        {
+            return g;
+        }
+        position[i] = 0;
+    }
+    while (1)
+    {
+        for (i = 0; i < parameterCount; i++)
+        {
+            point[i] = axes[i][position[i]];
+        }
+        addSweepPoint(g, point);
+        /* count like an odometer, the last parameter is the fastest digit */
+        for (i = parameterCount - 1; i >= 0 && ++position[i] == counts[i]; i--)
+        {
+            position[i] = 0;
+        }
+        if (i < 0)
+        {
+            return g;
+        }
+    }
+}
+
+void addSweepPoint(SweepGrid *g, const ldouble_t *point)
+{
+    if (g->pointCount == g->maxPoints)
+    {
+        g->maxPoints *= 2;
+        g->points = (ldouble_t *)realloc(g->points, (size_t)g->maxPoints * g->parameterCount * sizeof(ldouble_t));
+    }
+    memcpy(g->points + (size_t)g->pointCount * g->parameterCount, point, g->parameterCount * sizeof(ldouble_t));
+    g->pointCount++;
+}
+
+void destroySweepGrid(SweepGrid *g)
+{
+    free(g->points);
+    free(g);
+}
+
+typedef struct {
+    EVALABLE *e;
+    Program *p;
+    int variableCount;
+    SweepGrid *g;
+    MethodSettings *m;
+    int fold;
+    ldouble_t *results;
+    int *evaluations;
+} SweepContext;
+
+/* Runs the method for the points [begin, end) */
+void sweepPoints(void *context, int begin, int end)
+{
+    SweepContext *ctx = (SweepContext *)context;
+    SweepGrid *g = ctx->g;
+    ldouble_t values[VARIABLE_MAX];
+    int i, j;
+    for (i = begin; i < end; i++)
+    {
+        int *evaluations = ctx->evaluations != NULL ? &ctx->evaluations[i] : NULL;
+        for (j = 0; j < ctx->variableCount; j++)
+        {
+            values[j] = NAN;
+        }
+        for (j = 0; j < g->parameterCount; j++)
+        {
+            values[g->indices[j]] = g->points[(size_t)i * g->parameterCount + j];
+        }
+        if (ctx->fold)
+        {
+            /* the folded function lives only for this point, its nodes are released with the arena */
+            Arena *previous = useArena(createArena());
+            EVALABLE *f = substituteVariables(ctx->e, values, ctx->variableCount);
+            f = shareSubexpressions(fuseTrigonometric(optimize(f)));
+            Program *p = compileProgram(f);
+            ctx->results[i] = runMethod(f, p, values, ctx->m, evaluations);
+            destroyProgram(p);
+            destroyArena(useArena(previous));
+        }
+        else
+        {
+            ctx->results[i] = runMethod(ctx->e, ctx->p, values, ctx->m, evaluations);
+        }
+    }
+}
+
+int sweep(EVALABLE *e, int variableCount, SweepGrid *g, MethodSettings *m, int fold,
+          ldouble_t *results, int *evaluations)
+{
+    SweepContext ctx;
+    if (methodSettingsError(m) != NULL)
+    {
+        return 1;
+    }
+    ctx.e = e;
+    ctx.p = fold ? NULL : compileProgram(e);
+    ctx.variableCount = variableCount;
+    ctx.g = g;
+    ctx.m = m;
+    ctx.fold = fold;
+    ctx.results = results;
+    ctx.evaluations = evaluations;
+    if (g->pointCount >= getThreadCount())
+    {
+        parallelFor(g->pointCount, 1, sweepPoints, &ctx);
+    }
+    else
+    {
+        sweepPoints(&ctx, 0, g->pointCount);
+    }
+    if (ctx.p != NULL)
+    {
+        destroyProgram(ctx.p);
+    }
+    return 0;
+}
+
+void printSweep(VariableTable *t, SweepGrid *g, MethodSettings *m, ldouble_t *results, int *evaluations)
+{
+    int i, j;
+    for (j = 0; j < g->parameterCount; j++)
+    {
+        printf("%14c ", t->names[g->indices[j]]);
+    }
+    printf("%14s", m->method <= METHOD_NEWTON_RAPHSON ? "root" : "integral");
+    if (evaluations != NULL)
+    {
+        printf(" %12s", "evaluations");
+    }
+    printf("\n");
+    for (i = 0; i < g->pointCount; i++)
+    {
+        for (j = 0; j < g->parameterCount; j++)
+        {
+            printf("%14" LDOUBLE_PRI " ", g->points[(size_t)i * g->parameterCount + j]);
+        }
+        printf("%14" LDOUBLE_PRI, results[i]);
+        if (evaluations != NULL)
+        {
+            printf(" %12d", evaluations[i]);
+        }
+        printf("\n");
+    }
+}
+
+/* Compiled function cache */
+
+/*
+ * A cache of parsed, optimized and compiled functions keyed by their text,
+ * so a function that is asked for again is not parsed, optimized and
+ * compiled again. The cache keeps at most capacity functions, when it is
+ * full the least recently used one is removed.
+ *
+ * The key is the normal form of the text, the texts that are parsed the
+ * same way have the same key: the spaces between the tokens are removed
+ * and the implicit multiplications are written with '*', so "2x + 1",
+ * "2*x+1" and "2 x+1" are one function. The cache counts the texts that
+ * are found in it (hits) and the ones that are compiled (misses).
+ *
+ * The cache can be used by many threads. A function is used between
+ * acquireFunction() and releaseFunctionCache(), a function that is removed
+ * while a thread is using it is destroyed when the thread releases it.
+ * Each function has its own arena, its nodes are released together.
+ *
+ * In order to change the number of functions that are kept by default
+ * change the value of FUNCTION_CACHE_SIZE.
+ * i.e. gcc -DFUNCTION_CACHE_SIZE=256 ...
+*/
+#ifndef FUNCTION_CACHE_SIZE
+#define FUNCTION_CACHE_SIZE 64
+#endif
+
+typedef struct _CachedFunction {
+    /* the normal form of the text */
+    char *text;
+    unsigned long hash;
+    EVALABLE *e;
+    Program *p;
+    Arena *arena;
+    int references;
+    int cached;
+    /* the list from the most recently used to the least recently used */
+    struct _CachedFunction *previous;
+    struct _CachedFunction *next;
+} CachedFunction;
+
+typedef struct _FunctionCache {
+    int count;
+    int capacity;
+    CachedFunction *head;
+    CachedFunction *tail;
+    long hits;
+    long misses;
+    pthread_mutex_t lock;
+} FunctionCache;
+
+typedef struct _FunctionCacheStatistics {
+    long hits;
+    long misses;
+    int count;
+    int capacity;
+} FunctionCacheStatistics;
+
+/*
+ * Create an empty cache
+ *
+ * Parameters:
+ * - capacity: The number of functions that are kept
+ * Returns:
+ * - The created cache
+*/
+FunctionCache *createFunctionCache(int capacity);
+
+/*
+ * Destroy the cache and the functions in it, none of them can be in use
+ *
+ * Parameters:
+ * - c: The cache to be destroyed
+*/
+void destroyFunctionCache(FunctionCache *c);
+
+/*
+ * Get the compiled function of the text, it is compiled and added to the
+ * cache if it is not in it
+ *
+ * Parameters:
+ * - c: The cache
+ * - text: The function, only x is a variable
+ * - s: Set to the status of parsing, s->pos points into text
+ * Returns:
+ * - The function, NULL if it can not be parsed. It must be given back
+ *   with releaseFunctionCache()
+*/
+CachedFunction *acquireFunction(FunctionCache *c, const char *text, StatusCode *s);
+
+/*
+ * Give back a function that is returned by acquireFunction()
+ *
+ * Parameters:
+ * - c: The cache
+ * - f: The function
+*/
+void releaseFunctionCache(FunctionCache *c, CachedFunction *f);
+
+/*
+ * Get the number of hits and misses and the number of cached functions
+ *
+ * Parameters:
+ * - c: The cache
+ * Returns:
+ * - The statistics
+*/
+FunctionCacheStatistics getFunctionCacheStatistics(FunctionCache *c);
+
+/*
+ * Write the normal form of a function text, it is parsed the same way as
+ * the text. The spaces between the tokens are removed and '*' is written
+ * where CHECK_ARG_AVAILABLE() finds an implicit multiplication (2x,
+ * 2sin(x), (x+1)(x-1)). Only x is a variable.
+ *
+ * Parameters:
+ * - text: The function
+ * - out: Set to the normal form, it must have 2 * strlen(text) + 1 chars
+ * Returns:
+ * - 0 on success, 1 if the text can not be parsed
+*/
+int normalizeFunction(const char *text, char *out);
+
+/* djb2 hash of the text */
+unsigned long hashText(const char *text)
+{
+    unsigned long hash = 5381;
+    while (*text != '\0')
+    {
+        hash = hash * 33 + (unsigned char)*text++;
+    }
+    return hash;
+}
+
+char *normalizeExpression(const char *s, const char *end, char *out);
+
+/* Write the parantheses that start at *s and the normal form inside them, NULL if they are not closed */
+char *normalizeParantheses(const char **s, const char *end, char *out)
+{
+    const char *close = *s + 1;
+    int count = 1;
+    if (*s >= end || **s != '(')
+    {
+        return NULL;
+    }
+    /* the closing paranthesis is found the same way as parseInsideParantheses() */
+    while (close < end)
+    {
+        if (*close == '(')
+        {
+            count++;
+        }
+        else if (*close == ')' && --count == 0)
+        {
+            break;
+        }
+        close++;
+    }
+    if (count > 0)
+    {
+        return NULL;
+    }
+    *out++ = '(';
+    out = normalizeExpression(*s + 1, close, out);
+    if (out == NULL)
+    {
+        return NULL;
+    }
+    *out++ = ')';
+    *s = close + 1;
+    return out;
+}
+
+/*
+ * Write the normal form of the text between s and end, the tokens are
+ * read in the same order as parseExpression() reads them
+ *
+ * Returns:
+ * - The end of the written text, NULL if the text can not be parsed
+*/
+char *normalizeExpression(const char *s, const char *end, char *out)
+{
+    static const char *functions[] = {
+        "sin", "cos", "tan", "csc", "sec", "cot",
+        "asin", "acos", "atan", "acsc", "asec", "acot",
+    };
+    int isArgAvailable = 0;
+    int i;
+    while (s < end && out != NULL)
+    {
+        const char *token = s;
+        int length = 0;
+        int groups = 0;
+        int isLogarithm = 0;
+        if (*s == ' ')
+        {
+            s++;
+            continue;
+        }
+        if ((*s == '*' || *s == '/' || *s == '^') && !isArgAvailable)
+        {
+            return NULL;
+        }
+        if (*s == '+' || *s == '-' || *s == '*' || *s == '/')
+        {
+            isArgAvailable = 0;
+            *out++ = *s++;
+            continue;
+        }
+        if (*s == '^')
+        {
+            *out++ = *s++;
+            out = normalizeParantheses(&s, end, out);
+            isArgAvailable = 1;
+            continue;
+        }
+
+        if (strncmp(s, "log", 3) == 0)
+        {
+            length = 3;
+            groups = 2;
+            isLogarithm = 1;
+        }
+        else if (strncmp(s, "ln", 2) == 0)
+        {
+            length = 2;
+            groups = 1;
+        }
+        else if (*s == '(')
+        {
+            groups = 1;
+        }
+        else if (*s >= '0' && *s <= '9')
+        {
+            while (token + length < end && token[length] >= '0' && token[length] <= '9')
+            {
+                length++;
+            }
+            if (token + length < end && token[length] == '.')
+            {
+                length++;
+                while (token + length < end && token[length] >= '0' && token[length] <= '9')
+                {
+                    length++;
+                }
+            }
+        }
+        else if (*s == 'x' || *s == 'e')
+        {
+            length = 1;
+        }
+        else if (strncmp(s, "pi", 2) == 0 || strncmp(s, "PI", 2) == 0)
+        {
+            length = 2;
+        }
+        else
+        {
+            for (i = 0; i < 12 && length == 0; i++)
+            {
+                if (strncmp(s, functions[i], strlen(functions[i])) == 0)
+                {
+                    length = strlen(functions[i]);
+                    groups = 1;
+                }
+            }
+            if (length == 0)
+            {
+                return NULL;
+            }
+        }
+
+        if (isArgAvailable)
+        {
+            *out++ = '*';
+        }
+        memcpy(out, token, length);
+        out += length;
+        s += length;
+        if (isLogarithm)
+        {
+            /* log_(base)(value) */
+            if (s >= end || *s != '_')
+            {
+                return NULL;
+            }
+            *out++ = *s++;
+        }
+        for (i = 0; i < groups && out != NULL; i++)
+        {
+            out = normalizeParantheses(&s, end, out);
+        }
+        isArgAvailable = 1;
+    }
+    return out;
+}
+
+int normalizeFunction(const char *text, char *out)
+{
+    char *end = normalizeExpression(text, text + strlen(text), out);
+    if (end == NULL)
+    {
+        return 1;
+    }
+    *end = '\0';
+    return 0;
+}
+
+/* Parse, optimize and compile the text into its own arena with its normal form as the key, NULL if it can not be parsed */
+CachedFunction *compileCachedFunction(const char *text, const char *key, unsigned long hash, StatusCode *s)
+{
+    CachedFunction *f;
+    EVALABLE *e;
+    size_t length = strlen(text);
+    char *input = (char *)malloc(length + 1);
+    Arena *previous = useArena(createArena());
+    VariableTable *previousTable = useVariables(NULL);
+    memcpy(input, text, length + 1);
+    s->code = 0;
+    s->pos = NULL;
+    s->expected = '\0';
+    parseExpression(input, &e, s);
+    useVariables(previousTable);
+    if (s->code != 0)
+    {
+        s->pos = (char *)text + (s->pos - input);
+        free(input);
+        destroyArena(useArena(previous));
+        return NULL;
+    }
+    free(input);
+    length = strlen(key);
+    f = (CachedFunction *)malloc(sizeof(CachedFunction));
+    f->text = (char *)malloc(length + 1);
+    memcpy(f->text, key, length + 1);
+    f->hash = hash;
+    f->e = shareSubexpressions(fuseTrigonometric(optimize(e)));
+    f->p = compileProgram(f->e);
+    f->arena = useArena(previous);
+    f->references = 0;
+    f->cached = 0;
+    f->previous = NULL;
+    f->next = NULL;
+    return f;
+}
+
+void destroyCachedFunction(CachedFunction *f)
+{
+    destroyProgram(f->p);
+    destroyArena(f->arena);
+    free(f->text);
+    free(f);
+}
+
+/* Take the function out of the list */
+void unlinkCachedFunction(FunctionCache *c, CachedFunction *f)
+{
+    if (f->previous != NULL)
+    {
+        f->previous->next = f->next;
+    }
+    else
+    {
+        c->head = f->next;
+    }
+    if (f->next != NULL)
+    {
+        f->next->previous = f->previous;
+    }
+    else
+    {
+        c->tail = f->previous;
+    }
+    f->previous = NULL;
+    f->next = NULL;
+}
+
+/* Put the function at the start of the list as the most recently used */
+void pushCachedFunction(FunctionCache *c, CachedFunction *f)
+{
+    f->previous = NULL;
+    f->next = c->head;
+    if (c->head != NULL)
+    {
+        c->head->previous = f;
+    }
+    c->head = f;
+    if (c->tail == NULL)
+    {
+        c->tail = f;
+    }
+}
+
+/* The function with the text, NULL if it is not in the cache */
+CachedFunction *findCachedFunction(FunctionCache *c, const char *text, unsigned long hash)
+{
+    CachedFunction *f;
+    for (f = c->head; f != NULL; f = f->next)
+    {
+        if (f->hash == hash && strcmp(f->text, text) == 0)
+        {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+FunctionCache *createFunctionCache(int capacity)
+{
+    FunctionCache *c = (FunctionCache *)malloc(sizeof(FunctionCache));
+    c->count = 0;
+    c->capacity = MAX(capacity, 1);
+    c->head = NULL;
+    c->tail = NULL;
+    c->hits = 0;
+    c->misses = 0;
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+void destroyFunctionCache(FunctionCache *c)
+{
+    while (c->head != NULL)
+    {
+        CachedFunction *f = c->head;
+        unlinkCachedFunction(c, f);
+        destroyCachedFunction(f);
+    }
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+CachedFunction *acquireFunction(FunctionCache *c, const char *text, StatusCode *s)
+{
+    char *key = (char *)malloc(2 * strlen(text) + 1);
+    unsigned long hash;
+    CachedFunction *f;
+    CachedFunction *compiled;
+
+    if (normalizeFunction(text, key) != 0)
+    {
+        /* it fails to parse, the error is found by compiling the text itself */
+        strcpy(key, text);
+    }
+    hash = hashText(key);
+
+    pthread_mutex_lock(&c->lock);
+    f = findCachedFunction(c, key, hash);
+    if (f != NULL)
+    {
+        unlinkCachedFunction(c, f);
+        pushCachedFunction(c, f);
+        f->references++;
+        c->hits++;
+        pthread_mutex_unlock(&c->lock);
+        free(key);
+        s->code = 0;
+        return f;
+    }
+    c->misses++;
+    pthread_mutex_unlock(&c->lock);
+
+    /* compiled without the lock, so the other threads are not blocked */
+    compiled = compileCachedFunction(text, key, hash, s);
+    free(key);
+    if (compiled == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    f = findCachedFunction(c, compiled->text, hash);
+    if (f != NULL)
+    {
+        /* another thread compiled the same text meanwhile */
+        unlinkCachedFunction(c, f);
+        destroyCachedFunction(compiled);
+    }
+    else
+    {
+        f = compiled;
+        f->cached = 1;
+        c->count++;
+        if (c->count > c->capacity)
+        {
+            CachedFunction *oldest = c->tail;
+            unlinkCachedFunction(c, oldest);
+            oldest->cached = 0;
+            c->count--;
+            if (oldest->references == 0)
+            {
+                destroyCachedFunction(oldest);
+            }
+        }
+    }
+    pushCachedFunction(c, f);
+    f->references++;
+    pthread_mutex_unlock(&c->lock);
+    return f;
+}
+
+void releaseFunctionCache(FunctionCache *c, CachedFunction *f)
+{
+    pthread_mutex_lock(&c->lock);
+    f->references--;
+    if (f->references == 0 && !f->cached)
+    {
+        destroyCachedFunction(f);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+FunctionCacheStatistics getFunctionCacheStatistics(FunctionCache *c)
+{
+    FunctionCacheStatistics statistics;
+    pthread_mutex_lock(&c->lock);
+    statistics.hits = c->hits;
+    statistics.misses = c->misses;
+    statistics.count = c->count;
+    statistics.capacity = c->capacity;
+    pthread_mutex_unlock(&c->lock);
+    return statistics;
+}
+
+/* Matrix implementation */
+
+/*
+ * The elements of a matrix are stored row by row in one buffer, the
+ * element (i, j) is data[i * stride + j]. The stride is the number of
+ * columns rounded up so that each row starts at a MATRIX_ALIGN byte
+ * boundary.
+ *
+ * A view is a matrix that uses a part of the buffer of another matrix,
+ * destroying a view does not free the buffer.
+*/
+#define MATRIX_ALIGN 64
+#define MAT(m, i, j) ((m)->data[(size_t)(i) * (m)->stride + (j)])
+
+typedef struct
+{
+    int rows;
+    int cols;
+    int stride;
+    int isView;
+    ldouble_t *data;
+} Matrix;
+
+/* 
+ * Create a matrix and initialize the values to 0
+ *
+ * Parameters:
+ * - rows: The number of rows
+ * - cols: The number of columns
+ * Returns:
+ * - The created matrix
+*/
+Matrix *createMatrix(int rows, int cols);
+
+/* 
+ * Create a view of a part of a matrix, the elements are not copied
+ * Changing the view changes the matrix. The matrix must not be destroyed
+ * before the view.
+ *
+ * Parameters:
+ * - m: The matrix
+ * - row: The first row of the view
+ * - col: The first column of the view
+ * - rows: The number of rows
+ * - cols: The number of columns
+ * Returns:
+ * - The view, NULL if it does not fit in the matrix
+*/
+Matrix *viewMatrix(Matrix *m, int row, int col, int rows, int cols);
+
+/* 
+ * Destroy a matrix and free the memory
+ *
+ * Parameters:
+ * - m: The matrix to be destroyed
+*/
+void destroyMatrix(Matrix *m);
+
+/* 
+ * Print the matrix to the console
+ *
+ * Parameters:
+ * - m: The matrix to be printed
+*/
+void printMatrix(Matrix *m);
+
+/* 
+ * Copy a matrix
+ *
+ * Parameters:
+ * - m: The matrix to be copied
+ * Returns:
+ * - The copied matrix
+*/
+Matrix *copyMatrix(Matrix *m);
+
+/* 
+ * Add two matrices. m1 + scalar * m2
+ *
+ * Parameters:
+ * - m1: The first matrix
+ * - m2: The second matrix
+ * - scalar: The scalar to multiply the second matrix
+ * Returns:
+ * - The result of the addition
+*/
+Matrix *addMatrix(Matrix *m1, Matrix *m2, ldouble_t scalar);
+
+/* 
+ * Multiply two matrices. m1 * m2
+ *
+ * Parameters:
+ * - m1: The first matrix
+ * - m2: The second matrix
+ * Returns:
+ * - The result of the multiplication
+*/
+Matrix *multiplyMatrix(Matrix *m1, Matrix *m2);
+
+/* 
+ * Multiply two matrices with the textbook triple loop. m1 * m2
+ * Only used to compare multiplyMatrix against.
+ *
+ * Parameters:
+ * - m1: The first matrix
+ * - m2: The second matrix
+ * Returns:
+ * - The result of the multiplication
+*/
+Matrix *multiplyMatrixNaive(Matrix *m1, Matrix *m2);
+
+/* 
+ * Multiply a matrix with a scalar. scalar * m
+ *
+ * Parameters:
+ * - m: The matrix
+ * - scalar: The scalar
+ * Returns:
+ * - The result of the multiplication
+*/
+Matrix *multiplyMatrixScalar(Matrix *m, ldouble_t scalar);
+
+/* 
+ * Transpose a matrix
+ *
+ * Parameters:
+ * - m: The matrix
+ * Returns:
+ * - The transposed matrix
+*/
+Matrix *transposeMatrix(Matrix *m);
+
+/* 
+ * Inverse of a matrix
+ *
+ * Parameters:
+ * - m: The matrix
+ * Returns:
+ * - The inverse of the matrix
+*/
+Matrix *inverseMatrix(Matrix *m);
+
+/* 
+ * Solve a linear system of equations
+ *
+ * Parameters:
+ * - A: The coefficient matrix
+ * - B: The constant matrix
+ * Returns:
+ * - The solution matrix, NULL if A is singular or the sizes do not match
+*/
+Matrix *solveLinearSystem(Matrix *A, Matrix *B);
+
+/* 
+ * Calculate the determinant of a matrix
+ *
+ * Parameters:
+ * - m: The matrix
+ * Returns:
+ * - The determinant of the matrix
+*/
+ldouble_t determinantMatrix(Matrix *m);
+
+/* 
+ * Add a row to another row. r1 = r1 + scalar * r2
+ *
+ * Parameters:
+ * - m: The matrix
+ * - r1: The row to be added
+ * - r2: The row to be added
+ * - scalar: The scalar to multiply the row to be added
+*/
+void addRow(Matrix *m, int r1, int r2, ldouble_t scalar);
+
+/* 
+ * Multiply a row with a scalar. r = scalar * r
+ *
+ * Parameters:
+ * - m: The matrix
+ * - r: The row to be multiplied
+ * - scalar: The scalar to multiply the row
+*/
+void multiplyRow(Matrix *m, int r, ldouble_t scalar); 
+
+/* 
+ * Swap two rows. r1 <-> r2
+ *
+ * Parameters:
+ * - m: The matrix
+ * - r1: The first row
+ * - r2: The second row
+*/
+void swapRows(Matrix *m, int r1, int r2); 
+
+/* 
+ * Add a column to another column. c1 = c1 + scalar * c2
+ *
+ * Parameters:
+ * - m: The matrix
+ * - c1: The column to be added
+ * - c2: The column to be added
+ * - scalar: The scalar to multiply the column to be added
+*/
+void addColumn(Matrix *m, int c1, int c2, ldouble_t scalar);
+
+/* 
+ * Multiply a column with a scalar. c = scalar * c
+ *
+ * Parameters:
+ * - m: The matrix
+ * - c: The column to be multiplied
+ * - scalar: The scalar to multiply the column
+*/
+void multiplyColumn(Matrix *m, int c, ldouble_t scalar);
+
+/* 
+ * Swap two columns. c1 <-> c2
+ *
+ * Parameters:
+ * - m: The matrix
+ * - c1: The first column
+ * - c2: The second column
+*/
+void swapColumns(Matrix *m, int c1, int c2);
+
+/* 
+ * Solve a linear system of equations using Gaussian elimination
+ *
+ * Parameters:
+ * - m: The augmented matrix
+ * Returns:
+ * - The solution matrix
+*/
+Matrix *gauusElimination(Matrix *m);
+
+/* 
+ * Solve a linear system of equations using Gauus-Seidel method
+ *
+ * Parameters:
+ * - m: The augmented matrix
+ * - x0: The initial solution matrix
+ * - epsilon: The error tolerance
+ * Returns:
+ * - The solution matrix
+*/
+Matrix *gauusSeidel(Matrix *m, Matrix *x0, ldouble_t epsilon);
+
+/* 
+ * LU decomposition with partial pivoting. P * m = L * U
+ *
+ * L and U are returned in one matrix, U is the upper triangle with the
+ * diagonal and L is the lower triangle, the ones on the diagonal of L are
+ * not stored. If the matrix is singular a 0 is left on the diagonal of U.
+ *
+ * Parameters:
+ * - m: The square matrix
+ * - perm: The row permutation, the i. row of P * m is the perm[i]. row of m
+ *   (must have space for m->rows ints)
+ * - sign: The sign of the permutation, 1 or -1 (can be NULL)
+ * Returns:
+ * - The LU matrix, NULL if the matrix is not square
+*/
+Matrix *luDecompose(Matrix *m, int *perm, int *sign);
+
+/* 
+ * Solve m * x = b for each column of b with the LU decomposition of m
+ *
+ * Parameters:
+ * - lu: The LU matrix returned by luDecompose
+ * - perm: The row permutation returned by luDecompose
+ * - b: The constant matrix
+ * Returns:
+ * - The solution matrix, NULL if the matrix is singular
+*/
+Matrix *luSolve(Matrix *lu, int *perm, Matrix *b);
+
+
+Matrix *createMatrix(int rows, int cols)
+{
+    Matrix *m;
+    int perAlign = MATRIX_ALIGN / sizeof(ldouble_t);
+    size_t size;
+    m = (Matrix *)malloc(sizeof(Matrix));
+    m->rows = rows;
+    m->cols = cols;
+    m->stride = (cols + perAlign - 1) / perAlign * perAlign;
+    m->isView = 0;
+    size = (size_t)rows * m->stride * sizeof(ldouble_t);
+    m->data = (ldouble_t *)aligned_alloc(MATRIX_ALIGN, size > 0 ? size : MATRIX_ALIGN);
+    memset(m->data, 0, size);
+    return m;
+}
+
+Matrix *viewMatrix(Matrix *m, int row, int col, int rows, int cols)
+{
+    Matrix *view;
+    if (row < 0 || col < 0 || row + rows > m->rows || col + cols > m->cols)
+    {
+        return NULL;
+    }
+    view = (Matrix *)malloc(sizeof(Matrix));
+    view->rows = rows;
+    view->cols = cols;
+    view->stride = m->stride;
+    view->isView = 1;
+    view->data = &MAT(m, row, col);
+    return view;
+}
+
+void destroyMatrix(Matrix *m)
+{
+    if (m == NULL)
+    {
+        return;
+    }
+    if (!m->isView)
+    {
+        free(m->data);
+    }
+    free(m);
+}
+
+void printMatrix(Matrix *m)
+{
+    int i, j;
+    for (i = 0; i < m->rows; i++)
+    {
+        for (j = 0; j < m->cols; j++)
+        {
+            printf("%" LDOUBLE_PRI " ", MAT(m, i, j));
+        }
+        printf("\n");
+    }
+}
+
+Matrix *copyMatrix(Matrix *m)
+{
+    Matrix *copy;
+    int i;
+    copy = createMatrix(m->rows, m->cols);
+    for (i = 0; i < m->rows; i++)
+    {
+        memcpy(&MAT(copy, i, 0), &MAT(m, i, 0), m->cols * sizeof(ldouble_t));
+    }
+    return copy;
+}
+
+Matrix *addMatrix(Matrix *m1, Matrix *m2, ldouble_t scalar)
+{
+    if (m1->rows != m2->rows || m1->cols != m2->cols)
+    {
+        return NULL;
+    }
+    Matrix *result;
+    int i, j;
+    result = createMatrix(m1->rows, m1->cols);
+    for (i = 0; i < m1->rows; i++)
+    {
+        for (j = 0; j < m1->cols; j++)
+        {
+            MAT(result, i, j) = MAT(m1, i, j) + scalar * MAT(m2, i, j);
+        }
+    }
+    return result;
+}
+
+/*
+ * multiplyMatrix is a blocked multiplication. m2 is cut into panels of
+ * GEMM_KC rows and GEMM_NC columns and m1 into blocks of GEMM_MC rows and
+ * GEMM_KC columns, each panel and block is copied (packed) into a buffer
+ * in the order the micro kernel reads it, so the kernel reads both of them
+ * continuously from the cache. The micro kernel computes a GEMM_MR x
+ * GEMM_NR tile of the result.
+ *
+ * In order to tune the block sizes for a cache change GEMM_MC, GEMM_KC
+ * and GEMM_NC. GEMM_MC must be a multiple of GEMM_MR and GEMM_NC must be
+ * a multiple of GEMM_NR.
+*/
+#ifndef GEMM_MC
+#define GEMM_MC 64
+#endif
+#ifndef GEMM_KC
+#define GEMM_KC 256
+#endif
+#ifndef GEMM_NC
+#define GEMM_NC 1024
+#endif
+
+#ifdef USE_AVX2_KERNELS
+#define GEMM_MR 4
+#define GEMM_NR 8
+#else
+#define GEMM_MR 4
+#define GEMM_NR 4
+#endif
+
+/* Copy rows [row, row + rows) and columns [col, col + depth) of m as GEMM_MR row slivers */
+void packMatrixA(Matrix *m, int row, int rows, int col, int depth, ldouble_t *packed)
+{
+    int i, k, r;
+    for (i = 0; i < rows; i += GEMM_MR)
+    {
+        for (k = 0; k < depth; k++)
+        {
+            for (r = 0; r < GEMM_MR; r++)
+            {
+                *packed++ = i + r < rows ? MAT(m, row + i + r, col + k) : 0;
+            }
+        }
+    }
+}
+
+/* Copy rows [row, row + depth) and columns [col, col + cols) of m as GEMM_NR column slivers */
+void packMatrixB(Matrix *m, int row, int depth, int col, int cols, ldouble_t *packed)
+{
+    int j, k, c;
+    for (j = 0; j < cols; j += GEMM_NR)
+    {
+        for (k = 0; k < depth; k++)
+        {
+            ldouble_t *src = &MAT(m, row + k, col + j);
+            for (c = 0; c < GEMM_NR; c++)
+            {
+                *packed++ = j + c < cols ? src[c] : 0;
+            }
+        }
+    }
+}
+
+/* result[0..rows)[0..cols) += a * b for a GEMM_MR x depth sliver a and a depth x GEMM_NR sliver b */
+void multiplyMicroKernel(int depth, const ldouble_t *a, const ldouble_t *b,
+                         ldouble_t *result, int stride, int rows, int cols)
+{
+    int i, j, k;
+#ifdef USE_AVX2_KERNELS
+    __m256d c[GEMM_MR][2];
+    for (i = 0; i < GEMM_MR; i++)
+    {
+        c[i][0] = _mm256_setzero_pd();
+        c[i][1] = _mm256_setzero_pd();
+    }
+    for (k = 0; k < depth; k++)
+    {
+        __m256d b0 = _mm256_load_pd(b + k * GEMM_NR);
+        __m256d b1 = _mm256_load_pd(b + k * GEMM_NR + 4);
+        for (i = 0; i < GEMM_MR; i++)
+        {
+            __m256d av = _mm256_broadcast_sd(a + k * GEMM_MR + i);
+            c[i][0] = _mm256_fmadd_pd(av, b0, c[i][0]);
+            c[i][1] = _mm256_fmadd_pd(av, b1, c[i][1]);
+        }
+    }
+    if (rows == GEMM_MR && cols == GEMM_NR)
+    {
+        for (i = 0; i < GEMM_MR; i++)
+        {
+            ldouble_t *row = result + (size_t)i * stride;
+            _mm256_storeu_pd(row, _mm256_add_pd(_mm256_loadu_pd(row), c[i][0]));
+            _mm256_storeu_pd(row + 4, _mm256_add_pd(_mm256_loadu_pd(row + 4), c[i][1]));
+        }
+        return;
+    }
+    {
+        double tile[GEMM_MR][GEMM_NR];
+        for (i = 0; i < GEMM_MR; i++)
+        {
+            _mm256_storeu_pd(tile[i], c[i][0]);
+            _mm256_storeu_pd(tile[i] + 4, c[i][1]);
+        }
+        for (i = 0; i < rows; i++)
+        {
+            for (j = 0; j < cols; j++)
+            {
+                result[(size_t)i * stride + j] += tile[i][j];
+            }
+        }
+    }
+#else
+    ldouble_t c[GEMM_MR][GEMM_NR] = {{0}};
+    for (k = 0; k < depth; k++)
+    {
+        for (i = 0; i < GEMM_MR; i++)
+        {
+            ldouble_t av = a[k * GEMM_MR + i];
+            for (j = 0; j < GEMM_NR; j++)
+            {
+                c[i][j] += av * b[k * GEMM_NR + j];
+            }
+        }
+    }
+    for (i = 0; i < rows; i++)
+    {
+        for (j = 0; j < cols; j++)
+        {
+            result[(size_t)i * stride + j] += c[i][j];
+        }
+    }
+#endif
+}
+
+typedef struct {
+    Matrix *m1;
+    Matrix *m2;
+    Matrix *result;
+    int rowBlocks;
+} MultiplyContext;
+
+/*
+ * Computes the result tiles [begin, end), a tile is a block of GEMM_MC rows
+ * and GEMM_NC columns of the result. Every tile is summed in the same order
+ * as a single threaded multiplication, so the result does not depend on
+ * the number of threads.
+*/
+void multiplyMatrixTiles(void *context, int begin, int end)
+{
+    MultiplyContext *ctx = (MultiplyContext *)context;
+    Matrix *m1 = ctx->m1;
+    Matrix *m2 = ctx->m2;
+    Matrix *result = ctx->result;
+    ldouble_t *packedA;
+    ldouble_t *packedB;
+    int tile, jc, pc, ic, jr, ir;
+    int nc, kc, mc;
+    packedA = (ldouble_t *)aligned_alloc(MATRIX_ALIGN, GEMM_MC * GEMM_KC * sizeof(ldouble_t));
+    packedB = (ldouble_t *)aligned_alloc(MATRIX_ALIGN, GEMM_KC * GEMM_NC * sizeof(ldouble_t));
+
+    for (tile = begin; tile < end; tile++)
+    {
+        ic = (tile % ctx->rowBlocks) * GEMM_MC;
+        jc = (tile / ctx->rowBlocks) * GEMM_NC;
+        mc = MIN(GEMM_MC, m1->rows - ic);
+        nc = MIN(GEMM_NC, m2->cols - jc);
+        for (pc = 0; pc < m1->cols; pc += GEMM_KC)
+        {
+            kc = MIN(GEMM_KC, m1->cols - pc);
+            packMatrixB(m2, pc, kc, jc, nc, packedB);
+            packMatrixA(m1, ic, mc, pc, kc, packedA);
+            for (jr = 0; jr < nc; jr += GEMM_NR)
+            {
+                for (ir = 0; ir < mc; ir += GEMM_MR)
+                {
+                    multiplyMicroKernel(kc, packedA + ir * kc, packedB + jr * kc,
+                                        &MAT(result, ic + ir, jc + jr), result->stride,
+                                        MIN(GEMM_MR, mc - ir), MIN(GEMM_NR, nc - jr));
+                }
+            }
+        }
+    }
+
+    free(packedA);
+    free(packedB);
+}
+
+Matrix *multiplyMatrix(Matrix *m1, Matrix *m2)
+{
+    if (m1->cols != m2->rows)
+    {
+        return NULL;
+    }
+    MultiplyContext ctx;
+    int colBlocks;
+    ctx.m1 = m1;
+    ctx.m2 = m2;
+    ctx.result = createMatrix(m1->rows, m2->cols);
+    ctx.rowBlocks = (m1->rows + GEMM_MC - 1) / GEMM_MC;
+    colBlocks = (m2->cols + GEMM_NC - 1) / GEMM_NC;
+    if (m1->cols == 0)
+    {
+        return ctx.result;
+    }
+    parallelFor(ctx.rowBlocks * colBlocks,
+                parallelGrain(ctx.rowBlocks * colBlocks, (double)GEMM_MC * MIN(GEMM_NC, m2->cols) * m1->cols),
+                multiplyMatrixTiles, &ctx);
+    return ctx.result;
+}
+
+Matrix *multiplyMatrixNaive(Matrix *m1, Matrix *m2)
+{
+    if (m1->cols != m2->rows)
+    {
+        return NULL;
+    }
+    Matrix *result;
+    int i, j, k;
+    result = createMatrix(m1->rows, m2->cols);
+    for (i = 0; i < m1->rows; i++)
+    {
+        for (j = 0; j < m2->cols; j++)
+        {
+            for (k = 0; k < m1->cols; k++)
+            {
+                MAT(result, i, j) += MAT(m1, i, k) * MAT(m2, k, j);
+            }
+        }
+    }
+    return result;
+}
+
+Matrix *transposeMatrix(Matrix *m)
+{
+    Matrix *result;
+    int i, j;
+    result = createMatrix(m->cols, m->rows);
+    for (i = 0; i < m->rows; i++)
+    {
+        for (j = 0; j < m->cols; j++)
+        {
+            MAT(result, j, i) = MAT(m, i, j);
+        }
+    }
+    return result;
+}
+
+Matrix *inverseMatrix(Matrix *m)
+{
+    if (m->rows != m->cols)
+    {
+        return NULL;
+    }
+
+    Matrix *lu;
+    Matrix *identity;
+    Matrix *result;
+    int *perm;
+    int i;
+    perm = (int *)malloc(m->rows * sizeof(int));
+    lu = luDecompose(m, perm, NULL);
+    identity = createMatrix(m->rows, m->cols);
+    for (i = 0; i < m->rows; i++)
+    {
+        MAT(identity, i, i) = 1;
+    }
+
+    result = luSolve(lu, perm, identity);
+
+    destroyMatrix(identity);
+    destroyMatrix(lu);
+    free(perm);
+    return result;
+} 
+
+Matrix *solveLinearSystem(Matrix *A, Matrix *B)
+{
+    if (A->rows != A->cols || B->rows != A->rows)
+    {
+        return NULL;
+    }
+
+    Matrix *lu;
+    Matrix *result;
+    int *perm;
+    perm = (int *)malloc(A->rows * sizeof(int));
+    lu = luDecompose(A, perm, NULL);
+    result = luSolve(lu, perm, B);
+
+    destroyMatrix(lu);
+    free(perm);
+    return result;
+}
+
+ldouble_t determinantMatrix(Matrix *m)
+{
+    if (m->rows != m->cols)
+    {
+        return NAN;
+    }
+
+    Matrix *lu;
+    int *perm;
+    int sign;
+    int i;
+    ldouble_t det;
+    perm = (int *)malloc(m->rows * sizeof(int));
+    lu = luDecompose(m, perm, &sign);
+
+    det = sign;
+    for (i = 0; i < lu->rows; i++)
+    {
+        det *= MAT(lu, i, i);
+    }
+
+    destroyMatrix(lu);
+    free(perm);
+    return det;
+}
+
+typedef struct {
+    Matrix *lu;
+    int k;
+} EliminationContext;
+
+/* Eliminates column k from the rows k + 1 + [begin, end) */
+void eliminateRows(void *context, int begin, int end)
+{
+    EliminationContext *ctx = (EliminationContext *)context;
+    Matrix *lu = ctx->lu;
+    int k = ctx->k;
+    int n = lu->rows;
+    int i, j;
+    for (i = k + 1 + begin; i < k + 1 + end; i++)
+    {
+        ldouble_t factor = MAT(lu, i, k) / MAT(lu, k, k);
+        MAT(lu, i, k) = factor;
+        for (j = k + 1; j < n; j++)
+        {
+            MAT(lu, i, j) -= factor * MAT(lu, k, j);
+        }
+    }
+}
+
+Matrix *luDecompose(Matrix *m, int *perm, int *sign)
+{
+    if (m->rows != m->cols)
+    {
+        return NULL;
+    }
+
+    EliminationContext ctx;
+    Matrix *lu = copyMatrix(m);
+    int n = m->rows;
+    int i, k;
+    for (i = 0; i < n; i++)
+    {
+        perm[i] = i;
+    }
+    if (sign != NULL)
+    {
+        *sign = 1;
+    }
+
+    ctx.lu = lu;
+    for (k = 0; k < n; k++)
+    {
+        /* partial pivoting, the biggest element of the column is the pivot */
+        int maxRow = k;
+        ldouble_t max = ABS(MAT(lu, k, k));
+        for (i = k + 1; i < n; i++)
+        {
+            if (ABS(MAT(lu, i, k)) > max)
+            {
+                max = ABS(MAT(lu, i, k));
+                maxRow = i;
+            }
+        }
+        if (max == 0)
+        {
+            continue;
+        }
+        if (maxRow != k)
+        {
+            int temp = perm[k];
+            perm[k] = perm[maxRow];
+            perm[maxRow] = temp;
+            swapRows(lu, k, maxRow);
+            if (sign != NULL)
+            {
+                *sign = -*sign;
+            }
+        }
+
+        /* the rows below the pivot are independent of each other */
+        ctx.k = k;
+        parallelFor(n - k - 1, parallelGrain(n - k - 1, n - k), eliminateRows, &ctx);
+    }
+
+    return lu;
+}
+
+typedef struct {
+    Matrix *lu;
+    int *perm;
+    Matrix *b;
+    Matrix *x;
+} SolveContext;
+
+/* Solves the columns [begin, end) of b */
+void luSolveColumns(void *context, int begin, int end)
+{
+    SolveContext *ctx = (SolveContext *)context;
+    Matrix *lu = ctx->lu;
+    Matrix *b = ctx->b;
+    Matrix *x = ctx->x;
+    int n = lu->rows;
+    int i, j, c;
+    for (c = begin; c < end; c++)
+    {
+        /* forward substitution, L * y = P * b */
+        for (i = 0; i < n; i++)
+        {
+            ldouble_t sum = MAT(b, ctx->perm[i], c);
+            for (j = 0; j < i; j++)
+            {
+                sum -= MAT(lu, i, j) * MAT(x, j, c);
+            }
+            MAT(x, i, c) = sum;
+        }
+        /* back substitution, U * x = y */
+        for (i = n - 1; i >= 0; i--)
+        {
+            ldouble_t sum = MAT(x, i, c);
+            for (j = i + 1; j < n; j++)
+            {
+                sum -= MAT(lu, i, j) * MAT(x, j, c);
+            }
+            MAT(x, i, c) = sum / MAT(lu, i, i);
+        }
+    }
+}
+
+Matrix *luSolve(Matrix *lu, int *perm, Matrix *b)
+{
+    SolveContext ctx;
+    int n = lu->rows;
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        if (MAT(lu, i, i) == 0)
+        {
+            return NULL;
+        }
+    }
+
+    ctx.lu = lu;
+    ctx.perm = perm;
+    ctx.b = b;
+    ctx.x = createMatrix(n, b->cols);
+    /* the columns of b are independent systems */
+    parallelFor(b->cols, parallelGrain(b->cols, (double)n * n), luSolveColumns, &ctx);
+    return ctx.x;
+}
+
+void addRow(Matrix *m, int r1, int r2, ldouble_t scalar)
+{
+    int i;
+    for (i = 0; i < m->cols; i++)
+    {
+        MAT(m, r1, i) += scalar * MAT(m, r2, i);
+    }
+}
+
+void multiplyRow(Matrix *m, int r, ldouble_t scalar)
+{
+    int i;
+    for (i = 0; i < m->cols; i++)
+    {
+        MAT(m, r, i) *= scalar;
+    }
+}
+
+void swapRows(Matrix *m, int r1, int r2)
+{
+    ldouble_t *row1 = &MAT(m, r1, 0);
+    ldouble_t *row2 = &MAT(m, r2, 0);
+    int i;
+    for (i = 0; i < m->cols; i++)
+    {
+        ldouble_t temp = row1[i];
+        row1[i] = row2[i];
+        row2[i] = temp;
+    }
+}
+
+void addColumn(Matrix *m, int c1, int c2, ldouble_t scalar)
+{
+    int i;
+    for (i = 0; i < m->rows; i++)
+    {
+        MAT(m, i, c1) += scalar * MAT(m, i, c2);
+    }
+}
+
+void multiplyColumn(Matrix *m, int c, ldouble_t scalar)
+{
+    int i;
+    for (i = 0; i < m->rows; i++)
+    {
+        MAT(m, i, c) *= scalar;
+    }
+}
+
+void swapColumns(Matrix *m, int c1, int c2)
+{
+    int i;
+    for (i = 0; i < m->rows; i++)
+    {
+        ldouble_t temp = MAT(m, i, c1);
+        MAT(m, i, c1) = MAT(m, i, c2);
+        MAT(m, i, c2) = temp;
+    }
+}
+
+Matrix *gauusElimination(Matrix *m)
+{
+    if (m->rows != m->cols - 1)
+    {
+        return NULL;
+    }
+
+    Matrix *coefficients = viewMatrix(m, 0, 0, m->rows, m->rows);
+    Matrix *constants = viewMatrix(m, 0, m->cols - 1, m->rows, 1);
+    Matrix *lu;
+    Matrix *result;
+    int *perm;
+
+    /* upper triangular form, the row operations are kept in L */ 
+    perm = (int *)malloc(m->rows * sizeof(int));
+    lu = luDecompose(coefficients, perm, NULL);
+    result = luSolve(lu, perm, constants);
+
+    destroyMatrix(coefficients);
+    destroyMatrix(constants);
+    destroyMatrix(lu);
+    free(perm);
+
+    return result;
+}
+
+Matrix *gauusSeidel(Matrix *m, Matrix *x0, ldouble_t epsilon)
+{
+    if (m->rows != m->cols - 1)
+    {
+        return NULL;
+    }
+
+    Matrix *copy = copyMatrix(m);
+    Matrix *result = createMatrix(m->rows, 1);
+    Matrix *converged = createMatrix(m->rows, 1);
+    int convergedCount = 0;
+    int i, j;
+
+    for (i = 0; i < x0->rows; i++)
+    {
+        MAT(result, i, 0) = MAT(x0, i, 0);
+    }
+
+    /* Make sure the biggest element in each row is on the diagonal */ 
+    for (i = 0; i < copy->cols - 1; i++)
+    {
+        int maxRow = i;
+        ldouble_t max = ABS(MAT(copy, i, i));
+        for (j = i; j < copy->rows; j++)
+        {
+            if (ABS(MAT(copy, j, i)) > max)
+            {
+                max = ABS(MAT(copy, j, i));
+                maxRow = j;
+            }
+        }
+
+        if (maxRow != i)
+        {
+            ldouble_t mulNow = MAT(copy, i, i) * MAT(copy, maxRow, maxRow);
+            ldouble_t mulSwap = MAT(copy, i, maxRow) * MAT(copy, maxRow, i);
+
+            if (ABS(mulSwap) > ABS(mulNow))
+            {
+                swapRows(copy, i, maxRow);
+                swapRows(result, i, maxRow);
+            }
+        }
+    }
+
+    while (convergedCount < m->rows)
+    {
+        for (i = 0; i < copy->rows; i++)
+        {
+            ldouble_t sum = MAT(copy, i, copy->cols - 1);
+            for (j = 0; j < copy->cols - 1; j++)
+            {
+                if (j != i)
+                {
+                    sum -= MAT(copy, i, j) * MAT(result, j, 0);
+                }
+            }
+            MAT(result, i, 0) = sum / MAT(copy, i, i);
+        }
+
+        for (i = 0; i < copy->rows; i++)
+        {
+            if (ABS(MAT(result, i, 0) - MAT(converged, i, 0)) < epsilon)
+            {
+                convergedCount++;
+            }
+            MAT(converged, i, 0) = MAT(result, i, 0);
+        }
+    }
+
+    destroyMatrix(copy);
+    destroyMatrix(converged);
+
+    return result;
+}
+
+/*
+ * Read a function from the user, parse and optimize it
+ *
+ * The nodes of the function are allocated from a new expression arena that
+ * stays as the current arena, the function must be released with
+ * releaseFunction().
+ *
+ * Returns:
+ * - The optimized function, NULL if it can not be parsed
+*/
+EVALABLE *getFunction();
+
+/*
+ * Read a function that can have parameters from the user, parse and optimize it
+ * Same as getFunction(), the letters other than x and e are added to the table.
+ *
+ * Parameters:
+ * - t: The variable table, NULL to read only x
+ * Returns:
+ * - The optimized function, NULL if it can not be parsed
+*/
+EVALABLE *getFunctionVariables(VariableTable *t);
+
+/*
+ * Release a function that is returned by getFunction() and its arena
+ *
+ * Parameters:
+ * - f: The function to be released
+*/
+void releaseFunction(EVALABLE *f);
+
+EVALABLE *getFunction()
+{
+    return getFunctionVariables(NULL);
+}
+
+EVALABLE *getFunctionVariables(VariableTable *t)
+{
+    EVALABLE *f;
+    VariableTable *previous;
+    int i;
+    printf("Enter your function: ");
+    char input[256];
+    /* clear buffer */ 
+    while (getchar() != '\n');
+    if (fgets(input, 256, stdin) == NULL)
+    {
+        printf("Failed to read input.\n");
+        return NULL;
+    }
+    input[strlen(input) - 1] = '\0';
+    StatusCode status;
+    status.code = 0;
+    status.pos = NULL;
+    status.expected = '\0';
+    destroyArena(useArena(createArena()));
+    previous = useVariables(t);
+    parseExpression(input, &f, &status);
+    useVariables(previous);
+    if (status.code != 0)
+    {
+        int pos = status.pos - input + 1;
+        switch (status.code)
+        {
+            case 1:
+                printf("[Failed to parse]   ");
+                for (i = 0; i < pos; i++)
+                {
+                    printf(" ");
+                }
+                printf("^ Unexpected character.\n");
+                break;
+            case 2:
+                printf("[Failed to parse]   ");
+                for (i = 0; i < pos; i++)
+                {
+                    printf(" ");
+                }
+                printf("^ Expected '%c', received '%c'\n", status.expected, *status.pos);
+                break;
+        }
+        destroyArena(useArena(NULL));
+        return NULL;
+    }
+    f = shareSubexpressions(fuseTrigonometric(optimize(f)));
+    printf("[Optimized] f(x");
+    for (i = 1; t != NULL && i < t->count; i++)
+    {
+        printf(", %c", t->names[i]);
+    }
+    printf(") = ");
+    print(f);
+    printf("\n");
+    return f;
+}
+
+void releaseFunction(EVALABLE *f)
+{
+    destroy(f);
+    destroyArena(useArena(NULL));
+}
+
+int mainBisection()
+{
+    EVALABLE *f = getFunction();
+    if (f == NULL)
+    {
+        return 1;
+    }
+
+    ldouble_t a, b, epsilon;
+    printf("Enter the interval [a, b]: ");
+    scanf("%" LDOUBLE_SCN " %" LDOUBLE_SCN, &a, &b);
+    printf("Enter the error tolerance: ");
+    scanf("%" LDOUBLE_SCN, &epsilon);
+
+    ldouble_t result = solveBisection(f, a, b, epsilon);
+    if (isnan(result))
+    {
+        printf("No root found in the interval.\n");
+    }
+    else
+    {
+        printf("Root: %" LDOUBLE_PRI "\n", result);
+    }
+
+    releaseFunction(f);
+
+    return 0;
+}
+
+int mainRegulaFalsi()
+{
+    EVALABLE *f = getFunction();
+    if (f == NULL)
+    {
+        return 1;
+    }
+
+    ldouble_t a, b, epsilon;
+    printf("Enter the interval [a, b]: ");
+    scanf("%" LDOUBLE_SCN " %" LDOUBLE_SCN, &a, &b);
+    printf("Enter the error tolerance: ");
+    scanf("%" LDOUBLE_SCN, &epsilon);
+
+    ldouble_t result = solveRegulaFalsi(f, a, b, epsilon);
+    if (isnan(result))
+    {
+        printf("No root found in the interval.\n");
+    }
+    else
     {
-        m->data[i] = (ldouble_t *)malloc(cols * sizeof(ldouble_t));
-        for (j = 0; j < cols; j++)
-        {
-            m->data[i][j] = 0;
-        }
+        printf("Root: %" LDOUBLE_PRI "\n", result);
     }
-    return m;
+
+    releaseFunction(f);
+
+    return 0;
 }
 
-void destroyMatrix(Matrix *m)
+int mainNewtonRaphson()
 {
-    int i;
-    for (i = 0; i < m->rows; i++)
+    EVALABLE *f = getFunction();
+    if (f == NULL)
     {
-        free(m->data[i]);
+        return 1;
     }
-    free(m->data);
-    free(m);
-}
 
-void printMatrix(Matrix *m)
-{
-    int i, j;
-    for (i = 0; i < m->rows; i++)
+    ldouble_t x0, epsilon;
+    printf("Enter the initial guess: ");
+    scanf("%" LDOUBLE_SCN, &x0);
+    printf("Enter the error tolerance: ");
+    scanf("%" LDOUBLE_SCN, &epsilon);
+
+    ldouble_t result = solveNewtonRaphson(f, x0, epsilon);
+    if (isnan(result))
     {
-        for (j = 0; j < m->cols; j++)
-        {
-            printf("%Lf ", m->data[i][j]);
-        }
-        printf("\n");
+        printf("No root found from the initial guess.\n");
     }
+    else
+    {
+        printf("Root: %" LDOUBLE_PRI "\n", result);
+    }
+
+    releaseFunction(f);
+
+    return 0;
 }
 
-Matrix *copyMatrix(Matrix *m)
+int mainMatrixInverse()
 {
-    Matrix *copy;
+    int rows, cols;
     int i, j;
-    copy = createMatrix(m->rows, m->cols);
+    Matrix *m;
+    Matrix *result;
+    printf("Enter the number of rows and columns: ");
+    scanf("%d %d", &rows, &cols);
+
+    if (rows != cols)
+    {
+        printf("The matrix must be square.\n");
+        return 1;
+    }
+
+    printf("Enter the matrix:\n");
+    m = createMatrix(rows, cols);
+
     for (i = 0; i < m->rows; i++)
     {
         for (j = 0; j < m->cols; j++)
         {
-            copy->data[i][j] = m->data[i][j];
+            scanf("%" LDOUBLE_SCN, &MAT(m, i, j));
         }
     }
-    return copy;
-}
 
-Matrix *addMatrix(Matrix *m1, Matrix *m2, ldouble_t scalar)
-{
-    if (m1->rows != m2->rows || m1->cols != m2->cols)
+    result = inverseMatrix(m);
+    if (result == NULL)
     {
-        return NULL;
+        printf("The matrix is singular.\n");
     }
-    Matrix *result;
-    int i, j;
-    result = createMatrix(m1->rows, m1->cols);
-    for (i = 0; i < m1->rows; i++)
+    else
     {
-        for (j = 0; j < m1->cols; j++)
-        {
-            result->data[i][j] = m1->data[i][j] + scalar * m2->data[i][j];
-        }
+        printMatrix(result);
     }
-    return result;
+
+    destroyMatrix(m);
+    destroyMatrix(result);
+
+    return 0;
 }
 
-Matrix *multiplyMatrix(Matrix *m1, Matrix *m2)
+int mainGauusElimination()
 {
-    if (m1->cols != m2->rows)
+    int rows, cols;
+    int i, j;
+    printf("Enter the number of rows and columns: ");
+    scanf("%d %d", &rows, &cols);
+    if (rows != cols - 1)
     {
-        return NULL;
+        printf("The matrix must be augmented.\n");
+        return 1;
     }
-    Matrix *result;
-    int i, j, k;
-    result = createMatrix(m1->rows, m2->cols);
-    for (i = 0; i < m1->rows; i++)
+
+    printf("Enter the augmented matrix:\n");
+    Matrix *m = createMatrix(rows, cols);
+    for (i = 0; i < m->rows; i++)
     {
-        for (j = 0; j < m2->cols; j++)
+        for (j = 0; j < m->cols; j++)
         {
-            for (k = 0; k < m1->cols; k++)
-            {
-                result->data[i][j] += m1->data[i][k] * m2->data[k][j];
-            }
+            scanf("%" LDOUBLE_SCN, &MAT(m, i, j));
         }
     }
-    return result;
+
+    Matrix *result = gauusElimination(m);
+    if (result == NULL)
+    {
+        printf("The matrix is singular.\n");
+    }
+    else
+    {
+        printMatrix(result);
+    }
+
+    destroyMatrix(m);
+    destroyMatrix(result);
+
+    return 0;
 }
 
-Matrix *transposeMatrix(Matrix *m)
+int mainGauusSeidel()
 {
+    Matrix *m;
+    Matrix *x0;
     Matrix *result;
+    int rows, cols;
+    ldouble_t epsilon;
     int i, j;
-    result = createMatrix(m->cols, m->rows);
+    printf("Enter the number of rows and columns: ");
+    scanf("%d %d", &rows, &cols);
+    if (rows != cols - 1)
+    {
+        printf("The matrix must be augmented.\n");
+        return 1;
+    }
+
+    printf("Enter the augmented matrix:\n");
+    m = createMatrix(rows, cols);
     for (i = 0; i < m->rows; i++)
     {
         for (j = 0; j < m->cols; j++)
         {
-            result->data[j][i] = m->data[i][j];
+            scanf("%" LDOUBLE_SCN, &MAT(m, i, j));
         }
     }
-    return result;
-}
 
-Matrix *inverseMatrix(Matrix *m)
-{
-    if (m->rows != m->cols)
+    printf("Enter the initial solution matrix:\n");
+    x0 = createMatrix(rows, 1);
+    for (i = 0; i < x0->rows; i++)
     {
-        return NULL;
+        scanf("%" LDOUBLE_SCN, &MAT(x0, i, 0));
     }
 
-    if (determinantMatrix(m) == 0)
+    printf("Enter the error tolerance: ");
+    scanf("%" LDOUBLE_SCN, &epsilon);
+
+    result = gauusSeidel(m, x0, epsilon);
+    printMatrix(result);
+
+    destroyMatrix(m);
+    destroyMatrix(x0);
+    destroyMatrix(result);
+
+    return 0;
+}
+
+int mainNumericalDerivative()
+{
+    EVALABLE *f = getFunction();
+    if (f == NULL)
     {
-        return NULL;
+        return 1;
     }
 
-    Matrix *identity;
-    Matrix *copy;
-    int i, j;
-    identity = createMatrix(m->rows, m->cols);
-    for (i = 0; i < m->rows; i++)
+    int option;
+    ldouble_t x, h;
+    ldouble_t result;
+    printf("Select the method:\n");
+    printf("1. Forward difference\n");
+    printf("2. Backward difference\n");
+    printf("3. Central difference\n");
+    printf("4. Symbolic derivative\n");
+    scanf("%d", &option);
+
+    printf("Enter the point: ");
+    scanf("%" LDOUBLE_SCN, &x);
+    if (option != 4)
     {
-        identity->data[i][i] = 1;
+        printf("Enter the step size: ");
+        scanf("%" LDOUBLE_SCN, &h);
     }
 
-    copy = copyMatrix(m);
-    for (i = 0; i < copy->rows; i++)
+    switch (option)
     {
-        ldouble_t pivot = copy->data[i][i];
-        if (pivot == 0)
-        {
-            for (j = i + 1; j < copy->rows; j++)
-            {
-                if (copy->data[j][i] != 0)
-                {
-                    swapRows(copy, i, j);
-                    swapRows(identity, i, j);
-                    break;
-                }
-            }
-            pivot = copy->data[i][i];
-        }
-        multiplyRow(copy, i, 1 / pivot);
-        multiplyRow(identity, i, 1 / pivot);
-        for (j = 0; j < copy->rows; j++)
+        case 1:
+            result = (evaluate(f, x + h) - evaluate(f, x)) / h;
+            break;
+        case 2:
+            result = (evaluate(f, x) - evaluate(f, x - h)) / h;
+            break;
+        case 3:
+            result = (evaluate(f, x + h) - evaluate(f, x - h)) / (2 * h);
+            break;
+        case 4:
         {
-            if (j != i)
-            {
-                ldouble_t scalar = -copy->data[j][i];
-                addRow(copy, j, i, scalar);
-                addRow(identity, j, i, scalar);
-            }
+            EVALABLE *derivative = differentiate(f);
+            printf("f'(x) = ");
+            print(derivative);
+            printf("\n");
+            result = evaluate(derivative, x);
+            destroy(derivative);
+            break;
         }
+        default:
+            printf("Invalid option.\n");
+            return 1;
     }
-    destroyMatrix(copy);
-    return identity;
-} 
 
-ldouble_t determinantMatrix(Matrix *m)
+    printf("Derivative: %" LDOUBLE_PRI "\n", result);
+
+    releaseFunction(f);
+
+    return 0;
+}
+
+int mainSimpson()
 {
-    if (m->rows != m->cols)
+    int option;
+    EVALABLE *f;
+    ldouble_t a, b;
+    ldouble_t result;
+    ldouble_t tolerance;
+    int n;
+    int order;
+    int evaluations;
+    printf("Enter which method to use:\n");
+    printf("1. Simpson's 1/3 rule\n");
+    printf("2. Simpson's 3/8 rule\n");
+    printf("3. Adaptive Simpson's rule\n");
+    printf("4. Adaptive Gauss-Kronrod rule\n");
+    printf("5. Romberg's method\n");
+    printf("6. Gauss-Legendre rule\n");
+    scanf("%d", &option);
+
+    f = getFunction();
+    if (f == NULL)
     {
-        return NAN;
+        return 1;
     }
 
-    if (m->rows == 1)
+    printf("Enter the interval [a, b]: ");
+    scanf("%" LDOUBLE_SCN " %" LDOUBLE_SCN, &a, &b);
+    if (option >= 3 && option <= 5)
+    {
+        printf("Enter the tolerance: ");
+        scanf("%" LDOUBLE_SCN, &tolerance);
+    }
+    else if (option == 6)
     {
-        return m->data[0][0];
+        printf("Enter the number of points (order): ");
+        scanf("%d", &order);
+        printf("Enter the number of subintervals: ");
+        scanf("%d", &n);
+    }
+    else
+    {
+        printf("Enter the number of subintervals: ");
+        scanf("%d", &n);
     }
 
-    ldouble_t det = 0;
-    ldouble_t sign;
-    int i, j, k;
-    for (i = 0; i < m->rows; i++)
+    if (option == 1)
     {
-        Matrix *minor = createMatrix(m->rows - 1, m->cols - 1);
-        for (j = 1; j < m->rows; j++)
-        {
-            for (k = 0; k < m->cols; k++)
-            {
-                if (k < i)
-                {
-                    minor->data[j - 1][k] = m->data[j][k];
-                } else if (k > i)
-                {
-                    minor->data[j - 1][k - 1] = m->data[j][k];
-                }
-            }
-        }
-        sign = (i % 2 == 0) ? 1 : -1;
-        det += sign * m->data[0][i] * determinantMatrix(minor);
-        destroyMatrix(minor);
+        result = integrateSimpson13(f, a, b, n);
+    }
+    else if (option == 2)
+    {
+        result = integrateSimpson38(f, a, b, n);
+    }
+    else if (option == 3)
+    {
+        result = integrateAdaptiveSimpson(f, a, b, tolerance, &evaluations);
+    }
+    else if (option == 4)
+    {
+        result = integrateGaussKronrod(f, a, b, tolerance, &evaluations);
+    }
+    else if (option == 5)
+    {
+        result = integrateRomberg(f, a, b, tolerance, &evaluations);
     }
-
-    return det;
-}
-
-void addRow(Matrix *m, int r1, int r2, ldouble_t scalar)
-{
-    int i;
-    for (i = 0; i < m->cols; i++)
+    else if (option == 6)
     {
-        m->data[r1][i] += scalar * m->data[r2][i];
+        result = integrateGaussLegendre(f, a, b, order, n);
+    }
+    else
+    {
+        printf("Invalid option.\n");
+        return 1;
     }
-}
 
-void multiplyRow(Matrix *m, int r, ldouble_t scalar)
-{
-    int i;
-    for (i = 0; i < m->cols; i++)
+    printf("Integral: %" LDOUBLE_PRI "\n", result);
+    if (option >= 3 && option <= 5)
     {
-        m->data[r][i] *= scalar;
+        printf("Function evaluations: %d\n", evaluations);
     }
-}
 
-void swapRows(Matrix *m, int r1, int r2)
-{
-    ldouble_t *temp = m->data[r1];
-    m->data[r1] = m->data[r2];
-    m->data[r2] = temp;
+    releaseFunction(f);
+
+    return 0;
 }
 
-void addColumn(Matrix *m, int c1, int c2, ldouble_t scalar)
+int mainTrapez()
 {
-    int i;
-    for (i = 0; i < m->rows; i++)
+    EVALABLE *f = getFunction();
+    if (f == NULL)
     {
-        m->data[i][c1] += scalar * m->data[i][c2];
+        return 1;
     }
+
+    ldouble_t a, b;
+    ldouble_t result;
+    int n;
+    printf("Enter the interval [a, b]: ");
+    scanf("%" LDOUBLE_SCN " %" LDOUBLE_SCN, &a, &b);
+    printf("Enter the number of subintervals: ");
+    scanf("%d", &n);
+
+    result = integrateTrapez(f, a, b, n);
+    printf("Integral: %" LDOUBLE_PRI "\n", result);
+
+    releaseFunction(f);
+
+    return 0;
 }
 
-void multiplyColumn(Matrix *m, int c, ldouble_t scalar)
+/* Read the settings of the method from the user */
+void readMethodSettings(MethodSettings *m)
 {
-    int i;
-    for (i = 0; i < m->rows; i++)
+    if (m->method == METHOD_NEWTON_RAPHSON)
     {
-        m->data[i][c] *= scalar;
+        printf("Enter the initial guess: ");
+        scanf("%" LDOUBLE_SCN, &m->a);
     }
-}
-
-void swapColumns(Matrix *m, int c1, int c2)
-{
-    int i;
-    for (i = 0; i < m->rows; i++)
+    else
     {
-        ldouble_t temp = m->data[i][c1];
-        m->data[i][c1] = m->data[i][c2];
-        m->data[i][c2] = temp;
+        printf("Enter the interval [a, b]: ");
+        scanf("%" LDOUBLE_SCN " %" LDOUBLE_SCN, &m->a, &m->b);
     }
-}
-
-Matrix *gauusElimination(Matrix *m)
-{
-    if (m->rows != m->cols - 1)
+    if (m->method <= METHOD_NEWTON_RAPHSON)
     {
-        return NULL;
+        printf("Enter the error tolerance: ");
+        scanf("%" LDOUBLE_SCN, &m->tolerance);
     }
-
-    Matrix *copy = copyMatrix(m);
-    Matrix *result = createMatrix(m->rows, 1);
-    int i, j;
-
-    /* upper triangular form */ 
-    for (i = 0; i < copy->rows; i++)
+    else if (isAdaptiveMethod(m->method))
     {
-        ldouble_t pivot = copy->data[i][i];
-        if (pivot == 0)
-        {
-            for (j = i + 1; j < copy->rows; j++)
-            {
-                if (copy->data[j][i] != 0)
-                {
-                    swapRows(copy, i, j);
-                    break;
-                }
-            }
-            pivot = copy->data[i][i];
-        }
-        multiplyRow(copy, i, 1 / pivot);
-        for (j = i + 1; j < copy->rows; j++)
-        {
-            ldouble_t scalar = -copy->data[j][i];
-            addRow(copy, j, i, scalar);
-        }
+        printf("Enter the tolerance: ");
+        scanf("%" LDOUBLE_SCN, &m->tolerance);
     }
-
-    for (i = copy->rows - 1; i >= 0; i--)
+    else if (m->method == METHOD_GAUSS_LEGENDRE)
     {
-        result->data[i][0] = copy->data[i][copy->cols - 1];
-        for (j = i + 1; j < copy->cols - 1; j++)
-        {
-            result->data[i][0] -= copy->data[i][j] * result->data[j][0];
-        }
+        printf("Enter the number of points (order): ");
+        scanf("%d", &m->order);
+        printf("Enter the number of subintervals: ");
+        scanf("%d", &m->n);
+    }
+    else
+    {
+        printf("Enter the number of subintervals: ");
+        scanf("%d", &m->n);
     }
-
-    destroyMatrix(copy);
-
-    return result;
 }
 
-Matrix *gauusSeidel(Matrix *m, Matrix *x0, ldouble_t epsilon)
+int mainSweep()
 {
-    if (m->rows != m->cols - 1)
+    VariableTable *t;
+    EVALABLE *f;
+    MethodSettings m;
+    SweepGrid *grid;
+    ldouble_t *results;
+    int *evaluations = NULL;
+    int indices[VARIABLE_MAX];
+    const char *error;
+    int option, parameterCount, fold, i, j;
+
+    printf("Enter which method to use:\n");
+    for (i = 0; i < METHOD_COUNT; i++)
     {
-        return NULL;
+        printf("%d. %s\n", i + 1, methodTitles[i]);
     }
+    scanf("%d", &option);
+    if (option < 1 || option > METHOD_COUNT)
+    {
+        printf("Invalid option.\n");
+        return 1;
+    }
+    memset(&m, 0, sizeof(m));
+    m.method = (Method)(option - 1);
 
-    Matrix *copy = copyMatrix(m);
-    Matrix *result = createMatrix(m->rows, 1);
-    Matrix *converged = createMatrix(m->rows, 1);
-    int convergedCount = 0;
-    int i, j;
+    printf("The letters other than x and e are the parameters.\n");
+    t = createVariableTable();
+    f = getFunctionVariables(t);
+    if (f == NULL)
+    {
+        destroyVariableTable(t);
+        return 1;
+    }
+    parameterCount = t->count - 1;
+    if (parameterCount == 0)
+    {
+        printf("The function has no parameters.\n");
+        releaseFunction(f);
+        destroyVariableTable(t);
+        return 1;
+    }
+    for (i = 0; i < parameterCount; i++)
+    {
+        indices[i] = i + 1;
+    }
 
-    for (i = 0; i < x0->rows; i++)
+    readMethodSettings(&m);
+    error = methodSettingsError(&m);
+    if (error != NULL)
     {
-        result->data[i][0] = x0->data[i][0];
+        printf("%s\n", error);
+        releaseFunction(f);
+        destroyVariableTable(t);
+        return 1;
     }
 
-    /* Make sure the biggest element in each row is on the diagonal */ 
-    for (i = 0; i < copy->cols - 1; i++)
+    printf("Select the grid:\n");
+    printf("1. Cartesian grid\n");
+    printf("2. List of points\n");
+    scanf("%d", &option);
+    if (option == 1)
     {
-        int maxRow = i;
-        ldouble_t max = ABS(copy->data[i][i]);
-        for (j = i; j < copy->rows; j++)
+        ldouble_t *axes[VARIABLE_MAX] = {NULL};
+        int counts[VARIABLE_MAX];
+        for (i = 0; i < parameterCount; i++)
         {
-            if (ABS(copy->data[j][i]) > max)
+            ldouble_t first, last;
+            printf("Enter the first value, the last value and the number of values of %c: ", t->names[i + 1]);
+            scanf("%" LDOUBLE_SCN " %" LDOUBLE_SCN " %d", &first, &last, &counts[i]);
+            counts[i] = MAX(counts[i], 1);
+            axes[i] = (ldouble_t *)malloc(counts[i] * sizeof(ldouble_t));
+            for (j = 0; j < counts[i]; j++)
             {
-                max = ABS(copy->data[j][i]);
-                maxRow = j;
+                axes[i][j] = counts[i] == 1 ? first : first + (last - first) * j / (counts[i] - 1);
             }
         }
-
-        if (maxRow != i)
+        grid = createCartesianGrid(parameterCount, indices, axes, counts);
+        for (i = 0; i < parameterCount; i++)
         {
-            ldouble_t mulNow = copy->data[i][i] * copy->data[maxRow][maxRow];
-            ldouble_t mulSwap = copy->data[i][maxRow] * copy->data[maxRow][i];
-
-            if (ABS(mulSwap) > ABS(mulNow))
-            {
-                swapRows(copy, i, maxRow);
-                swapRows(result, i, maxRow);
-            }
+            free(axes[i]);
         }
     }
-
-    while (convergedCount < m->rows)
+    else if (option == 2)
     {
-        for (i = 0; i < copy->rows; i++)
+        ldouble_t point[VARIABLE_MAX];
+        int count;
+        printf("Enter the number of points: ");
+        scanf("%d", &count);
+        printf("Enter the points:\n");
+        for (i = 0; i < parameterCount; i++)
         {
-            ldouble_t sum = copy->data[i][copy->cols - 1];
-            for (j = 0; j < copy->cols - 1; j++)
-            {
-                if (j != i)
-                {
-                    sum -= copy->data[i][j] * result->data[j][0];
-                }
-            }
-            result->data[i][0] = sum / copy->data[i][i];
+            printf("%c ", t->names[i + 1]);
         }
-
-        for (i = 0; i < copy->rows; i++)
+        printf("\n");
+        grid = createSweepGrid(parameterCount, indices);
+        for (i = 0; i < count; i++)
         {
-            if (ABS(result->data[i][0] - converged->data[i][0]) < epsilon)
+            for (j = 0; j < parameterCount; j++)
             {
-                convergedCount++;
+                scanf("%" LDOUBLE_SCN, &point[j]);
             }
-            converged->data[i][0] = result->data[i][0];
+            addSweepPoint(grid, point);
         }
     }
+    else
+    {
+        printf("Invalid option.\n");
+        releaseFunction(f);
+        destroyVariableTable(t);
+        return 1;
+    }
 
-    destroyMatrix(copy);
-    destroyMatrix(converged);
+    printf("Optimize the function again for each point with the parameters as constants? (1 = yes, 0 = no): ");
+    scanf("%d", &fold);
 
-    return result;
+    results = (ldouble_t *)malloc((grid->pointCount + 1) * sizeof(ldouble_t));
+    if (isAdaptiveMethod(m.method))
+    {
+        evaluations = (int *)malloc((grid->pointCount + 1) * sizeof(int));
+    }
+    sweep(f, t->count, grid, &m, fold, results, evaluations);
+    printSweep(t, grid, &m, results, evaluations);
+
+    free(results);
+    free(evaluations);
+    destroySweepGrid(grid);
+    releaseFunction(f);
+    destroyVariableTable(t);
+
+    return 0;
 }
 
-EVALABLE *getFunction()
+int factorial(int n)
 {
-    EVALABLE *f;
-    printf("Enter your function: ");
-    char input[256];
-    /* clear buffer */ 
-    while (getchar() != '\n');
-    if (fgets(input, 256, stdin) == NULL)
-    {
-        printf("Failed to read input.\n");
-        return NULL;
-    }
-    input[strlen(input) - 1] = '\0';
-    StatusCode status;
-    status.code = 0;
-    status.pos = NULL;
-    status.expected = '\0';
-    parseExpression(input, &f, &status);
-    if (status.code != 0)
+    ldouble_t result = 1;
+    int i;
+    for (i = 1; i <= n; i++)
     {
-        int pos = status.pos - input + 1;
-        int i;
-        switch (status.code)
-        {
-            case 1:
-                printf("[Failed to parse]   ");
-                for (i = 0; i < pos; i++)
-                {
-                    printf(" ");
-                }
-                printf("^ Unexpected character.\n");
-                break;
-            case 2:
-                printf("[Failed to parse]   ");
-                for (i = 0; i < pos; i++)
-                {
-                    printf(" ");
-                }
-                printf("^ Expected '%c', received '%c'\n", status.expected, *status.pos);
-                break;
-        }
-        return NULL;
+        result *= i;
     }
-    f = optimize(f);
-    printf("[Optimized] f(x) = ");
-    print(f);
-    printf("\n");
-    return f;
+    return result;
 }
 
-int mainBisection()
+EVALABLE *gregoryNewton(Matrix *points)
 {
-    EVALABLE *f = getFunction();
-    if (f == NULL)
+    int n = points->rows;
+    int i, j, degree;
+    ldouble_t *coefficients, *centers;
+    EVALABLE *f;
+    Matrix *table = createMatrix(n, n + 1);
+
+    for (i = 0; i < n; i++)
     {
-        return 1;
+        MAT(table, i, 0) = MAT(points, i, 0);
+        MAT(table, i, 1) = MAT(points, i, 1);
     }
 
-    ldouble_t a, b, epsilon;
-    printf("Enter the interval [a, b]: ");
-    scanf("%Lf %Lf", &a, &b);
-    printf("Enter the error tolerance: ");
-    scanf("%Lf", &epsilon);
+    for (j = 2; j < n + 1; j++)
+    {
+        for (i = 0; i < n - j + 1; i++)
+        {
+            MAT(table, i, j) = MAT(table, i + 1, j - 1) - MAT(table, i, j - 1);
+            MAT(table, i, j) /= MAT(table, i + j - 1, 0) - MAT(table, i, 0);
+        }
+    }
 
-    ldouble_t result = solveBisection(f, a, b, epsilon);
-    if (isnan(result))
+    /* the divided differences are the coefficients of the Newton form */
+    coefficients = (ldouble_t *)calloc(n + 1, sizeof(ldouble_t));
+    centers = (ldouble_t *)calloc(n + 1, sizeof(ldouble_t));
+    for (i = 0; i < n; i++)
     {
-        printf("No root found in the interval.\n");
+        coefficients[i] = MAT(table, 0, i + 1);
+        centers[i] = MAT(table, i, 0);
     }
-    else
+    degree = n - 1;
+    while (degree > 0 && coefficients[degree] == 0)
     {
-        printf("Root: %Lf\n", result);
+        degree--;
     }
+    f = (EVALABLE *)createPolynomial(degree, coefficients, centers);
 
-    destroy(f);
-
-    return 0;
+    free(coefficients);
+    free(centers);
+    destroyMatrix(table);
+    return f;
 }
 
-int mainRegulaFalsi()
+int mainGregoryNewton()
 {
-    EVALABLE *f = getFunction();
-    if (f == NULL)
-    {
-        return 1;
-    }
+    int n, i, j;
+    EVALABLE *f;
+    ldouble_t x;
 
-    ldouble_t a, b, epsilon;
-    printf("Enter the interval [a, b]: ");
-    scanf("%Lf %Lf", &a, &b);
-    printf("Enter the error tolerance: ");
-    scanf("%Lf", &epsilon);
+    printf("Enter the number of points: ");
+    scanf("%d", &n);
 
-    ldouble_t result = solveRegulaFalsi(f, a, b, epsilon);
-    if (isnan(result))
-    {
-        printf("No root found in the interval.\n");
-    }
-    else
+    Matrix *points = createMatrix(n, n + 1);
+    printf("Enter the points:\n");
+    printf("x f(x)\n");
+    for (i = 0; i < n; i++)
     {
-        printf("Root: %Lf\n", result);
+        for (j = 0; j < 2; j++)
+        {
+            scanf("%" LDOUBLE_SCN, &MAT(points, i, j));
+        }
     }
 
+    f = gregoryNewton(points);
+
+    print(f);
+    printf("\n");
+    printf("Enter value: ");
+
+    scanf("%" LDOUBLE_SCN, &x);
+    printf("f(%" LDOUBLE_PRI ") = %" LDOUBLE_PRI "\n", x, evaluate(f, x));
+
+    destroyMatrix(points);
     destroy(f);
 
     return 0;
 }
 
-int mainNewtonRaphson()
+/* Wall clock time in seconds */
+double getTime()
 {
-    EVALABLE *f = getFunction();
-    if (f == NULL)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int mainMatrixBenchmark()
+{
+    int maxSize, size;
+    int i, j;
+    printf("Enter the largest matrix size (64-2048): ");
+    if (scanf("%d", &maxSize) != 1 || maxSize < 64 || maxSize > 2048)
     {
+        printf("Invalid size.\n");
         return 1;
     }
 
-    ldouble_t x0, epsilon;
-    printf("Enter the initial guess: ");
-    scanf("%Lf", &x0);
-    printf("Enter the error tolerance: ");
-    scanf("%Lf", &epsilon);
+    srand(1);
+    printf("%6s %12s %12s %10s %10s %14s\n", "size", "naive (s)", "blocked (s)", "GFLOPS", "speedup", "max difference");
+    for (size = 64; size <= maxSize; size *= 2)
+    {
+        Matrix *m1 = createMatrix(size, size);
+        Matrix *m2 = createMatrix(size, size);
+        Matrix *naive, *blocked;
+        ldouble_t maxDifference = 0;
+        double start, naiveTime, blockedTime;
+        for (i = 0; i < size; i++)
+        {
+            for (j = 0; j < size; j++)
+            {
+                MAT(m1, i, j) = (ldouble_t)rand() / RAND_MAX * 2 - 1;
+                MAT(m2, i, j) = (ldouble_t)rand() / RAND_MAX * 2 - 1;
+            }
+        }
 
-    ldouble_t result = solveNewtonRaphson(f, x0, epsilon);
-    printf("Root: %Lf\n", result);
+        start = getTime();
+        naive = multiplyMatrixNaive(m1, m2);
+        naiveTime = getTime() - start;
 
-    destroy(f);
+        start = getTime();
+        blocked = multiplyMatrix(m1, m2);
+        blockedTime = getTime() - start;
+
+        for (i = 0; i < size; i++)
+        {
+            for (j = 0; j < size; j++)
+            {
+                ldouble_t difference = ABS(MAT(naive, i, j) - MAT(blocked, i, j));
+                if (difference > maxDifference)
+                {
+                    maxDifference = difference;
+                }
+            }
+        }
+
+        printf("%6d %12.4f %12.4f %10.2f %9.2fx %14.3e\n", size, naiveTime, blockedTime,
+               2.0 * size * size * size / blockedTime * 1e-9, naiveTime / blockedTime, (double)maxDifference);
+
+        destroyMatrix(m1);
+        destroyMatrix(m2);
+        destroyMatrix(naive);
+        destroyMatrix(blocked);
+    }
 
     return 0;
 }
 
-int mainMatrixInverse()
-{
-    int rows, cols;
-    int i, j;
-    Matrix *m;
-    Matrix *result;
-    printf("Enter the number of rows and columns: ");
-    scanf("%d %d", &rows, &cols);
+/*
+ * The batch mode reads jobs from a file or from stdin and writes a result
+ * line for each job, so a script can run many jobs with one process:
+ *
+ *     ./analysis --batch jobs.txt
+ *     ./analysis --batch < jobs.txt
+ *
+ * A job is a line of fields that are separated with ';'
+ *
+ *     method; function; interval; tolerance; n; order
+ *
+ * method is one of methodNames, interval is "a b" or the initial guess for
+ * newton-raphson. The fields that the method does not use can be empty or
+ * left out at the end of the line. Empty lines and the lines that start
+ * with '#' are skipped and have no result line.
+ *
+ * The result line is the root or the integral with all of its digits, the
+ * adaptive integrators add the number of function evaluations. A job that
+ * can not be run writes "error: " and the reason instead.
+ *
+ * The functions are kept compiled in a FunctionCache, the jobs of a
+ * function that was used before do not parse it again. The hits and the
+ * misses of the cache are written to stderr at the end.
+ *
+ * In order to change the longest line that can be read change the value
+ * of BATCH_LINE_SIZE.
+ * i.e. gcc -DBATCH_LINE_SIZE=4096 ...
+*/
+#ifndef BATCH_LINE_SIZE
+#define BATCH_LINE_SIZE 1024
+#endif
 
-    if (rows != cols)
+#define BATCH_FIELDS 6
+
+/* Remove the spaces at the start and the end of the string */
+char *trimSpaces(char *s)
+{
+    char *end;
+    while (*s == ' ' || *s == '\t' || *s == '\r')
     {
-        printf("The matrix must be square.\n");
-        return 1;
+        s++;
     }
+    end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+    {
+        end--;
+    }
+    *end = '\0';
+    return s;
+}
 
-    printf("Enter the matrix:\n");
-    m = createMatrix(rows, cols);
-
-    for (i = 0; i < m->rows; i++)
+/*
+ * Split the line into the fields that are separated with ';'
+ *
+ * Parameters:
+ * - line: The line, the separators are replaced with '\0'
+ * - fields: Set to the fields without the spaces around them, the missing
+ *   ones at the end are ""
+ * - maxFields: The number of fields
+ * Returns:
+ * - The number of fields in the line, -1 if there are more than maxFields
+*/
+int splitFields(char *line, char **fields, int maxFields)
+{
+    int count = 0;
+    int i;
+    char *next = line;
+    while (count < maxFields && next != NULL)
     {
-        for (j = 0; j < m->cols; j++)
+        char *separator = strchr(next, ';');
+        if (separator != NULL)
         {
-            scanf("%Lf", &m->data[i][j]);
+            *separator = '\0';
         }
+        fields[count++] = trimSpaces(next);
+        next = separator != NULL ? separator + 1 : NULL;
     }
-
-    result = inverseMatrix(m);
-    if (result == NULL)
+    if (next != NULL)
     {
-        printf("The matrix is singular.\n");
+        return -1;
     }
-    else
+    for (i = count; i < maxFields; i++)
     {
-        printMatrix(result);
+        fields[i] = "";
     }
-
-    destroyMatrix(m);
-    destroyMatrix(result);
-
-    return 0;
+    return count;
 }
 
-int mainGauusElimination()
+/*
+ * Read the settings of a job from its fields
+ *
+ * Parameters:
+ * - fields: The BATCH_FIELDS fields of the job line, fields[1] is the function
+ * - m: Set to the method and its settings
+ * Returns:
+ * - What is wrong with the job, NULL if it can be run
+*/
+const char *parseBatchJob(char **fields, MethodSettings *m)
 {
-    int rows, cols;
-    int i, j;
-    printf("Enter the number of rows and columns: ");
-    scanf("%d %d", &rows, &cols);
-    if (rows != cols - 1)
+    int method, used;
+
+    memset(m, 0, sizeof(MethodSettings));
+    method = findMethod(fields[0]);
+    if (method < 0)
     {
-        printf("The matrix must be augmented.\n");
-        return 1;
+        return "Unknown method.";
     }
-
-    printf("Enter the augmented matrix:\n");
-    Matrix *m = createMatrix(rows, cols);
-    for (i = 0; i < m->rows; i++)
+    m->method = (Method)method;
+    if (fields[1][0] == '\0')
     {
-        for (j = 0; j < m->cols; j++)
-        {
-            scanf("%Lf", &m->data[i][j]);
-        }
+        return "The function is missing.";
     }
 
-    Matrix *result = gauusElimination(m);
-    if (result == NULL)
+    used = 0;
+    if (m->method == METHOD_NEWTON_RAPHSON)
     {
-        printf("The matrix is singular.\n");
+        sscanf(fields[2], "%" LDOUBLE_SCN "%n", &m->a, &used);
     }
     else
     {
-        printMatrix(result);
+        sscanf(fields[2], "%" LDOUBLE_SCN " %" LDOUBLE_SCN "%n", &m->a, &m->b, &used);
     }
+    if (used == 0 || fields[2][used] != '\0')
+    {
+        return m->method == METHOD_NEWTON_RAPHSON ? "Invalid initial guess." : "Invalid interval.";
+    }
+    if (sscanf(fields[3], "%" LDOUBLE_SCN, &m->tolerance) != 1 && fields[3][0] != '\0')
+    {
+        return "Invalid tolerance.";
+    }
+    if (sscanf(fields[4], "%d", &m->n) != 1 && fields[4][0] != '\0')
+    {
+        return "Invalid n.";
+    }
+    if (sscanf(fields[5], "%d", &m->order) != 1 && fields[5][0] != '\0')
+    {
+        return "Invalid order.";
+    }
+    return methodSettingsError(m);
+}
 
-    destroyMatrix(m);
-    destroyMatrix(result);
-
-    return 0;
+/* Write the line of a function that can not be parsed, input is the function text */
+void writeParseError(FILE *out, StatusCode *s, const char *input)
+{
+    if (s->code == 2)
+    {
+        fprintf(out, "error: Expected '%c' at %d.\n", s->expected, (int)(s->pos - input + 1));
+    }
+    else
+    {
+        fprintf(out, "error: Unexpected character at %d.\n", (int)(s->pos - input + 1));
+    }
 }
 
-int mainGauusSeidel()
+/* Write the result line of a job, the adaptive integrators add the number of evaluations */
+void writeMethodResult(FILE *out, MethodSettings *m, ldouble_t result, int evaluations)
 {
-    Matrix *m;
-    Matrix *x0;
-    Matrix *result;
-    int rows, cols;
-    ldouble_t epsilon;
-    int i, j;
-    printf("Enter the number of rows and columns: ");
-    scanf("%d %d", &rows, &cols);
-    if (rows != cols - 1)
+    fprintf(out, "%.*" LDOUBLE_EXACT, LDOUBLE_DIGITS, result);
+    if (isAdaptiveMethod(m->method))
     {
-        printf("The matrix must be augmented.\n");
-        return 1;
+        fprintf(out, " %d", evaluations);
     }
+    fprintf(out, "\n");
+}
 
-    printf("Enter the augmented matrix:\n");
-    m = createMatrix(rows, cols);
-    for (i = 0; i < m->rows; i++)
+/*
+ * Run the jobs of the input and write their results
+ *
+ * Parameters:
+ * - in: The jobs, a line for each job
+ * - out: The results, a line for each job
+ * - cache: The compiled functions
+*/
+void runBatch(FILE *in, FILE *out, FunctionCache *cache)
+{
+    char line[BATCH_LINE_SIZE];
+    CachedFunction *f;
+    StatusCode status;
+    MethodSettings m;
+    const char *error;
+    char *fields[BATCH_FIELDS];
+    char *text;
+    int evaluations, c;
+
+    while (fgets(line, BATCH_LINE_SIZE, in) != NULL)
     {
-        for (j = 0; j < m->cols; j++)
+        size_t length = strlen(line);
+        if (length > 0 && line[length - 1] == '\n')
+        {
+            line[length - 1] = '\0';
+        }
+        else if (!feof(in))
+        {
+            while ((c = fgetc(in)) != EOF && c != '\n');
+            fprintf(out, "error: The line is too long.\n");
+            fflush(out);
+            continue;
+        }
+        text = trimSpaces(line);
+        if (text[0] == '\0' || text[0] == '#')
+        {
+            continue;
+        }
+
+        error = splitFields(text, fields, BATCH_FIELDS) < 0 ? "Too many fields." : parseBatchJob(fields, &m);
+        if (error != NULL)
+        {
+            fprintf(out, "error: %s\n", error);
+            fflush(out);
+            continue;
+        }
+
+        f = acquireFunction(cache, fields[1], &status);
+        if (f == NULL)
         {
-            scanf("%Lf", &m->data[i][j]);
+            writeParseError(out, &status, fields[1]);
+            fflush(out);
+            continue;
         }
+        ldouble_t result = runMethod(f->e, f->p, NULL, &m, &evaluations);
+        releaseFunctionCache(cache, f);
+        writeMethodResult(out, &m, result, evaluations);
+        fflush(out);
     }
+}
 
-    printf("Enter the initial solution matrix:\n");
-    x0 = createMatrix(rows, 1);
-    for (i = 0; i < x0->rows; i++)
+int mainBatch(const char *path)
+{
+    FILE *in = stdin;
+    FunctionCache *cache;
+    FunctionCacheStatistics statistics;
+    if (path != NULL && strcmp(path, "-") != 0)
+    {
+        in = fopen(path, "r");
+        if (in == NULL)
+        {
+            fprintf(stderr, "Failed to open %s.\n", path);
+            return 1;
+        }
+    }
+    cache = createFunctionCache(FUNCTION_CACHE_SIZE);
+    runBatch(in, stdout, cache);
+    statistics = getFunctionCacheStatistics(cache);
+    fprintf(stderr, "Function cache: %ld hits, %ld misses\n", statistics.hits, statistics.misses);
+    destroyFunctionCache(cache);
+    if (in != stdin)
     {
-        scanf("%Lf", &x0->data[i][0]);
+        fclose(in);
     }
+    return 0;
+}
 
-    printf("Enter the error tolerance: ");
-    scanf("%Lf", &epsilon);
+/*
+ * The server mode keeps the engine running and answers the requests of
+ * other programs over a Unix domain socket:
+ *
+ *     ./analysis --server /tmp/analysis.sock
+ *
+ * A request is a line and its answer is a line, the fields are separated
+ * with ';' like in the batch mode:
+ *
+ *     compile; function                              -> ok
+ *     evaluate; function; x1 x2 ...                  -> f(x1) f(x2) ...
+ *     method; function; interval; tolerance; n; order -> the batch result
+ *     solve; n; a11 a12 ... ann; b1 b2 ... bn        -> x1 x2 ... xn
+ *     stats                                          -> hits misses count capacity
+ *
+ * A request that can not be answered gets "error: " and the reason.
+ *
+ * The functions are kept compiled in a FunctionCache, so a function that
+ * is asked for again is not parsed again. The main thread reads and writes
+ * all of the connections with poll(), a complete request line is given to
+ * one of the SERVER_WORKERS threads and its answer is sent back by the main
+ * thread. A connection has at most one request that is being answered, so
+ * a client that is waiting or sending a request slowly does not hold a
+ * worker. SIGINT and SIGTERM stop the server after the requests that the
+ * workers are answering, and remove the socket file.
+ *
+ * The cost of a request is bounded: the solvers and the adaptive
+ * integrators have their own limits, a function can have at most
+ * BATCH_LINE_SIZE characters and the other integrators at most
+ * METHOD_MAX_POINTS points. A line longer than SERVER_LINE_SIZE is answered
+ * with an error and the connection is closed, a connection that sends no
+ * request for SERVER_IDLE_TIMEOUT seconds is closed, and the clients after
+ * SERVER_MAX_CONNECTIONS are answered with an error and closed.
+ *
+ * In order to change the limits change the values of SERVER_WORKERS,
+ * SERVER_MAX_CONNECTIONS, SERVER_LINE_SIZE (bytes) and SERVER_IDLE_TIMEOUT
+ * (seconds).
+ * i.e. gcc -DSERVER_WORKERS=32 -DSERVER_IDLE_TIMEOUT=600 ...
+*/
+#ifndef SERVER_WORKERS
+#define SERVER_WORKERS 8
+#endif
+#ifndef SERVER_MAX_CONNECTIONS
+#define SERVER_MAX_CONNECTIONS 256
+#endif
+#ifndef SERVER_LINE_SIZE
+#define SERVER_LINE_SIZE (1 << 20)
+#endif
+#ifndef SERVER_IDLE_TIMEOUT
+#define SERVER_IDLE_TIMEOUT 60
+#endif
 
-    result = gauusSeidel(m, x0, epsilon);
-    printMatrix(result);
+/*
+ * A client of the server. input has the bytes that are read and not
+ * answered yet, output has the answer that is not sent yet. busy is set
+ * while a worker answers its request, ended when the client closed its
+ * side and closing when it is closed after its output is sent. shut is set
+ * when the server closed its side, the rest of the input is read and
+ * thrown away until the client closes, so it gets the last answer instead
+ * of a reset connection. fd is -1 after the connection is dropped, it is
+ * freed when it is not busy.
+*/
+typedef struct _Connection {
+    int fd;
+    char *input;
+    size_t inputLength;
+    size_t inputSize;
+    char *output;
+    size_t outputLength;
+    size_t outputSent;
+    int busy;
+    int ended;
+    int closing;
+    int shut;
+    double lastActive;
+} Connection;
+
+/* A request that is given to a worker, answer is written by the worker */
+typedef struct _ServerJob {
+    Connection *connection;
+    char *line;
+    char *request;
+    char *answer;
+    size_t answerLength;
+    struct _ServerJob *next;
+} ServerJob;
 
-    destroyMatrix(m);
-    destroyMatrix(x0);
-    destroyMatrix(result);
+/*
+ * waiting is the list of the requests for the workers, done is the list of
+ * the answered ones. A worker writes to wakeup after it answers, so the
+ * poll() of the main thread returns. stopping makes the workers return
+ * when the server stops.
+*/
+typedef struct {
+    ServerJob *waiting;
+    ServerJob *lastWaiting;
+    ServerJob *done;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int wakeup[2];
+    FunctionCache *cache;
+} Server;
+
+volatile sig_atomic_t serverStopping = 0;
+int serverWakeup = -1;
 
-    return 0;
+/*
+ * Read the numbers that are separated with spaces
+ *
+ * Parameters:
+ * - s: The text
+ * - values: Set to the numbers
+ * - max: The most numbers that can be read
+ * Returns:
+ * - The number of numbers, -1 if the text has something else or more than max numbers
+*/
+int readNumbers(const char *s, ldouble_t *values, int max)
+{
+    int count = 0;
+    char *end;
+    while (1)
+    {
+        while (*s == ' ' || *s == '\t')
+        {
+            s++;
+        }
+        if (*s == '\0')
+        {
+            return count;
+        }
+        if (count == max)
+        {
+            return -1;
+        }
+        values[count] = STR_TO_LDOUBLE(s, &end);
+        if (end == s)
+        {
+            return -1;
+        }
+        s = end;
+        count++;
+    }
 }
 
-int mainNumericalDerivative()
+/* Write the numbers separated with spaces and the end of the line */
+void writeNumbers(FILE *out, const ldouble_t *values, int count)
 {
-    EVALABLE *f = getFunction();
-    if (f == NULL)
+    int i;
+    for (i = 0; i < count; i++)
     {
-        return 1;
+        fprintf(out, i == 0 ? "%.*" LDOUBLE_EXACT : " %.*" LDOUBLE_EXACT, LDOUBLE_DIGITS, values[i]);
     }
+    fprintf(out, "\n");
+}
 
-    int option;
-    ldouble_t x, h;
-    ldouble_t result;
-    printf("Select the method:\n");
-    printf("1. Forward difference\n");
-    printf("2. Backward difference\n");
-    printf("3. Central difference\n");
-    scanf("%d", &option);
-
-    printf("Enter the point: ");
-    scanf("%Lf", &x);
-    printf("Enter the step size: ");
-    scanf("%Lf", &h);
-
-    switch (option)
+/* Answer "solve; n; a11 a12 ... ann; b1 b2 ... bn" */
+void answerLinearSystem(char **fields, FILE *out)
+{
+    Matrix *A, *B, *x;
+    ldouble_t *values;
+    int n, i, j;
+    if (sscanf(fields[1], "%d", &n) != 1 || n < 1)
     {
-        case 1:
-            result = (evaluate(f, x + h) - evaluate(f, x)) / h;
-            break;
-        case 2:
-            result = (evaluate(f, x) - evaluate(f, x - h)) / h;
-            break;
-        case 3:
-            result = (evaluate(f, x + h) - evaluate(f, x - h)) / (2 * h);
-            break;
-        default:
-            printf("Invalid option.\n");
-            return 1;
+        fprintf(out, "error: Invalid n.\n");
+        return;
+    }
+    /* the numbers are separated, so the line can not have more than half of its length */
+    if ((long long)n * n > (long long)strlen(fields[2]) / 2 + 1)
+    {
+        fprintf(out, "error: The matrix must have n * n numbers.\n");
+        return;
+    }
+    values = (ldouble_t *)malloc(((size_t)n * n + n) * sizeof(ldouble_t));
+    if (readNumbers(fields[2], values, n * n) != n * n)
+    {
+        fprintf(out, "error: The matrix must have n * n numbers.\n");
+        free(values);
+        return;
+    }
+    if (readNumbers(fields[3], values + n * n, n) != n)
+    {
+        fprintf(out, "error: The constants must have n numbers.\n");
+        free(values);
+        return;
     }
-
-    printf("Derivative: %Lf\n", result);
-
-    destroy(f);
-
-    return 0;
+    A = createMatrix(n, n);
+    B = createMatrix(n, 1);
+    for (i = 0; i < n; i++)
+    {
+        for (j = 0; j < n; j++)
+        {
+            MAT(A, i, j) = values[i * n + j];
+        }
+        MAT(B, i, 0) = values[n * n + i];
+    }
+    x = solveLinearSystem(A, B);
+    if (x == NULL)
+    {
+        fprintf(out, "error: The matrix is singular.\n");
+    }
+    else
+    {
+        for (i = 0; i < n; i++)
+        {
+            values[i] = MAT(x, i, 0);
+        }
+        writeNumbers(out, values, n);
+        destroyMatrix(x);
+    }
+    destroyMatrix(A);
+    destroyMatrix(B);
+    free(values);
 }
 
-int mainSimpson()
+/*
+ * Answer a request line of the server
+ *
+ * Parameters:
+ * - line: The request, it is split into its fields
+ * - out: The answer is written to it
+ * - cache: The compiled functions
+*/
+void answerRequest(char *line, FILE *out, FunctionCache *cache)
 {
-    int option;
-    EVALABLE *f;
-    ldouble_t a, b;
-    ldouble_t result;
-    int n;
-    printf("Enter which method to use:\n");
-    printf("1. Simpson's 1/3 rule\n");
-    printf("2. Simpson's 3/8 rule\n");
-    scanf("%d", &option);
+    char *fields[BATCH_FIELDS];
+    CachedFunction *f;
+    StatusCode status;
+    MethodSettings m;
+    const char *error = NULL;
+    int evaluations;
 
-    f = getFunction();
-    if (f == NULL)
+    if (splitFields(line, fields, BATCH_FIELDS) < 0)
     {
-        return 1;
+        error = "Too many fields.";
+    }
+    else if (strcmp(fields[0], "solve") == 0)
+    {
+        answerLinearSystem(fields, out);
+        return;
+    }
+    else if (strcmp(fields[0], "stats") == 0)
+    {
+        FunctionCacheStatistics statistics = getFunctionCacheStatistics(cache);
+        fprintf(out, "%ld %ld %d %d\n", statistics.hits, statistics.misses, statistics.count, statistics.capacity);
+        return;
+    }
+    else if (strcmp(fields[0], "compile") == 0 || strcmp(fields[0], "evaluate") == 0)
+    {
+        error = fields[1][0] == '\0' ? "The function is missing." : NULL;
+    }
+    else
+    {
+        error = parseBatchJob(fields, &m);
+    }
+    if (error == NULL && strlen(fields[1]) >= BATCH_LINE_SIZE)
+    {
+        error = "The function is too long.";
+    }
+    if (error != NULL)
+    {
+        fprintf(out, "error: %s\n", error);
+        return;
     }
 
-    printf("Enter the interval [a, b]: ");
-    scanf("%Lf %Lf", &a, &b);
-    printf("Enter the number of subintervals: ");
-    scanf("%d", &n);
-
-    if (option == 1)
+    f = acquireFunction(cache, fields[1], &status);
+    if (f == NULL)
     {
-        result = integrateSimpson13(f, a, b, n);
+        writeParseError(out, &status, fields[1]);
+        return;
     }
-    else if (option == 2)
+    if (strcmp(fields[0], "compile") == 0)
     {
-        result = integrateSimpson38(f, a, b, n);
+        fprintf(out, "ok\n");
+    }
+    else if (strcmp(fields[0], "evaluate") == 0)
+    {
+        int max = strlen(fields[2]) / 2 + 1;
+        ldouble_t *xs = (ldouble_t *)malloc(max * sizeof(ldouble_t));
+        ldouble_t *ys = (ldouble_t *)malloc(max * sizeof(ldouble_t));
+        int count = readNumbers(fields[2], xs, max);
+        if (count <= 0)
+        {
+            fprintf(out, "error: Invalid values of x.\n");
+        }
+        else
+        {
+            evaluateProgramBatch(f->p, xs, ys, count);
+            writeNumbers(out, ys, count);
+        }
+        free(xs);
+        free(ys);
     }
     else
     {
-        printf("Invalid option.\n");
-        return 1;
+        ldouble_t result = runMethod(f->e, f->p, NULL, &m, &evaluations);
+        writeMethodResult(out, &m, result, evaluations);
     }
+    releaseFunctionCache(cache, f);
+}
 
-    printf("Integral: %Lf\n", result);
+void *serverWorker(void *arg)
+{
+    Server *server = (Server *)arg;
+    ServerJob *job;
+    FILE *out;
+    char wakeup = 0;
+    ssize_t written;
+    while (1)
+    {
+        pthread_mutex_lock(&server->lock);
+        while (server->waiting == NULL && !server->stopping)
+        {
+            pthread_cond_wait(&server->ready, &server->lock);
+        }
+        if (server->stopping)
+        {
+            pthread_mutex_unlock(&server->lock);
+            return NULL;
+        }
+        job = server->waiting;
+        server->waiting = job->next;
+        pthread_mutex_unlock(&server->lock);
 
-    destroy(f);
+        job->answer = NULL;
+        out = open_memstream(&job->answer, &job->answerLength);
+        if (out != NULL)
+        {
+            answerRequest(job->request, out, server->cache);
+            fclose(out);
+        }
 
-    return 0;
+        pthread_mutex_lock(&server->lock);
+        job->next = server->done;
+        server->done = job;
+        pthread_mutex_unlock(&server->lock);
+        written = write(server->wakeup[1], &wakeup, 1);
+        UNUSED(written);
+    }
 }
 
-int mainTrapez()
+void stopServer(int signal)
 {
-    EVALABLE *f = getFunction();
-    if (f == NULL)
+    char wakeup = 0;
+    ssize_t written;
+    UNUSED(signal);
+    serverStopping = 1;
+    if (serverWakeup >= 0)
     {
-        return 1;
+        written = write(serverWakeup, &wakeup, 1);
+        UNUSED(written);
     }
+}
 
-    ldouble_t a, b;
-    ldouble_t result;
-    int n;
-    printf("Enter the interval [a, b]: ");
-    scanf("%Lf %Lf", &a, &b);
-    printf("Enter the number of subintervals: ");
-    scanf("%d", &n);
-
-    result = integrateTrapez(f, a, b, n);
-    printf("Integral: %Lf\n", result);
-
-    destroy(f);
-
-    return 0;
+/* Add the text to the answers that are sent to the client */
+void appendOutput(Connection *c, const char *text, size_t length)
+{
+    c->output = (char *)realloc(c->output, c->outputLength + length);
+    memcpy(c->output + c->outputLength, text, length);
+    c->outputLength += length;
 }
 
-int factorial(int n)
+/* Close the connection, it is freed when it has no request at a worker */
+void dropConnection(Connection *c)
 {
-    ldouble_t result = 1;
-    int i;
-    for (i = 1; i <= n; i++)
+    if (c->fd >= 0)
     {
-        result *= i;
+        close(c->fd);
+        c->fd = -1;
     }
-    return result;
 }
 
-EVALABLE *gregoryNewton(Matrix *points)
+/* Read what the client sent, the buffer grows up to SERVER_LINE_SIZE bytes */
+void readConnection(Connection *c)
 {
-    int n = points->rows;
-    int i, j;
-    ldouble_t constant;
-    MulChain *term;
-    SumChain *f, *arg;
-    Matrix *table = createMatrix(n, n + 1);
-
-    for (i = 0; i < n; i++)
+    ssize_t length;
+    if (c->shut)
     {
-        table->data[i][0] = points->data[i][0];
-        table->data[i][1] = points->data[i][1];
+        c->inputLength = 0;
     }
-
-    for (j = 2; j < n + 1; j++)
+    while (c->inputLength < SERVER_LINE_SIZE)
     {
-        for (i = 0; i < n - j + 1; i++)
+        if (c->inputLength == c->inputSize)
+        {
+            c->inputSize = MIN(MAX(2 * c->inputSize, 4096), SERVER_LINE_SIZE);
+            c->input = (char *)realloc(c->input, c->inputSize);
+        }
+        length = read(c->fd, c->input + c->inputLength, c->inputSize - c->inputLength);
+        if (length > 0)
+        {
+            c->inputLength += length;
+        }
+        else if (length == 0)
+        {
+            c->ended = 1;
+            return;
+        }
+        else
         {
-            table->data[i][j] = table->data[i + 1][j - 1] - table->data[i][j - 1];
-            table->data[i][j] /= table->data[i + j - 1][0] - table->data[i][0];
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                dropConnection(c);
+            }
+            return;
         }
     }
+}
 
-    f = createSumChain();
-    constant = table->data[0][1];
-    addSumChainArg(f, (EVALABLE*)createConstant(constant), 1);
+/* Send the answers until the socket is full */
+void writeConnection(Connection *c)
+{
+    ssize_t length;
+    while (c->outputSent < c->outputLength)
+    {
+        length = write(c->fd, c->output + c->outputSent, c->outputLength - c->outputSent);
+        if (length < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                dropConnection(c);
+            }
+            return;
+        }
+        c->outputSent += length;
+    }
+    c->outputLength = 0;
+    c->outputSent = 0;
+    c->lastActive = getTime();
+}
 
-    for (i = 1; i < n && constant != 0; i++)
+/*
+ * Give the next request line of the connection to the workers. The next
+ * request waits until the answer of the previous one is sent, so a client
+ * that does not read its answers can not make the server keep them.
+*/
+void dispatchRequest(Server *server, Connection *c)
+{
+    char *newline;
+    size_t length;
+    ServerJob *job;
+    char *request;
+    while (c->fd >= 0 && !c->busy && !c->closing && c->outputLength == 0)
     {
-        constant = table->data[0][i + 1];
+        newline = c->inputLength > 0 ? (char *)memchr(c->input, '\n', c->inputLength) : NULL;
+        if (newline != NULL)
+        {
+            length = newline - c->input;
+        }
+        else if (c->inputLength == SERVER_LINE_SIZE)
+        {
+            const char *error = "error: The line is too long.\n";
+            appendOutput(c, error, strlen(error));
+            c->closing = 1;
+            return;
+        }
+        else if (c->ended && c->inputLength > 0)
+        {
+            /* the last line does not need to end with a new line */
+            length = c->inputLength;
+        }
+        else if (c->ended)
+        {
+            c->closing = 1;
+            return;
+        }
+        else
+        {
+            return;
+        }
 
-        term = createMulChain();
-        for (j = 0; j < i; j++)
+        job = (ServerJob *)malloc(sizeof(ServerJob));
+        job->line = (char *)malloc(length + 1);
+        memcpy(job->line, c->input, length);
+        job->line[length] = '\0';
+        c->inputLength -= newline != NULL ? length + 1 : length;
+        memmove(c->input, c->input + length + (newline != NULL), c->inputLength);
+        request = trimSpaces(job->line);
+        if (request[0] == '\0' || request[0] == '#')
         {
-            arg = createSumChain();
-            addSumChainArg(arg, (EVALABLE*)createVariable(), 1);
-            addSumChainArg(arg, (EVALABLE*)createConstant(table->data[j][0]), 0);
-            addMulChainArg(term, (EVALABLE*)arg, 0);
+            free(job->line);
+            free(job);
+            continue;
         }
 
-        addMulChainArg(term, (EVALABLE*)createConstant(constant), 0);
-        addSumChainArg(f, (EVALABLE*)term, 1);
-    }
+        if (strcmp(request, "stats") == 0)
+        {
+            /* it is answered at once, so it is not behind the requests that take long */
+            FunctionCacheStatistics statistics = getFunctionCacheStatistics(server->cache);
+            char answer[64];
+            int written = snprintf(answer, sizeof(answer), "%ld %ld %d %d\n", statistics.hits,
+                                   statistics.misses, statistics.count, statistics.capacity);
+            appendOutput(c, answer, written);
+            free(job->line);
+            free(job);
+            return;
+        }
 
-    destroyMatrix(table);
-    return (EVALABLE*)f;
+        job->connection = c;
+        job->request = request;
+        job->next = NULL;
+        c->busy = 1;
+        c->lastActive = getTime();
+        pthread_mutex_lock(&server->lock);
+        if (server->waiting == NULL)
+        {
+            server->waiting = job;
+        }
+        else
+        {
+            server->lastWaiting->next = job;
+        }
+        server->lastWaiting = job;
+        pthread_cond_signal(&server->ready);
+        pthread_mutex_unlock(&server->lock);
+    }
 }
 
-int mainGregoryNewton()
+/* Give the answers of the workers to their connections */
+void collectAnswers(Server *server)
 {
-    int n, i, j;
-    EVALABLE *f;
-    ldouble_t x;
-
-    printf("Enter the number of points: ");
-    scanf("%d", &n);
+    char buffer[64];
+    ServerJob *job, *next;
+    while (read(server->wakeup[0], buffer, sizeof(buffer)) > 0)
+    {
+    }
+    pthread_mutex_lock(&server->lock);
+    job = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&server->lock);
+    for (; job != NULL; job = next)
+    {
+        Connection *c = job->connection;
+        next = job->next;
+        c->busy = 0;
+        if (job->answer == NULL)
+        {
+            dropConnection(c);
+        }
+        else if (c->fd >= 0)
+        {
+            appendOutput(c, job->answer, job->answerLength);
+        }
+        free(job->answer);
+        free(job->line);
+        free(job);
+    }
+}
 
-    Matrix *points = createMatrix(n, n + 1);
-    printf("Enter the points:\n");
-    printf("x f(x)\n");
-    for (i = 0; i < n; i++)
+/* Accept the waiting clients, the ones after SERVER_MAX_CONNECTIONS get an error */
+void acceptConnections(int listener, Connection **connections, int *count)
+{
+    const char *error = "error: Too many connections.\n";
+    Connection *c;
+    int fd;
+    ssize_t written;
+    while ((fd = accept(listener, NULL, NULL)) >= 0)
     {
-        for (j = 0; j < 2; j++)
+        if (*count == SERVER_MAX_CONNECTIONS)
         {
-            scanf("%Lf", &points->data[i][j]);
+            written = send(fd, error, strlen(error), MSG_DONTWAIT);
+            UNUSED(written);
+            close(fd);
+            continue;
         }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        c = (Connection *)calloc(1, sizeof(Connection));
+        c->fd = fd;
+        c->lastActive = getTime();
+        connections[(*count)++] = c;
     }
+}
 
-    f = gregoryNewton(points);
+int mainServer(const char *path)
+{
+    struct sockaddr_un address;
+    struct sigaction action;
+    struct stat info;
+    struct pollfd *polls;
+    sigset_t signals, previousSignals;
+    pthread_t workers[SERVER_WORKERS];
+    ServerJob *job;
+    Server server;
+    Connection **connections;
+    int listener, count, polled, i;
+    double now;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "The socket path is too long.\n");
+        return 1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
 
-    print(f);
-    printf("\n");
-    printf("Enter value: ");
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        fprintf(stderr, "Failed to create the socket.\n");
+        return 1;
+    }
+    /* a socket file that is left by a server that did not stop is removed, a running server is not */
+    if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+    {
+        if (connect(listener, (struct sockaddr *)&address, sizeof(address)) == 0)
+        {
+            fprintf(stderr, "A server is already listening on %s.\n", path);
+            close(listener);
+            return 1;
+        }
+        close(listener);
+        unlink(path);
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    }
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0
+        || listen(listener, SOMAXCONN) < 0 || pipe(server.wakeup) < 0)
+    {
+        fprintf(stderr, "Failed to listen on %s.\n", path);
+        if (listener >= 0)
+        {
+            close(listener);
+        }
+        return 1;
+    }
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+    fcntl(server.wakeup[0], F_SETFL, fcntl(server.wakeup[0], F_GETFL) | O_NONBLOCK);
+    fcntl(server.wakeup[1], F_SETFL, fcntl(server.wakeup[1], F_GETFL) | O_NONBLOCK);
+    serverWakeup = server.wakeup[1];
+
+    server.waiting = NULL;
+    server.lastWaiting = NULL;
+    server.done = NULL;
+    server.stopping = 0;
+    server.cache = createFunctionCache(FUNCTION_CACHE_SIZE);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+
+    /* the workers block the signals, so they are handled by this thread */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &previousSignals);
+    for (i = 0; i < SERVER_WORKERS; i++)
+    {
+        pthread_create(&workers[i], NULL, serverWorker, &server);
+    }
+    pthread_sigmask(SIG_SETMASK, &previousSignals, NULL);
+
+    /* the handler also writes to wakeup, so a signal before poll() is not missed */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopServer;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    connections = (Connection **)malloc(SERVER_MAX_CONNECTIONS * sizeof(Connection *));
+    polls = (struct pollfd *)malloc((SERVER_MAX_CONNECTIONS + 2) * sizeof(struct pollfd));
+    count = 0;
+
+    printf("Listening on %s\n", path);
+    fflush(stdout);
+    while (!serverStopping)
+    {
+        polls[0].fd = listener;
+        polls[0].events = POLLIN;
+        polls[1].fd = server.wakeup[0];
+        polls[1].events = POLLIN;
+        for (i = 0; i < count; i++)
+        {
+            Connection *c = connections[i];
+            polls[i + 2].fd = c->fd;
+            polls[i + 2].events = 0;
+            if (!c->ended && (c->inputLength < SERVER_LINE_SIZE || c->shut))
+            {
+                polls[i + 2].events |= POLLIN;
+            }
+            if (c->outputLength > 0)
+            {
+                polls[i + 2].events |= POLLOUT;
+            }
+            if (polls[i + 2].events == 0)
+            {
+                /* a closed client would make poll() return at once until its request is answered */
+                polls[i + 2].fd = -1;
+            }
+        }
+        polled = count;
+        /* it wakes up every second to close the idle connections */
+        if (poll(polls, polled + 2, 1000) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "Failed to wait for the connections.\n");
+            break;
+        }
 
-    scanf("%Lf", &x);
-    printf("f(%Lf) = %Lf\n", x, evaluate(f, x));
+        if (polls[1].revents != 0)
+        {
+            collectAnswers(&server);
+        }
+        for (i = 0; i < polled; i++)
+        {
+            Connection *c = connections[i];
+            if (c->fd >= 0 && (polls[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) != 0 && !c->ended)
+            {
+                readConnection(c);
+            }
+            if (c->fd >= 0 && (polls[i + 2].revents & (POLLOUT | POLLERR)) != 0)
+            {
+                writeConnection(c);
+            }
+        }
+        if (polls[0].revents != 0)
+        {
+            acceptConnections(listener, connections, &count);
+        }
 
-    destroyMatrix(points);
-    destroy(f);
+        now = getTime();
+        for (i = 0; i < count; i++)
+        {
+            Connection *c = connections[i];
+            /* an answer is sent before the next request of the connection is given to the workers */
+            if (c->fd >= 0 && c->outputLength > 0)
+            {
+                writeConnection(c);
+            }
+            dispatchRequest(&server, c);
+            if (c->fd >= 0 && c->outputLength > 0)
+            {
+                writeConnection(c);
+            }
+            if (c->fd >= 0 && !c->busy && now - c->lastActive > SERVER_IDLE_TIMEOUT)
+            {
+                dropConnection(c);
+            }
+            if (c->fd >= 0 && c->closing && !c->busy && c->outputLength == 0)
+            {
+                if (c->ended)
+                {
+                    dropConnection(c);
+                }
+                else if (!c->shut)
+                {
+                    shutdown(c->fd, SHUT_WR);
+                    c->shut = 1;
+                }
+            }
+            if (c->fd < 0 && !c->busy)
+            {
+                free(c->input);
+                free(c->output);
+                free(c);
+                connections[i--] = connections[--count];
+            }
+        }
+    }
 
+    /* the workers finish the requests they are answering, the waiting ones are not answered */
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    pthread_cond_broadcast(&server.ready);
+    pthread_mutex_unlock(&server.lock);
+    for (i = 0; i < SERVER_WORKERS; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    collectAnswers(&server);
+    while (server.waiting != NULL)
+    {
+        job = server.waiting;
+        server.waiting = job->next;
+        free(job->line);
+        free(job);
+    }
+    for (i = 0; i < count; i++)
+    {
+        dropConnection(connections[i]);
+        free(connections[i]->input);
+        free(connections[i]->output);
+        free(connections[i]);
+    }
+    free(connections);
+    free(polls);
+
+    serverWakeup = -1;
+    close(server.wakeup[0]);
+    close(server.wakeup[1]);
+    pthread_cond_destroy(&server.ready);
+    pthread_mutex_destroy(&server.lock);
+    destroyFunctionCache(server.cache);
+    close(listener);
+    unlink(path);
     return 0;
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+    {
+        return mainBatch(argc > 2 ? argv[2] : NULL);
+    }
+    if (argc > 2 && strcmp(argv[1], "--server") == 0)
+    {
+        return mainServer(argv[2]);
+    }
+
     char banner[] = 
 " _____                                                 _____ \n"
 "( ___ )-----------------------------------------------( ___ )\n"
@@ -2666,7 +11273,9 @@ int main()
 "7. Numerical Derivative\n"
 "8. Simpson's method\n"
 "9. Trapez Rule\n"
-"10. Gregory Newton enterpolation\n";
+"10. Gregory Newton enterpolation\n"
+"11. Matrix multiplication benchmark\n"
+"12. Parameter sweep\n";
 
     printf("%s", banner);
     int option;
@@ -2695,6 +11304,10 @@ int main()
             return mainTrapez();
         case 10:
             return mainGregoryNewton();
+        case 11:
+            return mainMatrixBenchmark();
+        case 12:
+            return mainSweep();
         default:
             printf("Invalid option.\n");
             return 1;
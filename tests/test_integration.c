@@ -0,0 +1,113 @@
+/*
+ * Checks of the chunks of the integrators with n near INT_MAX, the last
+ * chunk must not overflow int. Only the last chunk is evaluated, so the
+ * check does not evaluate 2^31 points.
+ *
+ *     gcc tests/test_integration.c -o test_integration -lm -pthread && ./test_integration
+*/
+#include <limits.h>
+#define main analysisMain
+#include "../analysis.c"
+#undef main
+
+int failures = 0;
+
+void check(const char *name, ldouble_t result, ldouble_t expected)
+{
+    if (!(ABS(result - expected) <= 1e-6 * MAX(ABS(expected), 1)))
+    {
+        printf("FAIL %s: %.*" LDOUBLE_EXACT " instead of %.*" LDOUBLE_EXACT "\n", name,
+               LDOUBLE_DIGITS, result, LDOUBLE_DIGITS, expected);
+        failures++;
+    }
+}
+
+/* The number of chunks of points, computed without int */
+int expectedChunks(long long points, long long chunkSize)
+{
+    return (int)((points + chunkSize - 1) / chunkSize);
+}
+
+int main()
+{
+    char input[] = "x";
+    EVALABLE *e;
+    StatusCode status;
+    IntegrationContext ctx;
+    ldouble_t *sums;
+    ldouble_t *sums2;
+    long long first, k, n;
+    ldouble_t even, odd;
+    int chunks;
+    status.code = 0;
+    status.pos = NULL;
+    status.expected = '\0';
+    useArena(createArena());
+    parseExpression(input, &e, &status);
+    ctx.e = e;
+    ctx.p = compileProgram(e);
+    ctx.values = NULL;
+    ctx.a = 0;
+    /* a sum for each chunk of Simpson's 3/8 rule, it has the most chunks */
+    sums = (ldouble_t *)malloc(expectedChunks(INT_MAX, INTEGRATION_CHUNK / 3) * sizeof(ldouble_t));
+    sums2 = (ldouble_t *)malloc(expectedChunks(INT_MAX, INTEGRATION_CHUNK / 3) * sizeof(ldouble_t));
+    ctx.sums = sums;
+    ctx.sums2 = sums2;
+
+    /* f(x) = x, the last chunk of trapez sums the points first ... n - 1 */
+    n = INT_MAX;
+    ctx.n = (int)n;
+    ctx.h = (ldouble_t)1 / n;
+    chunks = integrationChunks((int)n - 1);
+    if (chunks != expectedChunks(n - 1, INTEGRATION_CHUNK))
+    {
+        printf("FAIL integrationChunks: %d\n", chunks);
+        failures++;
+    }
+    sums[chunks - 1] = NAN;
+    integrateTrapezChunks(&ctx, chunks - 1, chunks);
+    first = 1 + (long long)(chunks - 1) * INTEGRATION_CHUNK;
+    check("trapez last chunk", sums[chunks - 1], ctx.h * (ldouble_t)(first + n - 1) * (n - first) / 2);
+
+    /* the even and the odd points of the last chunk of Simpson's 1/3 rule */
+    n = INT_MAX - 1;
+    ctx.n = (int)n;
+    ctx.h = (ldouble_t)1 / n;
+    chunks = integrationChunks((int)n - 1);
+    sums[chunks - 1] = NAN;
+    sums2[chunks - 1] = NAN;
+    integrateSimpson13Chunks(&ctx, chunks - 1, chunks);
+    first = 1 + (long long)(chunks - 1) * INTEGRATION_CHUNK;
+    even = 0;
+    odd = 0;
+    for (k = first; k < n; k++)
+    {
+        if (k % 2 == 0)
+        {
+            even += k * ctx.h;
+        }
+        else
+        {
+            odd += k * ctx.h;
+        }
+    }
+    check("simpson13 last chunk even", sums[chunks - 1], even);
+    check("simpson13 last chunk odd", sums2[chunks - 1], odd);
+
+    /* the last chunk of Simpson's 3/8 rule integrates x on [first * h, 1] */
+    n = INT_MAX;
+    ctx.n = (int)n;
+    ctx.h = (ldouble_t)1 / n;
+    chunks = expectedChunks(n, INTEGRATION_CHUNK / 3);
+    sums[chunks - 1] = NAN;
+    integrateSimpson38Chunks(&ctx, chunks - 1, chunks);
+    first = (long long)(chunks - 1) * (INTEGRATION_CHUNK / 3);
+    check("simpson38 last chunk", sums[chunks - 1], (1 - (first * ctx.h) * (first * ctx.h)) / 2);
+
+    free(sums);
+    free(sums2);
+    destroyProgram(ctx.p);
+    destroyArena(useArena(NULL));
+    printf("%s\n", failures == 0 ? "OK" : "FAILED");
+    return failures != 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Checks of compileNative(), the machine code must give the same values as
+ * the interpreter. The programs are compiled twice, with ANALYSIS_JIT=0 for
+ * the interpreter and with the machine code.
+ *
+ *     gcc -DUSE_DOUBLE tests/test_jit.c -o test_jit -lm -pthread && ./test_jit
+*/
+#define main analysisMain
+#include "../analysis.c"
+#undef main
+
+#define POINT_COUNT 200
+
+int failures = 0;
+
+#ifdef USE_JIT
+
+/* The values are the same if they have the same bits or both are NaN */
+int sameValue(double a, double b)
+{
+    return memcmp(&a, &b, sizeof(double)) == 0 || (isnan(a) && isnan(b));
+}
+
+/*
+ * Compare the machine code with the interpreter on the points
+ *
+ * Parameters:
+ * - text: The function, its letters other than x are the variables a, b, ...
+ * - values: The values of the variables, NULL if there are none
+ * - minStack: The program must need at least this many registers
+ * - isNative: If the program must have machine code
+*/
+void checkNative(const char *text, const double *values, int minStack, int isNative)
+{
+    VariableTable *table = createVariableTable();
+    char input[512];
+    EVALABLE *e;
+    StatusCode status;
+    Program *interpreted, *native;
+    double xs[POINT_COUNT], interpretedBatch[POINT_COUNT], nativeBatch[POINT_COUNT];
+    double interpretedValue, nativeValue;
+    int i;
+
+    status.code = 0;
+    status.pos = NULL;
+    status.expected = '\0';
+    strcpy(input, text);
+    useVariables(table);
+    parseExpression(input, &e, &status);
+    useVariables(NULL);
+    if (status.code != 0)
+    {
+        printf("FAIL %s: can not be parsed\n", text);
+        exit(1);
+    }
+    e = shareSubexpressions(fuseTrigonometric(optimize(e)));
+
+    setenv("ANALYSIS_JIT", "0", 1);
+    interpreted = compileProgram(e);
+    unsetenv("ANALYSIS_JIT");
+    native = compileProgram(e);
+    if ((native->native != NULL) != isNative || native->stackSize < minStack)
+    {
+        printf("FAIL %s: native %d, stack %d\n", text, native->native != NULL, native->stackSize);
+        failures++;
+    }
+
+    for (i = 0; i < POINT_COUNT; i++)
+    {
+        xs[i] = -5 + i * 0.0625;
+    }
+    /* 0, 1 and the points where the functions are not defined */
+    xs[80] = 0;
+    xs[96] = 1;
+    xs[POINT_COUNT - 1] = INFINITY;
+    xs[POINT_COUNT - 2] = NAN;
+    evaluateProgramBatchVariables(interpreted, values, xs, interpretedBatch, POINT_COUNT);
+    evaluateProgramBatchVariables(native, values, xs, nativeBatch, POINT_COUNT);
+    for (i = 0; i < POINT_COUNT; i++)
+    {
+        interpretedValue = evaluateProgramVariables(interpreted, xs[i], values);
+        nativeValue = evaluateProgramVariables(native, xs[i], values);
+        if (!sameValue(interpretedValue, nativeValue) || !sameValue(interpretedBatch[i], nativeBatch[i]) ||
+            !sameValue(interpretedValue, nativeBatch[i]))
+        {
+            printf("FAIL %s: at %.17g %.17g (interpreter) %.17g (native) %.17g (native batch)\n", text, xs[i],
+                   interpretedValue, nativeValue, nativeBatch[i]);
+            failures++;
+            break;
+        }
+    }
+    if (values == NULL && !sameValue(evaluateProgram(interpreted, 0.75), evaluateProgram(native, 0.75)))
+    {
+        printf("FAIL %s: evaluateProgram\n", text);
+        failures++;
+    }
+    destroyProgram(interpreted);
+    destroyProgram(native);
+    destroyVariableTable(table);
+}
+
+#endif
+
+int main()
+{
+#ifdef USE_JIT
+    const double values[3] = {0, 1.25, -0.5};
+    useArena(createArena());
+    checkNative("x", NULL, 1, 1);
+    checkNative("x^(3)-2x+1", NULL, 1, 1);
+    checkNative("x^(4)*(x-1)^(-3)+(x+2)^(17)+(x+3)^(32)", NULL, 2, 1);
+    checkNative("(x+1)^(0.5)+1/(x+2)+e^(x)+x^(1.5)", NULL, 2, 1);
+    checkNative("sin(2x)*cos(2x)+tan(2x)", NULL, 2, 1);
+    checkNative("csc(x+1)+sec(x+1)+cot(x+1)+sin(x+1)^(2)", NULL, 2, 1);
+    checkNative("asin(x/5)+acos(x/5)+atan(x)+acot(x)", NULL, 2, 1);
+    checkNative("log_(x+6)(x^(2)+1)+ln(x+2)*ln(x+3)", NULL, 2, 1);
+    checkNative("ax+sin(ax)*b+x^(b)", values, 2, 1);
+    /* the libm calls are deep in the stack, so the registers under them are spilled */
+    checkNative("x-(x/(x-(x/(x-(x/(x-sin(x/(x-cos(x/(x-ln(x+9)))))))))))", NULL, JIT_REGISTERS - 1, 1);
+    /* it needs more registers than the machine code has, so the interpreter evaluates it */
+    checkNative("x-(x/(x-(x/(x-(x/(x-(x/(x-(x/(x-(x/(x-(x/(x-(x/(x-sin(x+9)))))))))))))))))", NULL, JIT_REGISTERS + 1, 0);
+    destroyArena(useArena(NULL));
+#else
+    printf("The machine code is only built with -DUSE_DOUBLE on x86-64 Linux.\n");
+#endif
+    printf("%s\n", failures == 0 ? "OK" : "FAILED");
+    return failures != 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Checks of shareSubexpressions()
+ *
+ *     gcc tests/test_share.c -o test_share -lm -pthread && ./test_share
+*/
+#define main analysisMain
+#include "../analysis.c"
+#undef main
+
+int failures = 0;
+
+EVALABLE *parseOptimized(const char *text)
+{
+    char input[256];
+    EVALABLE *e;
+    StatusCode status;
+    status.code = 0;
+    status.pos = NULL;
+    status.expected = '\0';
+    strcpy(input, text);
+    parseExpression(input, &e, &status);
+    if (status.code != 0)
+    {
+        printf("FAIL %s: can not be parsed\n", text);
+        exit(1);
+    }
+    return fuseTrigonometric(optimize(e));
+}
+
+/* The expression must have Shared nodes if isShared and the same values as without sharing */
+void checkShared(const char *text, int isShared)
+{
+    EVALABLE *plain = parseOptimized(text);
+    EVALABLE *shared = shareSubexpressions(parseOptimized(text));
+    Program *p = compileProgram(shared);
+    ldouble_t x;
+    int count = sharedSlotCount(shared);
+    if ((count > 0) != isShared)
+    {
+        printf("FAIL %s: %d slots\n", text, count);
+        failures++;
+    }
+    for (x = 0.1; x < 2; x += 0.1)
+    {
+        if (evaluate(shared, x) != evaluate(plain, x) || evaluateProgram(p, x) != evaluate(plain, x))
+        {
+            printf("FAIL %s: different value at %" LDOUBLE_PRI "\n", text, x);
+            failures++;
+            break;
+        }
+    }
+    destroyProgram(p);
+}
+
+int main()
+{
+    useArena(createArena());
+    checkShared("ln(sin(x)+2)+ln(sin(x)+2)*x", 1);
+    /* x^(2)+1 becomes a Polynomial */
+    checkShared("sin(x^(2)+1)*ln(x^(2)+1)", 1);
+    checkShared("(x^(3)-2x+1)^(2)+sin(x^(3)-2x+1)", 1);
+    checkShared("sin(x^(2)+1)*ln(x^(2)+2)", 0);
+    destroyArena(useArena(NULL));
+    printf("%s\n", failures == 0 ? "OK" : "FAILED");
+    return failures != 0;
+}